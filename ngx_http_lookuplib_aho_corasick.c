@@ -0,0 +1,524 @@
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplib_aho_corasick.h"
+
+typedef struct ngx_http_lklb_ac_node_s ngx_http_lklb_ac_node_t;
+
+/* Mutable pattern trie. Siblings are kept sorted by label byte */
+struct ngx_http_lklb_ac_node_s {
+    ngx_http_lklb_ac_node_t     *child;
+    ngx_http_lklb_ac_node_t     *sibling;
+    uint32_t                     id;
+    u_char                       byte;
+    u_char                       has_id;
+};
+
+/*
+ * Compiled state. States are numbered in BFS order which places the
+ * children of a state next to each other, so only the index of the
+ * first child and the child count are needed. The label of a state is
+ * stored in a separate byte array indexed by state number.
+ */
+typedef struct {
+    uint32_t                     first;
+    uint32_t                     fail;
+    uint32_t                     dict;
+    uint32_t                     id;
+    uint16_t                     nchildren;
+    u_char                       out;
+} ngx_http_lklb_ac_state_t;
+
+typedef struct {
+    ngx_uint_t                   generation;
+    uint32_t                     nstates;
+    uint32_t                     root[ 256 ];
+    ngx_http_lklb_ac_state_t    *states;
+    u_char                      *labels;
+} ngx_http_lklb_ac_automaton_t;
+
+struct ngx_http_lklb_ac_s {
+    ngx_http_lklb_ac_node_t           *root;
+    ngx_http_lklb_ac_automaton_t      *automaton;
+
+    ngx_uint_t                         npatterns;
+    ngx_uint_t                         nnodes;
+    ngx_uint_t                         generation;
+
+    ngx_uint_t                         transforms;
+
+    ngx_pool_t                        *pool;
+    void                              *mem_ctx;
+    ngx_http_lklb_ac_calloc_pt         calloc_fnpt;
+    ngx_http_lklb_ac_free_pt           free_fnpt;
+
+    void                              *lock_ctx;
+    ngx_http_lklb_ac_rlock_pt          rlock_fnpt;
+    ngx_http_lklb_ac_wlock_pt          wlock_fnpt;
+    ngx_http_lklb_ac_unlock_pt         unlock_fnpt;
+};
+
+static void
+ngx_http_lklb_ac_rlock( ngx_http_lklb_ac_t *ac ) {
+    if( ac->rlock_fnpt ) {
+        ac->rlock_fnpt( ac->lock_ctx );
+    }
+}
+
+static void
+ngx_http_lklb_ac_wlock( ngx_http_lklb_ac_t *ac ) {
+    if( ac->wlock_fnpt ) {
+        ac->wlock_fnpt( ac->lock_ctx );
+    }
+}
+
+static void
+ngx_http_lklb_ac_unlock( ngx_http_lklb_ac_t *ac ) {
+    if( ac->unlock_fnpt ) {
+        ac->unlock_fnpt( ac->lock_ctx );
+    }
+}
+
+static void *
+ngx_http_lklb_ac_calloc( ngx_http_lklb_ac_t *ac, size_t size ) {
+    if( ac->calloc_fnpt ) {
+        return ac->calloc_fnpt( ac->mem_ctx, size );
+    }
+
+    return ngx_pcalloc( ac->pool, size );
+}
+
+static void
+ngx_http_lklb_ac_free( ngx_http_lklb_ac_t *ac, void *ptr ) {
+    if( ac->free_fnpt ) {
+        ac->free_fnpt( ac->mem_ctx, ptr );
+    }
+}
+
+#define ngx_http_lklb_ac_byte( __ac, __c )                                      \
+    ( ( NGX_HTTP_LKLB_TRANSFORM_TOLOWER & ( __ac )->transforms ) ? ngx_tolower( __c ) : ( __c ) )
+
+ngx_http_lklb_ac_t *
+ngx_http_lklb_ac_create(
+    ngx_pool_t                    *pool,
+    void                          *mem_ctx,
+    ngx_uint_t                     transforms,
+    ngx_http_lklb_ac_calloc_pt     calloc_fnpt,
+    ngx_http_lklb_ac_free_pt       free_fnpt
+) {
+    ngx_http_lklb_ac_t  *ac = NULL;
+
+    if( ( NULL == pool ) && ( NULL == calloc_fnpt ) ) {
+        return NULL;
+    }
+
+    if( calloc_fnpt ) {
+        ac = calloc_fnpt( mem_ctx, sizeof( ngx_http_lklb_ac_t ) );
+    } else if( pool ) {
+        ac = ngx_pcalloc( pool, sizeof( ngx_http_lklb_ac_t ) );
+    }
+
+    if( NULL == ac ) {
+        return NULL;
+    }
+
+    ac->pool        = pool;
+    ac->mem_ctx     = mem_ctx;
+    ac->calloc_fnpt = calloc_fnpt;
+    ac->free_fnpt   = free_fnpt;
+    ac->transforms  = transforms;
+
+    if( !( ac->root = ngx_http_lklb_ac_calloc( ac, sizeof( ngx_http_lklb_ac_node_t ) ) ) ) {
+        return NULL;
+    }
+
+    ac->nnodes = 1;
+
+    return ac;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_ac_set_lock_functions(
+    ngx_http_lklb_ac_t            *ac,
+    void                          *lock_ctx,
+    ngx_http_lklb_ac_rlock_pt      rlock_fnpt,
+    ngx_http_lklb_ac_wlock_pt      wlock_fnpt,
+    ngx_http_lklb_ac_unlock_pt     unlock_fnpt
+) {
+    if( NULL == ac ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    ac->lock_ctx     = lock_ctx;
+    ac->rlock_fnpt   = rlock_fnpt;
+    ac->wlock_fnpt   = wlock_fnpt;
+    ac->unlock_fnpt  = unlock_fnpt;
+
+    return NGX_HTTP_LKLB_OK;
+}
+
+ngx_uint_t
+ngx_http_lklb_ac_get_num_patterns( ngx_http_lklb_ac_t *ac ) {
+    return( ( ac ) ? ac->npatterns : 0 );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_ac_add_pattern(
+    ngx_http_lklb_ac_t     *ac,
+    uint8_t                *pattern,
+    size_t                  len,
+    uint32_t                id
+) {
+    size_t                       idx;
+    u_char                       c;
+    ngx_http_lklb_ac_node_t     *node, *next, **link;
+
+    if( ( NULL == ac ) || ( NULL == pattern ) || ( 0 == len ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    ngx_http_lklb_ac_wlock( ac );
+
+    node = ac->root;
+
+    for( idx = 0; idx < len; idx++ ) {
+        c    = ngx_http_lklb_ac_byte( ac, pattern[ idx ] );
+        link = &node->child;
+
+        while( ( *link ) && ( ( *link )->byte < c ) ) {
+            link = &( *link )->sibling;
+        }
+
+        if( ( NULL == *link ) || ( ( *link )->byte != c ) ) {
+            if( !( next = ngx_http_lklb_ac_calloc( ac, sizeof( ngx_http_lklb_ac_node_t ) ) ) ) {
+                ngx_http_lklb_ac_unlock( ac );
+                return NGX_HTTP_LKLB_ERR;
+            }
+
+            next->byte    = c;
+            next->sibling = *link;
+            *link         = next;
+
+            ac->nnodes++;
+        }
+
+        node = *link;
+    }
+
+    if( node->has_id ) {
+        ngx_http_lklb_ac_unlock( ac );
+        return NGX_HTTP_LKLB_DUP;
+    }
+
+    node->id     = id;
+    node->has_id = 1;
+
+    ac->npatterns++;
+    ac->generation++;
+
+    ngx_http_lklb_ac_unlock( ac );
+    return NGX_HTTP_LKLB_MATCH;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_ac_delete_pattern(
+    ngx_http_lklb_ac_t     *ac,
+    uint8_t                *pattern,
+    size_t                  len,
+    uint32_t               *result
+) {
+    size_t                       idx;
+    u_char                       c;
+    ngx_http_lklb_ac_node_t     *node, *next, **link, **keep;
+
+    if( ( NULL == ac ) || ( NULL == pattern ) || ( 0 == len ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    ngx_http_lklb_ac_wlock( ac );
+
+    /*
+     * keep points at the link to the topmost node of the chain that only
+     * leads to the pattern being deleted. Everything below it is freed
+     * once the pattern is found to be a leaf.
+     */
+    node = ac->root;
+    keep = NULL;
+
+    for( idx = 0; idx < len; idx++ ) {
+        c    = ngx_http_lklb_ac_byte( ac, pattern[ idx ] );
+        link = &node->child;
+
+        while( ( *link ) && ( ( *link )->byte < c ) ) {
+            link = &( *link )->sibling;
+        }
+
+        if( ( NULL == *link ) || ( ( *link )->byte != c ) ) {
+            ngx_http_lklb_ac_unlock( ac );
+            return NGX_HTTP_LKLB_ERR;
+        }
+
+        if( ( NULL == keep ) || ( node->has_id ) ||
+            ( node->child->sibling ) ) {
+            keep = link;
+        }
+
+        node = *link;
+    }
+
+    if( !node->has_id ) {
+        ngx_http_lklb_ac_unlock( ac );
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    if( result ) {
+        *result = node->id;
+    }
+
+    node->has_id = 0;
+
+    if( NULL == node->child ) {
+        node  = *keep;
+        *keep = node->sibling;
+
+        while( node ) {
+            next = node->child;
+            ngx_http_lklb_ac_free( ac, node );
+            ac->nnodes--;
+            node = next;
+        }
+    }
+
+    ac->npatterns--;
+    ac->generation++;
+
+    ngx_http_lklb_ac_unlock( ac );
+    return NGX_HTTP_LKLB_MATCH;
+}
+
+static uint32_t
+ngx_http_lklb_ac_goto(
+    ngx_http_lklb_ac_automaton_t  *automaton,
+    uint32_t                       state,
+    u_char                         c
+) {
+    uint32_t                     lo, hi, mid;
+    ngx_http_lklb_ac_state_t    *st;
+
+    if( 0 == state ) {
+        return automaton->root[ c ];
+    }
+
+    st = &automaton->states[ state ];
+    lo = st->first;
+    hi = st->first + st->nchildren;
+
+    while( lo < hi ) {
+        mid = lo + ( ( hi - lo ) >> 1 );
+
+        if( automaton->labels[ mid ] == c ) {
+            return mid;
+        }
+
+        if( automaton->labels[ mid ] < c ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return 0;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_ac_compile( ngx_http_lklb_ac_t *ac ) {
+    size_t                         size;
+    uint32_t                       nstates, head, tail, state, fail, next;
+    ngx_uint_t                     generation;
+    ngx_http_lklb_ac_node_t      **queue, *node, *child;
+    ngx_http_lklb_ac_state_t      *st;
+    ngx_http_lklb_ac_automaton_t  *automaton, *old;
+
+    if( NULL == ac ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    ngx_http_lklb_ac_rlock( ac );
+
+    nstates    = ac->nnodes;
+    generation = ac->generation;
+
+    size = sizeof( ngx_http_lklb_ac_automaton_t )
+         + nstates * sizeof( ngx_http_lklb_ac_state_t )
+         + nstates * sizeof( u_char );
+
+    queue = ngx_alloc( nstates * sizeof( ngx_http_lklb_ac_node_t * ), ngx_cycle->log );
+    if( NULL == queue ) {
+        ngx_http_lklb_ac_unlock( ac );
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    automaton = ngx_http_lklb_ac_calloc( ac, size );
+    if( NULL == automaton ) {
+        ngx_http_lklb_ac_unlock( ac );
+        ngx_free( queue );
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    automaton->generation = generation;
+    automaton->nstates    = nstates;
+    automaton->states     = ( ngx_http_lklb_ac_state_t * )( automaton + 1 );
+    automaton->labels     = ( u_char * )( automaton->states + nstates );
+
+    /* Number the trie in BFS order so that siblings get adjacent states */
+    head = 0;
+    tail = 0;
+
+    queue[ tail++ ]  = ac->root;
+
+    while( head < tail ) {
+        node = queue[ head ];
+        st   = &automaton->states[ head ];
+
+        st->first = tail;
+        st->id    = node->id;
+        st->out   = node->has_id;
+
+        for( child = node->child; child; child = child->sibling ) {
+            if( 0 == head ) {
+                automaton->root[ child->byte ] = tail;
+            }
+
+            automaton->labels[ tail ]     = child->byte;
+            queue[ tail++ ]               = child;
+            st->nchildren++;
+        }
+
+        head++;
+    }
+
+    /* Failure and dictionary suffix links, parents are always resolved first */
+    for( head = 0; head < tail; head++ ) {
+        st = &automaton->states[ head ];
+
+        for( next = st->first; next < st->first + st->nchildren; next++ ) {
+            if( 0 == head ) {
+                automaton->states[ next ].fail = 0;
+                automaton->states[ next ].dict = 0;
+                continue;
+            }
+
+            fail = st->fail;
+
+            while( ( 0 != fail ) &&
+                   ( 0 == ngx_http_lklb_ac_goto( automaton, fail, automaton->labels[ next ] ) ) ) {
+                fail = automaton->states[ fail ].fail;
+            }
+
+            state = ngx_http_lklb_ac_goto( automaton, fail, automaton->labels[ next ] );
+
+            automaton->states[ next ].fail = state;
+            automaton->states[ next ].dict = ( automaton->states[ state ].out ) ?
+                                               state : automaton->states[ state ].dict;
+        }
+    }
+
+    ngx_http_lklb_ac_unlock( ac );
+    ngx_free( queue );
+
+    ngx_http_lklb_ac_wlock( ac );
+
+    old = ac->automaton;
+
+    if( ( old ) && ( old->generation == ac->generation ) && ( generation != ac->generation ) ) {
+        /* A newer compile already published the current pattern set */
+        old       = automaton;
+        automaton = ac->automaton;
+    }
+
+    ac->automaton = automaton;
+
+    ngx_http_lklb_ac_unlock( ac );
+
+    if( old ) {
+        ngx_http_lklb_ac_free( ac, old );
+    }
+
+    return NGX_HTTP_LKLB_OK;
+}
+
+static ngx_uint_t
+ngx_http_lklb_ac_emit( uint32_t *ids, ngx_uint_t count, ngx_uint_t max, uint32_t id ) {
+    ngx_uint_t  idx;
+
+    for( idx = 0; idx < count; idx++ ) {
+        if( ids[ idx ] == id ) {
+            return count;
+        }
+    }
+
+    if( count < max ) {
+        ids[ count++ ] = id;
+    }
+
+    return count;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_ac_match(
+    ngx_http_lklb_ac_t     *ac,
+    uint8_t                *subject,
+    size_t                  len,
+    uint32_t               *ids,
+    ngx_uint_t             *nids
+) {
+    size_t                         idx;
+    u_char                         c;
+    uint32_t                       state, next, out;
+    ngx_uint_t                     count, max;
+    ngx_http_lklb_ac_state_t      *states;
+    ngx_http_lklb_ac_automaton_t  *automaton;
+
+    if( ( NULL == ac ) || ( NULL == subject ) || ( NULL == ids ) || ( NULL == nids ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    max   = *nids;
+    count = 0;
+    state = 0;
+
+    ngx_http_lklb_ac_rlock( ac );
+
+    automaton = ac->automaton;
+    if( NULL == automaton ) {
+        ngx_http_lklb_ac_unlock( ac );
+        *nids = 0;
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    states = automaton->states;
+
+    for( idx = 0; ( idx < len ) && ( count < max ); idx++ ) {
+        c = ngx_http_lklb_ac_byte( ac, subject[ idx ] );
+
+        while( 0 == ( next = ngx_http_lklb_ac_goto( automaton, state, c ) ) ) {
+            if( 0 == state ) {
+                break;
+            }
+
+            state = states[ state ].fail;
+        }
+
+        state = next;
+
+        for( out = ( states[ state ].out ) ? state : states[ state ].dict;
+             out;
+             out = states[ out ].dict ) {
+            count = ngx_http_lklb_ac_emit( ids, count, max, states[ out ].id );
+        }
+    }
+
+    ngx_http_lklb_ac_unlock( ac );
+
+    *nids = count;
+
+    return( ( count ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_ERR );
+}
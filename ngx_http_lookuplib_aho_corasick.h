@@ -0,0 +1,89 @@
+#ifndef _NGX_HTTP_LOOKUP_LIB_AHO_CORASICK_H_INCLUDED_
+#define _NGX_HTTP_LOOKUP_LIB_AHO_CORASICK_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_string.h>
+
+typedef struct ngx_http_lklb_ac_s ngx_http_lklb_ac_t;
+
+typedef void *( *ngx_http_lklb_ac_calloc_pt )( void *, size_t );
+typedef void( *ngx_http_lklb_ac_free_pt )( void *, void * );
+
+typedef void( *ngx_http_lklb_ac_rlock_pt )( void * );
+typedef void( *ngx_http_lklb_ac_wlock_pt )( void * );
+typedef void( *ngx_http_lklb_ac_unlock_pt )( void * );
+
+/*
+ * Multi pattern substring matcher. Patterns are kept in a mutable trie
+ * and are not visible to the match API until compiled. Compiling packs
+ * the trie into a single allocation holding the Aho-Corasick automaton
+ * (states in BFS order with failure and dictionary suffix links, one
+ * label byte per state and a dense transition table for the root), so
+ * a scan touches one contiguous block and never allocates.
+ */
+ngx_http_lklb_ac_t *
+ngx_http_lklb_ac_create(
+    ngx_pool_t                      *pool,
+    void                            *mem_ctx,
+    ngx_uint_t                       transforms,
+    ngx_http_lklb_ac_calloc_pt       calloc_fnpt,
+    ngx_http_lklb_ac_free_pt         free_fnpt
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_ac_set_lock_functions(
+    ngx_http_lklb_ac_t            *ac,
+    void                          *lock_ctx,
+    ngx_http_lklb_ac_rlock_pt      rlock_fn,
+    ngx_http_lklb_ac_wlock_pt      wlock_fn,
+    ngx_http_lklb_ac_unlock_pt     unlock_fn
+);
+
+ngx_uint_t
+ngx_http_lklb_ac_get_num_patterns( ngx_http_lklb_ac_t *ac );
+
+/*
+ * ac:      matcher returned from the create API above
+ * pattern: byte pattern, tolower transform is applied if configured
+ * id:      Caller chosen identifier reported by the match API
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_ac_add_pattern(
+    ngx_http_lklb_ac_t     *ac,
+    uint8_t                *pattern,
+    size_t                  len,
+    uint32_t                id
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_ac_delete_pattern(
+    ngx_http_lklb_ac_t     *ac,
+    uint8_t                *pattern,
+    size_t                  len,
+    uint32_t               *id
+);
+
+/*
+ * Rebuild the automaton from the current pattern set. Matches keep using
+ * the previous automaton until the new one is swapped in.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_ac_compile( ngx_http_lklb_ac_t *ac );
+
+/*
+ * subject: bytes to scan, e.g. URI, User-Agent or a header value
+ * ids:     caller supplied array receiving the matched pattern ids.
+ *          Every id is reported once regardless of how often it matched
+ * nids:    in - capacity of ids, out - number of ids stored
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_ac_match(
+    ngx_http_lklb_ac_t     *ac,
+    uint8_t                *subject,
+    size_t                  len,
+    uint32_t               *ids,
+    ngx_uint_t             *nids
+);
+
+#endif /* _NGX_HTTP_LOOKUP_LIB_AHO_CORASICK_H_INCLUDED_ */
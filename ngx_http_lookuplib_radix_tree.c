@@ -9,9 +9,38 @@
 
 static void *NGX_HTTP_LKLB_RADIX_NO_VALUE = ( void * )( -1 );
 
+/*
+ * Frozen index, a multibit trie of 8 bit strides packed in BFS order. A
+ * stride covers the nodes at relative depth 0 to 7 below its top node,
+ * numbered as a heap: 1 for the top, 2 n and 2 n + 1 for the children of
+ * n. prefixes has a bit per valued node, children a bit per byte value
+ * continuing into a child stride. The children and values of a stride
+ * are stored contiguously, the one for a bit is found by its rank, i.e.
+ * the number of bits set before it.
+ */
+typedef struct {
+    uint64_t                     prefixes[ 4 ];
+    uint64_t                     children[ 4 ];
+    uint32_t                     child;
+    uint32_t                     value;
+} ngx_http_lklb_radix_stride_t;
+
+typedef struct ngx_http_lklb_radix_frozen_s ngx_http_lklb_radix_frozen_t;
+
+struct ngx_http_lklb_radix_frozen_s {
+    ngx_http_lklb_radix_frozen_t  *next;
+    ngx_uint_t                     retired;
+    ngx_uint_t                     nstrides;
+    ngx_uint_t                     nvalues;
+    ngx_http_lklb_radix_stride_t  *strides;
+    void                         **values;
+    ngx_http_lklb_radix_stride_t  *mapped;
+};
+
 struct ngx_http_lklb_radix_s {
     ngx_http_lklb_radix_node_t        *root;
     ngx_http_lklb_radix_node_t        *free;
+    ngx_uint_t                         nfree;
 
     char                              *start;
     size_t                             size;
@@ -20,6 +49,10 @@ struct ngx_http_lklb_radix_s {
 
     ngx_uint_t                         transforms;
 
+    /* uint32 keys live under ::ffff:0:0/96, mapped caches the node of that prefix */
+    ngx_uint_t                         dualstack;
+    ngx_http_lklb_radix_node_t        *mapped;
+
     ngx_pool_t                        *pool;
     void                              *mem_ctx;
     ngx_http_lklb_radix_calloc_pt      calloc_fnpt;
@@ -29,6 +62,32 @@ struct ngx_http_lklb_radix_s {
     ngx_http_lklb_radix_rlock_pt       rlock_fnpt;
     ngx_http_lklb_radix_wlock_pt       wlock_fnpt;
     ngx_http_lklb_radix_unlock_pt      unlock_fnpt;
+
+    void                              *value_ctx;
+    ngx_http_lklb_radix_value_ref_pt   ref_fnpt;
+    ngx_http_lklb_radix_value_unref_pt unref_fnpt;
+    ngx_http_lklb_radix_value_expired_pt expired_fnpt;
+    ngx_http_lklb_radix_value_touch_pt   touch_fnpt;
+    ngx_http_lklb_radix_value_referenced_pt referenced_fnpt;
+
+    void                              *epoch_ctx;
+    ngx_http_lklb_radix_retire_pt      retire_fnpt;
+    ngx_http_lklb_radix_quiesced_pt    quiesced_fnpt;
+
+    /* Nodes have no parent pointer, sweep and eviction resume by key */
+    ngx_http_lklb_radix_cursor_t       sweep;
+    ngx_http_lklb_radix_cursor_t       hand;
+
+    ngx_http_lklb_radix_batch_t       *batch;
+
+    /* Finds use frozen without locking while set, writes retire it */
+    ngx_http_lklb_radix_frozen_t      *volatile frozen;
+    ngx_http_lklb_radix_frozen_t      *retired;
+
+    /* Finds skip the lock while set, released is the epoch it was last cleared at */
+    ngx_uint_t                         readonly;
+    ngx_uint_t                         released;
+    ngx_uint_t                         generation;
 };
 
 static void
@@ -52,27 +111,373 @@ ngx_http_lklb_radix_unlock( ngx_http_lklb_radix_t *tree ) {
     }
 }
 
+/*
+ * Finds of read-only trees skip the lock, no write can run meanwhile.
+ * Returns whether the read lock was taken, the tree may change state
+ * before the find is done.
+ */
+static ngx_uint_t
+ngx_http_lklb_radix_find_lock( ngx_http_lklb_radix_t *tree ) {
+    if( tree->readonly ) {
+        return 0;
+    }
+
+    ngx_http_lklb_radix_rlock( tree );
+    return 1;
+}
+
+static void
+ngx_http_lklb_radix_find_unlock( ngx_http_lklb_radix_t *tree, ngx_uint_t locked ) {
+    if( locked ) {
+        ngx_http_lklb_radix_unlock( tree );
+    }
+}
+
+static void
+ngx_http_lklb_radix_ref( ngx_http_lklb_radix_t *tree, void *value ) {
+    if( tree->ref_fnpt ) {
+        tree->ref_fnpt( tree->value_ctx, value );
+    }
+}
+
+static void
+ngx_http_lklb_radix_unref( ngx_http_lklb_radix_t *tree, void *value ) {
+    if( tree->unref_fnpt ) {
+        tree->unref_fnpt( tree->value_ctx, value );
+    }
+}
+
+static ngx_uint_t
+ngx_http_lklb_radix_expired( ngx_http_lklb_radix_t *tree, void *value ) {
+    return( ( tree->expired_fnpt ) && ( tree->expired_fnpt( tree->value_ctx, value ) ) );
+}
+
+static void
+ngx_http_lklb_radix_touch( ngx_http_lklb_radix_t *tree, void *value ) {
+    if( tree->touch_fnpt ) {
+        tree->touch_fnpt( tree->value_ctx, value );
+    }
+}
+
+static void
+ngx_http_lklb_radix_frozen_free( ngx_http_lklb_radix_t *tree, ngx_http_lklb_radix_frozen_t *frozen ) {
+    if( tree->free_fnpt ) {
+        tree->free_fnpt( tree->mem_ctx, frozen );
+    }
+}
+
+static ngx_uint_t
+ngx_http_lklb_radix_quiesced( ngx_http_lklb_radix_t *tree, ngx_uint_t epoch ) {
+    return( ( NULL == tree->quiesced_fnpt ) || ( tree->quiesced_fnpt( tree->epoch_ctx, epoch ) ) );
+}
+
+/* Free the retired indexes no find walks anymore, caller holds the write lock */
+static void
+ngx_http_lklb_radix_frozen_purge( ngx_http_lklb_radix_t *tree ) {
+    ngx_http_lklb_radix_frozen_t  **link, *frozen;
+
+    link = &tree->retired;
+
+    while( ( frozen = *link ) ) {
+        if( !ngx_http_lklb_radix_quiesced( tree, frozen->retired ) ) {
+            link = &frozen->next;
+            continue;
+        }
+
+        *link = frozen->next;
+        ngx_http_lklb_radix_frozen_free( tree, frozen );
+    }
+}
+
+/* frozen is unlinked already, finds still walking it keep it alive */
+static void
+ngx_http_lklb_radix_frozen_retire( ngx_http_lklb_radix_t *tree, ngx_http_lklb_radix_frozen_t *frozen ) {
+    ngx_http_lklb_radix_frozen_purge( tree );
+
+    frozen->retired = ( tree->retire_fnpt ) ? tree->retire_fnpt( tree->epoch_ctx ) : 0;
+    frozen->next    = tree->retired;
+    tree->retired   = frozen;
+}
+
+/*
+ * Trees made writable again refuse writes until every worker passed the
+ * epoch they were released at, finds that skipped the lock may still be
+ * walking them. Caller holds the write lock.
+ */
+static ngx_uint_t
+ngx_http_lklb_radix_writable( ngx_http_lklb_radix_t *tree ) {
+    if( tree->readonly ) {
+        return 0;
+    }
+
+    if( ( tree->released ) && ( !ngx_http_lklb_radix_quiesced( tree, tree->released ) ) ) {
+        return 0;
+    }
+
+    tree->released = 0;
+
+    return 1;
+}
+
+/*
+ * Every write goes through here with the write lock held. Read-only
+ * trees refuse it, otherwise a frozen index is dropped and finds go back
+ * to the tree.
+ */
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_thaw( ngx_http_lklb_radix_t *tree ) {
+    ngx_http_lklb_radix_frozen_t  *frozen = tree->frozen;
+
+    if( !ngx_http_lklb_radix_writable( tree ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    tree->generation++;
+
+    if( frozen ) {
+        tree->frozen = NULL;
+        ngx_http_lklb_radix_frozen_retire( tree, frozen );
+    }
+
+    return NGX_HTTP_LKLB_OK;
+}
+
+/*
+ * child[ 0 ] follows a 0 key bit, child[ 1 ] a 1 bit. There is no parent
+ * pointer, pruning works from the path state kept on the way down.
+ */
 struct ngx_http_lklb_radix_node_s {
-    ngx_http_lklb_radix_node_t  *right;
-    ngx_http_lklb_radix_node_t  *left;
-    ngx_http_lklb_radix_node_t  *parent;
+    ngx_http_lklb_radix_node_t  *child[ 2 ];
+    void                        *value;
+};
+
+#define NGX_HTTP_LKLB_RADIX_BATCH_INSERT    0
+#define NGX_HTTP_LKLB_RADIX_BATCH_DELETE    1
+
+/*
+ * A recorded op. Numeric keys use key, string keys str. Keys are stored
+ * after transforms, bits is the prefix length. value is the value
+ * inserted, or the value a delete took out of the tree.
+ */
+typedef struct {
+    ngx_uint_t                   op;
+    uint32_t                     key[ 4 ];
+    ngx_uint_t                   bits;
+    uint8_t                     *str;
     void                        *value;
+    ngx_http_lklb_retval_e       rc;
+} ngx_http_lklb_radix_batch_op_t;
+
+struct ngx_http_lklb_radix_batch_s {
+    ngx_http_lklb_radix_t       *tree;
+    ngx_pool_t                  *pool;
+    ngx_array_t                  ops;
+    ngx_array_t                  pages;
 };
  
 static void
 ngx_http_lklb_radix_init_children( ngx_http_lklb_radix_node_t *node ) {
-    node->right = node->left = NULL;
+    node->child[ 0 ] = node->child[ 1 ] = NULL;
 }
 
 static uint32_t
 ngx_http_lklb_radix_is_leaf_node( ngx_http_lklb_radix_node_t *node ) {
-    return( ( NULL == node->right ) && ( NULL == node->left ) );
+    return( ( NULL == node->child[ 0 ] ) && ( NULL == node->child[ 1 ] ) );
+}
+
+/* find_node flags, expired values are only skipped for lookups */
+#define NGX_HTTP_LKLB_RADIX_FIND_PREFIX     1
+#define NGX_HTTP_LKLB_RADIX_FIND_LIVE       2
+
+#define ngx_http_lklb_radix_find_flags( __prefix )                                      \
+    ( ( ( __prefix ) ? NGX_HTTP_LKLB_RADIX_FIND_PREFIX : 0 ) | NGX_HTTP_LKLB_RADIX_FIND_LIVE )
+
+static ngx_uint_t
+ngx_http_lklb_radix_has_value( ngx_http_lklb_radix_t *tree, ngx_http_lklb_radix_node_t *node, uint8_t flags ) {
+    return( ( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) &&
+            ( !( NGX_HTTP_LKLB_RADIX_FIND_LIVE & flags ) || !ngx_http_lklb_radix_expired( tree, node->value ) ) );
+}
+
+/*
+ * Collects the valued nodes find_node passes on its way down, instead of
+ * stopping at the first one for prefix finds.
+ */
+typedef struct {
+    ngx_http_lklb_radix_match_t *matches;
+    ngx_uint_t                   nmatches;
+    ngx_uint_t                   count;
+} ngx_http_lklb_radix_path_t;
+
+static void
+ngx_http_lklb_radix_path_add(
+    ngx_http_lklb_radix_t       *tree,
+    ngx_http_lklb_radix_path_t  *all,
+    ngx_http_lklb_radix_node_t  *node,
+    ngx_uint_t                   bits
+) {
+    if( ( all->count < all->nmatches ) && ( ngx_http_lklb_radix_has_value( tree, node, NGX_HTTP_LKLB_RADIX_FIND_LIVE ) ) ) {
+        all->matches[ all->count ].value = node->value;
+        all->matches[ all->count ].bits  = bits;
+        all->count++;
+    }
+}
+
+/* Touch the collected values and hand them over, locked as by find_lock */
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_path_done(
+    ngx_http_lklb_radix_t       *tree,
+    ngx_uint_t                   locked,
+    ngx_http_lklb_radix_path_t  *all,
+    ngx_http_lklb_retval_e       rc,
+    ngx_uint_t                  *count
+) {
+    ngx_uint_t  idx;
+
+    for( idx = 0; idx < all->count; idx++ ) {
+        ngx_http_lklb_radix_touch( tree, all->matches[ idx ].value );
+    }
+
+    ngx_http_lklb_radix_find_unlock( tree, locked );
+
+    if( count ) {
+        *count = all->count;
+    }
+
+    return rc;
 }
 
-#define NGX_HTTP_LKLB_RADIX_NODE_IS_ROOT( __node )    ( NULL == ( __node )->parent )
+/* path_done for the frozen index, the values were touched on the way */
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_frozen_done(
+    ngx_http_lklb_radix_path_t  *all,
+    ngx_http_lklb_retval_e       rc,
+    ngx_uint_t                  *count
+) {
+    if( count ) {
+        *count = all->count;
+    }
+
+    return rc;
+}
+
+/* Return node to the free list, linked through its first child */
+static void
+ngx_http_lklb_radix_free_node( ngx_http_lklb_radix_t *tree, ngx_http_lklb_radix_node_t *node ) {
+    if( node == tree->mapped ) {
+        tree->mapped = NULL;
+    }
+
+    node->child[ 0 ] = tree->free;
+    tree->free       = node;
+    tree->nfree++;
+}
+
+/* Store value in node, an expired value is replaced */
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_set_value( ngx_http_lklb_radix_t *tree, ngx_http_lklb_radix_node_t *node, void *value ) {
+    if( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) {
+        if( !ngx_http_lklb_radix_expired( tree, node->value ) ) {
+            return NGX_HTTP_LKLB_DUP;
+        }
+
+        ngx_http_lklb_radix_unref( tree, node->value );
+    }
+
+    node->value = value;
+    ngx_http_lklb_radix_ref( tree, value );
+    return NGX_HTTP_LKLB_MATCH;
+}
 
 static ngx_http_lklb_radix_node_t *
-ngx_http_lklb_radix_alloc( ngx_http_lklb_radix_t *tree );
+ngx_http_lklb_radix_alloc( ngx_http_lklb_radix_t *tree, ngx_http_lklb_radix_node_t *pin );
+
+/*
+ * Where the path to a node is cut when the node is pruned: the deepest
+ * node above it that stays, i.e. the root, the mapped node of a dual-stack
+ * tree, pin or a node holding a value or a second child, and the side the
+ * path leaves it on. Below it the path is a chain of bare single child
+ * nodes.
+ */
+typedef struct {
+    ngx_http_lklb_radix_node_t  *node;
+    ngx_uint_t                   side;
+} ngx_http_lklb_radix_trail_t;
+
+/* Account for the path leaving node on side */
+static void
+ngx_http_lklb_radix_trail_step(
+    ngx_http_lklb_radix_t        *tree,
+    ngx_http_lklb_radix_trail_t  *trail,
+    ngx_http_lklb_radix_node_t   *node,
+    ngx_uint_t                    side,
+    ngx_http_lklb_radix_node_t   *pin
+) {
+    if( ( node == tree->root ) || ( node == tree->mapped ) || ( node == pin ) ||
+        ( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) || ( NULL != node->child[ 1 - side ] ) ) {
+        trail->node = node;
+        trail->side = side;
+    }
+}
+
+/*
+ * Drop the value held by node. A node left without a value or children
+ * goes back to the free list along with the chain above it, up to the
+ * trail of its path. trail->node is NULL for the root, it is never freed,
+ * e.g. for a /0 entry. Returns 1 if node was freed.
+ */
+static ngx_uint_t
+ngx_http_lklb_radix_delete_node(
+    ngx_http_lklb_radix_t        *tree,
+    ngx_http_lklb_radix_node_t   *node,
+    ngx_http_lklb_radix_trail_t  *trail
+) {
+    ngx_http_lklb_radix_node_t  *next;
+
+    node->value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
+
+    if( ( NULL == trail->node ) || ( !ngx_http_lklb_radix_is_leaf_node( node ) ) ) {
+        return 0;
+    }
+
+    next = trail->node->child[ trail->side ];
+    trail->node->child[ trail->side ] = NULL;
+
+    while( next ) {
+        node = next;
+        next = node->child[ NULL == node->child[ 0 ] ];
+
+        ngx_http_lklb_radix_free_node( tree, node );
+    }
+
+    return 1;
+}
+
+/*
+ * Drop the value of node if it expired, caller holds the write lock.
+ * Returns 1 if node was freed.
+ */
+static ngx_uint_t
+ngx_http_lklb_radix_reclaim(
+    ngx_http_lklb_radix_t        *tree,
+    ngx_http_lklb_radix_node_t   *node,
+    ngx_http_lklb_radix_trail_t  *trail
+) {
+    void        *value = node->value;
+    ngx_uint_t   freed;
+
+    if( ( NGX_HTTP_LKLB_RADIX_NO_VALUE == value ) || ( !ngx_http_lklb_radix_expired( tree, value ) ) ) {
+        return 0;
+    }
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_thaw( tree ) ) {
+        return 0;
+    }
+
+    freed = ngx_http_lklb_radix_delete_node( tree, node, trail );
+    ngx_http_lklb_radix_unref( tree, value );
+
+    return freed;
+}
 
 ngx_http_lklb_radix_t *
 ngx_http_lklb_radix_create(
@@ -103,15 +508,14 @@ ngx_http_lklb_radix_create(
     tree->calloc_fnpt = calloc_fnpt;
     tree->free_fnpt   = free_fnpt;
 
-    if( !( tree->root = ngx_http_lklb_radix_alloc( tree ) ) ) {
+    if( !( tree->root = ngx_http_lklb_radix_alloc( tree, NULL ) ) ) {
         return NULL;
     }
 
     tree->transforms = transforms;
 
     ngx_http_lklb_radix_init_children( tree->root );
-    tree->root->parent = NULL;
-    tree->root->value  = NGX_HTTP_LKLB_RADIX_NO_VALUE;
+    tree->root->value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
 
     return tree;
 }
@@ -137,856 +541,2864 @@ ngx_http_lklb_radix_set_lock_functions(
 }
 
 ngx_http_lklb_retval_e
-ngx_http_lklb_radix_set_transforms(
-    ngx_http_lklb_radix_t         *tree,
-    ngx_uint_t                     transforms
+ngx_http_lklb_radix_set_value_functions(
+    ngx_http_lklb_radix_t              *tree,
+    void                               *value_ctx,
+    ngx_http_lklb_radix_value_ref_pt    ref_fnpt,
+    ngx_http_lklb_radix_value_unref_pt  unref_fnpt
 ) {
     if( NULL == tree ) {
         return NGX_HTTP_LKLB_ERR;
     }
 
-    tree->transforms = transforms;
+    tree->value_ctx  = value_ctx;
+    tree->ref_fnpt   = ref_fnpt;
+    tree->unref_fnpt = unref_fnpt;
+
     return NGX_HTTP_LKLB_OK;
 }
 
-ngx_uint_t
-ngx_http_lklb_radix_get_num_pages( ngx_http_lklb_radix_t *tree ) {
-    return( ( tree ) ? tree->npages : 0 );
-}
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_set_epoch_functions(
+    ngx_http_lklb_radix_t              *tree,
+    void                               *epoch_ctx,
+    ngx_http_lklb_radix_retire_pt       retire_fnpt,
+    ngx_http_lklb_radix_quiesced_pt     quiesced_fnpt
+) {
+    if( NULL == tree ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
 
-ngx_uint_t
-ngx_http_lklb_radix_get_num_nodes( ngx_http_lklb_radix_t *tree ) {
-    return( ( tree ) ? tree->nnodes : 0 );
-}
+    tree->epoch_ctx     = epoch_ctx;
+    tree->retire_fnpt   = retire_fnpt;
+    tree->quiesced_fnpt = quiesced_fnpt;
 
-#define NGX_HTTP_LKLB_RADIX_UINT32_MSB      ( 1 << 31 )
+    return NGX_HTTP_LKLB_OK;
+}
 
 ngx_http_lklb_retval_e
-ngx_http_lklb_radix_uint32_insert_with_mask(
-    ngx_http_lklb_radix_t *tree,
-    uint32_t               key,
-    uint32_t               mask,
-    void                  *value
+ngx_http_lklb_radix_set_expire_function(
+    ngx_http_lklb_radix_t                *tree,
+    ngx_http_lklb_radix_value_expired_pt  expired_fnpt
 ) {
-    uint32_t                     bit;
-    ngx_http_lklb_radix_node_t  *node, *next;
-
     if( NULL == tree ) {
         return NGX_HTTP_LKLB_ERR;
     }
 
-    bit = NGX_HTTP_LKLB_RADIX_UINT32_MSB;
-
-    key  = ngx_http_lklb_uint32_htonl( tree->transforms, key );
-    mask = ngx_http_lklb_uint32_htonl( tree->transforms, mask );
+    tree->expired_fnpt = expired_fnpt;
 
-    ngx_http_lklb_radix_wlock( tree );
+    return NGX_HTTP_LKLB_OK;
+}
 
-    node = tree->root;
-    next = tree->root;
+#define NGX_HTTP_LKLB_RADIX_UINT8_MSB    ( 1 << 7 )
 
-    while( bit & mask ) {
-        if( key & bit ) {
-            next = node->right;
-        } else {
-            next = node->left;
-        }
+#define ngx_http_lklb_radix_cursor_bit( __cursor, __depth )                             \
+    ( ( __cursor )->key[ ( __depth ) / 8 ] & ( NGX_HTTP_LKLB_RADIX_UINT8_MSB >> ( ( __depth ) % 8 ) ) )
 
-        if( NULL == next ) {
-            break;
-        }
+static void
+ngx_http_lklb_radix_cursor_set( ngx_http_lklb_radix_cursor_t *cursor, ngx_uint_t depth, ngx_uint_t set ) {
+    uint8_t     bit = NGX_HTTP_LKLB_RADIX_UINT8_MSB >> ( depth % 8 );
 
-        bit  >>= 1;
-        node   = next;
+    if( set ) {
+        cursor->key[ depth / 8 ] |= bit;
+    } else {
+        cursor->key[ depth / 8 ] &= ~bit;
     }
+}
 
-    if( next ) {
-        if( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) {
-            ngx_http_lklb_radix_unlock( tree );
-            return NGX_HTTP_LKLB_DUP;
-        }
+/*
+ * Follow the first depth bits of the cursor key. Returns the node reached
+ * or, if the path ends earlier, the last node on it. reached is set to
+ * the depth of that node, trail if given as for a find.
+ */
+static ngx_http_lklb_radix_node_t *
+ngx_http_lklb_radix_cursor_seek(
+    ngx_http_lklb_radix_t         *tree,
+    ngx_http_lklb_radix_cursor_t  *cursor,
+    ngx_uint_t                     depth,
+    ngx_uint_t                    *reached,
+    ngx_http_lklb_radix_trail_t   *trail,
+    ngx_http_lklb_radix_node_t    *pin
+) {
+    ngx_http_lklb_radix_node_t  *node = tree->root;
+    ngx_uint_t                   idx, side;
 
-        node->value = value;
-        ngx_http_lklb_radix_unlock( tree );
-        return NGX_HTTP_LKLB_MATCH;
+    if( trail ) {
+        trail->node = NULL;
     }
 
-    while( bit & mask ) {
-        if( !( next = ngx_http_lklb_radix_alloc( tree ) ) ) {
-            ngx_http_lklb_radix_unlock( tree );
-            return NGX_HTTP_LKLB_ERR;
-        }
+    for( idx = 0; idx < depth; idx++ ) {
+        side = ( 0 != ngx_http_lklb_radix_cursor_bit( cursor, idx ) );
 
-        ngx_http_lklb_radix_init_children( next );
-        next->parent = node;
-        next->value  = NGX_HTTP_LKLB_RADIX_NO_VALUE;
+        if( NULL == node->child[ side ] ) {
+            break;
+        }
 
-        if( key & bit ) {
-            node->right = next;
-        } else {
-            node->left = next;
+        if( trail ) {
+            ngx_http_lklb_radix_trail_step( tree, trail, node, side, pin );
         }
 
-        bit  >>= 1;
-        node   = next;
+        node = node->child[ side ];
     }
 
-    node->value = value;
-    ngx_http_lklb_radix_unlock( tree );
-    return NGX_HTTP_LKLB_MATCH;
-}
+    *reached = idx;
 
-ngx_http_lklb_retval_e
-ngx_http_lklb_radix_uint32_insert(
-    ngx_http_lklb_radix_t  *tree,
-    uint32_t                key,
-    void                   *value
-) {
-    return ngx_http_lklb_radix_uint32_insert_with_mask( tree, key, ( uint32_t )( -1 ), value ); 
+    return node;
 }
 
-static ngx_http_lklb_retval_e
-ngx_http_lklb_radix_uint32_find_node(
-    ngx_http_lklb_radix_t       *tree,
-    uint32_t                     key,
-    uint32_t                     mask,
-    uint8_t                      prefix,
-    ngx_http_lklb_radix_node_t **result
+/*
+ * Pre-order successor of the subtree at depth bits of the cursor key, or
+ * of the point its path breaks off at if the subtree is gone. Without
+ * parent pointers the path is followed again from the root to find the
+ * deepest node on it whose right subtree is still ahead. Nodes above the
+ * cursor base are not left.
+ */
+static ngx_http_lklb_radix_node_t *
+ngx_http_lklb_radix_cursor_climb(
+    ngx_http_lklb_radix_t         *tree,
+    ngx_http_lklb_radix_cursor_t  *cursor,
+    ngx_uint_t                    *depth
 ) {
-    uint32_t                     bit;
-    ngx_http_lklb_radix_node_t  *node;
-    ngx_http_lklb_retval_e       rc = NGX_HTTP_LKLB_ERR;
-
-    if( NULL == tree ) {
-        return NGX_HTTP_LKLB_ERR;
-    }
-
-    bit  = NGX_HTTP_LKLB_RADIX_UINT32_MSB;
-    node = tree->root;
+    ngx_http_lklb_radix_node_t  *node = tree->root, *turn = NULL;
+    ngx_uint_t                   idx, side, at = 0;
 
-    while( ( node ) && ( bit & mask ) ) {
-        if( ( prefix ) && ( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) ) {
-            rc = NGX_HTTP_LKLB_PARTIAL_MATCH;
-            break;
-        }
+    for( idx = 0; ( node ) && ( idx < *depth ); idx++ ) {
+        side = ( 0 != ngx_http_lklb_radix_cursor_bit( cursor, idx ) );
 
-        if( key & bit ) {
-            node = node->right;
-        } else {
-            node = node->left;
+        if( ( idx >= cursor->base ) && ( 0 == side ) && ( node->child[ 1 ] ) ) {
+            turn = node;
+            at   = idx;
         }
 
-        bit >>= 1;
+        node = node->child[ side ];
     }
 
-    if( ( node ) && ( NGX_HTTP_LKLB_ERR == rc ) && ( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) ) {
-        rc = NGX_HTTP_LKLB_MATCH;
+    if( NULL == turn ) {
+        return NULL;
     }
 
-    if( result ) {
-        *result = node;
-    }
+    ngx_http_lklb_radix_cursor_set( cursor, at, 1 );
+    *depth = at + 1;
 
-    return rc;
+    return turn->child[ 1 ];
 }
 
-ngx_http_lklb_retval_e
-ngx_http_lklb_radix_uint32_delete_with_mask(
-    ngx_http_lklb_radix_t  *tree,
-    uint32_t                key,
-    uint32_t                mask,
-    void                  **result
-) {
+/*
+ * Pre-order successor of node within the subtree the cursor walks,
+ * tracking the key bits on the way. Nodes below the longest key a
+ * cursor holds are not entered.
+ */
+static ngx_http_lklb_radix_node_t *
+ngx_http_lklb_radix_cursor_succ(
+    ngx_http_lklb_radix_t         *tree,
+    ngx_http_lklb_radix_cursor_t  *cursor,
+    ngx_http_lklb_radix_node_t    *node,
+    ngx_uint_t                    *depth
+) {
+    if( *depth < 8 * NGX_HTTP_LKLB_RADIX_KEY_MAX ) {
+        if( node->child[ 0 ] ) {
+            ngx_http_lklb_radix_cursor_set( cursor, ( *depth )++, 0 );
+            return node->child[ 0 ];
+        }
+
+        if( node->child[ 1 ] ) {
+            ngx_http_lklb_radix_cursor_set( cursor, ( *depth )++, 1 );
+            return node->child[ 1 ];
+        }
+    }
+
+    return ngx_http_lklb_radix_cursor_climb( tree, cursor, depth );
+}
+
+/*
+ * First node after the cursor position, or the top of its subtree if it
+ * did not start yet. The position may have been pruned since.
+ */
+static ngx_http_lklb_radix_node_t *
+ngx_http_lklb_radix_cursor_resume(
+    ngx_http_lklb_radix_t         *tree,
+    ngx_http_lklb_radix_cursor_t  *cursor,
+    ngx_uint_t                    *depth
+) {
+    ngx_http_lklb_radix_node_t  *node;
+    ngx_uint_t                   target;
+
+    target = ( cursor->started ) ? cursor->depth : cursor->base;
+    node   = ngx_http_lklb_radix_cursor_seek( tree, cursor, target, depth, NULL, NULL );
+
+    if( *depth < cursor->base ) {
+        /* The subtree is gone */
+        return NULL;
+    }
+
+    if( !cursor->started ) {
+        return node;
+    }
+
+    if( *depth == target ) {
+        return ngx_http_lklb_radix_cursor_succ( tree, cursor, node, depth );
+    }
+
+    /* The position is gone, what followed it comes next */
+    *depth = target;
+
+    return ngx_http_lklb_radix_cursor_climb( tree, cursor, depth );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_sweep(
+    ngx_http_lklb_radix_t  *tree,
+    ngx_uint_t              max_nodes,
+    ngx_uint_t             *count
+) {
+    ngx_http_lklb_radix_node_t   *node;
+    ngx_http_lklb_radix_trail_t   trail;
+    ngx_uint_t                    visited, depth, reached, freed;
+
+    if( ( NULL == tree ) || ( NULL == tree->expired_fnpt ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    *count = 0;
+
+    ngx_http_lklb_radix_wlock( tree );
+
+    /* Expired entries of read-only trees stay, finds pass over them */
+    if( !ngx_http_lklb_radix_writable( tree ) ) {
+        ngx_http_lklb_radix_unlock( tree );
+        return NGX_HTTP_LKLB_MATCH;
+    }
+
+    node = ngx_http_lklb_radix_cursor_resume( tree, &tree->sweep, &depth );
+
+    for( visited = 0; ( node ) && ( visited < max_nodes ); visited++ ) {
+        tree->sweep.depth   = depth;
+        tree->sweep.started = 1;
+        freed               = 0;
+
+        if( ( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) &&
+            ( ngx_http_lklb_radix_expired( tree, node->value ) ) ) {
+            ngx_http_lklb_radix_cursor_seek( tree, &tree->sweep, depth, &reached, &trail, NULL );
+            freed = ngx_http_lklb_radix_reclaim( tree, node, &trail );
+            ( *count )++;
+        }
+
+        /* A freed node took no subtree along, the walk goes on past it */
+        node = ( freed ) ? ngx_http_lklb_radix_cursor_climb( tree, &tree->sweep, &depth )
+                         : ngx_http_lklb_radix_cursor_succ( tree, &tree->sweep, node, &depth );
+    }
+
+    if( NULL == node ) {
+        ngx_http_lklb_radix_cursor_rewind( &tree->sweep );
+    }
+
+    ngx_http_lklb_radix_unlock( tree );
+
+    return( ( NULL == node ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_OK );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_set_clock_functions(
+    ngx_http_lklb_radix_t                   *tree,
+    ngx_http_lklb_radix_value_touch_pt       touch_fnpt,
+    ngx_http_lklb_radix_value_referenced_pt  referenced_fnpt
+) {
+    if( NULL == tree ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    tree->touch_fnpt      = touch_fnpt;
+    tree->referenced_fnpt = referenced_fnpt;
+
+    return NGX_HTTP_LKLB_OK;
+}
+
+/*
+ * CLOCK eviction of valued leaves, the only entries whose removal gives
+ * nodes back. Leaves referenced since the hand last passed get a second
+ * chance, expired ones go first. pin, the node an insert is extending, is
+ * neither evicted nor pruned. Caller holds the write lock.
+ */
+static ngx_uint_t
+ngx_http_lklb_radix_evict_locked(
+    ngx_http_lklb_radix_t       *tree,
+    ngx_http_lklb_radix_node_t  *pin,
+    ngx_uint_t                   max_entries
+) {
+    ngx_http_lklb_radix_node_t   *node;
+    ngx_http_lklb_radix_trail_t   trail;
+    ngx_uint_t                    visited, limit, depth, reached, freed, count = 0;
+    void                         *value;
+
+    if( ( NULL == tree->referenced_fnpt ) || ( !ngx_http_lklb_radix_writable( tree ) ) ) {
+        return 0;
+    }
+
+    /* Two turns of the hand clear every reference bit */
+    limit = 2 * tree->nnodes + 1;
+    node  = ngx_http_lklb_radix_cursor_resume( tree, &tree->hand, &depth );
+
+    for( visited = 0; ( visited < limit ) && ( count < max_entries ); visited++ ) {
+        if( NULL == node ) {
+            node  = tree->root;
+            depth = 0;
+        }
+
+        tree->hand.depth   = depth;
+        tree->hand.started = 1;
+        value              = node->value;
+        freed              = 0;
+
+        if( ( node != pin ) && ( NGX_HTTP_LKLB_RADIX_NO_VALUE != value ) &&
+            ( ngx_http_lklb_radix_is_leaf_node( node ) ) &&
+            ( ( ngx_http_lklb_radix_expired( tree, value ) ) ||
+              ( !tree->referenced_fnpt( tree->value_ctx, value ) ) ) ) {
+            /* A tree that cannot be written stops the hand, callers see what was freed so far */
+            if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_thaw( tree ) ) {
+                break;
+            }
+
+            ngx_http_lklb_radix_cursor_seek( tree, &tree->hand, depth, &reached, &trail, pin );
+            freed = ngx_http_lklb_radix_delete_node( tree, node, &trail );
+            ngx_http_lklb_radix_unref( tree, value );
+            count++;
+        }
+
+        node = ( freed ) ? ngx_http_lklb_radix_cursor_climb( tree, &tree->hand, &depth )
+                         : ngx_http_lklb_radix_cursor_succ( tree, &tree->hand, node, &depth );
+    }
+
+    return count;
+}
+
+ngx_uint_t
+ngx_http_lklb_radix_evict( ngx_http_lklb_radix_t *tree, ngx_uint_t max_entries ) {
+    ngx_uint_t  count;
+
+    if( NULL == tree ) {
+        return 0;
+    }
+
+    ngx_http_lklb_radix_wlock( tree );
+    count = ngx_http_lklb_radix_evict_locked( tree, NULL, max_entries );
+    ngx_http_lklb_radix_unlock( tree );
+
+    return count;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_set_transforms(
+    ngx_http_lklb_radix_t         *tree,
+    ngx_uint_t                     transforms
+) {
+    if( NULL == tree ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    tree->transforms = transforms;
+    return NGX_HTTP_LKLB_OK;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_set_dualstack( ngx_http_lklb_radix_t *tree ) {
+    if( ( NULL == tree ) || ( !ngx_http_lklb_radix_is_leaf_node( tree->root ) ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    tree->dualstack = 1;
+    return NGX_HTTP_LKLB_OK;
+}
+
+ngx_uint_t
+ngx_http_lklb_radix_get_num_pages( ngx_http_lklb_radix_t *tree ) {
+    return( ( tree ) ? tree->npages : 0 );
+}
+
+ngx_uint_t
+ngx_http_lklb_radix_get_num_nodes( ngx_http_lklb_radix_t *tree ) {
+    return( ( tree ) ? tree->nnodes : 0 );
+}
+
+static ngx_uint_t
+ngx_http_lklb_radix_popcount( uint64_t word ) {
+#if ( __GNUC__ )
+    return __builtin_popcountll( word );
+#else
+    ngx_uint_t  count;
+
+    for( count = 0; word; count++ ) {
+        word &= word - 1;
+    }
+
+    return count;
+#endif
+}
+
+#define ngx_http_lklb_radix_bitmap_test( __bitmap, __pos )                              \
+    ( ( __bitmap )[ ( __pos ) / 64 ] & ( ( uint64_t )1 << ( ( __pos ) % 64 ) ) )
+
+/* Number of bits set in bitmap before pos */
+static ngx_uint_t
+ngx_http_lklb_radix_bitmap_rank( uint64_t *bitmap, ngx_uint_t pos ) {
+    ngx_uint_t  idx, rank = 0;
+
+    for( idx = 0; idx < pos / 64; idx++ ) {
+        rank += ngx_http_lklb_radix_popcount( bitmap[ idx ] );
+    }
+
+    return rank + ngx_http_lklb_radix_popcount( bitmap[ idx ] & ( ( ( uint64_t )1 << ( pos % 64 ) ) - 1 ) );
+}
+
+/*
+ * find_node on the frozen index, for lookups only. The key is a bit
+ * string of bits bits read most significant bit first, like cursor keys,
+ * walked from stride top. Expired values are skipped but left for the
+ * tree to reclaim.
+ */
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_frozen_find(
+    ngx_http_lklb_radix_t         *tree,
+    ngx_http_lklb_radix_frozen_t  *frozen,
+    ngx_http_lklb_radix_stride_t  *top,
+    uint8_t                       *key,
+    ngx_uint_t                     bits,
+    uint8_t                        flags,
+    void                         **result,
+    ngx_http_lklb_radix_path_t    *all
+) {
+    ngx_http_lklb_radix_stride_t  *stride = top;
+    ngx_uint_t                     depth = 0, idx = 1, chunk;
+    void                          *value = NULL;
+    ngx_http_lklb_retval_e         rc = NGX_HTTP_LKLB_ERR;
+
+    while( 1 ) {
+        if( ngx_http_lklb_radix_bitmap_test( stride->prefixes, idx ) ) {
+            value = frozen->values[ stride->value + ngx_http_lklb_radix_bitmap_rank( stride->prefixes, idx ) ];
+
+            if( !ngx_http_lklb_radix_expired( tree, value ) ) {
+                if( all ) {
+                    if( all->count < all->nmatches ) {
+                        all->matches[ all->count ].value = value;
+                        all->matches[ all->count ].bits  = depth;
+                        all->count++;
+                    }
+
+                    if( depth == bits ) {
+                        rc = NGX_HTTP_LKLB_MATCH;
+                    }
+                } else if( ( depth == bits ) || ( NGX_HTTP_LKLB_RADIX_FIND_PREFIX & flags ) ) {
+                    rc = ( depth == bits ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_PARTIAL_MATCH;
+                    break;
+                }
+            }
+        }
+
+        if( depth == bits ) {
+            break;
+        }
+
+        if( 7 == depth % 8 ) {
+            /* The whole byte selects the child stride */
+            chunk = key[ depth / 8 ];
+
+            if( !ngx_http_lklb_radix_bitmap_test( stride->children, chunk ) ) {
+                break;
+            }
+
+            stride = &frozen->strides[ stride->child + ngx_http_lklb_radix_bitmap_rank( stride->children, chunk ) ];
+            idx    = 1;
+        } else {
+            idx = 2 * idx + ( 0 != ( key[ depth / 8 ] & ( NGX_HTTP_LKLB_RADIX_UINT8_MSB >> ( depth % 8 ) ) ) );
+        }
+
+        depth++;
+    }
+
+    if( all ) {
+        for( idx = 0; idx < all->count; idx++ ) {
+            ngx_http_lklb_radix_touch( tree, all->matches[ idx ].value );
+        }
+
+        return( ( ( NGX_HTTP_LKLB_ERR == rc ) && ( all->count ) ) ? NGX_HTTP_LKLB_PARTIAL_MATCH : rc );
+    }
+
+    if( NGX_HTTP_LKLB_ERR != rc ) {
+        ngx_http_lklb_radix_touch( tree, value );
+
+        if( result ) {
+            *result = value;
+        }
+    }
+
+    return rc;
+}
+
+#define NGX_HTTP_LKLB_RADIX_UINT32_MSB      ( ( uint32_t )1 << 31 )
+
+static ngx_uint_t
+ngx_http_lklb_radix_leading_ones( uint32_t word ) {
+#if ( __GNUC__ )
+    return( ( ( uint32_t )( -1 ) == word ) ? 32 : __builtin_clz( ~word ) );
+#else
+    ngx_uint_t  count;
+
+    for( count = 0; word & NGX_HTTP_LKLB_RADIX_UINT32_MSB; word <<= 1 ) {
+        count++;
+    }
+
+    return count;
+#endif
+}
+
+/* Prefix length of a mask, i.e. the number of its leading ones */
+static ngx_uint_t
+ngx_http_lklb_radix_mask_bits( uint32_t *mask, ngx_uint_t nwords ) {
+    ngx_uint_t  idx, bits = 0;
+
+    for( idx = 0; idx < nwords; idx++ ) {
+        bits += ngx_http_lklb_radix_leading_ones( mask[ idx ] );
+
+        if( ( uint32_t )( -1 ) != mask[ idx ] ) {
+            break;
+        }
+    }
+
+    return bits;
+}
+
+/* Numeric keys of nwords host order words */
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_frozen_words_find(
+    ngx_http_lklb_radix_t         *tree,
+    ngx_http_lklb_radix_frozen_t  *frozen,
+    ngx_http_lklb_radix_stride_t  *top,
+    uint32_t                      *key,
+    ngx_uint_t                     nwords,
+    ngx_uint_t                     bits,
+    uint8_t                        flags,
+    void                         **result,
+    ngx_http_lklb_radix_path_t    *all
+) {
+    uint8_t     bytes[ 16 ];
+    ngx_uint_t  idx;
+
+    for( idx = 0; idx < nwords; idx++ ) {
+        bytes[ 4 * idx ]     = ( uint8_t )( key[ idx ] >> 24 );
+        bytes[ 4 * idx + 1 ] = ( uint8_t )( key[ idx ] >> 16 );
+        bytes[ 4 * idx + 2 ] = ( uint8_t )( key[ idx ] >> 8 );
+        bytes[ 4 * idx + 3 ] = ( uint8_t )( key[ idx ] );
+    }
+
+    return ngx_http_lklb_radix_frozen_find( tree, frozen, top, &bytes[ 0 ], bits, flags, result, all );
+}
+
+/*
+ * Key walkers. Keys are walked from their most significant bit on and
+ * read 64 bits at a time: ngx_http_lklb_radix_<type>_chunk( key, idx,
+ * bits ) returns bits 64 * idx to 64 * idx + 63 of a key of bits bits
+ * in the top of a uint64_t, left aligned. NGX_HTTP_LKLB_RADIX_WALKERS
+ * generates the walkers of a key type from its chunk reader, each type
+ * gets its own inner loop with the reader inlined. Adding a key type
+ * takes a chunk reader, a frozen find and an instance of the macro.
+ * bits is the number of key bits walked, i.e. the prefix length.
+ */
+static uint64_t
+ngx_http_lklb_radix_uint32_chunk( uint32_t *key, ngx_uint_t idx, ngx_uint_t bits ) {
+    return ( uint64_t )key[ 0 ] << 32;
+}
+
+static uint64_t
+ngx_http_lklb_radix_uint128_chunk( uint32_t *key, ngx_uint_t idx, ngx_uint_t bits ) {
+    return ( ( uint64_t )key[ 2 * idx ] << 32 ) | key[ 2 * idx + 1 ];
+}
+
+/* Never reads past the key */
+static uint64_t
+ngx_http_lklb_radix_str_chunk( uint8_t *key, ngx_uint_t idx, ngx_uint_t bits ) {
+    uint64_t    chunk = 0;
+    ngx_uint_t  off, len;
+
+    key += 8 * idx;
+    len  = ngx_min( 8, bits / 8 - 8 * idx );
+
+    for( off = 0; off < len; off++ ) {
+        chunk |= ( uint64_t )key[ off ] << ( 56 - 8 * off );
+    }
+
+    return chunk;
+}
+
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_frozen_find(
+    ngx_http_lklb_radix_t         *tree,
+    ngx_http_lklb_radix_frozen_t  *frozen,
+    uint32_t                      *key,
+    ngx_uint_t                     bits,
+    uint8_t                        flags,
+    void                         **result,
+    ngx_http_lklb_radix_path_t    *all
+) {
+    ngx_http_lklb_radix_stride_t  *top = ( tree->dualstack ) ? frozen->mapped : &frozen->strides[ 0 ];
+
+    if( NULL == top ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    return ngx_http_lklb_radix_frozen_words_find( tree, frozen, top, key, 1, bits, flags, result, all );
+}
+
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_frozen_find(
+    ngx_http_lklb_radix_t         *tree,
+    ngx_http_lklb_radix_frozen_t  *frozen,
+    uint32_t                      *key,
+    ngx_uint_t                     bits,
+    uint8_t                        flags,
+    void                         **result,
+    ngx_http_lklb_radix_path_t    *all
+) {
+    return ngx_http_lklb_radix_frozen_words_find( tree, frozen, &frozen->strides[ 0 ], key, 4, bits, flags, result,
+                                                  all );
+}
+
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_str_frozen_find(
+    ngx_http_lklb_radix_t         *tree,
+    ngx_http_lklb_radix_frozen_t  *frozen,
+    uint8_t                       *key,
+    ngx_uint_t                     bits,
+    uint8_t                        flags,
+    void                         **result,
+    ngx_http_lklb_radix_path_t    *all
+) {
+    return ngx_http_lklb_radix_frozen_find( tree, frozen, &frozen->strides[ 0 ], key, bits, flags, result, all );
+}
+
+/* Dual-stack trees keep uint32 keys as IPv4-mapped keys, ::ffff:0:0/96 */
+#define NGX_HTTP_LKLB_RADIX_MAPPED_BITS     96
+#define NGX_HTTP_LKLB_RADIX_MAPPED_ONES     80
+
+/*
+ * Node of ::ffff:0:0/96 in a dual-stack tree, uint32 keys are walked
+ * from it and skip the 96 levels above. It is created with create set,
+ * caller holds the write lock then. Readers may cache it as well, they
+ * all store the same node and writers are excluded. free_node drops the
+ * cached node. NULL if it does not exist or could not be created.
+ */
+static ngx_http_lklb_radix_node_t *
+ngx_http_lklb_radix_mapped( ngx_http_lklb_radix_t *tree, ngx_uint_t create ) {
+    ngx_uint_t                   depth, set;
+    ngx_http_lklb_radix_node_t  *node = tree->root, *next;
+
+    for( depth = 0; depth < NGX_HTTP_LKLB_RADIX_MAPPED_BITS; depth++ ) {
+        set = ( depth >= NGX_HTTP_LKLB_RADIX_MAPPED_ONES );
+
+        if( NULL == ( next = node->child[ set ] ) ) {
+            /* A chain left partial is completed by the next insert */
+            if( ( !create ) || ( NULL == ( next = ngx_http_lklb_radix_alloc( tree, node ) ) ) ) {
+                return NULL;
+            }
+
+            ngx_http_lklb_radix_init_children( next );
+            next->value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
+
+            node->child[ set ] = next;
+        }
+
+        node = next;
+    }
+
+    tree->mapped = node;
+    return node;
+}
+
+/* Node the keys of a type are walked from, see ngx_http_lklb_radix_mapped */
+#define ngx_http_lklb_radix_uint32_root( __tree, __create )                             \
+    ( ( !( __tree )->dualstack ) ? ( __tree )->root                                     \
+      : ( ( __tree )->mapped ) ? ( __tree )->mapped                                     \
+      : ngx_http_lklb_radix_mapped( __tree, __create ) )
+
+#define ngx_http_lklb_radix_uint128_root( __tree, __create )    ( ( __tree )->root )
+#define ngx_http_lklb_radix_str_root( __tree, __create )        ( ( __tree )->root )
+
+/*
+ * Bit depth of a key as child index. Called once per depth, in order,
+ * __chunk holds the bits left of the 64 read last.
+ */
+#define ngx_http_lklb_radix_key_bit( __type, __key, __bits, __depth, __chunk )          \
+    ( ( ngx_uint_t )( ( __chunk = ( 0 == ( __depth ) % 64 )                             \
+        ? ngx_http_lklb_radix_##__type##_chunk( __key, ( __depth ) / 64, __bits )       \
+        : ( __chunk ) << 1 ) >> 63 ) )
+
+/*
+ * Generates for key type __type, keys of C type __key_t:
+ * _find_node:      the node of the key or, with
+ *                  NGX_HTTP_LKLB_RADIX_FIND_PREFIX, of its first prefix
+ *                  with a value. Collects the values on the path into
+ *                  all and records the way down into trail if given.
+ * _insert_locked:  caller holds the write lock
+ * _delete_locked:  caller holds the write lock
+ * _find_value:     takes the read lock, reclaims expired keys
+ * _find_path:      takes the read lock
+ * Keys already went through the configured transforms.
+ */
+#define NGX_HTTP_LKLB_RADIX_WALKERS( __type, __key_t )                                  \
+                                                                                        \
+static ngx_http_lklb_retval_e                                                           \
+ngx_http_lklb_radix_##__type##_find_node(                                               \
+    ngx_http_lklb_radix_t       *tree,                                                  \
+    __key_t                      key,                                                   \
+    ngx_uint_t                   bits,                                                  \
+    uint8_t                      flags,                                                 \
+    ngx_http_lklb_radix_node_t **result,                                                \
+    ngx_http_lklb_radix_path_t  *all,                                                   \
+    ngx_http_lklb_radix_trail_t *trail                                                  \
+) {                                                                                     \
+    uint64_t                     chunk = 0;                                             \
+    ngx_uint_t                   depth, set;                                            \
+    ngx_http_lklb_radix_node_t  *node = ngx_http_lklb_radix_##__type##_root( tree, 0 ); \
+    ngx_http_lklb_retval_e       rc = NGX_HTTP_LKLB_ERR;                                \
+                                                                                        \
+    if( trail ) {                                                                       \
+        trail->node = NULL;                                                             \
+    }                                                                                   \
+                                                                                        \
+    for( depth = 0; ( node ) && ( depth < bits ); depth++ ) {                           \
+        if( all ) {                                                                     \
+            ngx_http_lklb_radix_path_add( tree, all, node, depth );                     \
+        } else if( ( NGX_HTTP_LKLB_RADIX_FIND_PREFIX & flags )                          \
+                   && ( ngx_http_lklb_radix_has_value( tree, node, flags ) ) ) {        \
+            rc = NGX_HTTP_LKLB_PARTIAL_MATCH;                                           \
+            break;                                                                      \
+        }                                                                               \
+                                                                                        \
+        set = ngx_http_lklb_radix_key_bit( __type, key, bits, depth, chunk );           \
+                                                                                        \
+        if( trail ) {                                                                   \
+            ngx_http_lklb_radix_trail_step( tree, trail, node, set, NULL );             \
+        }                                                                               \
+                                                                                        \
+        node = node->child[ set ];                                                      \
+    }                                                                                   \
+                                                                                        \
+    if( ( node ) && ( NGX_HTTP_LKLB_ERR == rc )                                         \
+        && ( ngx_http_lklb_radix_has_value( tree, node, flags ) ) ) {                   \
+        rc = NGX_HTTP_LKLB_MATCH;                                                       \
+    }                                                                                   \
+                                                                                        \
+    if( all ) {                                                                         \
+        if( node ) {                                                                    \
+            ngx_http_lklb_radix_path_add( tree, all, node, depth );                     \
+        }                                                                               \
+                                                                                        \
+        if( ( NGX_HTTP_LKLB_ERR == rc ) && ( all->count ) ) {                           \
+            rc = NGX_HTTP_LKLB_PARTIAL_MATCH;                                           \
+        }                                                                               \
+    }                                                                                   \
+                                                                                        \
+    if( result ) {                                                                      \
+        *result = node;                                                                 \
+    }                                                                                   \
+                                                                                        \
+    return rc;                                                                          \
+}                                                                                       \
+                                                                                        \
+static ngx_http_lklb_retval_e                                                           \
+ngx_http_lklb_radix_##__type##_insert_locked(                                           \
+    ngx_http_lklb_radix_t       *tree,                                                  \
+    __key_t                      key,                                                   \
+    ngx_uint_t                   bits,                                                  \
+    void                        *value                                                  \
+) {                                                                                     \
+    uint64_t                     chunk = 0;                                             \
+    ngx_uint_t                   depth, set = 0, created;                               \
+    ngx_http_lklb_radix_node_t  *node, *next;                                           \
+    ngx_http_lklb_radix_trail_t  trail;                                                 \
+                                                                                        \
+    if( NULL == ( node = ngx_http_lklb_radix_##__type##_root( tree, 1 ) ) ) {           \
+        return NGX_HTTP_LKLB_ERR;                                                       \
+    }                                                                                   \
+                                                                                        \
+    for( depth = 0; depth < bits; depth++ ) {                                           \
+        set = ngx_http_lklb_radix_key_bit( __type, key, bits, depth, chunk );           \
+                                                                                        \
+        if( NULL == ( next = node->child[ set ] ) ) {                                   \
+            break;                                                                      \
+        }                                                                               \
+                                                                                        \
+        node = next;                                                                    \
+    }                                                                                   \
+                                                                                        \
+    if( depth == bits ) {                                                               \
+        return ngx_http_lklb_radix_set_value( tree, node, value );                      \
+    }                                                                                   \
+                                                                                        \
+    created = 0;                                                                        \
+                                                                                        \
+    while( 1 ) {                                                                        \
+        if( !( next = ngx_http_lklb_radix_alloc( tree, node ) ) ) {                     \
+            /* Give back the path built so far, its trail is found again after evictions */ \
+            if( created ) {                                                             \
+                ngx_http_lklb_radix_##__type##_find_node( tree, key, bits, 0, NULL,     \
+                                                          NULL, &trail );               \
+                ngx_http_lklb_radix_delete_node( tree, node, &trail );                  \
+            }                                                                           \
+                                                                                        \
+            return NGX_HTTP_LKLB_ERR;                                                   \
+        }                                                                               \
+                                                                                        \
+        ngx_http_lklb_radix_init_children( next );                                      \
+        next->value = NGX_HTTP_LKLB_RADIX_NO_VALUE;                                     \
+                                                                                        \
+        node->child[ set ] = next;                                                      \
+                                                                                        \
+        node    = next;                                                                 \
+        created = 1;                                                                    \
+                                                                                        \
+        if( ++depth == bits ) {                                                         \
+            break;                                                                      \
+        }                                                                               \
+                                                                                        \
+        set = ngx_http_lklb_radix_key_bit( __type, key, bits, depth, chunk );           \
+    }                                                                                   \
+                                                                                        \
+    node->value = value;                                                                \
+    ngx_http_lklb_radix_ref( tree, value );                                             \
+    return NGX_HTTP_LKLB_MATCH;                                                         \
+}                                                                                       \
+                                                                                        \
+static ngx_http_lklb_retval_e                                                           \
+ngx_http_lklb_radix_##__type##_delete_locked(                                           \
+    ngx_http_lklb_radix_t       *tree,                                                  \
+    __key_t                      key,                                                   \
+    ngx_uint_t                   bits,                                                  \
+    void                       **result                                                 \
+) {                                                                                     \
+    ngx_http_lklb_radix_node_t  *node;                                                  \
+    ngx_http_lklb_radix_trail_t  trail;                                                 \
+    ngx_http_lklb_retval_e       rc;                                                    \
+                                                                                        \
+    rc = ngx_http_lklb_radix_##__type##_find_node( tree, key, bits, 0, &node, NULL,     \
+                                                   &trail );                            \
+    if( ( NULL == node ) || ( NGX_HTTP_LKLB_MATCH != rc ) ) {                           \
+        return NGX_HTTP_LKLB_ERR;                                                       \
+    }                                                                                   \
+                                                                                        \
+    *result = node->value;                                                              \
+                                                                                        \
+    /* Prunes up to the root but never frees it, e.g. for a /0 entry */                 \
+    ngx_http_lklb_radix_delete_node( tree, node, &trail );                              \
+    return NGX_HTTP_LKLB_MATCH;                                                         \
+}                                                                                       \
+                                                                                        \
+static ngx_http_lklb_retval_e                                                           \
+ngx_http_lklb_radix_##__type##_find_value(                                              \
+    ngx_http_lklb_radix_t       *tree,                                                  \
+    __key_t                      key,                                                   \
+    ngx_uint_t                   bits,                                                  \
+    void                       **result,                                                \
+    uint8_t                      prefix                                                 \
+) {                                                                                     \
+    void                        *value = NGX_HTTP_LKLB_RADIX_NO_VALUE;                  \
+    ngx_http_lklb_radix_node_t  *node;                                                  \
+    ngx_http_lklb_radix_trail_t  trail;                                                 \
+    ngx_http_lklb_radix_frozen_t *frozen = tree->frozen;                                \
+    ngx_http_lklb_retval_e       rc;                                                    \
+    ngx_uint_t                   locked;                                                \
+                                                                                        \
+    if( frozen ) {                                                                      \
+        return ngx_http_lklb_radix_##__type##_frozen_find( tree, frozen, key, bits,     \
+                   ngx_http_lklb_radix_find_flags( prefix ), result, NULL );            \
+    }                                                                                   \
+                                                                                        \
+    locked = ngx_http_lklb_radix_find_lock( tree );                                     \
+                                                                                        \
+    rc = ngx_http_lklb_radix_##__type##_find_node( tree, key, bits,                     \
+             ngx_http_lklb_radix_find_flags( prefix ), &node, NULL, NULL );             \
+    if( NGX_HTTP_LKLB_ERR == rc ) {                                                     \
+        /* Expired keys of read-only trees are left in place */                         \
+        if( ( NULL == node ) || ( NGX_HTTP_LKLB_RADIX_NO_VALUE == node->value ) ||      \
+            ( !locked ) ) {                                                             \
+            ngx_http_lklb_radix_find_unlock( tree, locked );                            \
+            return NGX_HTTP_LKLB_ERR;                                                   \
+        }                                                                               \
+                                                                                        \
+        /* The key expired, reclaim it unless it was replaced meanwhile */              \
+        ngx_http_lklb_radix_unlock( tree );                                             \
+        ngx_http_lklb_radix_wlock( tree );                                              \
+                                                                                        \
+        if( NGX_HTTP_LKLB_MATCH == ngx_http_lklb_radix_##__type##_find_node( tree, key, \
+                                       bits, 0, &node, NULL, &trail ) ) {               \
+            ngx_http_lklb_radix_reclaim( tree, node, &trail );                          \
+        }                                                                               \
+                                                                                        \
+        ngx_http_lklb_radix_unlock( tree );                                             \
+        return NGX_HTTP_LKLB_ERR;                                                       \
+    }                                                                                   \
+                                                                                        \
+    if( node ) {                                                                        \
+        value = node->value;                                                            \
+        ngx_http_lklb_radix_touch( tree, value );                                       \
+    }                                                                                   \
+                                                                                        \
+    ngx_http_lklb_radix_find_unlock( tree, locked );                                    \
+                                                                                        \
+    if( result ) {                                                                      \
+        *result = value;                                                                \
+    }                                                                                   \
+                                                                                        \
+    return rc;                                                                          \
+}                                                                                       \
+                                                                                        \
+static ngx_http_lklb_retval_e                                                           \
+ngx_http_lklb_radix_##__type##_find_path(                                               \
+    ngx_http_lklb_radix_t       *tree,                                                  \
+    __key_t                      key,                                                   \
+    ngx_uint_t                   bits,                                                  \
+    ngx_http_lklb_radix_path_t  *all,                                                   \
+    ngx_uint_t                  *count                                                  \
+) {                                                                                     \
+    ngx_http_lklb_radix_node_t  *node;                                                  \
+    ngx_http_lklb_radix_frozen_t *frozen = tree->frozen;                                \
+    ngx_http_lklb_retval_e       rc;                                                    \
+    ngx_uint_t                   locked;                                                \
+                                                                                        \
+    if( frozen ) {                                                                      \
+        rc = ngx_http_lklb_radix_##__type##_frozen_find( tree, frozen, key, bits,       \
+                 NGX_HTTP_LKLB_RADIX_FIND_LIVE, NULL, all );                            \
+        return ngx_http_lklb_radix_frozen_done( all, rc, count );                       \
+    }                                                                                   \
+                                                                                        \
+    locked = ngx_http_lklb_radix_find_lock( tree );                                     \
+                                                                                        \
+    rc = ngx_http_lklb_radix_##__type##_find_node( tree, key, bits,                     \
+             NGX_HTTP_LKLB_RADIX_FIND_LIVE, &node, all, NULL );                         \
+                                                                                        \
+    return ngx_http_lklb_radix_path_done( tree, locked, all, rc, count );               \
+}
+
+NGX_HTTP_LKLB_RADIX_WALKERS( uint32, uint32_t * )
+NGX_HTTP_LKLB_RADIX_WALKERS( uint128, uint32_t * )
+NGX_HTTP_LKLB_RADIX_WALKERS( str, uint8_t * )
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_insert_with_mask(
+    ngx_http_lklb_radix_t *tree,
+    uint32_t               key,
+    uint32_t               mask,
+    void                  *value
+) {
+    ngx_http_lklb_retval_e       rc;
+
+    if( NULL == tree ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    key  = ngx_http_lklb_uint32_htonl( tree->transforms, key );
+    mask = ngx_http_lklb_uint32_htonl( tree->transforms, mask );
+
+    ngx_http_lklb_radix_wlock( tree );
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_thaw( tree ) ) {
+        ngx_http_lklb_radix_unlock( tree );
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    rc = ngx_http_lklb_radix_uint32_insert_locked( tree, &key, ngx_http_lklb_radix_mask_bits( &mask, 1 ), value );
+
+    ngx_http_lklb_radix_unlock( tree );
+    return rc;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_insert(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t                key,
+    void                   *value
+) {
+    return ngx_http_lklb_radix_uint32_insert_with_mask( tree, key, ( uint32_t )( -1 ), value );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_delete_with_mask(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t                key,
+    uint32_t                mask,
+    void                  **result
+) {
+    void                        *value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
+    ngx_http_lklb_retval_e       rc;
+
+    if( NULL == tree ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    key  = ngx_http_lklb_uint32_htonl( tree->transforms, key );
+    mask = ngx_http_lklb_uint32_htonl( tree->transforms, mask );
+
+    ngx_http_lklb_radix_wlock( tree );
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_thaw( tree ) ) {
+        ngx_http_lklb_radix_unlock( tree );
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    rc = ngx_http_lklb_radix_uint32_delete_locked( tree, &key, ngx_http_lklb_radix_mask_bits( &mask, 1 ), &value );
+
+    ngx_http_lklb_radix_unlock( tree );
+
+    if( result ) {
+        *result = value;
+    }
+
+    return rc;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_delete(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t                key,
+    void                  **result
+) {
+    return ngx_http_lklb_radix_uint32_delete_with_mask( tree, key, ( uint32_t )( -1 ), result );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_find_with_mask(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t                key,
+    uint32_t                mask,
+    void                  **result,
+    uint8_t                 prefix
+) {
+    if( NULL == tree ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    key  = ngx_http_lklb_uint32_htonl( tree->transforms, key );
+    mask = ngx_http_lklb_uint32_htonl( tree->transforms, mask );
+
+    return ngx_http_lklb_radix_uint32_find_value( tree, &key, ngx_http_lklb_radix_mask_bits( &mask, 1 ), result,
+                                                  prefix );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_find(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t                key,
+    void                  **result,
+    uint8_t                 prefix
+) {
+    return ngx_http_lklb_radix_uint32_find_with_mask( tree, key, ( uint32_t )( -1 ), result, prefix );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_find_all(
+    ngx_http_lklb_radix_t        *tree,
+    uint32_t                      key,
+    uint32_t                      mask,
+    ngx_http_lklb_radix_match_t  *matches,
+    ngx_uint_t                    nmatches,
+    ngx_uint_t                   *count
+) {
+    ngx_http_lklb_radix_path_t   all = { matches, nmatches, 0 };
+
+    if( ( NULL == tree ) || ( NULL == matches ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    key  = ngx_http_lklb_uint32_htonl( tree->transforms, key );
+    mask = ngx_http_lklb_uint32_htonl( tree->transforms, mask );
+
+    return ngx_http_lklb_radix_uint32_find_path( tree, &key, ngx_http_lklb_radix_mask_bits( &mask, 1 ), &all,
+                                                 count );
+}
+
+#define NGX_HTTP_LKLB_RADIX_UINT128_DEFAULT_MASK { ( uint32_t )-1, ( uint32_t )-1, ( uint32_t )-1, ( uint32_t )-1 }
+
+/* Copies key through the configured transforms, returns the prefix length of mask */
+static ngx_uint_t
+ngx_http_lklb_radix_uint128_prepare(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t               *key,
+    uint32_t               *mask,
+    uint32_t               *lkey
+) {
+    uint32_t    lmask[ 4 ];
+
+    ngx_memcpy( lkey, key, 4 * sizeof( uint32_t ) );
+    ngx_memcpy( &lmask[ 0 ], mask, 4 * sizeof( uint32_t ) );
+
+    ngx_http_lklb_uint128_htonl( tree->transforms, lkey );
+    ngx_http_lklb_uint128_htonl( tree->transforms, &lmask[ 0 ] );
+
+    return ngx_http_lklb_radix_mask_bits( &lmask[ 0 ], 4 );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_insert_with_mask(
+    ngx_http_lklb_radix_t *tree,
+    uint32_t              *key,
+    uint32_t              *mask,
+    void                  *value
+) {
+    uint32_t                     lkey[ 4 ];
+    ngx_uint_t                   bits;
+    ngx_http_lklb_retval_e       rc;
+
+    if( ( NULL == tree ) || ( NULL == key ) || ( NULL == mask ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    bits = ngx_http_lklb_radix_uint128_prepare( tree, key, mask, &lkey[ 0 ] );
+
+    ngx_http_lklb_radix_wlock( tree );
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_thaw( tree ) ) {
+        ngx_http_lklb_radix_unlock( tree );
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    rc = ngx_http_lklb_radix_uint128_insert_locked( tree, &lkey[ 0 ], bits, value );
+
+    ngx_http_lklb_radix_unlock( tree );
+    return rc;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_insert(
+    ngx_http_lklb_radix_t *tree,
+    uint32_t              *key,
+    void                  *value
+) {
+    uint32_t    mask[ 4 ] = NGX_HTTP_LKLB_RADIX_UINT128_DEFAULT_MASK;
+
+    return ngx_http_lklb_radix_uint128_insert_with_mask( tree, key, &mask[ 0 ], value );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_delete_with_mask(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t               *key,
+    uint32_t               *mask,
+    void                  **result
+) {
+    void                        *value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
+    uint32_t                     lkey[ 4 ];
+    ngx_uint_t                   bits;
+    ngx_http_lklb_retval_e       rc;
+
+    if( ( NULL == tree ) || ( NULL == key ) || ( NULL == mask ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    bits = ngx_http_lklb_radix_uint128_prepare( tree, key, mask, &lkey[ 0 ] );
+
+    ngx_http_lklb_radix_wlock( tree );
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_thaw( tree ) ) {
+        ngx_http_lklb_radix_unlock( tree );
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    rc = ngx_http_lklb_radix_uint128_delete_locked( tree, &lkey[ 0 ], bits, &value );
+
+    ngx_http_lklb_radix_unlock( tree );
+
+    if( result ) {
+        *result = value;
+    }
+
+    return rc;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_delete(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t               *key,
+    void                  **result
+) {
+    uint32_t    mask[ 4 ] = NGX_HTTP_LKLB_RADIX_UINT128_DEFAULT_MASK;
+
+    return ngx_http_lklb_radix_uint128_delete_with_mask( tree, key, &mask[ 0 ], result );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_find_with_mask(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t               *key,
+    uint32_t               *mask,
+    void                  **result,
+    uint8_t                 prefix
+) {
+    uint32_t                     lkey[ 4 ];
+    ngx_uint_t                   bits;
+
+    if( ( NULL == tree ) || ( NULL == key ) || ( NULL == mask ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    bits = ngx_http_lklb_radix_uint128_prepare( tree, key, mask, &lkey[ 0 ] );
+
+    return ngx_http_lklb_radix_uint128_find_value( tree, &lkey[ 0 ], bits, result, prefix );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_find(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t               *key,
+    void                  **result,
+    uint8_t                 prefix
+) {
+    uint32_t    mask[ 4 ] = NGX_HTTP_LKLB_RADIX_UINT128_DEFAULT_MASK;
+
+    return ngx_http_lklb_radix_uint128_find_with_mask( tree, key, &mask[ 0 ], result, prefix );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_find_all(
+    ngx_http_lklb_radix_t        *tree,
+    uint32_t                     *key,
+    uint32_t                     *mask,
+    ngx_http_lklb_radix_match_t  *matches,
+    ngx_uint_t                    nmatches,
+    ngx_uint_t                   *count
+) {
+    ngx_http_lklb_radix_path_t   all = { matches, nmatches, 0 };
+    uint32_t                     lkey[ 4 ];
+    ngx_uint_t                   bits;
+
+    if( ( NULL == tree ) || ( NULL == key ) || ( NULL == mask ) || ( NULL == matches ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    bits = ngx_http_lklb_radix_uint128_prepare( tree, key, mask, &lkey[ 0 ] );
+
+    return ngx_http_lklb_radix_uint128_find_path( tree, &lkey[ 0 ], bits, &all, count );
+}
+
+/*
+ * Range support. Ranges are split into the minimal set of CIDR blocks,
+ * keys are handled as big endian arrays of nwords 32 bit words so the
+ * same code serves uint32 (nwords 1) and uint128 (nwords 4) keys. uint32
+ * blocks are applied through the uint128 walkers with the trailing words
+ * masked off which visits exactly the nodes the uint32 walkers do.
+ */
+static ngx_int_t
+ngx_http_lklb_radix_words_cmp( uint32_t *a, uint32_t *b, ngx_uint_t nwords ) {
+    ngx_uint_t  idx;
+
+    for( idx = 0; idx < nwords; idx++ ) {
+        if( a[ idx ] != b[ idx ] ) {
+            return( ( a[ idx ] < b[ idx ] ) ? -1 : 1 );
+        }
+    }
+
+    return 0;
+}
+
+/* Largest block starting at start that does not go past end */
+static ngx_uint_t
+ngx_http_lklb_radix_range_block(
+    uint32_t   *start,
+    uint32_t   *end,
+    ngx_uint_t  nwords,
+    uint32_t   *last
+) {
+    ngx_uint_t  hostbits, idx, shift;
+    uint32_t    word;
+
+    hostbits = 0;
+
+    for( idx = nwords; idx > 0; idx-- ) {
+        word = start[ idx - 1 ];
+
+        if( 0 == word ) {
+            hostbits += 32;
+            continue;
+        }
+
+        while( !( word & 1 ) ) {
+            word >>= 1;
+            hostbits++;
+        }
+
+        break;
+    }
+
+    while( 1 ) {
+        for( idx = 0; idx < nwords; idx++ ) {
+            shift = ( nwords - 1 - idx ) * 32;
+
+            if( hostbits >= shift + 32 ) {
+                last[ idx ] = start[ idx ] | ( uint32_t )( -1 );
+            } else if( hostbits > shift ) {
+                last[ idx ] = start[ idx ] | ( ( ( uint32_t )1 << ( hostbits - shift ) ) - 1 );
+            } else {
+                last[ idx ] = start[ idx ];
+            }
+        }
+
+        if( ( 0 == hostbits ) || ( ngx_http_lklb_radix_words_cmp( last, end, nwords ) <= 0 ) ) {
+            return hostbits;
+        }
+
+        hostbits--;
+    }
+}
+
+/*
+ * Release every value in the subtree below top, including top itself,
+ * and return the nodes to the free list. trail is the trail of top.
+ * Returns the number of values released.
+ */
+static ngx_uint_t
+ngx_http_lklb_radix_delete_subtree(
+    ngx_http_lklb_radix_t        *tree,
+    ngx_http_lklb_radix_node_t   *top,
+    ngx_http_lklb_radix_trail_t  *trail
+) {
+    ngx_uint_t                   side, count = 0;
+    ngx_http_lklb_radix_node_t  *node, *next;
+
+    for( side = 0; side < 2; side++ ) {
+        node = top->child[ side ];
+        top->child[ side ] = NULL;
+
+        /* Rotating left children up flattens the subtree as it is freed */
+        while( node ) {
+            if( node->child[ 0 ] ) {
+                next             = node->child[ 0 ];
+                node->child[ 0 ] = next->child[ 1 ];
+                next->child[ 1 ] = node;
+                node             = next;
+                continue;
+            }
+
+            next = node->child[ 1 ];
+
+            if( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) {
+                ngx_http_lklb_radix_unref( tree, node->value );
+                count++;
+            }
+
+            ngx_http_lklb_radix_free_node( tree, node );
+
+            node = next;
+        }
+    }
+
+    if( NGX_HTTP_LKLB_RADIX_NO_VALUE != top->value ) {
+        ngx_http_lklb_radix_unref( tree, top->value );
+        count++;
+    }
+
+    ngx_http_lklb_radix_delete_node( tree, top, trail );
+
+    return count;
+}
+
+#define NGX_HTTP_LKLB_RADIX_RANGE_INSERT     0
+#define NGX_HTTP_LKLB_RADIX_RANGE_DELETE     1
+#define NGX_HTTP_LKLB_RADIX_RANGE_ROLLBACK   2
+
+/* uint32 blocks go by the uint32 walkers, mapped in dual-stack trees */
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_range_find_node(
+    ngx_http_lklb_radix_t         *tree,
+    uint32_t                      *key,
+    ngx_uint_t                     nwords,
+    ngx_uint_t                     bits,
+    ngx_http_lklb_radix_node_t   **node,
+    ngx_http_lklb_radix_trail_t   *trail
+) {
+    if( 1 == nwords ) {
+        return ngx_http_lklb_radix_uint32_find_node( tree, key, bits, 0, node, NULL, trail );
+    }
+
+    return ngx_http_lklb_radix_uint128_find_node( tree, key, bits, 0, node, NULL, trail );
+}
+
+/*
+ * Walk the CIDR blocks covering [start, end] and apply op to each one.
+ * Insert flags the blocks it stored in the stored bitmap, indexed by
+ * block number, and rollback releases just those. With
+ * NGX_HTTP_LKLB_RADIX_RANGE_ROLLBACK only the blocks before stop are
+ * visited, all of them without stop. Caller holds the write lock.
+ */
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_range_apply(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t               *start,
+    uint32_t               *end,
+    ngx_uint_t              nwords,
+    ngx_uint_t              op,
+    void                   *value,
+    uint32_t               *stop,
+    uint32_t               *stored,
+    ngx_uint_t             *count
+) {
+    uint32_t                     cur[ 4 ], last[ 4 ], key[ 4 ];
+    ngx_uint_t                   hostbits, bits, idx, block;
+    ngx_http_lklb_radix_node_t  *node;
+    ngx_http_lklb_radix_trail_t  trail;
+    ngx_http_lklb_retval_e       rc;
+
+    ngx_memcpy( &cur[ 0 ], start, nwords * sizeof( uint32_t ) );
+
+    for( block = 0; ; block++ ) {
+        if( ( NGX_HTTP_LKLB_RADIX_RANGE_ROLLBACK == op ) && ( NULL != stop ) &&
+            ( 0 == ngx_http_lklb_radix_words_cmp( &cur[ 0 ], stop, nwords ) ) ) {
+            break;
+        }
+
+        hostbits = ngx_http_lklb_radix_range_block( &cur[ 0 ], end, nwords, &last[ 0 ] );
+
+        ngx_memzero( &key[ 0 ], sizeof( key ) );
+        ngx_memcpy( &key[ 0 ], &cur[ 0 ], nwords * sizeof( uint32_t ) );
+        bits = nwords * 32 - hostbits;
+
+        switch( op ) {
+            case NGX_HTTP_LKLB_RADIX_RANGE_INSERT:
+                rc = ( 1 == nwords ) ? ngx_http_lklb_radix_uint32_insert_locked( tree, &key[ 0 ], bits, value )
+                                     : ngx_http_lklb_radix_uint128_insert_locked( tree, &key[ 0 ], bits, value );
+                if( NGX_HTTP_LKLB_ERR == rc ) {
+                    ngx_memcpy( stop, &cur[ 0 ], nwords * sizeof( uint32_t ) );
+                    return NGX_HTTP_LKLB_ERR;
+                }
+
+                if( NGX_HTTP_LKLB_MATCH == rc ) {
+                    stored[ block / 32 ] |= ( uint32_t )1 << ( block % 32 );
+                    ( *count )++;
+                }
+
+                break;
+
+            case NGX_HTTP_LKLB_RADIX_RANGE_DELETE:
+                ngx_http_lklb_radix_range_find_node( tree, &key[ 0 ], nwords, bits, &node, &trail );
+                if( node ) {
+                    *count += ngx_http_lklb_radix_delete_subtree( tree, node, &trail );
+                }
+
+                break;
+
+            default:
+                if( !( stored[ block / 32 ] & ( ( uint32_t )1 << ( block % 32 ) ) ) ) {
+                    break;
+                }
+
+                ngx_http_lklb_radix_range_find_node( tree, &key[ 0 ], nwords, bits, &node, &trail );
+                if( ( node ) && ( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) ) {
+                    ngx_http_lklb_radix_unref( tree, node->value );
+                    ngx_http_lklb_radix_delete_node( tree, node, &trail );
+                }
+
+                break;
+        }
+
+        for( idx = 0; idx < nwords; idx++ ) {
+            if( ( uint32_t )( -1 ) != last[ idx ] ) {
+                break;
+            }
+        }
+
+        if( idx == nwords ) {
+            /* Range ends at the top of the key space */
+            break;
+        }
+
+        for( idx = nwords; idx > 0; idx-- ) {
+            cur[ idx - 1 ] = last[ idx - 1 ] + 1;
+
+            if( 0 != cur[ idx - 1 ] ) {
+                while( --idx > 0 ) {
+                    cur[ idx - 1 ] = last[ idx - 1 ];
+                }
+
+                break;
+            }
+        }
+
+        if( ngx_http_lklb_radix_words_cmp( &cur[ 0 ], end, nwords ) > 0 ) {
+            break;
+        }
+    }
+
+    return NGX_HTTP_LKLB_OK;
+}
+
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_range_insert(
+    ngx_http_lklb_radix_t             *tree,
+    uint32_t                          *start,
+    uint32_t                          *end,
+    ngx_uint_t                         nwords,
+    void                              *value,
+    ngx_uint_t                        *result,
+    ngx_http_lklb_radix_range_undo_t  *undo
+) {
+    uint32_t                          stop[ 4 ];
+    ngx_uint_t                        count = 0, ignored = 0;
+    ngx_http_lklb_radix_range_undo_t  local;
+    ngx_http_lklb_retval_e            rc;
+
+    if( NULL == undo ) {
+        undo = &local;
+    }
+
+    ngx_memzero( undo, sizeof( ngx_http_lklb_radix_range_undo_t ) );
+
+    if( ngx_http_lklb_radix_words_cmp( start, end, nwords ) > 0 ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    ngx_http_lklb_radix_wlock( tree );
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_thaw( tree ) ) {
+        ngx_http_lklb_radix_unlock( tree );
+
+        if( result ) {
+            *result = 0;
+        }
+
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    rc = ngx_http_lklb_radix_range_apply( tree, start, end, nwords, NGX_HTTP_LKLB_RADIX_RANGE_INSERT,
+                                          value, &stop[ 0 ], &undo->stored[ 0 ], &count );
+    if( NGX_HTTP_LKLB_ERR == rc ) {
+        ngx_http_lklb_radix_range_apply( tree, start, end, nwords, NGX_HTTP_LKLB_RADIX_RANGE_ROLLBACK,
+                                         value, &stop[ 0 ], &undo->stored[ 0 ], &ignored );
+        ngx_memzero( undo, sizeof( ngx_http_lklb_radix_range_undo_t ) );
+        count = 0;
+    }
+
+    ngx_http_lklb_radix_unlock( tree );
+
+    if( result ) {
+        *result = count;
+    }
+
+    if( NGX_HTTP_LKLB_ERR == rc ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    return( ( count ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_DUP );
+}
+
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_range_delete(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t               *start,
+    uint32_t               *end,
+    ngx_uint_t              nwords,
+    ngx_uint_t             *result
+) {
+    ngx_uint_t                   count = 0;
+
+    if( ngx_http_lklb_radix_words_cmp( start, end, nwords ) > 0 ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    ngx_http_lklb_radix_wlock( tree );
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_thaw( tree ) ) {
+        ngx_http_lklb_radix_unlock( tree );
+
+        if( result ) {
+            *result = 0;
+        }
+
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    ngx_http_lklb_radix_range_apply( tree, start, end, nwords, NGX_HTTP_LKLB_RADIX_RANGE_DELETE,
+                                     NULL, NULL, NULL, &count );
+
+    ngx_http_lklb_radix_unlock( tree );
+
+    if( result ) {
+        *result = count;
+    }
+
+    return( ( count ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_ERR );
+}
+
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_range_undo(
+    ngx_http_lklb_radix_t             *tree,
+    uint32_t                          *start,
+    uint32_t                          *end,
+    ngx_uint_t                         nwords,
+    ngx_http_lklb_radix_range_undo_t  *undo
+) {
+    ngx_uint_t                   ignored = 0;
+
+    if( ngx_http_lklb_radix_words_cmp( start, end, nwords ) > 0 ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    ngx_http_lklb_radix_wlock( tree );
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_thaw( tree ) ) {
+        ngx_http_lklb_radix_unlock( tree );
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    ngx_http_lklb_radix_range_apply( tree, start, end, nwords, NGX_HTTP_LKLB_RADIX_RANGE_ROLLBACK,
+                                     NULL, NULL, &undo->stored[ 0 ], &ignored );
+
+    ngx_http_lklb_radix_unlock( tree );
+
+    return NGX_HTTP_LKLB_OK;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_insert_range(
+    ngx_http_lklb_radix_t             *tree,
+    uint32_t                           start,
+    uint32_t                           end,
+    void                              *value,
+    ngx_uint_t                        *count,
+    ngx_http_lklb_radix_range_undo_t  *undo
+) {
+    if( NULL == tree ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    start = ngx_http_lklb_uint32_htonl( tree->transforms, start );
+    end   = ngx_http_lklb_uint32_htonl( tree->transforms, end );
+
+    return ngx_http_lklb_radix_range_insert( tree, &start, &end, 1, value, count, undo );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_delete_range(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t                start,
+    uint32_t                end,
+    ngx_uint_t             *count
+) {
+    if( NULL == tree ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    start = ngx_http_lklb_uint32_htonl( tree->transforms, start );
+    end   = ngx_http_lklb_uint32_htonl( tree->transforms, end );
+
+    return ngx_http_lklb_radix_range_delete( tree, &start, &end, 1, count );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_insert_range(
+    ngx_http_lklb_radix_t             *tree,
+    uint32_t                          *start,
+    uint32_t                          *end,
+    void                              *value,
+    ngx_uint_t                        *count,
+    ngx_http_lklb_radix_range_undo_t  *undo
+) {
+    uint32_t    lstart[ 4 ], lend[ 4 ];
+
+    if( ( NULL == tree ) || ( NULL == start ) || ( NULL == end ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    ngx_memcpy( &lstart[ 0 ], start, 4 * sizeof( uint32_t ) );
+    ngx_memcpy( &lend[ 0 ], end, 4 * sizeof( uint32_t ) );
+
+    ngx_http_lklb_uint128_htonl( tree->transforms, &lstart[ 0 ] );
+    ngx_http_lklb_uint128_htonl( tree->transforms, &lend[ 0 ] );
+
+    return ngx_http_lklb_radix_range_insert( tree, &lstart[ 0 ], &lend[ 0 ], 4, value, count, undo );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_delete_range(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t               *start,
+    uint32_t               *end,
+    ngx_uint_t             *count
+) {
+    uint32_t    lstart[ 4 ], lend[ 4 ];
+
+    if( ( NULL == tree ) || ( NULL == start ) || ( NULL == end ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    ngx_memcpy( &lstart[ 0 ], start, 4 * sizeof( uint32_t ) );
+    ngx_memcpy( &lend[ 0 ], end, 4 * sizeof( uint32_t ) );
+
+    ngx_http_lklb_uint128_htonl( tree->transforms, &lstart[ 0 ] );
+    ngx_http_lklb_uint128_htonl( tree->transforms, &lend[ 0 ] );
+
+    return ngx_http_lklb_radix_range_delete( tree, &lstart[ 0 ], &lend[ 0 ], 4, count );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_undo_range(
+    ngx_http_lklb_radix_t             *tree,
+    uint32_t                           start,
+    uint32_t                           end,
+    ngx_http_lklb_radix_range_undo_t  *undo
+) {
+    if( ( NULL == tree ) || ( NULL == undo ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    start = ngx_http_lklb_uint32_htonl( tree->transforms, start );
+    end   = ngx_http_lklb_uint32_htonl( tree->transforms, end );
+
+    return ngx_http_lklb_radix_range_undo( tree, &start, &end, 1, undo );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_undo_range(
+    ngx_http_lklb_radix_t             *tree,
+    uint32_t                          *start,
+    uint32_t                          *end,
+    ngx_http_lklb_radix_range_undo_t  *undo
+) {
+    uint32_t    lstart[ 4 ], lend[ 4 ];
+
+    if( ( NULL == tree ) || ( NULL == start ) || ( NULL == end ) || ( NULL == undo ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    ngx_memcpy( &lstart[ 0 ], start, 4 * sizeof( uint32_t ) );
+    ngx_memcpy( &lend[ 0 ], end, 4 * sizeof( uint32_t ) );
+
+    ngx_http_lklb_uint128_htonl( tree->transforms, &lstart[ 0 ] );
+    ngx_http_lklb_uint128_htonl( tree->transforms, &lend[ 0 ] );
+
+    return ngx_http_lklb_radix_range_undo( tree, &lstart[ 0 ], &lend[ 0 ], 4, undo );
+}
+
+/*
+ * Address lookups. Addresses are given in network byte order and are
+ * converted straight to the host order keys the tree walks, bypassing the
+ * configured transforms. Entries inserted either as host order keys or as
+ * network order keys with the htonl transform are found alike.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_addr_find(
+    ngx_http_lklb_radix_t  *tree4,
+    ngx_http_lklb_radix_t  *tree6,
+    u_char                 *addr,
+    size_t                  len,
+    void                  **result,
+    uint8_t                 prefix
+) {
+    static u_char    v4mapped[ 12 ] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    uint32_t         key[ 4 ];
+    ngx_uint_t       idx;
+
+    if( NULL == addr ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    if( ( 16 == len ) && ( 0 == ngx_memcmp( addr, v4mapped, sizeof( v4mapped ) ) ) ) {
+        addr += sizeof( v4mapped );
+        len   = 4;
+    }
+
+    if( 4 == len ) {
+        if( NULL == tree4 ) {
+            return NGX_HTTP_LKLB_ERR;
+        }
+
+        key[ 0 ] = ( ( uint32_t )addr[ 0 ] << 24 ) | ( ( uint32_t )addr[ 1 ] << 16 )
+                 | ( ( uint32_t )addr[ 2 ] << 8 ) | addr[ 3 ];
+
+        return ngx_http_lklb_radix_uint32_find_value( tree4, &key[ 0 ], 32, result, prefix );
+    }
+
+    if( ( 16 != len ) || ( NULL == tree6 ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    for( idx = 0; idx < 4; idx++, addr += 4 ) {
+        key[ idx ] = ( ( uint32_t )addr[ 0 ] << 24 ) | ( ( uint32_t )addr[ 1 ] << 16 )
+                   | ( ( uint32_t )addr[ 2 ] << 8 ) | addr[ 3 ];
+    }
+
+    return ngx_http_lklb_radix_uint128_find_value( tree6, &key[ 0 ], 128, result, prefix );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_sockaddr_find(
+    ngx_http_lklb_radix_t  *tree4,
+    ngx_http_lklb_radix_t  *tree6,
+    struct sockaddr        *sockaddr,
+    void                  **result,
+    uint8_t                 prefix
+) {
+    if( NULL == sockaddr ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    switch( sockaddr->sa_family ) {
+        case AF_INET:
+            return ngx_http_lklb_radix_addr_find( tree4, tree6,
+                                                  ( u_char * )&( ( struct sockaddr_in * )sockaddr )->sin_addr,
+                                                  4, result, prefix );
+
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            return ngx_http_lklb_radix_addr_find( tree4, tree6,
+                                                  ( ( struct sockaddr_in6 * )sockaddr )->sin6_addr.s6_addr,
+                                                  16, result, prefix );
+#endif
+
+        default:
+            return NGX_HTTP_LKLB_ERR;
+    }
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_str_insert(
+    ngx_http_lklb_radix_t  *tree,
+    uint8_t                *key,
+    size_t                  key_len,
+    void                   *value
+) {
+    ngx_http_lklb_retval_e       rc;
+
+    if( ( NULL == tree ) || ( NULL == key ) || ( 0 == key_len ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    key = ngx_http_lklb_str_transform( tree->transforms, key, key_len );
+
+    ngx_http_lklb_radix_wlock( tree );
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_thaw( tree ) ) {
+        ngx_http_lklb_radix_unlock( tree );
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    rc = ngx_http_lklb_radix_str_insert_locked( tree, key, 8 * key_len, value );
+
+    ngx_http_lklb_radix_unlock( tree );
+    return rc;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_str_delete(
+    ngx_http_lklb_radix_t   *tree,
+    uint8_t                 *key,
+    size_t                   key_len,
+    void                   **result
+) {
     void                        *value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
-    ngx_http_lklb_radix_node_t  *node;
     ngx_http_lklb_retval_e       rc;
 
-    if( NULL == tree ) {
+    if( ( NULL == tree ) || ( NULL == key ) || ( 0 == key_len ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    key = ngx_http_lklb_str_transform( tree->transforms, key, key_len );
+
+    ngx_http_lklb_radix_wlock( tree );
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_thaw( tree ) ) {
+        ngx_http_lklb_radix_unlock( tree );
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    rc = ngx_http_lklb_radix_str_delete_locked( tree, key, 8 * key_len, &value );
+
+    ngx_http_lklb_radix_unlock( tree );
+
+    if( result ) {
+        *result = value;
+    }
+
+    return rc;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_str_find(
+    ngx_http_lklb_radix_t   *tree,
+    uint8_t                 *key,
+    size_t                   key_len,
+    void                   **result,
+    uint8_t                  prefix
+) {
+    ngx_http_lklb_retval_e       rc;
+
+    if( ( NULL == tree ) || ( NULL == key ) || ( 0 == key_len ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    key = ngx_http_lklb_str_transform( tree->transforms, key, key_len );
+
+    rc = ngx_http_lklb_radix_str_find_value( tree, key, 8 * key_len, result, prefix );
+
+    /* A prefix find reports the string key itself as a partial match too */
+    return( ( ( prefix ) && ( NGX_HTTP_LKLB_MATCH == rc ) ) ? NGX_HTTP_LKLB_PARTIAL_MATCH : rc );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_str_find_all(
+    ngx_http_lklb_radix_t        *tree,
+    uint8_t                      *key,
+    size_t                        key_len,
+    ngx_http_lklb_radix_match_t  *matches,
+    ngx_uint_t                    nmatches,
+    ngx_uint_t                   *count
+) {
+    ngx_http_lklb_radix_path_t   all = { matches, nmatches, 0 };
+
+    if( ( NULL == tree ) || ( NULL == matches ) || ( NULL == key ) || ( 0 == key_len ) ) {
         return NGX_HTTP_LKLB_ERR;
     }
 
-    key  = ngx_http_lklb_uint32_htonl( tree->transforms, key );
-    mask = ngx_http_lklb_uint32_htonl( tree->transforms, mask );
+    key = ngx_http_lklb_str_transform( tree->transforms, key, key_len );
 
-    ngx_http_lklb_radix_wlock( tree );
+    return ngx_http_lklb_radix_str_find_path( tree, key, 8 * key_len, &all, count );
+}
 
-    rc = ngx_http_lklb_radix_uint32_find_node( tree, key, mask, 0, &node );
-    if( ( NULL == node ) || ( NGX_HTTP_LKLB_MATCH != rc ) ) {
-        goto ldone;
+#define NGX_HTTP_LKLB_RADIX_EVICT_BATCH     32
+
+static ngx_http_lklb_radix_node_t *
+ngx_http_lklb_radix_alloc( ngx_http_lklb_radix_t *tree, ngx_http_lklb_radix_node_t *pin ) {
+    ngx_http_lklb_radix_node_t *new_node;
+
+    if( tree->free ) {
+        new_node   = tree->free;
+        tree->free = tree->free->child[ 0 ];
+        tree->nfree--;
+        goto lret;
     }
 
-    value = node->value;
+    if( tree->size < sizeof( ngx_http_lklb_radix_node_t ) ) {
+        tree->start = NULL;
 
-    if( !( ngx_http_lklb_radix_is_leaf_node( node ) ) ) {
-        if( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) {
-            node->value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
+        if( tree->calloc_fnpt ) {
+            tree->start = tree->calloc_fnpt( tree->mem_ctx, ngx_pagesize );
+        } else if( tree->pool ) {
+            tree->start = ngx_pmemalign( tree->pool, ngx_pagesize, ngx_pagesize );
+        }
+        
+        if( NULL == tree->start ) {
+            /*
+             * Out of memory, make room by evicting entries if enabled.
+             * A batch being committed fails instead, eviction would
+             * prune nodes its undo log refers to.
+             */
+            if( ( NULL != tree->batch ) ||
+                ( 0 == ngx_http_lklb_radix_evict_locked( tree, pin, NGX_HTTP_LKLB_RADIX_EVICT_BATCH ) ) ||
+                ( NULL == tree->free ) ) {
+                return NULL;
+            }
+
+            new_node   = tree->free;
+            tree->free = tree->free->child[ 0 ];
+            tree->nfree--;
+            goto lret;
         }
 
-        goto ldone;
+        tree->size = ngx_pagesize;
+        tree->npages++;
     }
 
-    while( 1 ) {
-        if( node == node->parent->right ) {
-            node->parent->right = NULL;
-        } else {
-            node->parent->left = NULL;
-        }
+    new_node = ( ngx_http_lklb_radix_node_t * )tree->start;
+    tree->nnodes++;
+
+    tree->start += sizeof( ngx_http_lklb_radix_node_t );
+    tree->size  -= sizeof( ngx_http_lklb_radix_node_t );
+
+lret:
+    return new_node;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_cursor_init(
+    ngx_http_lklb_radix_cursor_t  *cursor,
+    uint8_t                       *prefix,
+    ngx_uint_t                     bits
+) {
+    if( ( NULL == cursor ) || ( bits > 8 * NGX_HTTP_LKLB_RADIX_KEY_MAX ) || ( ( bits ) && ( NULL == prefix ) ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    ngx_memzero( cursor, sizeof( ngx_http_lklb_radix_cursor_t ) );
+    ngx_memcpy( &cursor->key[ 0 ], prefix, ( bits + 7 ) / 8 );
+
+    cursor->depth = bits;
+    cursor->base  = bits;
+
+    return NGX_HTTP_LKLB_OK;
+}
+
+/* Bounds the time a chunk holds the lock when few nodes hold values */
+#define NGX_HTTP_LKLB_RADIX_CURSOR_VISITS   16
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_cursor_next(
+    ngx_http_lklb_radix_t         *tree,
+    ngx_http_lklb_radix_cursor_t  *cursor,
+    ngx_http_lklb_radix_entry_t   *entries,
+    ngx_uint_t                     nentries,
+    ngx_uint_t                    *count
+) {
+    ngx_http_lklb_radix_node_t  *node;
+    ngx_uint_t                   depth, visited, len;
+
+    if( ( NULL == tree ) || ( NULL == cursor ) || ( NULL == count ) || ( ( nentries ) && ( NULL == entries ) ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    *count = 0;
+
+    if( cursor->done ) {
+        return NGX_HTTP_LKLB_MATCH;
+    }
+
+    if( 0 == nentries ) {
+        return NGX_HTTP_LKLB_OK;
+    }
 
-        node->right = tree->free;
-        tree->free  = node;
+    ngx_http_lklb_radix_rlock( tree );
+
+    /* Find the position again, it may have been pruned since */
+    node = ngx_http_lklb_radix_cursor_resume( tree, cursor, &depth );
+
+    for( visited = 0; node; visited++ ) {
+        if( ngx_http_lklb_radix_has_value( tree, node, NGX_HTTP_LKLB_RADIX_FIND_LIVE ) ) {
+            len = ( depth + 7 ) / 8;
+
+            ngx_memcpy( &entries[ *count ].key[ 0 ], &cursor->key[ 0 ], len );
+
+            /* Clear the bits past the key, they are left over from earlier keys */
+            if( depth % 8 ) {
+                entries[ *count ].key[ len - 1 ] &= ( uint8_t )( 0xff << ( 8 - depth % 8 ) );
+            }
+
+            entries[ *count ].bits  = depth;
+            entries[ *count ].value = node->value;
+
+            if( cursor->ref ) {
+                ngx_http_lklb_radix_ref( tree, node->value );
+            }
+
+            ( *count )++;
+        }
 
-        node = node->parent;
+        cursor->depth   = depth;
+        cursor->started = 1;
 
-        if( !( ngx_http_lklb_radix_is_leaf_node( node ) )   ||
-            ( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) ||
-            ( NGX_HTTP_LKLB_RADIX_NODE_IS_ROOT( node ) )
-          ) {
+        if( ( *count == nentries ) || ( visited == NGX_HTTP_LKLB_RADIX_CURSOR_VISITS * nentries ) ) {
             break;
         }
+
+        node = ngx_http_lklb_radix_cursor_succ( tree, cursor, node, &depth );
+    }
+
+    if( NULL == node ) {
+        cursor->done = 1;
     }
 
-ldone:
     ngx_http_lklb_radix_unlock( tree );
 
-    if( result ) {
-        *result = value;
+    return( ( cursor->done ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_OK );
+}
+
+ngx_http_lklb_radix_batch_t *
+ngx_http_lklb_radix_batch_begin( ngx_http_lklb_radix_t *tree, ngx_log_t *log ) {
+    ngx_http_lklb_radix_batch_t  *batch;
+    ngx_pool_t                   *pool;
+
+    if( NULL == tree ) {
+        return NULL;
+    }
+
+    if( NULL == ( pool = ngx_create_pool( NGX_DEFAULT_POOL_SIZE, log ) ) ) {
+        return NULL;
+    }
+
+    if( ( NULL == ( batch = ngx_pcalloc( pool, sizeof( ngx_http_lklb_radix_batch_t ) ) ) )                   ||
+        ( NGX_OK != ngx_array_init( &batch->ops, pool, 16, sizeof( ngx_http_lklb_radix_batch_op_t ) ) )     ||
+        ( NGX_OK != ngx_array_init( &batch->pages, pool, 4, sizeof( void * ) ) ) ) {
+        ngx_destroy_pool( pool );
+        return NULL;
     }
 
-    return( ( NGX_HTTP_LKLB_RADIX_NO_VALUE != value ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_ERR );
+    batch->tree = tree;
+    batch->pool = pool;
+
+    return batch;
 }
 
-ngx_http_lklb_retval_e
-ngx_http_lklb_radix_uint32_delete(
-    ngx_http_lklb_radix_t  *tree,
-    uint32_t                key,
-    void                  **result
-) {
-    return ngx_http_lklb_radix_uint32_delete_with_mask( tree, key, ( uint32_t )( -1 ), result );
+static ngx_http_lklb_radix_batch_op_t *
+ngx_http_lklb_radix_batch_push( ngx_http_lklb_radix_batch_t *batch, ngx_uint_t op, void *value ) {
+    ngx_http_lklb_radix_batch_op_t  *bop;
+
+    if( ( NULL == batch ) || ( NULL == ( bop = ngx_array_push( &batch->ops ) ) ) ) {
+        return NULL;
+    }
+
+    ngx_memzero( bop, sizeof( ngx_http_lklb_radix_batch_op_t ) );
+
+    bop->op    = op;
+    bop->value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
+    bop->rc    = NGX_HTTP_LKLB_ERR;
+
+    if( NGX_HTTP_LKLB_RADIX_BATCH_INSERT == op ) {
+        bop->value = value;
+        ngx_http_lklb_radix_ref( batch->tree, value );
+    }
+
+    return bop;
 }
 
-ngx_http_lklb_retval_e
-ngx_http_lklb_radix_uint32_find_with_mask(
-    ngx_http_lklb_radix_t  *tree,
-    uint32_t                key,
-    uint32_t                mask,
-    void                  **result,
-    uint8_t                 prefix
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_uint32_push(
+    ngx_http_lklb_radix_batch_t  *batch,
+    ngx_uint_t                    op,
+    uint32_t                      key,
+    uint32_t                      mask,
+    void                         *value
 ) {
-    void                        *value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
-    ngx_http_lklb_radix_node_t  *node;
-    ngx_http_lklb_retval_e       rc;
+    ngx_http_lklb_radix_batch_op_t  *bop;
 
-    if( NULL == tree ) {
+    if( NULL == ( bop = ngx_http_lklb_radix_batch_push( batch, op, value ) ) ) {
         return NGX_HTTP_LKLB_ERR;
     }
 
-    key  = ngx_http_lklb_uint32_htonl( tree->transforms, key );
-    mask = ngx_http_lklb_uint32_htonl( tree->transforms, mask );
+    mask = ngx_http_lklb_uint32_htonl( batch->tree->transforms, mask );
 
-    ngx_http_lklb_radix_rlock( tree );
+    bop->key[ 0 ] = ngx_http_lklb_uint32_htonl( batch->tree->transforms, key );
+    bop->bits     = ngx_http_lklb_radix_mask_bits( &mask, 1 );
 
-    rc = ngx_http_lklb_radix_uint32_find_node( tree, key, mask, prefix, &node );
-    if( NGX_HTTP_LKLB_ERR == rc ) {
-        ngx_http_lklb_radix_unlock( tree );
+    /* Ops are walked as uint128 keys, from the root */
+    if( batch->tree->dualstack ) {
+        bop->key[ 3 ]  = bop->key[ 0 ];
+        bop->key[ 2 ]  = ( uint32_t )0xffff;
+        bop->key[ 0 ]  = 0;
+        bop->bits     += NGX_HTTP_LKLB_RADIX_MAPPED_BITS;
+    }
+
+    return NGX_HTTP_LKLB_OK;
+}
+
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_uint128_push(
+    ngx_http_lklb_radix_batch_t  *batch,
+    ngx_uint_t                    op,
+    uint32_t                     *key,
+    uint32_t                     *mask,
+    void                         *value
+) {
+    ngx_http_lklb_radix_batch_op_t  *bop;
+
+    if( ( NULL == key ) || ( NULL == mask ) ||
+        ( NULL == ( bop = ngx_http_lklb_radix_batch_push( batch, op, value ) ) ) ) {
         return NGX_HTTP_LKLB_ERR;
     }
 
-    if( node ) {
-        value = node->value;
+    bop->bits = ngx_http_lklb_radix_uint128_prepare( batch->tree, key, mask, &bop->key[ 0 ] );
+
+    return NGX_HTTP_LKLB_OK;
+}
+
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_str_push(
+    ngx_http_lklb_radix_batch_t  *batch,
+    ngx_uint_t                    op,
+    uint8_t                      *key,
+    size_t                        key_len,
+    void                         *value
+) {
+    ngx_http_lklb_radix_batch_op_t  *bop;
+    uint8_t                         *str;
+
+    if( ( NULL == batch ) || ( NULL == key ) || ( 0 == key_len ) ||
+        ( NULL == ( str = ngx_pnalloc( batch->pool, key_len ) ) ) ) {
+        return NGX_HTTP_LKLB_ERR;
     }
 
-    ngx_http_lklb_radix_unlock( tree );
+    /* Transforms work in place, keep the caller's key as it is */
+    ngx_memcpy( str, key, key_len );
+    ngx_http_lklb_str_transform( batch->tree->transforms, str, key_len );
 
-    if( result ) {
-        *result = value;
+    if( NULL == ( bop = ngx_http_lklb_radix_batch_push( batch, op, value ) ) ) {
+        return NGX_HTTP_LKLB_ERR;
     }
 
-    return rc;
+    bop->str  = str;
+    bop->bits = 8 * key_len;
+
+    return NGX_HTTP_LKLB_OK;
 }
 
 ngx_http_lklb_retval_e
-ngx_http_lklb_radix_uint32_find(
-    ngx_http_lklb_radix_t  *tree,
-    uint32_t                key,
-    void                  **result,
-    uint8_t                 prefix
+ngx_http_lklb_radix_batch_uint32_insert(
+    ngx_http_lklb_radix_batch_t  *batch,
+    uint32_t                      key,
+    uint32_t                      mask,
+    void                         *value
 ) {
-    return ngx_http_lklb_radix_uint32_find_with_mask( tree, key, ( uint32_t )( -1 ), result, prefix );
+    return ngx_http_lklb_radix_batch_uint32_push( batch, NGX_HTTP_LKLB_RADIX_BATCH_INSERT, key, mask, value );
 }
 
-#define NGX_HTTP_LKLB_RADIX_UINT128_DEFAULT_MASK { ( uint32_t )-1, ( uint32_t )-1, ( uint32_t )-1, ( uint32_t )-1 }
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_uint32_delete(
+    ngx_http_lklb_radix_batch_t  *batch,
+    uint32_t                      key,
+    uint32_t                      mask
+) {
+    return ngx_http_lklb_radix_batch_uint32_push( batch, NGX_HTTP_LKLB_RADIX_BATCH_DELETE, key, mask, NULL );
+}
 
 ngx_http_lklb_retval_e
-ngx_http_lklb_radix_uint128_insert_with_mask(
-    ngx_http_lklb_radix_t *tree,
-    uint32_t              *key,
-    uint32_t              *mask,
-    void                  *value
+ngx_http_lklb_radix_batch_uint128_insert(
+    ngx_http_lklb_radix_batch_t  *batch,
+    uint32_t                     *key,
+    uint32_t                     *mask,
+    void                         *value
 ) {
-    uint32_t                     lkey[ 4 ], lmask[ 4 ];
-    uint32_t                     bit, idx;
-    ngx_http_lklb_radix_node_t  *node, *next;
+    return ngx_http_lklb_radix_batch_uint128_push( batch, NGX_HTTP_LKLB_RADIX_BATCH_INSERT, key, mask, value );
+}
 
-    if( ( NULL == tree ) || ( NULL == key ) || ( NULL == mask ) ) {
-        return NGX_HTTP_LKLB_ERR;
-    }
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_uint128_delete(
+    ngx_http_lklb_radix_batch_t  *batch,
+    uint32_t                     *key,
+    uint32_t                     *mask
+) {
+    return ngx_http_lklb_radix_batch_uint128_push( batch, NGX_HTTP_LKLB_RADIX_BATCH_DELETE, key, mask, NULL );
+}
 
-    bit = NGX_HTTP_LKLB_RADIX_UINT32_MSB;
-    idx = 0;
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_str_insert(
+    ngx_http_lklb_radix_batch_t  *batch,
+    uint8_t                      *key,
+    size_t                        key_len,
+    void                         *value
+) {
+    return ngx_http_lklb_radix_batch_str_push( batch, NGX_HTTP_LKLB_RADIX_BATCH_INSERT, key, key_len, value );
+}
 
-    ngx_memcpy( &lkey[ 0 ], key, 4 * sizeof( uint32_t ) );
-    ngx_memcpy( &lmask[ 0 ], mask, 4 * sizeof( uint32_t ) );
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_str_delete(
+    ngx_http_lklb_radix_batch_t  *batch,
+    uint8_t                      *key,
+    size_t                        key_len
+) {
+    return ngx_http_lklb_radix_batch_str_push( batch, NGX_HTTP_LKLB_RADIX_BATCH_DELETE, key, key_len, NULL );
+}
 
-    ngx_http_lklb_uint128_htonl( tree->transforms, &lkey[ 0 ] );
-    ngx_http_lklb_uint128_htonl( tree->transforms, &lmask[ 0 ] );
- 
-    ngx_http_lklb_radix_wlock( tree );
+/*
+ * Number of nodes missing from the path of the op key. Nodes on the path
+ * of prev, the insert before, are left to it: it creates those missing.
+ */
+#define ngx_http_lklb_radix_batch_bit( __bop, __depth )                                 \
+    ( ( __bop )->str                                                                    \
+      ? ( 0 != ( ( __bop )->str[ ( __depth ) / 8 ] & ( NGX_HTTP_LKLB_RADIX_UINT8_MSB >> ( ( __depth ) % 8 ) ) ) ) \
+      : ( 0 != ( ( __bop )->key[ ( __depth ) / 32 ] & ( NGX_HTTP_LKLB_RADIX_UINT32_MSB >> ( ( __depth ) % 32 ) ) ) ) )
+
+static ngx_uint_t
+ngx_http_lklb_radix_batch_missing(
+    ngx_http_lklb_radix_t           *tree,
+    ngx_http_lklb_radix_batch_op_t  *bop,
+    ngx_http_lklb_radix_batch_op_t  *prev
+) {
+    ngx_uint_t                   depth, set, shared, missing = 0;
+    ngx_http_lklb_radix_node_t  *node = tree->root;
 
-    node = tree->root;
-    next = tree->root;
+    shared = ( ( NULL != prev ) && ( ( NULL == prev->str ) == ( NULL == bop->str ) ) );
 
-    while( ( idx < 4 ) && ( bit & lmask[ idx ] ) ) {
-        if( lkey[ idx ] & bit ) {
-            next = node->right;
-        } else {
-            next = node->left;
-        }
+    for( depth = 0; depth < bop->bits; depth++ ) {
+        set = ngx_http_lklb_radix_batch_bit( bop, depth );
 
-        if( NULL == next ) {
-            break;
-        }
+        shared = ( ( shared ) && ( depth < prev->bits ) && ( ngx_http_lklb_radix_batch_bit( prev, depth ) == set ) );
 
-        bit  >>= 1;
-        node   = next;
+        if( node ) {
+            node = node->child[ set ];
+        }
 
-        if( 0 == bit ) {
-            bit  = NGX_HTTP_LKLB_RADIX_UINT32_MSB;
-            idx++;
+        if( ( NULL == node ) && ( !shared ) ) {
+            missing++;
         }
     }
 
-    if( next ) {
-        if( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) {
-            ngx_http_lklb_radix_unlock( tree );
-            return NGX_HTTP_LKLB_DUP;
+    return missing;
+}
+
+/*
+ * Allocate the pages the inserts may need, without holding the lock.
+ * Nodes on the free list and left in the current page go first. The
+ * count is an upper bound, paths shared by inserts that are not next to
+ * each other are counted once per insert. Inserts sorted by key thus get
+ * about as many nodes as they use.
+ */
+static void
+ngx_http_lklb_radix_batch_prealloc( ngx_http_lklb_radix_batch_t *batch ) {
+    ngx_http_lklb_radix_t           *tree = batch->tree;
+    ngx_http_lklb_radix_batch_op_t  *bop = batch->ops.elts, *prev = NULL;
+    ngx_uint_t                       idx, needed = 0, avail, per_page;
+    void                            *page, **slot;
+
+    ngx_http_lklb_radix_rlock( tree );
+
+    for( idx = 0; idx < batch->ops.nelts; idx++ ) {
+        if( NGX_HTTP_LKLB_RADIX_BATCH_INSERT != bop[ idx ].op ) {
+            prev = NULL;
+            continue;
         }
 
-        node->value = value;
-        ngx_http_lklb_radix_unlock( tree );
-        return NGX_HTTP_LKLB_MATCH;
+        needed += ngx_http_lklb_radix_batch_missing( tree, &bop[ idx ], prev );
+        prev    = &bop[ idx ];
     }
 
-    while( ( idx < 4 ) && ( bit & lmask[ idx ] ) ) {
-        if( !( next = ngx_http_lklb_radix_alloc( tree ) ) ) {
-            ngx_http_lklb_radix_unlock( tree );
-            return NGX_HTTP_LKLB_ERR;
-        }
+    avail = tree->nfree + tree->size / sizeof( ngx_http_lklb_radix_node_t );
 
-        ngx_http_lklb_radix_init_children( next );
-        next->parent = node;
-        next->value  = NGX_HTTP_LKLB_RADIX_NO_VALUE;
+    ngx_http_lklb_radix_unlock( tree );
 
-        if( lkey[ idx ] & bit ) {
-            node->right = next;
-        } else {
-            node->left = next;
+    per_page = ngx_pagesize / sizeof( ngx_http_lklb_radix_node_t );
+
+    while( needed > avail ) {
+        page = NULL;
+
+        if( tree->calloc_fnpt ) {
+            page = tree->calloc_fnpt( tree->mem_ctx, ngx_pagesize );
+        } else if( tree->pool ) {
+            page = ngx_pmemalign( tree->pool, ngx_pagesize, ngx_pagesize );
+        }
+
+        /* Commit finds out whether what was had suffices */
+        if( NULL == page ) {
+            return;
         }
 
-        bit  >>= 1;
-        node   = next;
+        if( NULL == ( slot = ngx_array_push( &batch->pages ) ) ) {
+            if( tree->free_fnpt ) {
+                tree->free_fnpt( tree->mem_ctx, page );
+            }
 
-        if( 0 == bit ) {
-            bit  = NGX_HTTP_LKLB_RADIX_UINT32_MSB;
-            idx++;
+            return;
         }
+
+        *slot   = page;
+        needed -= ngx_min( needed, per_page );
     }
+}
 
-    node->value = value;
-    ngx_http_lklb_radix_unlock( tree );
-    return NGX_HTTP_LKLB_MATCH;
+/* Move the preallocated pages to the free list, caller holds the write lock */
+static void
+ngx_http_lklb_radix_batch_splice( ngx_http_lklb_radix_batch_t *batch ) {
+    ngx_http_lklb_radix_t       *tree = batch->tree;
+    ngx_http_lklb_radix_node_t  *node;
+    void                       **pages = batch->pages.elts;
+    ngx_uint_t                   idx, off;
+
+    for( idx = 0; idx < batch->pages.nelts; idx++ ) {
+        for( off = 0; off + sizeof( ngx_http_lklb_radix_node_t ) <= ngx_pagesize;
+             off += sizeof( ngx_http_lklb_radix_node_t ) ) {
+            node             = ( ngx_http_lklb_radix_node_t * )( ( char * )pages[ idx ] + off );
+            node->child[ 0 ] = tree->free;
+            tree->free       = node;
+            tree->nfree++;
+            tree->nnodes++;
+        }
+
+        tree->npages++;
+    }
 }
 
-ngx_http_lklb_retval_e
-ngx_http_lklb_radix_uint128_insert(
-    ngx_http_lklb_radix_t *tree,
-    uint32_t              *key,
-    void                  *value
+static ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_find_node(
+    ngx_http_lklb_radix_t           *tree,
+    ngx_http_lklb_radix_batch_op_t  *bop,
+    ngx_http_lklb_radix_node_t     **node,
+    ngx_http_lklb_radix_trail_t     *trail
 ) {
-    uint32_t    mask[ 4 ] = NGX_HTTP_LKLB_RADIX_UINT128_DEFAULT_MASK;
+    if( bop->str ) {
+        return ngx_http_lklb_radix_str_find_node( tree, bop->str, bop->bits, 0, node, NULL, trail );
+    }
 
-    return ngx_http_lklb_radix_uint128_insert_with_mask( tree, key, &mask[ 0 ], value );
+    return ngx_http_lklb_radix_uint128_find_node( tree, &bop->key[ 0 ], bop->bits, 0, node, NULL, trail );
 }
 
+/*
+ * Deletes only take the value out of the node, pruning waits for the
+ * commit to succeed so that no node the undo log refers to goes away.
+ */
 static ngx_http_lklb_retval_e
-ngx_http_lklb_radix_uint128_find_node(
-    ngx_http_lklb_radix_t       *tree,
-    uint32_t                    *key,
-    uint32_t                    *mask,
-    uint8_t                      prefix,
-    ngx_http_lklb_radix_node_t **result
-) {
-    uint32_t                     bit, idx;
+ngx_http_lklb_radix_batch_apply( ngx_http_lklb_radix_t *tree, ngx_http_lklb_radix_batch_op_t *bop ) {
     ngx_http_lklb_radix_node_t  *node;
-    ngx_http_lklb_retval_e       rc = NGX_HTTP_LKLB_ERR;
 
-    if( ( NULL == tree ) || ( NULL == key ) || ( NULL == mask ) ) {
-        return NGX_HTTP_LKLB_ERR;
+    if( NGX_HTTP_LKLB_RADIX_BATCH_INSERT == bop->op ) {
+        if( bop->str ) {
+            return ngx_http_lklb_radix_str_insert_locked( tree, bop->str, bop->bits, bop->value );
+        }
+
+        return ngx_http_lklb_radix_uint128_insert_locked( tree, &bop->key[ 0 ], bop->bits, bop->value );
     }
 
-    bit  = NGX_HTTP_LKLB_RADIX_UINT32_MSB;
-    idx  = 0;
-    node = tree->root;
+    if( ( NGX_HTTP_LKLB_MATCH != ngx_http_lklb_radix_batch_find_node( tree, bop, &node, NULL ) ) || ( NULL == node ) ) {
+        /* Nothing to delete, not a failure */
+        return NGX_HTTP_LKLB_DUP;
+    }
 
-    while( ( idx < 4 ) && ( node ) && ( bit & mask[ idx ] ) ) {
-        if( ( prefix ) && ( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) ) {
-            rc = NGX_HTTP_LKLB_PARTIAL_MATCH;
-            break;
+    bop->value  = node->value;
+    node->value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
+
+    return NGX_HTTP_LKLB_MATCH;
+}
+
+/* Undo the first nops ops, caller holds the write lock */
+static void
+ngx_http_lklb_radix_batch_rollback( ngx_http_lklb_radix_batch_t *batch, ngx_uint_t nops ) {
+    ngx_http_lklb_radix_t           *tree = batch->tree;
+    ngx_http_lklb_radix_batch_op_t  *bop = batch->ops.elts;
+    ngx_http_lklb_radix_node_t      *node;
+    ngx_http_lklb_radix_trail_t      trail;
+    ngx_uint_t                       idx;
+
+    for( idx = nops; idx-- > 0; ) {
+        if( NGX_HTTP_LKLB_MATCH != bop[ idx ].rc ) {
+            continue;
+        }
+
+        ngx_http_lklb_radix_batch_find_node( tree, &bop[ idx ], &node, NULL );
+
+        if( NULL == node ) {
+            continue;
         }
 
-        if( key[ idx ] & bit ) {
-            node = node->right;
+        if( NGX_HTTP_LKLB_RADIX_BATCH_INSERT == bop[ idx ].op ) {
+            node->value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
+            ngx_http_lklb_radix_unref( tree, bop[ idx ].value );
         } else {
-            node = node->left;
+            node->value = bop[ idx ].value;
+        }
+    }
+
+    /*
+     * Prune the paths inserts left bare, with every value back in place.
+     * This covers the nodes the batch created as well as inserts that
+     * replaced an expired value. A chain shared by several paths goes
+     * once the last of them leaves it.
+     */
+    for( idx = nops; idx-- > 0; ) {
+        if( ( NGX_HTTP_LKLB_MATCH == bop[ idx ].rc ) && ( NGX_HTTP_LKLB_RADIX_BATCH_INSERT == bop[ idx ].op ) ) {
+            ngx_http_lklb_radix_batch_find_node( tree, &bop[ idx ], &node, &trail );
+
+            if( ( node ) && ( NGX_HTTP_LKLB_RADIX_NO_VALUE == node->value ) ) {
+                ngx_http_lklb_radix_delete_node( tree, node, &trail );
+            }
+        }
+    }
+}
+
+/* Release what the deletes took out, caller holds the write lock */
+static void
+ngx_http_lklb_radix_batch_finish( ngx_http_lklb_radix_batch_t *batch ) {
+    ngx_http_lklb_radix_t           *tree = batch->tree;
+    ngx_http_lklb_radix_batch_op_t  *bop = batch->ops.elts;
+    ngx_http_lklb_radix_node_t      *node;
+    ngx_http_lklb_radix_trail_t      trail;
+    ngx_uint_t                       idx;
+
+    for( idx = 0; idx < batch->ops.nelts; idx++ ) {
+        if( ( NGX_HTTP_LKLB_MATCH != bop[ idx ].rc ) || ( NGX_HTTP_LKLB_RADIX_BATCH_DELETE != bop[ idx ].op ) ) {
+            continue;
         }
 
-        bit >>= 1;
+        ngx_http_lklb_radix_unref( tree, bop[ idx ].value );
 
-        if( 0 == bit ) {
-            bit  = NGX_HTTP_LKLB_RADIX_UINT32_MSB;
-            idx++;
+        /* Looked up again, pruning an earlier key may have freed the node */
+        ngx_http_lklb_radix_batch_find_node( tree, &bop[ idx ], &node, &trail );
+
+        if( ( node ) && ( NGX_HTTP_LKLB_RADIX_NO_VALUE == node->value ) ) {
+            ngx_http_lklb_radix_delete_node( tree, node, &trail );
         }
     }
+}
 
-    if( ( node ) && ( NGX_HTTP_LKLB_ERR == rc ) && ( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) ) {
-        rc = NGX_HTTP_LKLB_MATCH;
-    }
+/* Drop the references recorded inserts hold and free the batch */
+static void
+ngx_http_lklb_radix_batch_free( ngx_http_lklb_radix_batch_t *batch ) {
+    ngx_http_lklb_radix_batch_op_t  *bop = batch->ops.elts;
+    ngx_uint_t                       idx;
 
-    if( result ) {
-        *result = node;
+    for( idx = 0; idx < batch->ops.nelts; idx++ ) {
+        if( NGX_HTTP_LKLB_RADIX_BATCH_INSERT == bop[ idx ].op ) {
+            ngx_http_lklb_radix_unref( batch->tree, bop[ idx ].value );
+        }
     }
 
-    return rc;
+    ngx_destroy_pool( batch->pool );
 }
 
 ngx_http_lklb_retval_e
-ngx_http_lklb_radix_uint128_delete_with_mask(
-    ngx_http_lklb_radix_t  *tree,
-    uint32_t               *key,
-    uint32_t               *mask,
-    void                  **result
-) {
-    void                        *value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
-    uint32_t                     lkey[ 4 ], lmask[ 4 ];
-    ngx_http_lklb_radix_node_t  *node;
-    ngx_http_lklb_retval_e       rc;
+ngx_http_lklb_radix_batch_commit( ngx_http_lklb_radix_batch_t *batch, ngx_uint_t *count ) {
+    ngx_http_lklb_radix_t           *tree;
+    ngx_http_lklb_radix_batch_op_t  *bop;
+    ngx_uint_t                       idx, changed = 0;
+    ngx_http_lklb_retval_e           rc = NGX_HTTP_LKLB_OK;
 
-    if( ( NULL == tree ) || ( NULL == key ) || ( NULL == mask ) ) {
+    if( NULL == batch ) {
         return NGX_HTTP_LKLB_ERR;
     }
 
-    ngx_memcpy( &lkey[ 0 ], key, 4 * sizeof( uint32_t ) );
-    ngx_memcpy( &lmask[ 0 ], mask, 4 * sizeof( uint32_t ) );
+    tree = batch->tree;
+    bop  = batch->ops.elts;
 
-    ngx_http_lklb_uint128_htonl( tree->transforms, &lkey[ 0 ] );
-    ngx_http_lklb_uint128_htonl( tree->transforms, &lmask[ 0 ] );
+    ngx_http_lklb_radix_batch_prealloc( batch );
 
     ngx_http_lklb_radix_wlock( tree );
- 
-    rc = ngx_http_lklb_radix_uint128_find_node( tree, &lkey[ 0 ], &lmask[ 0 ], 0, &node );
 
-    if( ( NULL == node ) || ( NGX_HTTP_LKLB_MATCH != rc ) ) {
-        goto ldone;
-    }
+    /* Spliced pages serve later writes if this one is refused */
+    ngx_http_lklb_radix_batch_splice( batch );
 
-    value = node->value;
-
-    if( !( ngx_http_lklb_radix_is_leaf_node( node ) ) ) {
-        if( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) {
-            node->value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
-        }
+    tree->batch = batch;
 
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_thaw( tree ) ) {
+        rc = NGX_HTTP_LKLB_ERR;
         goto ldone;
     }
 
-    while( 1 ) {
-        if( node == node->parent->right ) {
-            node->parent->right = NULL;
-        } else {
-            node->parent->left = NULL;
-        }
-
-        node->right = tree->free;
-        tree->free  = node;
+    for( idx = 0; idx < batch->ops.nelts; idx++ ) {
+        bop[ idx ].rc = ngx_http_lklb_radix_batch_apply( tree, &bop[ idx ] );
 
-        node = node->parent;
+        if( NGX_HTTP_LKLB_ERR == bop[ idx ].rc ) {
+            ngx_http_lklb_radix_batch_rollback( batch, idx );
+            rc = NGX_HTTP_LKLB_ERR;
+            goto ldone;
+        }
 
-        if( !( ngx_http_lklb_radix_is_leaf_node( node ) )   ||
-            ( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) ||
-            ( NGX_HTTP_LKLB_RADIX_NODE_IS_ROOT( node ) )
-          ) {
-            break;
+        if( NGX_HTTP_LKLB_MATCH == bop[ idx ].rc ) {
+            changed++;
         }
     }
 
+    ngx_http_lklb_radix_batch_finish( batch );
+
 ldone:
+    tree->batch = NULL;
+
     ngx_http_lklb_radix_unlock( tree );
 
-    if( result ) {
-        *result = value;
+    if( count ) {
+        *count = ( NGX_HTTP_LKLB_OK == rc ) ? changed : 0;
     }
 
-    return( ( NGX_HTTP_LKLB_RADIX_NO_VALUE != value ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_ERR );
-}
-
-ngx_http_lklb_retval_e
-ngx_http_lklb_radix_uint128_delete(
-    ngx_http_lklb_radix_t  *tree,
-    uint32_t               *key,
-    void                  **result
-) {
-    uint32_t    mask[ 4 ] = NGX_HTTP_LKLB_RADIX_UINT128_DEFAULT_MASK;
+    ngx_http_lklb_radix_batch_free( batch );
 
-    return ngx_http_lklb_radix_uint128_delete_with_mask( tree, key, &mask[ 0 ], result );
+    return rc;
 }
 
-ngx_http_lklb_retval_e
-ngx_http_lklb_radix_uint128_find_with_mask(
-    ngx_http_lklb_radix_t  *tree,
-    uint32_t               *key,
-    uint32_t               *mask,
-    void                  **result,
-    uint8_t                 prefix
-) {
-    void                        *value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
-    uint32_t                     lkey[ 4 ], lmask[ 4 ];
-    ngx_http_lklb_radix_node_t  *node;
-    ngx_http_lklb_retval_e       rc;
-
-    if( ( NULL == tree ) || ( NULL == key ) || ( NULL == mask ) ) {
-        return NGX_HTTP_LKLB_ERR;
+void
+ngx_http_lklb_radix_batch_abort( ngx_http_lklb_radix_batch_t *batch ) {
+    if( batch ) {
+        ngx_http_lklb_radix_batch_free( batch );
     }
+}
 
-    ngx_memcpy( &lkey[ 0 ], key, 4 * sizeof( uint32_t ) );
-    ngx_memcpy( &lmask[ 0 ], mask, 4 * sizeof( uint32_t ) );
+/* Stride topped by the node of ::ffff:0:0/96, see ngx_http_lklb_radix_mapped */
+static ngx_http_lklb_radix_stride_t *
+ngx_http_lklb_radix_frozen_mapped( ngx_http_lklb_radix_frozen_t *frozen ) {
+    ngx_http_lklb_radix_stride_t  *stride = &frozen->strides[ 0 ];
+    ngx_uint_t                     depth, chunk;
 
-    ngx_http_lklb_uint128_htonl( tree->transforms, &lkey[ 0 ] );
-    ngx_http_lklb_uint128_htonl( tree->transforms, &lmask[ 0 ] );
+    for( depth = 0; depth < NGX_HTTP_LKLB_RADIX_MAPPED_BITS; depth += 8 ) {
+        chunk = ( depth < NGX_HTTP_LKLB_RADIX_MAPPED_ONES ) ? 0 : 0xff;
 
-    ngx_http_lklb_radix_rlock( tree );
- 
-    rc = ngx_http_lklb_radix_uint128_find_node( tree, &lkey[ 0 ], &lmask[ 0 ], prefix, &node );
-    if( NGX_HTTP_LKLB_ERR == rc ) {
-        ngx_http_lklb_radix_unlock( tree );
-        return NGX_HTTP_LKLB_ERR;
-    }
+        if( !ngx_http_lklb_radix_bitmap_test( stride->children, chunk ) ) {
+            return NULL;
+        }
 
-    if( node ) {
-        value = node->value;
+        stride = &frozen->strides[ stride->child + ngx_http_lklb_radix_bitmap_rank( stride->children, chunk ) ];
     }
 
-    ngx_http_lklb_radix_unlock( tree );
+    return stride;
+}
 
-    if( result ) {
-        *result = value;
-    }
+/* Nodes of the stride topped by node, as numbered in the frozen index */
+static void
+ngx_http_lklb_radix_stride_nodes( ngx_http_lklb_radix_node_t *node, ngx_http_lklb_radix_node_t **heap ) {
+    ngx_uint_t  idx;
 
-    return rc;
-}
+    heap[ 1 ] = node;
 
-ngx_http_lklb_retval_e
-ngx_http_lklb_radix_uint128_find(
-    ngx_http_lklb_radix_t  *tree,
-    uint32_t               *key,
-    void                  **result,
-    uint8_t                 prefix
-) {
-    uint32_t    mask[ 4 ] = NGX_HTTP_LKLB_RADIX_UINT128_DEFAULT_MASK;
+    for( idx = 1; idx < 256; idx++ ) {
+        node = heap[ idx ];
 
-    return ngx_http_lklb_radix_uint128_find_with_mask( tree, key, &mask[ 0 ], result, prefix );
+        heap[ 2 * idx ]     = ( node ) ? node->child[ 0 ] : NULL;
+        heap[ 2 * idx + 1 ] = ( node ) ? node->child[ 1 ] : NULL;
+    }
 }
 
-#define NGX_HTTP_LKLB_RADIX_UINT8_MSB    ( 1 << 7 )
-
 ngx_http_lklb_retval_e
-ngx_http_lklb_radix_str_insert(
-    ngx_http_lklb_radix_t  *tree,
-    uint8_t                *key,
-    size_t                  key_len,
-    void                   *value
-) {
-    uint8_t                      bit;
-    uint32_t                     idx;
-    ngx_http_lklb_radix_node_t  *node, *next;
+ngx_http_lklb_radix_freeze( ngx_http_lklb_radix_t *tree ) {
+    size_t                          size;
+    ngx_uint_t                      generation, nstrides, nvalues, head, tail, idx;
+    ngx_http_lklb_radix_node_t    **queue, *heap[ 512 ];
+    ngx_http_lklb_radix_stride_t   *stride;
+    ngx_http_lklb_radix_frozen_t   *frozen, *old;
 
-    if( ( NULL == tree ) || ( NULL == key ) || ( 0 == key_len ) ) {
+    if( NULL == tree ) {
         return NGX_HTTP_LKLB_ERR;
     }
 
-    idx = 0;
-    bit = NGX_HTTP_LKLB_RADIX_UINT8_MSB;
+    ngx_http_lklb_radix_rlock( tree );
 
-    key = ngx_http_lklb_str_transform( tree->transforms, key, key_len );
+    generation = tree->generation;
 
-    ngx_http_lklb_radix_wlock( tree );
+    /* Every stride is topped by a distinct node */
+    queue = ngx_alloc( tree->nnodes * sizeof( ngx_http_lklb_radix_node_t * ), ngx_cycle->log );
+    if( NULL == queue ) {
+        ngx_http_lklb_radix_unlock( tree );
+        return NGX_HTTP_LKLB_ERR;
+    }
 
-    node = tree->root;
-    next = tree->root;
+    /* Number the strides in BFS order so that siblings are adjacent */
+    head    = 0;
+    tail    = 0;
+    nvalues = 0;
 
-    while( idx < key_len ) {
-        if( key[ idx ] & bit ) {
-            next = node->right;
-        } else {
-            next = node->left;
-        }
+    queue[ tail++ ] = tree->root;
 
-        if( next == NULL ) {
-            break;
-        }
+    while( head < tail ) {
+        ngx_http_lklb_radix_stride_nodes( queue[ head++ ], &heap[ 0 ] );
 
-        bit  >>= 1;
-        node   = next;
+        for( idx = 1; idx < 256; idx++ ) {
+            nvalues += ( ( heap[ idx ] ) && ( NGX_HTTP_LKLB_RADIX_NO_VALUE != heap[ idx ]->value ) );
+        }
 
-        if( bit == 0 ) {
-            bit  = NGX_HTTP_LKLB_RADIX_UINT8_MSB;
-            idx++;
+        for( idx = 256; idx < 512; idx++ ) {
+            if( heap[ idx ] ) {
+                queue[ tail++ ] = heap[ idx ];
+            }
         }
     }
 
-    if( next ) {
-        if( node->value != NGX_HTTP_LKLB_RADIX_NO_VALUE ) {
-            ngx_http_lklb_radix_unlock( tree );
-            return NGX_HTTP_LKLB_DUP;
-        }
+    nstrides = tail;
+
+    size = sizeof( ngx_http_lklb_radix_frozen_t )
+         + nstrides * sizeof( ngx_http_lklb_radix_stride_t )
+         + nvalues * sizeof( void * );
+
+    if( tree->calloc_fnpt ) {
+        frozen = tree->calloc_fnpt( tree->mem_ctx, size );
+    } else {
+        frozen = ngx_pcalloc( tree->pool, size );
+    }
 
-        node->value = value;
+    if( NULL == frozen ) {
         ngx_http_lklb_radix_unlock( tree );
-        return NGX_HTTP_LKLB_MATCH;
+        ngx_free( queue );
+        return NGX_HTTP_LKLB_ERR;
     }
 
-    while( idx < key_len ) {
-        if( !( next = ngx_http_lklb_radix_alloc( tree ) ) ) {
-            ngx_http_lklb_radix_unlock( tree );
-            return NGX_HTTP_LKLB_ERR;
-        }
+    frozen->nstrides = nstrides;
+    frozen->nvalues  = nvalues;
+    frozen->strides  = ( ngx_http_lklb_radix_stride_t * )( frozen + 1 );
+    frozen->values   = ( void ** )( frozen->strides + nstrides );
 
-        ngx_http_lklb_radix_init_children( next );
-        next->parent = node;
-        next->value  = NGX_HTTP_LKLB_RADIX_NO_VALUE;
+    nvalues = 0;
+    tail    = 1;
 
-        if( key[ idx ] & bit ) {
-            node->right = next;
-        } else {
-            node->left = next;
-        }
+    for( head = 0; head < nstrides; head++ ) {
+        stride = &frozen->strides[ head ];
+
+        stride->child = tail;
+        stride->value = nvalues;
+
+        ngx_http_lklb_radix_stride_nodes( queue[ head ], &heap[ 0 ] );
 
-        bit  >>= 1;
-        node   = next;
+        for( idx = 1; idx < 256; idx++ ) {
+            if( ( heap[ idx ] ) && ( NGX_HTTP_LKLB_RADIX_NO_VALUE != heap[ idx ]->value ) ) {
+                stride->prefixes[ idx / 64 ] |= ( uint64_t )1 << ( idx % 64 );
+                frozen->values[ nvalues++ ]   = heap[ idx ]->value;
+            }
+        }
 
-        if( bit == 0 ) {
-            bit  = NGX_HTTP_LKLB_RADIX_UINT8_MSB;
-            idx++;
+        for( idx = 256; idx < 512; idx++ ) {
+            if( heap[ idx ] ) {
+                stride->children[ ( idx - 256 ) / 64 ] |= ( uint64_t )1 << ( ( idx - 256 ) % 64 );
+                tail++;
+            }
         }
     }
 
-    node->value = value;
+    if( tree->dualstack ) {
+        frozen->mapped = ngx_http_lklb_radix_frozen_mapped( frozen );
+    }
+
     ngx_http_lklb_radix_unlock( tree );
-    return NGX_HTTP_LKLB_MATCH;
-}
+    ngx_free( queue );
 
-static ngx_http_lklb_retval_e
-ngx_http_lklb_radix_str_find_node(
-    ngx_http_lklb_radix_t       *tree,
-    uint8_t                     *key,
-    size_t                       key_len,
-    uint8_t                      prefix,
-    ngx_http_lklb_radix_node_t **result
-) {
-    uint8_t                      bit;
-    uint32_t                     idx;
-    ngx_http_lklb_radix_node_t  *node;
-    ngx_http_lklb_retval_e       rc = NGX_HTTP_LKLB_ERR;
+    ngx_http_lklb_radix_wlock( tree );
 
-    if( ( NULL == tree ) || ( NULL == key ) || ( 0 == key_len ) ) {
+    if( generation != tree->generation ) {
+        /* Written meanwhile, the index would miss the change */
+        ngx_http_lklb_radix_unlock( tree );
+        ngx_http_lklb_radix_frozen_free( tree, frozen );
         return NGX_HTTP_LKLB_ERR;
     }
 
-    idx  = 0;
-    bit  = NGX_HTTP_LKLB_RADIX_UINT8_MSB;
-
-    node = tree->root;
-    while( idx < key_len ) {
-        if( key[ idx ] & bit ) {
-            node = node->right;
-        } else {
-            node = node->left;
-        } 
-
-        if( NULL == node ) {
-            break;
-        }
-
-        if( ( prefix ) && ( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) ) {
-            rc = NGX_HTTP_LKLB_PARTIAL_MATCH;
-            break;
-        }
+    old = tree->frozen;
 
-        bit >>= 1;
-
-        if( bit == 0 ) {
-            bit  = NGX_HTTP_LKLB_RADIX_UINT8_MSB;
-            idx++;
-        }
+    if( old ) {
+        ngx_http_lklb_radix_frozen_retire( tree, old );
+    } else {
+        ngx_http_lklb_radix_frozen_purge( tree );
     }
 
-    if( ( node ) && ( NGX_HTTP_LKLB_ERR == rc ) && ( NGX_HTTP_LKLB_RADIX_NO_VALUE != node->value ) ) {
-        rc = NGX_HTTP_LKLB_MATCH;
-    }
+    /* Readers see the index only once it is complete */
+    ngx_memory_barrier();
 
-    if( result ) {
-        *result = node;
-    }
+    tree->frozen = frozen;
 
-    return rc;
+    ngx_http_lklb_radix_unlock( tree );
+
+    return NGX_HTTP_LKLB_OK;
 }
 
 ngx_http_lklb_retval_e
-ngx_http_lklb_radix_str_delete(
-    ngx_http_lklb_radix_t   *tree,
-    uint8_t                 *key,
-    size_t                   key_len,
-    void                   **result
-) {
-    void                        *value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
-    ngx_http_lklb_radix_node_t  *node;
-    ngx_http_lklb_retval_e       rc;
-
+ngx_http_lklb_radix_set_readonly( ngx_http_lklb_radix_t *tree, ngx_uint_t readonly ) {
     if( NULL == tree ) {
         return NGX_HTTP_LKLB_ERR;
     }
 
-    key = ngx_http_lklb_str_transform( tree->transforms, key, key_len );
-
+    /* Finds still holding the read lock are done once it is taken */
     ngx_http_lklb_radix_wlock( tree );
 
-    rc = ngx_http_lklb_radix_str_find_node( tree, key, key_len, 0, &node );
-
-    if( ( NULL == node ) || ( NGX_HTTP_LKLB_MATCH != rc ) ) {
-        goto ldone;
+    if( ( tree->readonly ) && ( !readonly ) ) {
+        tree->released = ( tree->retire_fnpt ) ? tree->retire_fnpt( tree->epoch_ctx ) : 0;
     }
 
-    value = node->value;
-
-    if( !( ngx_http_lklb_radix_is_leaf_node( node ) ) ) {
-        if( node->value != NGX_HTTP_LKLB_RADIX_NO_VALUE ) {
-            node->value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
-        }
-
-        goto ldone;
-    }
+    tree->readonly = ( readonly ) ? 1 : 0;
 
-    while( 1 ) {
-        if( node == node->parent->right ) {
-            node->parent->right = NULL;
-        } else {
-            node->parent->left = NULL;
-        }
+    ngx_http_lklb_radix_unlock( tree );
 
-        node->right = tree->free;
-        tree->free  = node;
+    return NGX_HTTP_LKLB_OK;
+}
 
-        node = node->parent;
+ngx_uint_t
+ngx_http_lklb_radix_settling( ngx_http_lklb_radix_t *tree ) {
+    ngx_uint_t  released;
 
-        if( !( ngx_http_lklb_radix_is_leaf_node( node ) )   ||
-            ( node->value != NGX_HTTP_LKLB_RADIX_NO_VALUE ) ||
-            ( NGX_HTTP_LKLB_RADIX_NODE_IS_ROOT( node ) )
-          ) {
-            break;
-        }
+    if( NULL == tree ) {
+        return 0;
     }
 
-ldone:
-    ngx_http_lklb_radix_unlock( tree );
-
-    if( result ) {
-        *result = value;
-    }
+    released = tree->released;
 
-    return( ( NGX_HTTP_LKLB_RADIX_NO_VALUE != value ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_ERR );
+    return( ( !tree->readonly ) && ( released ) && ( !ngx_http_lklb_radix_quiesced( tree, released ) ) );
 }
 
 ngx_http_lklb_retval_e
-ngx_http_lklb_radix_str_find(
-    ngx_http_lklb_radix_t   *tree,
-    uint8_t                 *key,
-    size_t                   key_len,
-    void                   **result,
-    uint8_t                  prefix
+ngx_http_lklb_radix_copy(
+    ngx_http_lklb_radix_t              *dst,
+    ngx_http_lklb_radix_t              *src,
+    void                               *copy_ctx,
+    ngx_http_lklb_radix_value_copy_pt   copy_fnpt
 ) {
-    void                        *value = NGX_HTTP_LKLB_RADIX_NO_VALUE;
-    ngx_http_lklb_radix_node_t  *node;
-    ngx_http_lklb_retval_e       rc;
-
-    if( NULL == tree ) {
+    ngx_http_lklb_radix_node_t               **queue, *node, *from, *next;
+    ngx_http_lklb_radix_value_referenced_pt    referenced;
+    ngx_http_lklb_retval_e                     rc = NGX_HTTP_LKLB_ERR;
+    ngx_uint_t                                 head, tail, side, locked;
+    void                                      *value;
+
+    if( ( NULL == dst ) || ( NULL == src ) || ( !ngx_http_lklb_radix_is_leaf_node( dst->root ) ) ||
+        ( NGX_HTTP_LKLB_RADIX_NO_VALUE != dst->root->value ) ) {
         return NGX_HTTP_LKLB_ERR;
     }
 
-    key = ngx_http_lklb_str_transform( tree->transforms, key, key_len );
-
-    ngx_http_lklb_radix_rlock( tree );
-
-    rc = ngx_http_lklb_radix_str_find_node( tree, key, key_len, prefix, &node );
+    /* Read-only sources are copied like finds walk them, without the lock */
+    locked = ngx_http_lklb_radix_find_lock( src );
+    ngx_http_lklb_radix_wlock( dst );
 
-    if( NGX_HTTP_LKLB_ERR == rc ) {
-        ngx_http_lklb_radix_unlock( tree );
-        return NGX_HTTP_LKLB_ERR;
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_thaw( dst ) ) {
+        goto ldone;
     }
 
-    if( node ) {
-        value = node->value;
+    /* Pairs of a node of src and its copy */
+    queue = ngx_alloc( 2 * src->nnodes * sizeof( ngx_http_lklb_radix_node_t * ), ngx_cycle->log );
+    if( NULL == queue ) {
+        goto ldone;
     }
 
-    ngx_http_lklb_radix_unlock( tree );
+    /* No eviction while copied nodes still link to the children in src */
+    referenced           = dst->referenced_fnpt;
+    dst->referenced_fnpt = NULL;
 
-    if( result ) {
-        *result = value;
-    }
+    tail = 0;
 
-    return rc;
-}
+    queue[ tail++ ] = src->root;
+    queue[ tail++ ] = dst->root;
 
-static ngx_http_lklb_radix_node_t *
-ngx_http_lklb_radix_alloc( ngx_http_lklb_radix_t *tree ) {
-    ngx_http_lklb_radix_node_t *new_node;
+    /* Copies enter the queue with the children of their original */
+    dst->root->child[ 0 ] = src->root->child[ 0 ];
+    dst->root->child[ 1 ] = src->root->child[ 1 ];
 
-    if( tree->free ) {
-        new_node   = tree->free;
-        tree->free = tree->free->right;
-        goto lret;
-    }
+    for( head = 0; head < tail; head += 2 ) {
+        from = queue[ head ];
+        node = queue[ head + 1 ];
 
-    if( tree->size < sizeof( ngx_http_lklb_radix_node_t ) ) {
-        tree->start = NULL;
+        value = from->value;
 
-        if( tree->calloc_fnpt ) {
-            tree->start = tree->calloc_fnpt( tree->mem_ctx, ngx_pagesize );
-        } else if( tree->pool ) {
-            tree->start = ngx_pmemalign( tree->pool, ngx_pagesize, ngx_pagesize );
+        if( ( NGX_HTTP_LKLB_RADIX_NO_VALUE != value ) && ( copy_fnpt ) &&
+            ( NGX_HTTP_LKLB_OK != copy_fnpt( copy_ctx, value, &value ) ) ) {
+            break;
         }
-        
-        if( NULL == tree->start ) {
-            return NULL;
+
+        if( NGX_HTTP_LKLB_RADIX_NO_VALUE != value ) {
+            node->value = value;
+            ngx_http_lklb_radix_ref( dst, value );
         }
 
-        tree->size = ngx_pagesize;
-        tree->npages++;
+        for( side = 0; side < 2; side++ ) {
+            if( NULL == node->child[ side ] ) {
+                continue;
+            }
+
+            if( NULL == ( next = ngx_http_lklb_radix_alloc( dst, NULL ) ) ) {
+                break;
+            }
+
+            next->child[ 0 ] = node->child[ side ]->child[ 0 ];
+            next->child[ 1 ] = node->child[ side ]->child[ 1 ];
+            next->value      = NGX_HTTP_LKLB_RADIX_NO_VALUE;
+
+            queue[ tail++ ]     = node->child[ side ];
+            queue[ tail++ ]     = next;
+            node->child[ side ] = next;
+        }
+
+        if( side < 2 ) {
+            break;
+        }
     }
 
-    new_node = ( ngx_http_lklb_radix_node_t * )tree->start;
-    tree->nnodes++;
+    if( head < tail ) {
+        /* Out of room, unlink what still points into src */
+        for( ; head < tail; head += 2 ) {
+            node = queue[ head + 1 ];
 
-    tree->start += sizeof( ngx_http_lklb_radix_node_t );
-    tree->size  -= sizeof( ngx_http_lklb_radix_node_t );
+            for( side = 0; side < 2; side++ ) {
+                if( ( node->child[ side ] ) && ( node->child[ side ] == queue[ head ]->child[ side ] ) ) {
+                    node->child[ side ] = NULL;
+                }
+            }
+        }
+    } else {
+        rc = NGX_HTTP_LKLB_OK;
+    }
 
-lret:
-    return new_node;
+    dst->referenced_fnpt = referenced;
+
+    ngx_free( queue );
+
+ldone:
+    ngx_http_lklb_radix_unlock( dst );
+    ngx_http_lklb_radix_find_unlock( src, locked );
+
+    return rc;
 }
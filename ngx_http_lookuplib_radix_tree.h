@@ -12,6 +12,7 @@
 
 typedef struct ngx_http_lklb_radix_s ngx_http_lklb_radix_t;
 typedef struct ngx_http_lklb_radix_node_s ngx_http_lklb_radix_node_t;
+typedef struct ngx_http_lklb_radix_batch_s ngx_http_lklb_radix_batch_t;
 
 typedef void *( *ngx_http_lklb_radix_calloc_pt )( void *, size_t );
 typedef void( *ngx_http_lklb_radix_free_pt )( void *, void * );
@@ -20,6 +21,16 @@ typedef void( *ngx_http_lklb_radix_rlock_pt )( void * );
 typedef void( *ngx_http_lklb_radix_wlock_pt )( void * );
 typedef void( *ngx_http_lklb_radix_unlock_pt )( void * );
 
+typedef void( *ngx_http_lklb_radix_value_ref_pt )( void *, void * );
+typedef void( *ngx_http_lklb_radix_value_unref_pt )( void *, void * );
+typedef ngx_uint_t( *ngx_http_lklb_radix_value_expired_pt )( void *, void * );
+typedef void( *ngx_http_lklb_radix_value_touch_pt )( void *, void * );
+typedef ngx_uint_t( *ngx_http_lklb_radix_value_referenced_pt )( void *, void * );
+typedef ngx_http_lklb_retval_e( *ngx_http_lklb_radix_value_copy_pt )( void *, void *, void ** );
+
+typedef ngx_uint_t( *ngx_http_lklb_radix_retire_pt )( void * );
+typedef ngx_uint_t( *ngx_http_lklb_radix_quiesced_pt )( void *, ngx_uint_t );
+
 ngx_http_lklb_radix_t *
 ngx_http_lklb_radix_create(
     ngx_pool_t                      *pool,
@@ -38,12 +49,97 @@ ngx_http_lklb_radix_set_lock_functions(
     ngx_http_lklb_radix_unlock_pt  unlock_fn
 );
 
+/*
+ * Optional value reference counting. ref is called whenever a value is
+ * stored in a node. unref is called whenever the tree drops a value on
+ * its own, e.g. range deletes. Delete APIs returning the value hand the
+ * reference over to the caller.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_set_value_functions(
+    ngx_http_lklb_radix_t              *tree,
+    void                               *value_ctx,
+    ngx_http_lklb_radix_value_ref_pt    ref_fn,
+    ngx_http_lklb_radix_value_unref_pt  unref_fn
+);
+
+/*
+ * Optional deferred reclamation of memory finds walk without the lock,
+ * i.e. frozen indexes. retire returns the epoch memory unlinked before
+ * the call is retired at, quiesced tells whether finds are done with
+ * memory retired at an epoch, both called with epoch_ctx. Without them
+ * retired memory goes at the next write, which suits trees used by a
+ * single thread only.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_set_epoch_functions(
+    ngx_http_lklb_radix_t              *tree,
+    void                               *epoch_ctx,
+    ngx_http_lklb_radix_retire_pt       retire_fn,
+    ngx_http_lklb_radix_quiesced_pt     quiesced_fn
+);
+
+/*
+ * Optional value expiry, called with the value context. Finds treat
+ * expired values as absent and reclaim an expired exact match, inserts
+ * replace them. Deletes still return them.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_set_expire_function(
+    ngx_http_lklb_radix_t                *tree,
+    ngx_http_lklb_radix_value_expired_pt  expired_fn
+);
+
+/*
+ * Incremental reclaim of expired values. Visits at most max_nodes nodes
+ * under the write lock, resuming where the previous call stopped. Like
+ * cursors and eviction it walks keys of up to NGX_HTTP_LKLB_RADIX_KEY_MAX
+ * bytes, longer string keys are left to finds to reclaim.
+ * count:   number of values reclaimed
+ * Returns NGX_HTTP_LKLB_MATCH once a pass over the whole tree completed.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_sweep(
+    ngx_http_lklb_radix_t  *tree,
+    ngx_uint_t              max_nodes,
+    ngx_uint_t             *count
+);
+
+/*
+ * Optional CLOCK eviction, called with the value context. Finds touch the
+ * value they return, referenced tests and clears that mark. Once set,
+ * node allocation failures evict the least recently found leaf entries
+ * and retry. referenced may be NULL to only have finds touch values,
+ * e.g. to count hits, eviction stays off then.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_set_clock_functions(
+    ngx_http_lklb_radix_t                   *tree,
+    ngx_http_lklb_radix_value_touch_pt       touch_fn,
+    ngx_http_lklb_radix_value_referenced_pt  referenced_fn
+);
+
+/* Evict up to max_entries entries, returns the number evicted */
+ngx_uint_t
+ngx_http_lklb_radix_evict( ngx_http_lklb_radix_t *tree, ngx_uint_t max_entries );
+
 ngx_http_lklb_retval_e
 ngx_http_lklb_radix_set_transforms(
     ngx_http_lklb_radix_t         *tree,
     ngx_uint_t                     transforms
 );
 
+/*
+ * Makes tree a dual-stack tree, before any key is stored. The uint32 APIs
+ * then store and find IPv4 keys as the IPv4-mapped keys of the uint128
+ * APIs, ::ffff:0:0/96 and below, uint32 prefix lengths counting from
+ * /96. uint32 finds start at the node of ::ffff:0:0/96 and see none of
+ * the uint128 prefixes shorter than that. Cursors return IPv4 keys as
+ * IPv4-mapped uint128 keys.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_set_dualstack( ngx_http_lklb_radix_t *tree );
+
 ngx_uint_t
 ngx_http_lklb_radix_get_num_pages( ngx_http_lklb_radix_t *tree );
 
@@ -155,6 +251,114 @@ ngx_http_lklb_radix_uint128_find(
     uint8_t                 prefix
 );
 
+/* A range splits into at most two blocks per key bit */
+#define NGX_HTTP_LKLB_RADIX_RANGE_BLOCKS     256
+
+/* Blocks of a range an insert stored, by block number */
+typedef struct {
+    uint32_t                     stored[ NGX_HTTP_LKLB_RADIX_RANGE_BLOCKS / 32 ];
+} ngx_http_lklb_radix_range_undo_t;
+
+/*
+ * Range APIs
+ * start, end: Inclusive range, e.g. first and last address of a feed entry.
+ *             The range is split into the minimal set of CIDR blocks which
+ *             are applied under a single write lock.
+ * value:      Shared by every block, referenced once per block stored.
+ *             Blocks that already hold a value are left untouched. If a
+ *             block can not be stored the blocks stored so far are rolled back.
+ * count:      Number of blocks stored by insert, number of values released
+ *             by delete. Delete releases every entry that lies entirely
+ *             within the range, covering shorter prefixes are kept.
+ * undo:       Optional, insert records the blocks it stored in it for the
+ *             undo range APIs.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_insert_range(
+    ngx_http_lklb_radix_t             *tree,
+    uint32_t                           start,
+    uint32_t                           end,
+    void                              *value,
+    ngx_uint_t                        *count,
+    ngx_http_lklb_radix_range_undo_t  *undo
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_delete_range(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t                start,
+    uint32_t                end,
+    ngx_uint_t             *count
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_insert_range(
+    ngx_http_lklb_radix_t             *tree,
+    uint32_t                          *start,
+    uint32_t                          *end,
+    void                              *value,
+    ngx_uint_t                        *count,
+    ngx_http_lklb_radix_range_undo_t  *undo
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_delete_range(
+    ngx_http_lklb_radix_t  *tree,
+    uint32_t               *start,
+    uint32_t               *end,
+    ngx_uint_t             *count
+);
+
+/*
+ * Releases the blocks of [start, end] recorded in undo, undoing an insert
+ * range that succeeded before a related insert failed. Blocks the insert
+ * found already stored are kept.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_undo_range(
+    ngx_http_lklb_radix_t             *tree,
+    uint32_t                           start,
+    uint32_t                           end,
+    ngx_http_lklb_radix_range_undo_t  *undo
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_undo_range(
+    ngx_http_lklb_radix_t             *tree,
+    uint32_t                          *start,
+    uint32_t                          *end,
+    ngx_http_lklb_radix_range_undo_t  *undo
+);
+
+/*
+ * Address APIs
+ * tree4:    tree holding IPv4 (uint32) keys
+ * tree6:    tree holding IPv6 (uint128) keys, may be the same as tree4,
+ *           e.g. a dual-stack tree
+ * addr:     4 or 16 bytes in network byte order, e.g. $binary_remote_addr.
+ *           IPv4-mapped IPv6 addresses are looked up in tree4
+ * sockaddr: AF_INET or AF_INET6 address, e.g. r->connection->sockaddr
+ * Addresses are looked up with the full key, transforms do not apply.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_addr_find(
+    ngx_http_lklb_radix_t  *tree4,
+    ngx_http_lklb_radix_t  *tree6,
+    u_char                 *addr,
+    size_t                  len,
+    void                  **value,
+    uint8_t                 prefix
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_sockaddr_find(
+    ngx_http_lklb_radix_t  *tree4,
+    ngx_http_lklb_radix_t  *tree6,
+    struct sockaddr        *sockaddr,
+    void                  **value,
+    uint8_t                 prefix
+);
+
 ngx_http_lklb_retval_e
 ngx_http_lklb_radix_str_insert(
     ngx_http_lklb_radix_t  *tree,
@@ -180,4 +384,230 @@ ngx_http_lklb_radix_str_find(
     uint8_t                 prefix
 );
 
+/*
+ * Covering prefix APIs
+ * Collect every live value on the path to key in a single traversal,
+ * shortest prefix first, e.g. the /8, /16 and /24 entries covering an
+ * address. Up to nmatches are stored in matches, count tells how many.
+ * bits is the prefix length of a match in bits, string keys count 8 per byte.
+ * Returns MATCH if key itself holds a value, PARTIAL_MATCH if only
+ * shorter prefixes do, ERR if there are none.
+ */
+typedef struct {
+    void                    *value;
+    ngx_uint_t               bits;
+} ngx_http_lklb_radix_match_t;
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint32_find_all(
+    ngx_http_lklb_radix_t        *tree,
+    uint32_t                      key,
+    uint32_t                      mask,
+    ngx_http_lklb_radix_match_t  *matches,
+    ngx_uint_t                    nmatches,
+    ngx_uint_t                   *count
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_uint128_find_all(
+    ngx_http_lklb_radix_t        *tree,
+    uint32_t                     *key,
+    uint32_t                     *mask,
+    ngx_http_lklb_radix_match_t  *matches,
+    ngx_uint_t                    nmatches,
+    ngx_uint_t                   *count
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_str_find_all(
+    ngx_http_lklb_radix_t        *tree,
+    uint8_t                      *key,
+    size_t                        key_len,
+    ngx_http_lklb_radix_match_t  *matches,
+    ngx_uint_t                    nmatches,
+    ngx_uint_t                   *count
+);
+
+/*
+ * Cursor APIs
+ * Entries are returned in key order, a prefix before the longer prefixes
+ * it covers. Keys are given as stored, i.e. after transforms, as a bit
+ * string read most significant bit first: the host order words of
+ * numeric keys in big endian, the bytes of string keys. Entries with
+ * keys longer than NGX_HTTP_LKLB_RADIX_KEY_MAX bytes are skipped.
+ * The cursor holds no pointer into the tree. Every call takes the read
+ * lock for one chunk, a cursor resumes after the key it stopped at even
+ * if the tree changed meanwhile.
+ * ref: set after init to have values returned with a reference, taken
+ *      under the lock, for the caller to drop with the unref function.
+ */
+#define NGX_HTTP_LKLB_RADIX_KEY_MAX     256
+
+typedef struct {
+    uint8_t                  key[ NGX_HTTP_LKLB_RADIX_KEY_MAX ];
+    ngx_uint_t               bits;
+    void                    *value;
+} ngx_http_lklb_radix_entry_t;
+
+typedef struct {
+    uint8_t                  key[ NGX_HTTP_LKLB_RADIX_KEY_MAX ];
+    ngx_uint_t               depth;
+    ngx_uint_t               base;
+    ngx_uint_t               started;
+    ngx_uint_t               done;
+    ngx_uint_t               ref;
+} ngx_http_lklb_radix_cursor_t;
+
+/* Start over, e.g. with the same prefix on another tree */
+#define ngx_http_lklb_radix_cursor_rewind( __cursor )                                   \
+    ( __cursor )->started = ( __cursor )->done = 0
+
+/*
+ * prefix, bits: Only walk the entries under this prefix, given as stored.
+ *               NULL and 0 walk the whole tree.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_cursor_init(
+    ngx_http_lklb_radix_cursor_t  *cursor,
+    uint8_t                       *prefix,
+    ngx_uint_t                     bits
+);
+
+/*
+ * Fill up to nentries entries, count is set to the number filled. Values
+ * are read like find results, they stay valid until the caller returns
+ * to its event loop, or until unreferenced with ref.
+ * Returns NGX_HTTP_LKLB_MATCH once the walk is complete, NGX_HTTP_LKLB_OK
+ * if more entries may follow. A chunk visits a bounded number of nodes
+ * and may end with fewer entries than asked for.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_cursor_next(
+    ngx_http_lklb_radix_t         *tree,
+    ngx_http_lklb_radix_cursor_t  *cursor,
+    ngx_http_lklb_radix_entry_t   *entries,
+    ngx_uint_t                     nentries,
+    ngx_uint_t                    *count
+);
+
+/*
+ * Batch APIs
+ * Ops are recorded without locking and applied in order by commit under a
+ * single write lock. The nodes the inserts need are allocated before the
+ * lock is taken. If a node can still not be had, e.g. the zone is full,
+ * every op applied so far is undone and the tree is left as it was.
+ * Eviction is not attempted while a batch is being committed.
+ * value:   Inserts take a reference on value that commit or abort drop
+ *          again, a value not stored by anyone else is then released.
+ *          Values taken out by deletes are released by commit.
+ * Inserts on a key holding a value and deletes of keys without one are
+ * no-ops, as are the tree APIs of the same name.
+ */
+ngx_http_lklb_radix_batch_t *
+ngx_http_lklb_radix_batch_begin( ngx_http_lklb_radix_t *tree, ngx_log_t *log );
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_uint32_insert(
+    ngx_http_lklb_radix_batch_t  *batch,
+    uint32_t                      key,
+    uint32_t                      mask,
+    void                         *value
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_uint32_delete(
+    ngx_http_lklb_radix_batch_t  *batch,
+    uint32_t                      key,
+    uint32_t                      mask
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_uint128_insert(
+    ngx_http_lklb_radix_batch_t  *batch,
+    uint32_t                     *key,
+    uint32_t                     *mask,
+    void                         *value
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_uint128_delete(
+    ngx_http_lklb_radix_batch_t  *batch,
+    uint32_t                     *key,
+    uint32_t                     *mask
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_str_insert(
+    ngx_http_lklb_radix_batch_t  *batch,
+    uint8_t                      *key,
+    size_t                        key_len,
+    void                         *value
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_str_delete(
+    ngx_http_lklb_radix_batch_t  *batch,
+    uint8_t                      *key,
+    size_t                        key_len
+);
+
+/*
+ * Applies the batch and frees it.
+ * count:   Number of ops that changed the tree, may be NULL
+ * Returns NGX_HTTP_LKLB_OK, or NGX_HTTP_LKLB_ERR once rolled back.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_batch_commit( ngx_http_lklb_radix_batch_t *batch, ngx_uint_t *count );
+
+void
+ngx_http_lklb_radix_batch_abort( ngx_http_lklb_radix_batch_t *batch );
+
+/*
+ * Packs the tree into a read-only multibit trie with 8 bit strides, a
+ * single allocation next to the tree. Until the next write, finds and
+ * covering prefix finds walk it without taking the lock and visit one
+ * stride per key byte. Any write, including reclaim and eviction, drops
+ * the index again, freeze once more after a round of updates. Cursors
+ * and sweeps keep using the tree.
+ * Returns NGX_HTTP_LKLB_ERR if out of memory or if the tree was written
+ * while the index was built.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_freeze( ngx_http_lklb_radix_t *tree );
+
+/*
+ * Read-only trees refuse every write, sweeps and eviction included, and
+ * their finds skip the lock, the cache line of which is no longer shared
+ * by all lookups. Expired entries stay until the tree is writable again.
+ * A frozen index is kept, freeze the tree too for multibit finds. Once
+ * made writable again, writes are refused until the epoch it was made
+ * writable at quiesced, finds that skipped the lock may still be walking
+ * the tree, see ngx_http_lklb_radix_set_epoch_functions.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_set_readonly( ngx_http_lklb_radix_t *tree, ngx_uint_t readonly );
+
+/* Whether the tree was made writable again but still refuses writes */
+ngx_uint_t
+ngx_http_lklb_radix_settling( ngx_http_lklb_radix_t *tree );
+
+/*
+ * Copies every entry of src into dst, a tree without entries, e.g. to
+ * migrate a zone into a segment of another size. Each node is copied
+ * once, breadth first, instead of reinserting the keys one by one. Both
+ * trees must use the same transforms. A read-only src is walked without
+ * its lock, as finds do.
+ * copy:    called with copy_ctx for every value, stores the value dst is
+ *          to hold in its last argument. NULL shares the values of src
+ * Returns NGX_HTTP_LKLB_ERR if dst is read-only or ran out of memory,
+ * dst then holds part of the entries only and is meant to be discarded.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_radix_copy(
+    ngx_http_lklb_radix_t              *dst,
+    ngx_http_lklb_radix_t              *src,
+    void                               *copy_ctx,
+    ngx_http_lklb_radix_value_copy_pt   copy_fn
+);
+
 #endif /* _NGX_HTTP_LOOKUP_LIB_RADIX_TREE_H_INCLUDED_ */
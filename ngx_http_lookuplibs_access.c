@@ -0,0 +1,126 @@
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_internal.h"
+
+typedef struct {
+    ngx_http_lklb_lookup_t       lookup;
+    ngx_uint_t                   deny;
+    ngx_uint_t                   status;
+} ngx_http_lklb_access_rule_t;
+
+/*
+ * Handler for lookup_deny and lookup_allow directives
+ *      "lookup_deny <shared segment name> [key=<value>] [key_type=addr|string] [prefix=on|off] [zone6=<name>]
+ *                   [status=<code>]"
+ *      "lookup_allow <shared segment name> [key=<value>] [key_type=addr|string] [prefix=on|off] [zone6=<name>]"
+ * Rules are checked in order and the first one finding its key in the zone
+ * decides, like the allow and deny directives of the access module. Without
+ * a key the client address is looked up. Denied requests get status, 403 by
+ * default.
+ */
+char *
+ngx_http_lklb_access_rule( ngx_conf_t *cf, ngx_command_t *cmd, void *conf ) {
+    ngx_http_lklb_loc_conf_t        *lklblcf = conf;
+    ngx_http_lklb_access_rule_t     *rule;
+    ngx_str_t                       *value;
+    ngx_uint_t                       idx;
+    ngx_int_t                        rc, status;
+
+    if( NULL == lklblcf->access_rules ) {
+        lklblcf->access_rules = ngx_array_create( cf->pool, 4, sizeof( ngx_http_lklb_access_rule_t ) );
+        if( NULL == lklblcf->access_rules ) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    rule = ngx_array_push( lklblcf->access_rules );
+    if( NULL == rule ) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    rule->deny   = ( 'd' == value[ 0 ].data[ sizeof( "lookup_" ) - 1 ] );
+    rule->status = NGX_HTTP_FORBIDDEN;
+
+    if( NGX_CONF_OK != ngx_http_lklb_lookup_init( cf, &rule->lookup, &value[ 1 ] ) ) {
+        return NGX_CONF_ERROR;
+    }
+
+    for( idx = 2; idx < cf->args->nelts; idx++ ) {
+        rc = ngx_http_lklb_lookup_param( cf, &rule->lookup, &value[ idx ] );
+        if( NGX_ERROR == rc ) {
+            return NGX_CONF_ERROR;
+        }
+
+        if( NGX_OK == rc ) {
+            continue;
+        }
+
+        if( ( rule->deny ) && ( value[ idx ].len > 7 ) &&
+            ( 0 == ngx_strncmp( value[ idx ].data, "status=", 7 ) ) ) {
+            status = ngx_atoi( value[ idx ].data + 7, value[ idx ].len - 7 );
+            if( ( status < 400 ) || ( status > 599 ) ) {
+                ngx_conf_log_error( NGX_LOG_EMERG, cf, 0,
+                                    "status must be between 400 and 599 in \"%V\"", &value[ idx ] );
+                return NGX_CONF_ERROR;
+            }
+
+            rule->status = status;
+            continue;
+        }
+
+        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[ idx ] );
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_lklb_access_handler( ngx_http_request_t *r ) {
+    ngx_http_lklb_loc_conf_t        *lklblcf;
+    ngx_http_lklb_access_rule_t     *rule;
+    ngx_uint_t                       idx;
+    void                            *value;
+
+    lklblcf = ngx_http_get_module_loc_conf( r, ngx_http_lookuplibs_module );
+    if( NULL == lklblcf->access_rules ) {
+        return NGX_DECLINED;
+    }
+
+    rule = lklblcf->access_rules->elts;
+
+    for( idx = 0; idx < lklblcf->access_rules->nelts; idx++ ) {
+        if( NGX_HTTP_LKLB_ERR == ngx_http_lklb_lookup_find( r, &rule[ idx ].lookup, &value ) ) {
+            continue;
+        }
+
+        if( !rule[ idx ].deny ) {
+            return NGX_OK;
+        }
+
+        ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
+                       "access forbidden by shared lookup zone \"%V\"", &rule[ idx ].lookup.zone->shm.name );
+
+        return rule[ idx ].status;
+    }
+
+    return NGX_DECLINED;
+}
+
+ngx_int_t
+ngx_http_lklb_access_init( ngx_conf_t *cf ) {
+    ngx_http_handler_pt         *h;
+    ngx_http_core_main_conf_t   *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf( cf, ngx_http_core_module );
+
+    h = ngx_array_push( &cmcf->phases[ NGX_HTTP_ACCESS_PHASE ].handlers );
+    if( NULL == h ) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_lklb_access_handler;
+
+    return NGX_OK;
+}
@@ -0,0 +1,12 @@
+#ifndef _NGX_HTTP_LOOKUPLIBS_ACCESS_H_INCLUDED_
+#define _NGX_HTTP_LOOKUPLIBS_ACCESS_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+char *ngx_http_lklb_access_rule( ngx_conf_t *cf, ngx_command_t *cmd, void *conf );
+
+ngx_int_t ngx_http_lklb_access_init( ngx_conf_t *cf );
+
+#endif /* _NGX_HTTP_LOOKUPLIBS_ACCESS_H_INCLUDED_ */
@@ -0,0 +1,133 @@
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_epochs.h"
+
+/* Slot the next tick checks for a dead worker */
+static ngx_uint_t  ngx_http_lklb_epochs_probe;
+
+ngx_http_lklb_epochs_t *
+ngx_http_lklb_epochs_create( ngx_slab_pool_t *shpool ) {
+    return ngx_slab_calloc( shpool, sizeof( ngx_http_lklb_epochs_t ) );
+}
+
+/*
+ * Workers lagging behind are either busy or gone. One lagging slot is
+ * probed per tick so that a dead worker, whose slot the master may not
+ * hand out again, does not hold reclamation back for good.
+ */
+static void
+ngx_http_lklb_epochs_reap( ngx_http_lklb_epochs_t *epochs ) {
+    ngx_http_lklb_epoch_slot_t  *slot;
+    ngx_atomic_uint_t            pid;
+    ngx_uint_t                   idx, last = epochs->last;
+
+    for( idx = 0; idx < last; idx++ ) {
+        slot = &epochs->slots[ ngx_http_lklb_epochs_probe++ % last ];
+        pid  = slot->pid;
+
+        if( ( 0 == pid ) || ( ( ngx_atomic_uint_t )ngx_pid == pid ) || ( slot->epoch == epochs->epoch ) ) {
+            continue;
+        }
+
+        if( ( -1 == kill( ( ngx_pid_t )pid, 0 ) ) && ( NGX_ESRCH == ngx_errno ) ) {
+            ngx_atomic_cmp_set( &slot->pid, pid, 0 );
+        }
+
+        return;
+    }
+}
+
+void
+ngx_http_lklb_epochs_quiesce( ngx_http_lklb_epochs_t *epochs ) {
+    ngx_http_lklb_epoch_slot_t  *slot;
+    ngx_atomic_uint_t            last;
+
+    if( ( NULL == epochs ) || ( ngx_process_slot >= NGX_MAX_PROCESSES ) ) {
+        return;
+    }
+
+    slot = &epochs->slots[ ngx_process_slot ];
+
+    /* Pointers read from here on were published after the epoch seen */
+    ngx_memory_barrier();
+
+    if( ( ngx_atomic_uint_t )ngx_pid != slot->pid ) {
+        slot->held = 0;
+    }
+
+    if( 0 == slot->held ) {
+        slot->epoch = epochs->epoch;
+    }
+
+    ngx_memory_barrier();
+
+    if( ( ngx_atomic_uint_t )ngx_pid != slot->pid ) {
+        slot->pid = ngx_pid;
+
+        while( ( last = epochs->last ) <= ( ngx_atomic_uint_t )ngx_process_slot ) {
+            ngx_atomic_cmp_set( &epochs->last, last, ngx_process_slot + 1 );
+        }
+    }
+
+    ngx_http_lklb_epochs_reap( epochs );
+}
+
+void
+ngx_http_lklb_epochs_hold( ngx_http_lklb_epochs_t *epochs ) {
+    if( ( NULL == epochs ) || ( ngx_process_slot >= NGX_MAX_PROCESSES ) ) {
+        return;
+    }
+
+    ngx_atomic_fetch_add( &epochs->slots[ ngx_process_slot ].held, 1 );
+}
+
+void
+ngx_http_lklb_epochs_release( ngx_http_lklb_epochs_t *epochs ) {
+    if( ( NULL == epochs ) || ( ngx_process_slot >= NGX_MAX_PROCESSES ) ) {
+        return;
+    }
+
+    ngx_atomic_fetch_add( &epochs->slots[ ngx_process_slot ].held, -1 );
+}
+
+void
+ngx_http_lklb_epochs_leave( ngx_http_lklb_epochs_t *epochs ) {
+    if( ( NULL == epochs ) || ( ngx_process_slot >= NGX_MAX_PROCESSES ) ) {
+        return;
+    }
+
+    ngx_atomic_cmp_set( &epochs->slots[ ngx_process_slot ].pid, ngx_pid, 0 );
+}
+
+ngx_uint_t
+ngx_http_lklb_epochs_retire( void *ctx ) {
+    ngx_http_lklb_epochs_t  *epochs = ctx;
+
+    if( NULL == epochs ) {
+        return 0;
+    }
+
+    return ngx_atomic_fetch_add( &epochs->epoch, 1 ) + 1;
+}
+
+ngx_uint_t
+ngx_http_lklb_epochs_quiesced( void *ctx, ngx_uint_t epoch ) {
+    ngx_http_lklb_epochs_t      *epochs = ctx;
+    ngx_http_lklb_epoch_slot_t  *slot;
+    ngx_uint_t                   idx, last;
+
+    if( ( NULL == epochs ) || ( 0 == epoch ) ) {
+        return 1;
+    }
+
+    last = epochs->last;
+
+    for( idx = 0; idx < last; idx++ ) {
+        slot = &epochs->slots[ idx ];
+
+        if( ( slot->pid ) && ( ( ngx_atomic_int_t )( slot->epoch - epoch ) < 0 ) ) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
@@ -0,0 +1,69 @@
+#ifndef _NGX_HTTP_LOOKUPLIBS_EPOCHS_H_INCLUDED_
+#define _NGX_HTTP_LOOKUPLIBS_EPOCHS_H_INCLUDED_
+
+#include "ngx_http_lookuplibs_module.h"
+
+/* How often workers report being between finds */
+#define NGX_HTTP_LKLB_EPOCHS_INTERVAL   100
+
+typedef struct {
+    ngx_atomic_t                 pid;
+    ngx_atomic_t                 epoch;
+    ngx_atomic_t                 held;
+} ngx_http_lklb_epoch_slot_t;
+
+/*
+ * Quiescence tracking of a zone, for memory finds use after dropping the
+ * lock or without taking it: values, frozen indexes and read-only trees.
+ * Retiring such memory advances epoch. Every worker copies epoch into
+ * its slot, at its process slot, from its event loop, see
+ * ngx_http_lklb_epochs_quiesce. Finds never span event loop passes, so
+ * once every live worker copied an epoch past the one memory was retired
+ * at, nothing refers to it anymore. A stalled worker holds reclamation
+ * back for as long as it stalls, slots of workers that died are dropped.
+ * A worker handing a walk to a thread holds its epoch while it runs.
+ * last is one past the highest slot used.
+ */
+typedef struct {
+    ngx_atomic_t                 epoch;
+    ngx_atomic_t                 last;
+    ngx_http_lklb_epoch_slot_t   slots[ NGX_MAX_PROCESSES ];
+} ngx_http_lklb_epochs_t;
+
+ngx_http_lklb_epochs_t *
+ngx_http_lklb_epochs_create( ngx_slab_pool_t *shpool );
+
+/*
+ * Called by every worker on each timer tick, the first call registers
+ * the worker. Slots of workers that died are cleared on the way.
+ */
+void
+ngx_http_lklb_epochs_quiesce( ngx_http_lklb_epochs_t *epochs );
+
+/*
+ * Keeps the epoch of the calling worker where it is, for finds of a
+ * thread it posted, until released again.
+ */
+void
+ngx_http_lklb_epochs_hold( ngx_http_lklb_epochs_t *epochs );
+
+void
+ngx_http_lklb_epochs_release( ngx_http_lklb_epochs_t *epochs );
+
+/* Unregisters the calling worker on exit */
+void
+ngx_http_lklb_epochs_leave( ngx_http_lklb_epochs_t *epochs );
+
+/*
+ * Tree epoch functions, see ngx_http_lklb_radix_set_epoch_functions.
+ * retire returns the epoch memory unlinked before the call is retired
+ * at, quiesced whether every worker has moved past it. NULL epochs
+ * retire at 0, which is always quiesced.
+ */
+ngx_uint_t
+ngx_http_lklb_epochs_retire( void *epochs );
+
+ngx_uint_t
+ngx_http_lklb_epochs_quiesced( void *epochs, ngx_uint_t epoch );
+
+#endif /* _NGX_HTTP_LOOKUPLIBS_EPOCHS_H_INCLUDED_ */
@@ -3,38 +3,80 @@
 
 #include "ngx_http_lookuplibs_module.h"
 #include "ngx_http_lookuplib_radix_tree.h"
+#include "ngx_http_lookuplib_aho_corasick.h"
 #include "ngx_http_lookuplibs_lua.h"
+#include "ngx_http_lookuplibs_epochs.h"
+#include "ngx_http_lookuplibs_values.h"
+#include "ngx_http_lookuplibs_shards.h"
+#include "ngx_http_lookuplibs_queue.h"
+#include "ngx_http_lookuplibs_journal.h"
+#include "ngx_http_lookuplibs_replica.h"
+#include "ngx_http_lookuplibs_loader.h"
+#include "ngx_http_lookuplibs_access.h"
+#include "ngx_http_lookuplibs_variables.h"
+#include "ngx_http_lookuplibs_stats.h"
 
 typedef struct ngx_http_lklb_main_conf_s ngx_http_lklb_main_conf_t;
 typedef struct ngx_http_lklb_ctx_s ngx_http_lklb_ctx_t;
 
 typedef enum {
     NGX_HTTP_LKLB_TYPE_RADIX    = 0,
+    NGX_HTTP_LKLB_TYPE_AC       = 1,
     /* Add newer types here */
 
     NGX_HTTP_LKLB_TYPE_MAX
 } ngx_http_lklb_type_e;
 
+typedef enum {
+    NGX_HTTP_LKLB_EVICT_NONE    = 0,
+    NGX_HTTP_LKLB_EVICT_CLOCK   = 1
+} ngx_http_lklb_evict_e;
+
+/* Free slab pages evicting zones try to keep and entries evicted at once */
+#define NGX_HTTP_LKLB_EVICT_RESERVE     8
+#define NGX_HTTP_LKLB_EVICT_BATCH       32
+
 typedef struct {
     ngx_atomic_t             rwlock;
-    ngx_http_lklb_radix_t   *tree;
-} ngx_http_lklb_radix_ctx_t;
+    ngx_http_lklb_ac_t      *ac;
+} ngx_http_lklb_ac_ctx_t;
 
 struct ngx_http_lklb_ctx_s {
 #define ngx_http_lklb_ctx_type( __ctx )         ( __ctx )->type
 #define ngx_http_lklb_ctx_is_radix( __ctx )     ( NGX_HTTP_LKLB_TYPE_RADIX == ngx_http_lklb_ctx_type( __ctx ) )
+#define ngx_http_lklb_ctx_is_ac( __ctx )        ( NGX_HTTP_LKLB_TYPE_AC == ngx_http_lklb_ctx_type( __ctx ) )
     ngx_http_lklb_type_e             type;
 
     ngx_uint_t                       transforms;
+    ngx_http_lklb_evict_e            evict;
+    ngx_uint_t                       shards;
+    ngx_uint_t                       queue;
+    ngx_uint_t                       stats;
+    ngx_str_t                        journal;
+    ngx_uint_t                       replicate;
+    ngx_uint_t                       dualstack;
+    ngx_uint_t                       readonly;
 
 #define ngx_http_lklb_ctx_type_ctx( __ctx )     ( __ctx )->type_ctx
 #define ngx_http_lklb_ctx_radix( __ctx )        ( ngx_http_lklb_ctx_type_ctx( __ctx ) ).radix_ctx
+#define ngx_http_lklb_ctx_ac( __ctx )           ( ngx_http_lklb_ctx_type_ctx( __ctx ) ).ac_ctx
     union {
         ngx_http_lklb_radix_ctx_t   *radix_ctx;
+        ngx_http_lklb_ac_ctx_t      *ac_ctx;
     } type_ctx;
 
     ngx_slab_pool_t                 *shpool;
     ngx_http_lklb_main_conf_t       *lklbmcf;
+    ngx_cycle_t                     *cycle;
+
+    /*
+     * Zone of the previous cycle whose entries a new segment takes over,
+     * moved is set once it was made read-only for that, oreadonly is the
+     * state to restore if the new cycle fails.
+     */
+    ngx_http_lklb_ctx_t             *octx;
+    ngx_uint_t                       moved;
+    ngx_uint_t                       oreadonly;
 };
 
 typedef struct {
@@ -43,7 +85,46 @@ typedef struct {
 } ngx_http_lklb_shared_t;
 
 struct ngx_http_lklb_main_conf_s {
-    ngx_array_t             *shared_libs;
+    ngx_array_t                     *shared_libs;
+    ngx_http_lklb_replica_conf_t    *replica;
+    ngx_array_t                     *loads;
 };
 
+typedef struct {
+    ngx_array_t             *access_rules;
+    ngx_http_lklb_stats_t   *stats;
+} ngx_http_lklb_loc_conf_t;
+
+typedef enum {
+    NGX_HTTP_LKLB_KEY_ADDR      = 0,
+    NGX_HTTP_LKLB_KEY_STRING    = 1
+} ngx_http_lklb_key_type_e;
+
+/*
+ * Zone lookup as configured by a directive. Without a key the client
+ * address of the connection is looked up. IPv6 addresses go to zone6,
+ * see ngx_http_lklb_lookup_param.
+ */
+typedef struct {
+    ngx_shm_zone_t              *zone;
+    ngx_shm_zone_t              *zone6;
+    ngx_http_complex_value_t    *key;
+    ngx_http_lklb_key_type_e     key_type;
+    uint8_t                      prefix;
+} ngx_http_lklb_lookup_t;
+
+char *
+ngx_http_lklb_lookup_init( ngx_conf_t *cf, ngx_http_lklb_lookup_t *lookup, ngx_str_t *zone_name );
+
+ngx_int_t
+ngx_http_lklb_lookup_key( ngx_conf_t *cf, ngx_http_lklb_lookup_t *lookup, ngx_str_t *value );
+
+ngx_int_t
+ngx_http_lklb_lookup_param( ngx_conf_t *cf, ngx_http_lklb_lookup_t *lookup, ngx_str_t *param );
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_lookup_find( ngx_http_request_t *r, ngx_http_lklb_lookup_t *lookup, void **value );
+
+extern ngx_module_t ngx_http_lookuplibs_module;
+
 #endif /* _NGX_HTTP_LOOKUPLIBS_INTERNAL_H_INCLUDED_ */
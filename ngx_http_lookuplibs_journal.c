@@ -0,0 +1,1062 @@
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_transforms.h"
+#include "ngx_http_lookuplibs_queue.h"
+#include "ngx_http_lookuplibs_journal.h"
+
+/* File I/O buffer and cursor chunk of snapshots and replays */
+#define NGX_HTTP_LKLB_JOURNAL_CHUNK     ( 64 * 1024 )
+#define NGX_HTTP_LKLB_JOURNAL_ENTRIES   256
+
+typedef struct {
+    ngx_file_t       file;
+    u_char          *buf;
+    size_t           used;
+    off_t            offset;
+} ngx_http_lklb_journal_out_t;
+
+/* Compaction handed to a thread, flushing is held until it is done */
+typedef struct {
+    ngx_http_lklb_radix_ctx_t  *radix_ctx;
+    ngx_str_t                  *path;
+    ngx_pool_t                 *pool;
+    ngx_log_t                  *log;
+} ngx_http_lklb_journal_task_t;
+
+#if (NGX_THREADS)
+static ngx_str_t  ngx_http_lklb_journal_thread_pool = ngx_string( "default" );
+#endif
+
+ngx_int_t
+ngx_http_lklb_journal_init_conf( ngx_conf_t *cf ) {
+#if (NGX_THREADS)
+    if( NULL == ngx_thread_pool_add( cf, &ngx_http_lklb_journal_thread_pool ) ) {
+        return NGX_ERROR;
+    }
+#endif
+
+    return NGX_OK;
+}
+
+ngx_http_lklb_journal_t *
+ngx_http_lklb_journal_create( ngx_slab_pool_t *shpool, size_t size ) {
+    ngx_http_lklb_journal_t     *journal;
+
+    journal = ngx_slab_calloc( shpool, offsetof( ngx_http_lklb_journal_t, data ) + size );
+    if( NULL == journal ) {
+        return NULL;
+    }
+
+    journal->size = size;
+
+    return journal;
+}
+
+uint64_t
+ngx_http_lklb_journal_now( void ) {
+    ngx_time_t  *tp = ngx_timeofday();
+
+    return ( uint64_t )tp->sec * 1000 + tp->msec;
+}
+
+size_t
+ngx_http_lklb_journal_vlen( ngx_http_lklb_value_t *value ) {
+    return( ( ngx_http_lklb_value_has_data( value ) ) ? value->len : 0 );
+}
+
+size_t
+ngx_http_lklb_journal_encode(
+    u_char                     *p,
+    ngx_uint_t                  op,
+    ngx_uint_t                  nwords,
+    uint32_t                   *key,
+    uint32_t                   *arg,
+    ngx_http_lklb_value_t      *value
+) {
+    ngx_http_lklb_journal_record_t  *record = ( ngx_http_lklb_journal_record_t * )p;
+    ngx_msec_int_t                   left;
+    size_t                           vlen, len;
+
+    vlen = ngx_http_lklb_journal_vlen( value );
+    len  = ngx_http_lklb_journal_record_len( vlen );
+
+    ngx_memzero( p, len );
+
+    record->len    = ( uint32_t )len;
+    record->op     = ( uint32_t )op;
+    record->nwords = ( uint32_t )nwords;
+    record->vlen   = vlen;
+
+    ngx_memcpy( &record->key[ 0 ], key, nwords * sizeof( uint32_t ) );
+    ngx_memcpy( &record->arg[ 0 ], arg, nwords * sizeof( uint32_t ) );
+
+    if( NULL == value ) {
+        record->vtype = NGX_HTTP_LKLB_JOURNAL_VALUE_NONE;
+        return len;
+    }
+
+    record->vtype = ( value->nodata ) ? NGX_HTTP_LKLB_JOURNAL_VALUE_NODATA : NGX_HTTP_LKLB_JOURNAL_VALUE_DATA;
+
+    if( value->expires ) {
+        left = ( ngx_msec_int_t )( value->expires - ngx_current_msec );
+        record->expires = ngx_http_lklb_journal_now() + ( ( left > 0 ) ? left : 0 );
+    }
+
+    if( vlen ) {
+        ngx_memcpy( p + sizeof( ngx_http_lklb_journal_record_t ), value->data, vlen );
+    }
+
+    return len;
+}
+
+void
+ngx_http_lklb_journal_append(
+    ngx_http_lklb_journal_t    *journal,
+    ngx_uint_t                  op,
+    ngx_uint_t                  nwords,
+    uint32_t                   *key,
+    uint32_t                   *arg,
+    ngx_http_lklb_value_t      *value
+) {
+    size_t  len;
+
+    len = ngx_http_lklb_journal_record_len( ngx_http_lklb_journal_vlen( value ) );
+
+    /* The next snapshot makes up for the dropped record */
+    if( journal->size - journal->used < len ) {
+        journal->lost++;
+        return;
+    }
+
+    journal->used += ngx_http_lklb_journal_encode( &journal->data[ journal->used ], op, nwords, key, arg, value );
+}
+
+/* path and suffix into name, NGX_MAX_PATH bytes, the directive checked the length */
+static u_char *
+ngx_http_lklb_journal_name( ngx_str_t *path, char *suffix, u_char *name ) {
+    ngx_snprintf( name, NGX_MAX_PATH, "%V%s%Z", path, suffix );
+    return name;
+}
+
+ngx_int_t
+ngx_http_lklb_journal_take(
+    ngx_http_lklb_journal_t    *journal,
+    ngx_uint_t                  rotate,
+    u_char                    **buf,
+    size_t                     *len,
+    uint64_t                   *gen,
+    ngx_log_t                  *log
+) {
+    *buf = NULL;
+    *len = 0;
+
+    /* Records appended meanwhile stay for the next flush */
+    if( journal->used ) {
+        *buf = ngx_alloc( journal->size, log );
+        if( NULL == *buf ) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_http_lklb_journal_lock( journal );
+
+    if( *buf ) {
+        *len = journal->used;
+        ngx_memcpy( *buf, &journal->data[ 0 ], *len );
+        journal->used = 0;
+    }
+
+    *gen = journal->gen;
+
+    if( rotate ) {
+        journal->gen++;
+        journal->lost = 0;
+    }
+
+    ngx_http_lklb_journal_unlock( journal );
+
+    return NGX_OK;
+}
+
+/*
+ * Appends records to the journal file of generation gen and syncs it.
+ * A file of an older generation is left over from before the last
+ * snapshot and started over. Returns NGX_DECLINED if the file is of a
+ * newer one, i.e. this process lags behind.
+ */
+static ngx_int_t
+ngx_http_lklb_journal_write(
+    ngx_http_lklb_journal_t    *journal,
+    ngx_str_t                  *path,
+    uint64_t                    gen,
+    u_char                     *buf,
+    size_t                      len,
+    ngx_log_t                  *log
+) {
+    ngx_http_lklb_journal_header_t   header;
+    ngx_file_info_t                  fi;
+    ngx_file_t                       file;
+    u_char                           name[ NGX_MAX_PATH ];
+    off_t                            size;
+    ngx_int_t                        rc = NGX_ERROR;
+
+    ngx_memzero( &file, sizeof( ngx_file_t ) );
+
+    file.name.data = ngx_http_lklb_journal_name( path, "", name );
+    file.name.len  = ngx_strlen( name );
+    file.log       = log;
+
+    file.fd = ngx_open_file( name, NGX_FILE_RDWR, NGX_FILE_CREATE_OR_OPEN, NGX_FILE_DEFAULT_ACCESS );
+    if( NGX_INVALID_FILE == file.fd ) {
+        ngx_log_error( NGX_LOG_CRIT, log, ngx_errno, ngx_open_file_n " \"%s\" failed", name );
+        return NGX_ERROR;
+    }
+
+    if( NGX_FILE_ERROR == ngx_fd_info( file.fd, &fi ) ) {
+        ngx_log_error( NGX_LOG_CRIT, log, ngx_errno, ngx_fd_info_n " \"%s\" failed", name );
+        goto ldone;
+    }
+
+    size = ngx_file_size( &fi );
+
+    if( size >= ( off_t )sizeof( header ) ) {
+        if( sizeof( header ) != ngx_read_file( &file, ( u_char * )&header, sizeof( header ), 0 ) ) {
+            goto ldone;
+        }
+
+        if( ( NGX_HTTP_LKLB_JOURNAL_MAGIC != header.magic ) || ( header.gen < gen ) ) {
+            size = 0;
+        } else if( header.gen > gen ) {
+            rc = NGX_DECLINED;
+            goto ldone;
+        }
+    } else {
+        size = 0;
+    }
+
+    if( 0 == size ) {
+        if( -1 == ftruncate( file.fd, 0 ) ) {
+            ngx_log_error( NGX_LOG_CRIT, log, ngx_errno, "ftruncate() \"%s\" failed", name );
+            goto ldone;
+        }
+
+        header.magic   = NGX_HTTP_LKLB_JOURNAL_MAGIC;
+        header.version = NGX_HTTP_LKLB_JOURNAL_VERSION;
+        header.gen     = gen;
+
+        if( NGX_ERROR == ngx_write_file( &file, ( u_char * )&header, sizeof( header ), 0 ) ) {
+            goto ldone;
+        }
+
+        size = sizeof( header );
+    }
+
+    if( NGX_ERROR == ngx_write_file( &file, buf, len, size ) ) {
+        goto ldone;
+    }
+
+    if( -1 == fsync( file.fd ) ) {
+        ngx_log_error( NGX_LOG_CRIT, log, ngx_errno, "fsync() \"%s\" failed", name );
+        goto ldone;
+    }
+
+    journal->written = size + len;
+    rc = NGX_OK;
+
+ldone:
+    if( NGX_FILE_ERROR == ngx_close_file( file.fd ) ) {
+        ngx_log_error( NGX_LOG_ALERT, log, ngx_errno, ngx_close_file_n " \"%s\" failed", name );
+    }
+
+    return rc;
+}
+
+static ngx_int_t
+ngx_http_lklb_journal_out_flush( ngx_http_lklb_journal_out_t *out ) {
+    if( out->used ) {
+        if( NGX_ERROR == ngx_write_file( &out->file, out->buf, out->used, out->offset ) ) {
+            return NGX_ERROR;
+        }
+
+        out->offset += out->used;
+        out->used    = 0;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_lklb_journal_out_record(
+    ngx_http_lklb_journal_out_t    *out,
+    ngx_uint_t                      op,
+    ngx_uint_t                      nwords,
+    uint32_t                       *key,
+    uint32_t                       *arg,
+    ngx_http_lklb_value_t          *value
+) {
+    u_char      *buf;
+    size_t       len;
+    ngx_int_t    rc;
+
+    len = ngx_http_lklb_journal_record_len( ngx_http_lklb_journal_vlen( value ) );
+
+    if( ( NGX_HTTP_LKLB_JOURNAL_CHUNK - out->used < len ) && ( NGX_OK != ngx_http_lklb_journal_out_flush( out ) ) ) {
+        return NGX_ERROR;
+    }
+
+    if( len <= NGX_HTTP_LKLB_JOURNAL_CHUNK ) {
+        out->used += ngx_http_lklb_journal_encode( out->buf + out->used, op, nwords, key, arg, value );
+        return NGX_OK;
+    }
+
+    buf = ngx_alloc( len, out->file.log );
+    if( NULL == buf ) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_lklb_journal_encode( buf, op, nwords, key, arg, value );
+
+    rc = ( NGX_ERROR == ngx_write_file( &out->file, buf, len, out->offset ) ) ? NGX_ERROR : NGX_OK;
+    out->offset += len;
+
+    ngx_free( buf );
+
+    return rc;
+}
+
+/*
+ * Insert op recreating an entry as it was given, prefixes of up to 32
+ * bits as uint32 key and mask, longer ones as the range of the prefix.
+ */
+void
+ngx_http_lklb_journal_entry_op(
+    ngx_http_lklb_radix_ctx_t      *radix_ctx,
+    ngx_http_lklb_radix_entry_t    *entry,
+    ngx_uint_t                     *op,
+    ngx_uint_t                     *nwords,
+    uint32_t                       *key,
+    uint32_t                       *arg
+) {
+    uint32_t    word, mask;
+    uint8_t    *p;
+    ngx_uint_t  idx, bits;
+
+    for( idx = 0; idx < 4; idx++ ) {
+        p    = &entry->key[ 4 * idx ];
+        word = ( ( uint32_t )p[ 0 ] << 24 ) | ( ( uint32_t )p[ 1 ] << 16 ) | ( ( uint32_t )p[ 2 ] << 8 ) | p[ 3 ];
+        bits = ( entry->bits > 32 * idx ) ? ngx_min( entry->bits - 32 * idx, 32 ) : 0;
+        mask = ( bits ) ? ( uint32_t )( -1 ) << ( 32 - bits ) : 0;
+
+        key[ idx ] = word & mask;
+        arg[ idx ] = word | ~mask;
+    }
+
+    if( entry->bits <= 32 ) {
+        *op     = NGX_HTTP_LKLB_QUEUE_INSERT;
+        *nwords = 1;
+        arg[ 0 ] = ( entry->bits ) ? ( uint32_t )( -1 ) << ( 32 - entry->bits ) : 0;
+    } else {
+        *op     = NGX_HTTP_LKLB_QUEUE_INSERT_RANGE;
+        *nwords = 4;
+    }
+
+    for( idx = 0; idx < *nwords; idx++ ) {
+        key[ idx ] = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, key[ idx ] );
+        arg[ idx ] = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, arg[ idx ] );
+    }
+}
+
+/*
+ * Writes the entries of the zone to a new snapshot of generation gen.
+ * Entries sharing a value, e.g. the blocks of a range, get one each.
+ * The master hands the file to user, the worker user, unless unset.
+ */
+static ngx_int_t
+ngx_http_lklb_journal_snapshot(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_str_t                  *path,
+    uint64_t                    gen,
+    ngx_uid_t                   user,
+    ngx_log_t                  *log
+) {
+    ngx_http_lklb_journal_header_t   header;
+    ngx_http_lklb_journal_out_t      out;
+    ngx_http_lklb_shards_cursor_t    cursor;
+    ngx_http_lklb_radix_entry_t     *entries;
+    ngx_http_lklb_retval_e           rc;
+    u_char                           tname[ NGX_MAX_PATH ], sname[ NGX_MAX_PATH ];
+    uint32_t                         key[ 4 ], arg[ 4 ];
+    ngx_uint_t                       idx, count, op, nwords;
+    ngx_int_t                        ret = NGX_ERROR;
+
+    ngx_memzero( &out, sizeof( ngx_http_lklb_journal_out_t ) );
+
+    out.file.name.data = ngx_http_lklb_journal_name( path, ".snapshot.tmp", tname );
+    out.file.name.len  = ngx_strlen( tname );
+    out.file.log       = log;
+
+    ngx_http_lklb_journal_name( path, ".snapshot", sname );
+
+    entries = ngx_alloc( NGX_HTTP_LKLB_JOURNAL_ENTRIES * sizeof( ngx_http_lklb_radix_entry_t ), log );
+    out.buf = ngx_alloc( NGX_HTTP_LKLB_JOURNAL_CHUNK, log );
+
+    if( ( NULL == entries ) || ( NULL == out.buf ) ) {
+        goto lret;
+    }
+
+    out.file.fd = ngx_open_file( tname, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS );
+    if( NGX_INVALID_FILE == out.file.fd ) {
+        ngx_log_error( NGX_LOG_CRIT, log, ngx_errno, ngx_open_file_n " \"%s\" failed", tname );
+        goto lret;
+    }
+
+    if( ( ( ngx_uid_t )NGX_CONF_UNSET_UINT != user ) && ( -1 == fchown( out.file.fd, user, -1 ) ) ) {
+        ngx_log_error( NGX_LOG_CRIT, log, ngx_errno, "fchown() \"%s\" failed", tname );
+        goto ldone;
+    }
+
+    header.magic   = NGX_HTTP_LKLB_JOURNAL_MAGIC;
+    header.version = NGX_HTTP_LKLB_JOURNAL_VERSION;
+    header.gen     = gen;
+
+    ngx_memcpy( out.buf, &header, sizeof( header ) );
+    out.used = sizeof( header );
+
+    ngx_http_lklb_shards_cursor_init( radix_ctx, &cursor, NULL, 0, 0 );
+
+    do {
+        rc = ngx_http_lklb_shards_cursor_next( radix_ctx, &cursor, entries, NGX_HTTP_LKLB_JOURNAL_ENTRIES, &count );
+        if( NGX_HTTP_LKLB_ERR == rc ) {
+            goto ldone;
+        }
+
+        for( idx = 0; idx < count; idx++ ) {
+            if( ngx_http_lklb_value_expired( &radix_ctx->values, entries[ idx ].value ) ) {
+                continue;
+            }
+
+            ngx_http_lklb_journal_entry_op( radix_ctx, &entries[ idx ], &op, &nwords, &key[ 0 ], &arg[ 0 ] );
+
+            if( NGX_OK != ngx_http_lklb_journal_out_record( &out, op, nwords, &key[ 0 ], &arg[ 0 ],
+                                                            entries[ idx ].value ) ) {
+                goto ldone;
+            }
+        }
+    } while( NGX_HTTP_LKLB_MATCH != rc );
+
+    if( NGX_OK != ngx_http_lklb_journal_out_flush( &out ) ) {
+        goto ldone;
+    }
+
+    if( -1 == fsync( out.file.fd ) ) {
+        ngx_log_error( NGX_LOG_CRIT, log, ngx_errno, "fsync() \"%s\" failed", tname );
+        goto ldone;
+    }
+
+    ret = NGX_OK;
+
+ldone:
+    if( NGX_FILE_ERROR == ngx_close_file( out.file.fd ) ) {
+        ngx_log_error( NGX_LOG_ALERT, log, ngx_errno, ngx_close_file_n " \"%s\" failed", tname );
+    }
+
+    if( ( NGX_OK == ret ) && ( NGX_FILE_ERROR == ngx_rename_file( tname, sname ) ) ) {
+        ngx_log_error( NGX_LOG_CRIT, log, ngx_errno, ngx_rename_file_n " \"%s\" to \"%s\" failed", tname, sname );
+        ret = NGX_ERROR;
+    }
+
+lret:
+    if( entries ) {
+        ngx_free( entries );
+    }
+
+    if( out.buf ) {
+        ngx_free( out.buf );
+    }
+
+    return ret;
+}
+
+static void
+ngx_http_lklb_journal_unlink( ngx_str_t *path, char *suffix, ngx_log_t *log ) {
+    u_char  name[ NGX_MAX_PATH ];
+
+    ngx_http_lklb_journal_name( path, suffix, name );
+
+    if( ( NGX_FILE_ERROR == ngx_delete_file( name ) ) && ( NGX_ENOENT != ngx_errno ) ) {
+        ngx_log_error( NGX_LOG_CRIT, log, ngx_errno, ngx_delete_file_n " \"%s\" failed", name );
+    }
+}
+
+/*
+ * The journal moves aside while the snapshot is written. Should that
+ * fail it is moved back and the generation restored, records since are
+ * then appended to it as if nothing happened.
+ */
+static ngx_int_t
+ngx_http_lklb_journal_compact( ngx_http_lklb_radix_ctx_t *radix_ctx, ngx_str_t *path, ngx_log_t *log ) {
+    ngx_http_lklb_journal_t     *journal = radix_ctx->journal;
+    u_char                       name[ NGX_MAX_PATH ], oname[ NGX_MAX_PATH ];
+    u_char                      *buf;
+    uint64_t                     gen;
+    size_t                       len;
+    ngx_uint_t                   moved = 1;
+
+    if( NGX_OK != ngx_http_lklb_journal_take( journal, 1, &buf, &len, &gen, log ) ) {
+        return NGX_ERROR;
+    }
+
+    /* Lost records are taken care of by the snapshot */
+    if( len ) {
+        ngx_http_lklb_journal_write( journal, path, gen, buf, len, log );
+        ngx_free( buf );
+    }
+
+    ngx_http_lklb_journal_name( path, "", name );
+    ngx_http_lklb_journal_name( path, ".old", oname );
+
+    if( NGX_FILE_ERROR == ngx_rename_file( name, oname ) ) {
+        if( NGX_ENOENT != ngx_errno ) {
+            ngx_log_error( NGX_LOG_CRIT, log, ngx_errno, ngx_rename_file_n " \"%s\" to \"%s\" failed", name, oname );
+            goto lfailed;
+        }
+
+        moved = 0;
+    }
+
+    if( NGX_OK != ngx_http_lklb_journal_snapshot( radix_ctx, path, gen + 1, ( ngx_uid_t )NGX_CONF_UNSET_UINT, log ) ) {
+        if( ( moved ) && ( NGX_FILE_ERROR == ngx_rename_file( oname, name ) ) ) {
+            ngx_log_error( NGX_LOG_CRIT, log, ngx_errno, ngx_rename_file_n " \"%s\" to \"%s\" failed", oname, name );
+        }
+
+        goto lfailed;
+    }
+
+    ngx_http_lklb_journal_unlink( path, ".old", log );
+
+    journal->written = 0;
+
+    return NGX_OK;
+
+lfailed:
+    ngx_http_lklb_journal_lock( journal );
+    journal->gen = gen;
+    journal->lost++;
+    ngx_http_lklb_journal_unlock( journal );
+
+    return NGX_ERROR;
+}
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_lklb_journal_compact_thread( void *data, ngx_log_t *log ) {
+    ngx_http_lklb_journal_task_t    *jtask = data;
+
+    ngx_http_lklb_journal_compact( jtask->radix_ctx, jtask->path, jtask->log );
+}
+
+static void
+ngx_http_lklb_journal_compact_done( ngx_event_t *ev ) {
+    ngx_http_lklb_journal_task_t    *jtask = ev->data;
+
+    ngx_http_lklb_epochs_release( jtask->radix_ctx->epochs );
+    ngx_unlock( &jtask->radix_ctx->journal->flushing );
+
+    ngx_destroy_pool( jtask->pool );
+}
+
+/*
+ * Posts the compaction to the default thread pool. The walk reads values
+ * off the tree locks like finds do, the worker holds its epoch for it.
+ */
+static ngx_int_t
+ngx_http_lklb_journal_compact_post( ngx_http_lklb_radix_ctx_t *radix_ctx, ngx_str_t *path, ngx_log_t *log ) {
+    ngx_http_lklb_journal_task_t    *jtask;
+    ngx_thread_pool_t               *tp;
+    ngx_thread_task_t               *task;
+    ngx_pool_t                      *pool;
+
+    tp = ngx_thread_pool_get( ( ngx_cycle_t * )ngx_cycle, &ngx_http_lklb_journal_thread_pool );
+    if( NULL == tp ) {
+        ngx_log_error( NGX_LOG_CRIT, log, 0, "thread pool \"%V\" not found", &ngx_http_lklb_journal_thread_pool );
+        return NGX_ERROR;
+    }
+
+    pool = ngx_create_pool( NGX_DEFAULT_POOL_SIZE, log );
+    if( NULL == pool ) {
+        return NGX_ERROR;
+    }
+
+    task = ngx_thread_task_alloc( pool, sizeof( ngx_http_lklb_journal_task_t ) );
+    if( NULL == task ) {
+        goto lfailed;
+    }
+
+    jtask = task->ctx;
+
+    jtask->radix_ctx = radix_ctx;
+    jtask->path      = path;
+    jtask->pool      = pool;
+    jtask->log       = log;
+
+    task->handler       = ngx_http_lklb_journal_compact_thread;
+    task->event.handler = ngx_http_lklb_journal_compact_done;
+    task->event.data    = jtask;
+
+    ngx_http_lklb_epochs_hold( radix_ctx->epochs );
+
+    if( NGX_OK != ngx_thread_task_post( tp, task ) ) {
+        ngx_http_lklb_epochs_release( radix_ctx->epochs );
+        goto lfailed;
+    }
+
+    return NGX_OK;
+
+lfailed:
+    ngx_destroy_pool( pool );
+
+    return NGX_ERROR;
+}
+
+#endif
+
+ngx_int_t
+ngx_http_lklb_journal_flush(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_str_t                  *path,
+    ngx_uint_t                  exiting,
+    ngx_log_t                  *log
+) {
+    ngx_http_lklb_journal_t     *journal = radix_ctx->journal;
+    u_char                      *buf;
+    uint64_t                     gen;
+    size_t                       len;
+    ngx_int_t                    rc;
+
+    if( NULL == journal ) {
+        return NGX_OK;
+    }
+
+    /* Thread pools are gone by now, a compaction this worker posted is done */
+    if( ( exiting ) && ( ( ngx_atomic_uint_t )ngx_pid == journal->flushing ) ) {
+        ngx_unlock( &journal->flushing );
+    }
+
+    if( !ngx_http_lklb_trylock_owner( &journal->flushing ) ) {
+        return NGX_OK;
+    }
+
+    rc = ngx_http_lklb_journal_take( journal, 0, &buf, &len, &gen, log );
+
+    if( len ) {
+        rc = ngx_http_lklb_journal_write( journal, path, gen, buf, len, log );
+        ngx_free( buf );
+
+        if( NGX_ERROR == rc ) {
+            ngx_http_lklb_journal_lock( journal );
+            journal->lost++;
+            ngx_http_lklb_journal_unlock( journal );
+        }
+    }
+
+    /* The next start replays the journal instead */
+    if( ( exiting ) || ( NGX_DECLINED == rc ) ||
+        ( ( journal->written <= NGX_HTTP_LKLB_JOURNAL_COMPACT ) && ( 0 == journal->lost ) ) ) {
+        goto ldone;
+    }
+
+#if (NGX_THREADS)
+    rc = ngx_http_lklb_journal_compact_post( radix_ctx, path, log );
+
+    if( NGX_OK == rc ) {
+        return NGX_OK;
+    }
+#else
+    /* Without thread pools the worker compacts the journal itself */
+    rc = ngx_http_lklb_journal_compact( radix_ctx, path, log );
+#endif
+
+ldone:
+    ngx_unlock( &journal->flushing );
+
+    return( ( NGX_ERROR == rc ) ? NGX_ERROR : NGX_OK );
+}
+
+/* vlen is bounded before it is summed up, a huge one would wrap len around to 0 */
+ngx_uint_t
+ngx_http_lklb_journal_record_valid( ngx_http_lklb_journal_record_t *record, size_t max ) {
+    if( ( max < sizeof( ngx_http_lklb_journal_record_t ) ) ||
+        ( record->vlen > max - sizeof( ngx_http_lklb_journal_record_t ) ) ||
+        ( record->len < sizeof( ngx_http_lklb_journal_record_t ) ) ) {
+        return 0;
+    }
+
+    switch( record->vtype ) {
+        case NGX_HTTP_LKLB_JOURNAL_VALUE_DATA:
+        case NGX_HTTP_LKLB_JOURNAL_VALUE_NODATA:
+        case NGX_HTTP_LKLB_JOURNAL_VALUE_NONE:
+            break;
+
+        default:
+            return 0;
+    }
+
+    return( ( record->len == ngx_http_lklb_journal_record_len( record->vlen ) ) && ( record->len <= max ) );
+}
+
+/* Applies a record as the op it was, now is wall clock time */
+ngx_uint_t
+ngx_http_lklb_journal_apply(
+    ngx_http_lklb_radix_ctx_t          *radix_ctx,
+    ngx_http_lklb_journal_record_t     *record,
+    uint64_t                            now
+) {
+    ngx_http_lklb_value_t   *value = NULL;
+    ngx_http_lklb_retval_e   rc;
+    ngx_msec_t               ttl = 0;
+    void                    *result;
+
+    if( ( 1 != record->nwords ) && ( 4 != record->nwords ) ) {
+        return 0;
+    }
+
+    switch( record->op ) {
+        case NGX_HTTP_LKLB_QUEUE_DELETE:
+            rc = ( 1 == record->nwords )
+                 ? ngx_http_lklb_shards_uint32_delete_with_mask( radix_ctx, record->key[ 0 ], record->arg[ 0 ],
+                                                                 &result )
+                 : ngx_http_lklb_shards_uint128_delete_with_mask( radix_ctx, &record->key[ 0 ], &record->arg[ 0 ],
+                                                                  &result );
+
+            if( NGX_HTTP_LKLB_MATCH == rc ) {
+                ngx_http_lklb_value_unref( &radix_ctx->values, result );
+            }
+
+            return 0;
+
+        case NGX_HTTP_LKLB_QUEUE_DELETE_RANGE:
+            ngx_http_lklb_shards_delete_range( radix_ctx, &record->key[ 0 ], &record->arg[ 0 ], record->nwords, NULL );
+            return 0;
+
+        case NGX_HTTP_LKLB_QUEUE_INSERT:
+        case NGX_HTTP_LKLB_QUEUE_INSERT_RANGE:
+            break;
+
+        default:
+            return 0;
+    }
+
+    if( record->expires ) {
+        if( record->expires <= now ) {
+            return 0;
+        }
+
+        ttl = ( ngx_msec_t )( record->expires - now );
+    }
+
+    if( ( NGX_HTTP_LKLB_JOURNAL_VALUE_NONE != record->vtype ) || ( ttl ) ) {
+        value = ngx_http_lklb_value_create( &radix_ctx->values,
+                                            ( NGX_HTTP_LKLB_JOURNAL_VALUE_DATA == record->vtype )
+                                                ? ( u_char * )( record + 1 ) : NULL,
+                                            ( size_t )record->vlen, ttl );
+        if( NULL == value ) {
+            return 1;
+        }
+    }
+
+    if( ( NGX_HTTP_LKLB_QUEUE_INSERT == record->op ) && ( 1 == record->nwords ) ) {
+        rc = ngx_http_lklb_shards_uint32_insert_with_mask( radix_ctx, record->key[ 0 ], record->arg[ 0 ], value );
+    } else if( NGX_HTTP_LKLB_QUEUE_INSERT == record->op ) {
+        rc = ngx_http_lklb_shards_uint128_insert_with_mask( radix_ctx, &record->key[ 0 ], &record->arg[ 0 ], value );
+    } else {
+        rc = ngx_http_lklb_shards_insert_range( radix_ctx, &record->key[ 0 ], &record->arg[ 0 ], record->nwords,
+                                                value, NULL );
+    }
+
+    if( NGX_HTTP_LKLB_MATCH != rc ) {
+        ngx_http_lklb_value_unref( &radix_ctx->values, value );
+    }
+
+    return( NGX_HTTP_LKLB_ERR == rc );
+}
+
+/*
+ * Opens the file of path and suffix and reads its header.
+ * Returns NGX_DECLINED if there is no such file or it is not ours.
+ */
+static ngx_int_t
+ngx_http_lklb_journal_open(
+    ngx_str_t                          *path,
+    char                               *suffix,
+    u_char                             *name,
+    ngx_file_t                         *file,
+    ngx_http_lklb_journal_header_t     *header,
+    ngx_log_t                          *log
+) {
+    ngx_memzero( file, sizeof( ngx_file_t ) );
+
+    file->name.data = ngx_http_lklb_journal_name( path, suffix, name );
+    file->name.len  = ngx_strlen( name );
+    file->log       = log;
+
+    file->fd = ngx_open_file( name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0 );
+    if( NGX_INVALID_FILE == file->fd ) {
+        if( NGX_ENOENT == ngx_errno ) {
+            return NGX_DECLINED;
+        }
+
+        ngx_log_error( NGX_LOG_CRIT, log, ngx_errno, ngx_open_file_n " \"%s\" failed", name );
+        return NGX_ERROR;
+    }
+
+    if( ( sizeof( *header ) == ngx_read_file( file, ( u_char * )header, sizeof( *header ), 0 ) ) &&
+        ( NGX_HTTP_LKLB_JOURNAL_MAGIC == header->magic ) && ( NGX_HTTP_LKLB_JOURNAL_VERSION == header->version ) ) {
+        return NGX_OK;
+    }
+
+    ngx_log_error( NGX_LOG_WARN, log, 0, "ignoring invalid lookup journal \"%s\"", name );
+
+    if( NGX_FILE_ERROR == ngx_close_file( file->fd ) ) {
+        ngx_log_error( NGX_LOG_ALERT, log, ngx_errno, ngx_close_file_n " \"%s\" failed", name );
+    }
+
+    return NGX_DECLINED;
+}
+
+/*
+ * Replays the file of path and suffix unless it is older than generation
+ * min_gen. gen is set to its generation. A truncated or damaged tail,
+ * e.g. of a crash while writing, ends the replay.
+ * Returns NGX_DECLINED if there is no such file.
+ */
+static ngx_int_t
+ngx_http_lklb_journal_load(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_str_t                  *path,
+    char                       *suffix,
+    uint64_t                    min_gen,
+    uint64_t                   *gen,
+    ngx_log_t                  *log
+) {
+    ngx_http_lklb_journal_header_t   header;
+    ngx_http_lklb_journal_record_t  *record;
+    ngx_file_info_t                  fi;
+    ngx_file_t                       file;
+    u_char                           name[ NGX_MAX_PATH ];
+    u_char                          *buf = NULL, *p, *nbuf;
+    size_t                           size, have = 0, left;
+    off_t                            offset;
+    ssize_t                          n;
+    uint64_t                         now;
+    ngx_uint_t                       count = 0, failed = 0;
+    ngx_int_t                        rc;
+
+    rc = ngx_http_lklb_journal_open( path, suffix, name, &file, &header, log );
+    if( NGX_OK != rc ) {
+        return rc;
+    }
+
+    *gen = header.gen;
+
+    if( header.gen < min_gen ) {
+        goto ldone;
+    }
+
+    rc = NGX_ERROR;
+
+    if( NGX_FILE_ERROR == ngx_fd_info( file.fd, &fi ) ) {
+        ngx_log_error( NGX_LOG_CRIT, log, ngx_errno, ngx_fd_info_n " \"%s\" failed", name );
+        goto ldone;
+    }
+
+    size   = NGX_HTTP_LKLB_JOURNAL_CHUNK;
+    offset = sizeof( header );
+    now    = ngx_http_lklb_journal_now();
+
+    buf = ngx_alloc( size, log );
+    if( NULL == buf ) {
+        goto ldone;
+    }
+
+    while( 1 ) {
+        n = ngx_read_file( &file, buf + have, size - have, offset );
+        if( NGX_ERROR == n ) {
+            goto ldone;
+        }
+
+        offset += n;
+        have   += n;
+        p       = buf;
+
+        while( ( left = have - ( p - buf ) ) >= sizeof( ngx_http_lklb_journal_record_t ) ) {
+            record = ( ngx_http_lklb_journal_record_t * )p;
+
+            if( !ngx_http_lklb_journal_record_valid( record, ( size_t )ngx_file_size( &fi ) ) ) {
+                ngx_log_error( NGX_LOG_WARN, log, 0, "lookup journal \"%s\" damaged at offset %O",
+                               name, offset - ( off_t )left );
+                goto lreplayed;
+            }
+
+            if( record->len > left ) {
+                break;
+            }
+
+            failed += ngx_http_lklb_journal_apply( radix_ctx, record, now );
+            count++;
+            p += record->len;
+        }
+
+        ngx_memmove( buf, p, left );
+        have = left;
+
+        if( 0 == n ) {
+            if( have ) {
+                ngx_log_error( NGX_LOG_WARN, log, 0, "lookup journal \"%s\" ends with a partial record", name );
+            }
+
+            break;
+        }
+
+        /* A record larger than the buffer */
+        if( ( have >= sizeof( ngx_http_lklb_journal_record_t ) ) &&
+            ( ( ( ngx_http_lklb_journal_record_t * )buf )->len > size ) ) {
+            size = ( ( ngx_http_lklb_journal_record_t * )buf )->len;
+
+            nbuf = ngx_alloc( size, log );
+            if( NULL == nbuf ) {
+                goto ldone;
+            }
+
+            ngx_memcpy( nbuf, buf, have );
+            ngx_free( buf );
+            buf = nbuf;
+        }
+    }
+
+lreplayed:
+    if( failed ) {
+        ngx_log_error( NGX_LOG_ERR, log, 0, "lookup journal \"%s\": %ui of %ui records did not fit the zone",
+                       name, failed, count );
+    }
+
+    rc = NGX_OK;
+
+ldone:
+    if( buf ) {
+        ngx_free( buf );
+    }
+
+    if( NGX_FILE_ERROR == ngx_close_file( file.fd ) ) {
+        ngx_log_error( NGX_LOG_ALERT, log, ngx_errno, ngx_close_file_n " \"%s\" failed", name );
+    }
+
+    return rc;
+}
+
+/* Starts generation gen with a snapshot of the zone, replacing the journals */
+static ngx_int_t
+ngx_http_lklb_journal_restart(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_str_t                  *path,
+    uint64_t                    gen,
+    ngx_uid_t                   user,
+    ngx_log_t                  *log
+) {
+    if( NGX_OK != ngx_http_lklb_journal_snapshot( radix_ctx, path, gen, user, log ) ) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_lklb_journal_unlink( path, ".old", log );
+    ngx_http_lklb_journal_unlink( path, "", log );
+
+    radix_ctx->journal->gen     = gen;
+    radix_ctx->journal->written = 0;
+
+    return NGX_OK;
+}
+
+/*
+ * The journal moved aside by a compaction that did not finish precedes
+ * the current one. Either is skipped if the snapshot already has it.
+ */
+ngx_int_t
+ngx_http_lklb_journal_recover(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_str_t                  *path,
+    ngx_uid_t                   user,
+    ngx_log_t                  *log
+) {
+    static char                 *suffixes[ ] = { ".snapshot", ".old", "" };
+    ngx_http_lklb_journal_t     *journal = radix_ctx->journal, *outbox = radix_ctx->outbox;
+    uint64_t                     gen, min_gen = 0, max_gen = 0;
+    ngx_uint_t                   idx, found = 0;
+    ngx_int_t                    rc = NGX_OK;
+
+    /* Replayed ops are not journaled again, peers get a snapshot instead */
+    radix_ctx->journal = NULL;
+    radix_ctx->outbox  = NULL;
+
+    for( idx = 0; idx < sizeof( suffixes ) / sizeof( suffixes[ 0 ] ); idx++ ) {
+        rc = ngx_http_lklb_journal_load( radix_ctx, path, suffixes[ idx ], min_gen, &gen, log );
+
+        if( NGX_ERROR == rc ) {
+            goto ldone;
+        }
+
+        if( NGX_OK == rc ) {
+            found   = 1;
+            max_gen = ngx_max( max_gen, gen );
+
+            if( 0 == idx ) {
+                min_gen = gen;
+            }
+        }
+    }
+
+    rc = NGX_OK;
+
+ldone:
+    radix_ctx->journal = journal;
+    radix_ctx->outbox  = outbox;
+
+    if( ( NGX_OK == rc ) && ( found ) ) {
+        rc = ngx_http_lklb_journal_restart( radix_ctx, path, max_gen + 1, user, log );
+    }
+
+    return rc;
+}
+
+ngx_int_t
+ngx_http_lklb_journal_reset(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_str_t                  *path,
+    ngx_uid_t                   user,
+    ngx_log_t                  *log
+) {
+    static char                     *suffixes[ ] = { ".snapshot", ".old", "" };
+    ngx_http_lklb_journal_header_t   header;
+    ngx_file_t                       file;
+    u_char                           name[ NGX_MAX_PATH ];
+    uint64_t                         max_gen = 0;
+    ngx_uint_t                       idx;
+    ngx_int_t                        rc;
+
+    /* The new generation must be past any file around */
+    for( idx = 0; idx < sizeof( suffixes ) / sizeof( suffixes[ 0 ] ); idx++ ) {
+        rc = ngx_http_lklb_journal_open( path, suffixes[ idx ], name, &file, &header, log );
+
+        if( NGX_ERROR == rc ) {
+            return NGX_ERROR;
+        }
+
+        if( NGX_OK == rc ) {
+            max_gen = ngx_max( max_gen, header.gen );
+
+            if( NGX_FILE_ERROR == ngx_close_file( file.fd ) ) {
+                ngx_log_error( NGX_LOG_ALERT, log, ngx_errno, ngx_close_file_n " \"%s\" failed", name );
+            }
+        }
+    }
+
+    return ngx_http_lklb_journal_restart( radix_ctx, path, max_gen + 1, user, log );
+}
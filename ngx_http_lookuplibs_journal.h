@@ -0,0 +1,204 @@
+#ifndef _NGX_HTTP_LOOKUPLIBS_JOURNAL_H_INCLUDED_
+#define _NGX_HTTP_LOOKUPLIBS_JOURNAL_H_INCLUDED_
+
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_values.h"
+#include "ngx_http_lookuplibs_shards.h"
+
+/* Shared buffer, file size past which the zone is snapshotted, flush tick */
+#define NGX_HTTP_LKLB_JOURNAL_SIZE      ( 1 << 20 )
+#define NGX_HTTP_LKLB_JOURNAL_COMPACT   ( 64 << 20 )
+#define NGX_HTTP_LKLB_JOURNAL_INTERVAL  1000
+
+#define NGX_HTTP_LKLB_JOURNAL_MAGIC     0x6a626b6c
+#define NGX_HTTP_LKLB_JOURNAL_VERSION   1
+
+/*
+ * Files start with a header. A snapshot of generation gen holds every op
+ * of the journals of earlier generations, those are skipped on replay.
+ */
+typedef struct {
+    uint32_t                     magic;
+    uint32_t                     version;
+    uint64_t                     gen;
+} ngx_http_lklb_journal_header_t;
+
+/* Value of an insert record */
+#define NGX_HTTP_LKLB_JOURNAL_VALUE_DATA    0
+#define NGX_HTTP_LKLB_JOURNAL_VALUE_NODATA  1
+#define NGX_HTTP_LKLB_JOURNAL_VALUE_NONE    2
+
+/*
+ * An op applied to the zone, ops and keys as in the queue slots, i.e. as
+ * given to the shards APIs, deletes of uint128 prefixes carry key and
+ * mask in 4 words. expires is wall clock time in milliseconds, 0 never.
+ * vlen bytes of value data follow, len is padded to 8 bytes.
+ */
+typedef struct {
+    uint32_t                     len;
+    uint32_t                     op;
+    uint32_t                     nwords;
+    uint32_t                     vtype;
+    uint32_t                     key[ 4 ];
+    uint32_t                     arg[ 4 ];
+    uint64_t                     expires;
+    uint64_t                     vlen;
+} ngx_http_lklb_journal_record_t;
+
+#define ngx_http_lklb_journal_record_len( __vlen )                                      \
+    ngx_align( sizeof( ngx_http_lklb_journal_record_t ) + ( __vlen ), 8 )
+
+/*
+ * Append only log of the updates of a radix zone, see the journal= zone
+ * option. Writers append records to a shared buffer under lock, which
+ * the shards APIs hold across the op so that records are in apply order.
+ * A timer writes the buffer to the journal file and fsyncs it. Once the
+ * file grows past NGX_HTTP_LKLB_JOURNAL_COMPACT, or records were dropped
+ * on a full buffer, a thread of the default pool writes the zone to a
+ * snapshot and the journal starts over. flushing holds the pid of the
+ * process flushing or compacting.
+ *  <path>             journal of the current generation
+ *  <path>.old         journal being compacted
+ *  <path>.snapshot    entries of the zone
+ * A second buffer serves as the outbox of replicated zones, drained by
+ * the replication timer instead, see ngx_http_lklb_replica_s.
+ */
+struct ngx_http_lklb_journal_s {
+    ngx_atomic_t                 lock;
+    ngx_atomic_t                 flushing;
+    ngx_uint_t                   lost;
+    uint64_t                     gen;
+    off_t                        written;
+    size_t                       size;
+    size_t                       used;
+    u_char                       data[ 1 ];
+};
+
+/* Adds the thread pool compactions run in, for zones with a journal */
+ngx_int_t
+ngx_http_lklb_journal_init_conf( ngx_conf_t *cf );
+
+ngx_http_lklb_journal_t *
+ngx_http_lklb_journal_create( ngx_slab_pool_t *shpool, size_t size );
+
+#define ngx_http_lklb_journal_lock( __journal )     ngx_spinlock( &( __journal )->lock, ngx_pid, 1024 )
+#define ngx_http_lklb_journal_unlock( __journal )   ngx_unlock( &( __journal )->lock )
+
+/*
+ * Records an op, the journal lock is held. value is NULL for deletes.
+ * Never blocks, the record is dropped if the buffer is full.
+ */
+void
+ngx_http_lklb_journal_append(
+    ngx_http_lklb_journal_t    *journal,
+    ngx_uint_t                  op,
+    ngx_uint_t                  nwords,
+    uint32_t                   *key,
+    uint32_t                   *arg,
+    ngx_http_lklb_value_t      *value
+);
+
+/*
+ * Takes the buffered records out, rotate starts the next generation.
+ * gen is set to the generation of the records. buf is NULL if there
+ * were none, to be freed otherwise.
+ */
+ngx_int_t
+ngx_http_lklb_journal_take(
+    ngx_http_lklb_journal_t    *journal,
+    ngx_uint_t                  rotate,
+    u_char                    **buf,
+    size_t                     *len,
+    uint64_t                   *gen,
+    ngx_log_t                  *log
+);
+
+/* Wall clock time in milliseconds, the time base of record expiry */
+uint64_t
+ngx_http_lklb_journal_now( void );
+
+/* Length of the value data of a record */
+size_t
+ngx_http_lklb_journal_vlen( ngx_http_lklb_value_t *value );
+
+/* Writes a record to p, returns its length */
+size_t
+ngx_http_lklb_journal_encode(
+    u_char                     *p,
+    ngx_uint_t                  op,
+    ngx_uint_t                  nwords,
+    uint32_t                   *key,
+    uint32_t                   *arg,
+    ngx_http_lklb_value_t      *value
+);
+
+/* Insert op recreating a cursor entry */
+void
+ngx_http_lklb_journal_entry_op(
+    ngx_http_lklb_radix_ctx_t      *radix_ctx,
+    ngx_http_lklb_radix_entry_t    *entry,
+    ngx_uint_t                     *op,
+    ngx_uint_t                     *nwords,
+    uint32_t                       *key,
+    uint32_t                       *arg
+);
+
+/*
+ * Whether a record read from a file or a datagram is well formed and at
+ * most max bytes long. Records that are not must not be applied or
+ * skipped by len.
+ */
+ngx_uint_t
+ngx_http_lklb_journal_record_valid( ngx_http_lklb_journal_record_t *record, size_t max );
+
+/*
+ * Applies a record through the shards APIs, now as given by
+ * ngx_http_lklb_journal_now(). Returns 1 if it did not fit the zone.
+ */
+ngx_uint_t
+ngx_http_lklb_journal_apply(
+    ngx_http_lklb_radix_ctx_t          *radix_ctx,
+    ngx_http_lklb_journal_record_t     *record,
+    uint64_t                            now
+);
+
+/*
+ * Writes the buffered records out and posts a compaction when due. Only
+ * one process flushes at a time, others return NGX_OK. A worker exiting
+ * only writes the records out.
+ */
+ngx_int_t
+ngx_http_lklb_journal_flush(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_str_t                  *path,
+    ngx_uint_t                  exiting,
+    ngx_log_t                  *log
+);
+
+/*
+ * Rebuilds a new zone from the snapshot and the journals, then writes a
+ * fresh snapshot. Runs in the master before the zone is shared, nothing
+ * is journaled. The snapshot is handed to user, the worker user, so
+ * that workers can compact it later.
+ */
+ngx_int_t
+ngx_http_lklb_journal_recover(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_str_t                  *path,
+    ngx_uid_t                   user,
+    ngx_log_t                  *log
+);
+
+/*
+ * Writes a snapshot of the zone and drops the journals, e.g. once a zone
+ * got its entries from the previous cycle instead of the files.
+ */
+ngx_int_t
+ngx_http_lklb_journal_reset(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_str_t                  *path,
+    ngx_uid_t                   user,
+    ngx_log_t                  *log
+);
+
+#endif /* _NGX_HTTP_LOOKUPLIBS_JOURNAL_H_INCLUDED_ */
@@ -0,0 +1,952 @@
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_internal.h"
+#include "ngx_http_lookuplibs_transforms.h"
+#include "ngx_http_lookuplibs_loader.h"
+
+/* Zone entries read per cursor call while diffing */
+#define NGX_HTTP_LKLB_LOADER_ENTRIES    256
+
+/* Ops per event loop iteration, a line takes two at most */
+#define NGX_HTTP_LKLB_LOADER_OPS        ( NGX_HTTP_LKLB_LOADER_BATCH * NGX_HTTP_LKLB_LOADER_BATCHES )
+
+/*
+ * A parsed line, or an entry of the zone while diffing. Keys and masks
+ * are in host order, unused words zero, bits is the prefix length.
+ */
+typedef struct {
+    ngx_http_lklb_shards_op_t        op;
+    ngx_uint_t                       bits;
+    ngx_uint_t                       line;
+    ngx_str_t                        data;
+} ngx_http_lklb_loader_line_t;
+
+/*
+ * File of a lookup_load directive with watch=, polled by a timer of the
+ * first worker. mtime, size and uniq identify the file last loaded.
+ */
+typedef struct {
+    ngx_http_lklb_loader_conf_t     *load;
+    ngx_cycle_t                     *cycle;
+    time_t                           mtime;
+    off_t                            size;
+    ngx_file_uniq_t                  uniq;
+    ngx_event_t                      event;
+} ngx_http_lklb_loader_watch_t;
+
+/*
+ * A bulk load of a radix zone. The file is read, parsed and sorted on a
+ * thread of the pool, which does not touch the zone. The event loop then
+ * goes through the lines in rounds of NGX_HTTP_LKLB_LOADER_OPS ops: it
+ * creates their values, evicting as needed, records the inserts into
+ * batches and commits them, each under one short write lock per shard.
+ * Sorted inserts of a batch share their paths, which keeps the nodes
+ * commit preallocates few.
+ * Keys holding a value already keep it as with the insert APIs, loads
+ * add to the zone. Watched files are synced instead: the sorted lines
+ * are merged with a walk of the zone in key order and only the entries
+ * missing, gone or changed make it into the batches, as inserts and
+ * deletes. Zones are loaded by one process at a time, loading is set to
+ * its pid until the last batch is committed, a load of a process that
+ * died is taken over.
+ * n is the next line, idx and count the entries of the cursor, walked
+ * what it last returned.
+ */
+typedef struct {
+    ngx_pool_t                      *pool;
+    ngx_log_t                       *log;
+    ngx_str_t                        name;
+    ngx_str_t                        path;
+    ngx_http_lklb_ctx_t             *ctx;
+    ngx_http_lklb_radix_ctx_t       *radix_ctx;
+    ngx_http_lklb_loader_watch_t    *watch;
+    ngx_int_t                        rc;
+
+    time_t                           mtime;
+    off_t                            size;
+    ngx_file_uniq_t                  uniq;
+
+    u_char                          *buf;
+    ngx_http_lklb_loader_line_t     *parsed;
+    ngx_uint_t                       nparsed;
+    ngx_uint_t                       n;
+
+    ngx_http_lklb_shards_cursor_t    cursor;
+    ngx_http_lklb_radix_entry_t     *entries;
+    ngx_uint_t                       idx;
+    ngx_uint_t                       count;
+    ngx_http_lklb_retval_e           walked;
+
+    ngx_http_lklb_shards_op_t       *ops;
+    ngx_uint_t                       nops;
+    ngx_http_lklb_shards_batch_t     batch;
+
+    ngx_uint_t                       lines;
+    ngx_uint_t                       invalid;
+    ngx_uint_t                       inserts;
+    ngx_uint_t                       deletes;
+    ngx_uint_t                       lost;
+
+    ngx_event_t                      event;
+} ngx_http_lklb_loader_t;
+
+static u_char *
+ngx_http_lklb_loader_read( ngx_http_lklb_loader_t *loader, size_t *len ) {
+    ngx_file_t       file;
+    ngx_file_info_t  fi;
+    u_char          *buf = NULL;
+    ssize_t          n;
+    size_t           size;
+
+    ngx_memzero( &file, sizeof( ngx_file_t ) );
+
+    file.name = loader->path;
+    file.log  = loader->log;
+
+    file.fd = ngx_open_file( loader->path.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0 );
+    if( NGX_INVALID_FILE == file.fd ) {
+        ngx_log_error( NGX_LOG_ERR, loader->log, ngx_errno, ngx_open_file_n " \"%V\" failed", &loader->path );
+        return NULL;
+    }
+
+    if( NGX_FILE_ERROR == ngx_fd_info( file.fd, &fi ) ) {
+        ngx_log_error( NGX_LOG_ERR, loader->log, ngx_errno, ngx_fd_info_n " \"%V\" failed", &loader->path );
+        goto ldone;
+    }
+
+    loader->mtime = ngx_file_mtime( &fi );
+    loader->size  = ngx_file_size( &fi );
+    loader->uniq  = ngx_file_uniq( &fi );
+
+    size = ( size_t )ngx_file_size( &fi );
+
+    buf = ngx_alloc( size + 1, loader->log );
+    if( NULL == buf ) {
+        goto ldone;
+    }
+
+    for( *len = 0; *len < size; *len += n ) {
+        n = ngx_read_file( &file, buf + *len, size - *len, *len );
+
+        if( NGX_ERROR == n ) {
+            ngx_free( buf );
+            buf = NULL;
+            goto ldone;
+        }
+
+        /* Truncated meanwhile */
+        if( 0 == n ) {
+            break;
+        }
+    }
+
+ldone:
+    if( NGX_FILE_ERROR == ngx_close_file( file.fd ) ) {
+        ngx_log_error( NGX_LOG_ALERT, loader->log, ngx_errno, ngx_close_file_n " \"%V\" failed", &loader->path );
+    }
+
+    return buf;
+}
+
+/* Words of a binary address in host order */
+static void
+ngx_http_lklb_loader_words( u_char *addr, ngx_uint_t nwords, uint32_t *words ) {
+    ngx_uint_t  idx;
+
+    for( idx = 0; idx < nwords; idx++, addr += 4 ) {
+        words[ idx ] = ( ( uint32_t )addr[ 0 ] << 24 ) | ( ( uint32_t )addr[ 1 ] << 16 )
+                     | ( ( uint32_t )addr[ 2 ] << 8 ) | addr[ 3 ];
+    }
+}
+
+/* Prefix length of a contiguous mask */
+static ngx_uint_t
+ngx_http_lklb_loader_bits( uint32_t *mask, ngx_uint_t nwords ) {
+    ngx_uint_t  idx, bits = 0;
+    uint32_t    word;
+
+    for( idx = 0; idx < nwords; idx++ ) {
+        for( word = mask[ idx ]; word; word <<= 1 ) {
+            bits++;
+        }
+    }
+
+    return bits;
+}
+
+#define ngx_http_lklb_loader_is_space( __c )    ( ( ' ' == ( __c ) ) || ( '\t' == ( __c ) ) || ( '\r' == ( __c ) ) )
+
+/*
+ * Parses a line, the value data points into the line. Returns
+ * NGX_DECLINED for blank and comment lines, NGX_ERROR for invalid ones.
+ * dualstack: IPv4 prefixes become the IPv4-mapped uint128 prefixes the
+ * zone stores, see ngx_http_lklb_radix_set_dualstack.
+ */
+static ngx_int_t
+ngx_http_lklb_loader_parse(
+    u_char                       *p,
+    u_char                       *last,
+    ngx_uint_t                    dualstack,
+    ngx_http_lklb_loader_line_t  *line
+) {
+    ngx_http_lklb_shards_op_t   *op = &line->op;
+    ngx_str_t                    key;
+    ngx_cidr_t                   cidr;
+
+    while( ( p < last ) && ( ngx_http_lklb_loader_is_space( *p ) ) ) {
+        p++;
+    }
+
+    while( ( last > p ) && ( ngx_http_lklb_loader_is_space( *( last - 1 ) ) ) ) {
+        last--;
+    }
+
+    if( ( p == last ) || ( '#' == *p ) ) {
+        return NGX_DECLINED;
+    }
+
+    for( key.data = p; ( p < last ) && ( !ngx_http_lklb_loader_is_space( *p ) ); p++ ) {
+        /* void */
+    }
+
+    key.len = p - key.data;
+
+    while( ( p < last ) && ( ngx_http_lklb_loader_is_space( *p ) ) ) {
+        p++;
+    }
+
+    line->data.data = p;
+    line->data.len  = last - p;
+
+    /* Host bits set are cleared */
+    if( NGX_ERROR == ngx_ptocidr( &key, &cidr ) ) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero( op, sizeof( ngx_http_lklb_shards_op_t ) );
+
+    op->op = NGX_HTTP_LKLB_QUEUE_INSERT;
+
+    switch( cidr.family ) {
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            op->nwords = 4;
+            ngx_http_lklb_loader_words( cidr.u.in6.addr.s6_addr, 4, &op->key[ 0 ] );
+            ngx_http_lklb_loader_words( cidr.u.in6.mask.s6_addr, 4, &op->mask[ 0 ] );
+            break;
+#endif
+
+        case AF_INET:
+            if( dualstack ) {
+                op->nwords    = 4;
+                op->key[ 2 ]  = ( uint32_t )0xffff;
+                op->key[ 3 ]  = ntohl( cidr.u.in.addr );
+                op->mask[ 0 ] = ( uint32_t )( -1 );
+                op->mask[ 1 ] = ( uint32_t )( -1 );
+                op->mask[ 2 ] = ( uint32_t )( -1 );
+                op->mask[ 3 ] = ntohl( cidr.u.in.mask );
+                break;
+            }
+
+            op->nwords = 1;
+            op->key[ 0 ]  = ntohl( cidr.u.in.addr );
+            op->mask[ 0 ] = ntohl( cidr.u.in.mask );
+            break;
+
+        default:
+            return NGX_ERROR;
+    }
+
+    line->bits = ngx_http_lklb_loader_bits( &op->mask[ 0 ], op->nwords );
+
+    return NGX_OK;
+}
+
+/*
+ * Key order of the tree, covering prefixes first. uint32 keys are the
+ * first word of uint128 ones, a tree holds both as the same bit strings.
+ */
+static ngx_int_t
+ngx_http_lklb_loader_line_cmp( ngx_http_lklb_loader_line_t *a, ngx_http_lklb_loader_line_t *b ) {
+    ngx_uint_t  idx;
+
+    for( idx = 0; idx < 4; idx++ ) {
+        if( a->op.key[ idx ] != b->op.key[ idx ] ) {
+            return( ( a->op.key[ idx ] < b->op.key[ idx ] ) ? -1 : 1 );
+        }
+    }
+
+    if( a->bits != b->bits ) {
+        return( ( a->bits < b->bits ) ? -1 : 1 );
+    }
+
+    return 0;
+}
+
+/* Lines of the same key stay in file order */
+static int ngx_libc_cdecl
+ngx_http_lklb_loader_cmp( const void *one, const void *two ) {
+    const ngx_http_lklb_loader_line_t   *a = one, *b = two;
+    ngx_int_t                            cmp;
+
+    cmp = ngx_http_lklb_loader_line_cmp( ( ngx_http_lklb_loader_line_t * )a, ( ngx_http_lklb_loader_line_t * )b );
+    if( cmp ) {
+        return ( int )cmp;
+    }
+
+    return( ( a->line < b->line ) ? -1 : ( a->line > b->line ) );
+}
+
+/* Entry of the zone as a line, value is that of the entry. Dual-stack zones hold uint128 keys only */
+static void
+ngx_http_lklb_loader_entry(
+    ngx_http_lklb_radix_entry_t  *entry,
+    ngx_uint_t                    dualstack,
+    ngx_http_lklb_loader_line_t  *line
+) {
+    ngx_http_lklb_shards_op_t   *op = &line->op;
+    ngx_uint_t                   idx, bits;
+    uint32_t                     mask;
+
+    ngx_memzero( line, sizeof( ngx_http_lklb_loader_line_t ) );
+
+    ngx_http_lklb_loader_words( &entry->key[ 0 ], 4, &op->key[ 0 ] );
+
+    for( idx = 0; idx < 4; idx++ ) {
+        bits = ( entry->bits > 32 * idx ) ? ngx_min( entry->bits - 32 * idx, 32 ) : 0;
+        mask = ( bits ) ? ( uint32_t )( -1 ) << ( 32 - bits ) : 0;
+
+        op->key[ idx ]  &= mask;
+        op->mask[ idx ]  = mask;
+    }
+
+    op->nwords = ( ( entry->bits <= 32 ) && ( !dualstack ) ) ? 1 : 4;
+    op->value  = entry->value;
+    line->bits = entry->bits;
+}
+
+/* Whether the value of an entry is the one the data of a line gives */
+static ngx_uint_t
+ngx_http_lklb_loader_same( ngx_http_lklb_value_t *value, ngx_str_t *data ) {
+    if( NULL == value ) {
+        return( 0 == data->len );
+    }
+
+    if( value->expires ) {
+        return 0;
+    }
+
+    if( 0 == data->len ) {
+        return value->nodata;
+    }
+
+    return( ( !value->nodata ) && ( value->len == data->len ) &&
+            ( 0 == ngx_memcmp( value->data, data->data, data->len ) ) );
+}
+
+/*
+ * Appends the insert of a line with its value. Lines whose value can
+ * not be had are counted as lost and skipped.
+ */
+static void
+ngx_http_lklb_loader_insert( ngx_http_lklb_loader_t *loader, ngx_http_lklb_loader_line_t *line ) {
+    ngx_http_lklb_ctx_t         *ctx = loader->ctx;
+    ngx_http_lklb_shards_op_t   *op;
+    ngx_http_lklb_value_t       *value = NULL;
+
+    /* Evicting and counting zones track entries on values, keep one for every entry */
+    if( ( line->data.len ) || ( NGX_HTTP_LKLB_EVICT_NONE != ctx->evict ) || ( ctx->stats ) ) {
+        if( ( NGX_HTTP_LKLB_EVICT_NONE != ctx->evict ) &&
+            ( ctx->shpool->pfree < NGX_HTTP_LKLB_EVICT_RESERVE ) ) {
+            ngx_http_lklb_shards_evict( loader->radix_ctx, NGX_HTTP_LKLB_EVICT_BATCH );
+        }
+
+        value = ngx_http_lklb_value_create( &loader->radix_ctx->values, ( line->data.len ) ? line->data.data : NULL,
+                                            line->data.len, 0 );
+        if( NULL == value ) {
+            loader->lost++;
+            return;
+        }
+    }
+
+    op = &loader->ops[ loader->nops++ ];
+
+    *op = line->op;
+    op->value = value;
+
+    loader->inserts++;
+}
+
+static void
+ngx_http_lklb_loader_delete( ngx_http_lklb_loader_t *loader, ngx_http_lklb_loader_line_t *line ) {
+    ngx_http_lklb_shards_op_t   *op;
+
+    op = &loader->ops[ loader->nops++ ];
+
+    *op = line->op;
+    op->op    = NGX_HTTP_LKLB_QUEUE_DELETE;
+    op->value = NULL;
+
+    loader->deletes++;
+}
+
+/*
+ * Appends the inserts of the next lines, of lines of the same key the
+ * first one counts. Returns NGX_DONE once all lines are in.
+ */
+static ngx_int_t
+ngx_http_lklb_loader_add( ngx_http_lklb_loader_t *loader ) {
+    for( /* void */ ; loader->n < loader->nparsed; loader->n++ ) {
+        if( loader->nops == NGX_HTTP_LKLB_LOADER_OPS ) {
+            return NGX_OK;
+        }
+
+        if( ( loader->n ) &&
+            ( 0 == ngx_http_lklb_loader_line_cmp( &loader->parsed[ loader->n - 1 ], &loader->parsed[ loader->n ] ) ) ) {
+            continue;
+        }
+
+        ngx_http_lklb_loader_insert( loader, &loader->parsed[ loader->n ] );
+    }
+
+    return NGX_DONE;
+}
+
+/*
+ * Merges the sorted lines with the entries of the zone, both in key
+ * order, for as many ops as a round takes. Entries without a line are
+ * deleted, lines without an entry inserted and entries whose value
+ * differs replaced. Of lines of the same key the first one counts.
+ * Entries are walked with a reference on their value, the merge
+ * resumes with them next round. Inserts of earlier rounds are behind
+ * the cursor and not seen again. Returns NGX_DONE once merged.
+ */
+static ngx_int_t
+ngx_http_lklb_loader_diff( ngx_http_lklb_loader_t *loader ) {
+    ngx_http_lklb_radix_ctx_t       *radix_ctx = loader->radix_ctx;
+    ngx_http_lklb_loader_line_t      entry, *line;
+    ngx_uint_t                       same;
+    ngx_int_t                        cmp;
+
+    while( loader->nops + 2 <= NGX_HTTP_LKLB_LOADER_OPS ) {
+        if( ( loader->idx == loader->count ) && ( NGX_HTTP_LKLB_MATCH != loader->walked ) ) {
+            loader->idx    = 0;
+            loader->walked = ngx_http_lklb_shards_cursor_next( radix_ctx, &loader->cursor, loader->entries,
+                                                               NGX_HTTP_LKLB_LOADER_ENTRIES, &loader->count );
+            if( NGX_HTTP_LKLB_ERR == loader->walked ) {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        if( ( loader->idx == loader->count ) && ( loader->n == loader->nparsed ) ) {
+            return NGX_DONE;
+        }
+
+        line = &loader->parsed[ loader->n ];
+        same = 0;
+
+        if( loader->idx < loader->count ) {
+            ngx_http_lklb_loader_entry( &loader->entries[ loader->idx ], radix_ctx->dualstack, &entry );
+            cmp = ( loader->n < loader->nparsed ) ? ngx_http_lklb_loader_line_cmp( &entry, line ) : -1;
+        } else {
+            cmp = 1;
+        }
+
+        if( cmp <= 0 ) {
+            same = ( 0 == cmp ) && ( ngx_http_lklb_loader_same( entry.op.value, &line->data ) );
+
+            ngx_http_lklb_value_unref( &radix_ctx->values, entry.op.value );
+            loader->idx++;
+
+            if( !same ) {
+                ngx_http_lklb_loader_delete( loader, &entry );
+            }
+
+            if( cmp < 0 ) {
+                continue;
+            }
+        }
+
+        if( !same ) {
+            ngx_http_lklb_loader_insert( loader, line );
+        }
+
+        for( loader->n++;
+             ( loader->n < loader->nparsed ) &&
+             ( 0 == ngx_http_lklb_loader_line_cmp( line, &loader->parsed[ loader->n ] ) );
+             loader->n++ ) {
+            /* void */
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* Runs on a thread of the pool, reads, parses and sorts the file without touching the zone */
+static ngx_int_t
+ngx_http_lklb_loader_prepare( ngx_http_lklb_loader_t *loader ) {
+    ngx_http_lklb_radix_ctx_t       *radix_ctx = loader->radix_ctx;
+    u_char                          *p, *last, *eol;
+    size_t                           len = 0;
+    ngx_uint_t                       nlines;
+    ngx_int_t                        rc;
+
+    /* Line data points into the file, it is kept until the load is done */
+    loader->buf = ngx_http_lklb_loader_read( loader, &len );
+    if( NULL == loader->buf ) {
+        return NGX_ERROR;
+    }
+
+    last = loader->buf + len;
+
+    for( nlines = 1, p = loader->buf; p < last; p++ ) {
+        nlines += ( '\n' == *p );
+    }
+
+    loader->parsed = ngx_alloc( nlines * sizeof( ngx_http_lklb_loader_line_t ), loader->log );
+    loader->ops    = ngx_alloc( NGX_HTTP_LKLB_LOADER_OPS * sizeof( ngx_http_lklb_shards_op_t ), loader->log );
+
+    if( ( NULL == loader->parsed ) || ( NULL == loader->ops ) ) {
+        return NGX_ERROR;
+    }
+
+    if( loader->watch ) {
+        loader->entries = ngx_alloc( NGX_HTTP_LKLB_LOADER_ENTRIES * sizeof( ngx_http_lklb_radix_entry_t ),
+                                     loader->log );
+        if( NULL == loader->entries ) {
+            return NGX_ERROR;
+        }
+    }
+
+    for( p = loader->buf; p < last; p = eol + 1 ) {
+        eol = ngx_strlchr( p, last, '\n' );
+        if( NULL == eol ) {
+            eol = last;
+        }
+
+        loader->lines++;
+
+        rc = ngx_http_lklb_loader_parse( p, eol, radix_ctx->dualstack, &loader->parsed[ loader->nparsed ] );
+
+        if( NGX_OK == rc ) {
+            loader->parsed[ loader->nparsed++ ].line = loader->lines;
+        } else if( NGX_ERROR == rc ) {
+            loader->invalid++;
+        }
+    }
+
+    ngx_qsort( loader->parsed, loader->nparsed, sizeof( ngx_http_lklb_loader_line_t ), ngx_http_lklb_loader_cmp );
+
+    return NGX_OK;
+}
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_lklb_loader_thread( void *data, ngx_log_t *log ) {
+    ngx_http_lklb_loader_t  *loader = data;
+
+    loader->rc = ngx_http_lklb_loader_prepare( loader );
+}
+
+#endif
+
+/* Records the ops of a round into batches and commits them */
+static void
+ngx_http_lklb_loader_commit( ngx_http_lklb_loader_t *loader ) {
+    ngx_http_lklb_radix_ctx_t       *radix_ctx = loader->radix_ctx;
+    ngx_http_lklb_shards_op_t       *op;
+    ngx_uint_t                       n, idx, first, nops;
+
+    /* Keys are recorded in the order the insert APIs take them */
+    for( n = 0; n < loader->nops; n++ ) {
+        op = &loader->ops[ n ];
+
+        for( idx = 0; idx < op->nwords; idx++ ) {
+            op->key[ idx ]  = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, op->key[ idx ] );
+            op->mask[ idx ] = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, op->mask[ idx ] );
+        }
+    }
+
+    for( first = 0; first < loader->nops; first += NGX_HTTP_LKLB_LOADER_BATCH ) {
+        nops = ngx_min( loader->nops - first, NGX_HTTP_LKLB_LOADER_BATCH );
+
+        ngx_http_lklb_shards_batch_record( &loader->batch, radix_ctx, &loader->ops[ first ], nops, loader->log );
+        loader->lost += ngx_http_lklb_shards_batch_commit( &loader->batch, &loader->ops[ first ], nops );
+    }
+
+    loader->nops = 0;
+}
+
+static void
+ngx_http_lklb_loader_free( ngx_http_lklb_loader_t *loader ) {
+    ngx_uint_t  n;
+
+    /* Values of ops a failed round did not commit */
+    for( n = 0; n < loader->nops; n++ ) {
+        ngx_http_lklb_value_unref( &loader->radix_ctx->values, loader->ops[ n ].value );
+    }
+
+    /* Entries still referenced by the cursor */
+    for( /* void */ ; loader->idx < loader->count; loader->idx++ ) {
+        ngx_http_lklb_value_unref( &loader->radix_ctx->values, loader->entries[ loader->idx ].value );
+    }
+
+    if( loader->ops ) {
+        ngx_free( loader->ops );
+    }
+
+    if( loader->entries ) {
+        ngx_free( loader->entries );
+    }
+
+    if( loader->parsed ) {
+        ngx_free( loader->parsed );
+    }
+
+    if( loader->buf ) {
+        ngx_free( loader->buf );
+    }
+
+    ngx_unlock( &loader->radix_ctx->loading );
+
+    ngx_destroy_pool( loader->pool );
+}
+
+/*
+ * Zones of the readonly option turn read-only once loaded, failed loads
+ * included, they are not written to anymore either way. Such zones can
+ * not be watched, the configuration is refused.
+ */
+static void
+ngx_http_lklb_loader_seal( ngx_http_lklb_ctx_t *ctx, ngx_str_t *name, ngx_log_t *log ) {
+    if( ( !ctx->readonly ) || ( NULL == ctx->shpool ) || ( !ngx_http_lklb_ctx_is_radix( ctx ) ) ) {
+        return;
+    }
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_shards_set_readonly( ngx_http_lklb_ctx_radix( ctx ), 1 ) ) {
+        ngx_log_error( NGX_LOG_ALERT, log, 0, "could not make shared lookup zone \"%V\" read only", name );
+    }
+}
+
+/*
+ * Diffs or adds the lines of a round and commits them, posts itself
+ * again until all lines are in.
+ */
+static void
+ngx_http_lklb_loader_publish( ngx_event_t *ev ) {
+    ngx_http_lklb_loader_t          *loader = ev->data;
+    ngx_int_t                        rc = NGX_ERROR;
+
+    if( NGX_OK == loader->rc ) {
+        rc = ( loader->watch ) ? ngx_http_lklb_loader_diff( loader ) : ngx_http_lklb_loader_add( loader );
+        loader->rc = ( NGX_ERROR == rc ) ? NGX_ERROR : NGX_OK;
+    }
+
+    if( NGX_OK != loader->rc ) {
+        ngx_log_error( NGX_LOG_ERR, loader->log, 0, "could not load shared lookup zone \"%V\" from \"%V\"",
+                       &loader->name, &loader->path );
+        goto ldone;
+    }
+
+    ngx_http_lklb_loader_commit( loader );
+
+    if( NGX_DONE != rc ) {
+        ngx_post_event( &loader->event, &ngx_posted_events );
+        return;
+    }
+
+    if( loader->watch ) {
+        loader->watch->mtime = loader->mtime;
+        loader->watch->size  = loader->size;
+        loader->watch->uniq  = loader->uniq;
+
+        ngx_log_error( ( loader->invalid || loader->lost ) ? NGX_LOG_WARN : NGX_LOG_NOTICE, loader->log, 0,
+                       "shared lookup zone \"%V\" synced to \"%V\", %ui inserted, %ui deleted "
+                       "(%ui lines, %ui invalid, %ui did not fit)",
+                       &loader->name, &loader->path, loader->inserts - loader->lost, loader->deletes,
+                       loader->lines, loader->invalid, loader->lost );
+        goto ldone;
+    }
+
+    ngx_log_error( ( loader->invalid || loader->lost ) ? NGX_LOG_WARN : NGX_LOG_NOTICE, loader->log, 0,
+                   "shared lookup zone \"%V\" loaded %ui entries from \"%V\" "
+                   "(%ui lines, %ui invalid, %ui did not fit)",
+                   &loader->name, loader->inserts - loader->lost, &loader->path,
+                   loader->lines, loader->invalid, loader->lost );
+
+ldone:
+    if( NULL == loader->watch ) {
+        ngx_http_lklb_loader_seal( loader->ctx, &loader->name, loader->log );
+    }
+
+    ngx_http_lklb_loader_free( loader );
+}
+
+/* watch: the file of a lookup_load directive with watch=, synced, or NULL */
+static ngx_int_t
+ngx_http_lklb_loader_run(
+    ngx_cycle_t                    *cycle,
+    ngx_shm_zone_t                 *zone,
+    ngx_str_t                      *path,
+    ngx_str_t                      *thread_pool,
+    ngx_http_lklb_loader_watch_t   *watch
+) {
+    ngx_http_lklb_ctx_t         *ctx = zone->data;
+    ngx_http_lklb_radix_ctx_t   *radix_ctx;
+    ngx_http_lklb_loader_t      *loader;
+    ngx_pool_t                  *pool;
+    ngx_str_t                    full;
+#if (NGX_THREADS)
+    ngx_thread_pool_t           *tp;
+    ngx_thread_task_t           *task;
+#endif
+
+    if( ( NULL == ctx ) || ( NULL == ctx->shpool ) || ( !ngx_http_lklb_ctx_is_radix( ctx ) ) ) {
+        return NGX_ERROR;
+    }
+
+    radix_ctx = ngx_http_lklb_ctx_radix( ctx );
+
+    /* Watched files are looked at again next tick */
+    if( radix_ctx->readonly ) {
+        return NGX_ABORT;
+    }
+
+#if (NGX_THREADS)
+    tp = ngx_thread_pool_get( cycle, thread_pool );
+    if( NULL == tp ) {
+        return NGX_DECLINED;
+    }
+#endif
+
+    if( !ngx_http_lklb_trylock_owner( &radix_ctx->loading ) ) {
+        return NGX_BUSY;
+    }
+
+    pool = ngx_create_pool( NGX_DEFAULT_POOL_SIZE, cycle->log );
+    if( NULL == pool ) {
+        goto lfailed;
+    }
+
+    loader = ngx_pcalloc( pool, sizeof( ngx_http_lklb_loader_t ) );
+    if( NULL == loader ) {
+        goto lfailed;
+    }
+
+    loader->pool      = pool;
+    loader->log       = cycle->log;
+    loader->ctx       = ctx;
+    loader->radix_ctx = radix_ctx;
+    loader->watch     = watch;
+    loader->rc        = NGX_ERROR;
+    loader->walked    = NGX_HTTP_LKLB_OK;
+
+    loader->name.data = ngx_pstrdup( pool, &zone->shm.name );
+    loader->name.len  = zone->shm.name.len;
+
+    full = *path;
+
+    if( ( NULL == loader->name.data ) || ( NGX_OK != ngx_get_full_name( pool, &cycle->prefix, &full ) ) ) {
+        goto lfailed;
+    }
+
+    /* Opened by name, NUL terminated */
+    loader->path.data = ngx_pnalloc( pool, full.len + 1 );
+    if( NULL == loader->path.data ) {
+        goto lfailed;
+    }
+
+    *ngx_cpymem( loader->path.data, full.data, full.len ) = '\0';
+    loader->path.len = full.len;
+
+    /* Values of the walk are referenced, rounds span event loop iterations */
+    ngx_http_lklb_shards_cursor_init( radix_ctx, &loader->cursor, NULL, 0, 0 );
+    loader->cursor.cursor.ref = 1;
+
+    loader->event.handler = ngx_http_lklb_loader_publish;
+    loader->event.data    = loader;
+    loader->event.log     = cycle->log;
+
+#if (NGX_THREADS)
+    task = ngx_thread_task_alloc( pool, 0 );
+    if( NULL == task ) {
+        goto lfailed;
+    }
+
+    task->ctx           = loader;
+    task->handler       = ngx_http_lklb_loader_thread;
+    task->event.handler = ngx_http_lklb_loader_publish;
+    task->event.data    = loader;
+
+    if( NGX_OK != ngx_thread_task_post( tp, task ) ) {
+        goto lfailed;
+    }
+#else
+    /* Without thread pools the worker parses the file itself */
+    loader->rc = ngx_http_lklb_loader_prepare( loader );
+    ngx_http_lklb_loader_publish( &loader->event );
+#endif
+
+    return NGX_OK;
+
+lfailed:
+    if( pool ) {
+        ngx_destroy_pool( pool );
+    }
+
+    ngx_unlock( &radix_ctx->loading );
+
+    return NGX_ERROR;
+}
+
+ngx_int_t
+ngx_http_lklb_loader_start(
+    ngx_cycle_t                *cycle,
+    ngx_shm_zone_t             *zone,
+    ngx_str_t                  *path,
+    ngx_str_t                  *thread_pool
+) {
+    return ngx_http_lklb_loader_run( cycle, zone, path, thread_pool, NULL );
+}
+
+char *
+ngx_http_lklb_load( ngx_conf_t *cf, ngx_command_t *cmd, void *conf ) {
+    ngx_http_lklb_main_conf_t       *lklbmcf = conf;
+    ngx_http_lklb_loader_conf_t     *load;
+    ngx_str_t                       *value, param;
+    ngx_uint_t                       idx;
+
+    if( NULL == lklbmcf->loads ) {
+        lklbmcf->loads = ngx_array_create( cf->pool, 1, sizeof( ngx_http_lklb_loader_conf_t ) );
+        if( NULL == lklbmcf->loads ) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    load = ngx_array_push( lklbmcf->loads );
+    if( NULL == load ) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    if( 0 == value[ 1 ].len ) {
+        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "invalid shared lookup lib name \"%V\"", &value[ 1 ] );
+        return NGX_CONF_ERROR;
+    }
+
+    load->zone = ngx_shared_memory_add( cf, &value[ 1 ], 0, &ngx_http_lookuplibs_module );
+    if( NULL == load->zone ) {
+        return NGX_CONF_ERROR;
+    }
+
+    load->path = value[ 2 ];
+
+    if( NGX_OK != ngx_conf_full_name( cf->cycle, &load->path, 0 ) ) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_set( &load->thread_pool, "default" );
+    load->watch = 0;
+
+    for( idx = 3; idx < cf->args->nelts; idx++ ) {
+        if( ( value[ idx ].len > 12 ) && ( 0 == ngx_strncmp( value[ idx ].data, "thread_pool=", 12 ) ) ) {
+            load->thread_pool.data = value[ idx ].data + 12;
+            load->thread_pool.len  = value[ idx ].len - 12;
+            continue;
+        }
+
+        if( ( value[ idx ].len > 6 ) && ( 0 == ngx_strncmp( value[ idx ].data, "watch=", 6 ) ) ) {
+            param.data = value[ idx ].data + 6;
+            param.len  = value[ idx ].len - 6;
+
+            load->watch = ngx_parse_time( &param, 0 );
+
+            if( ( ( ngx_msec_t )NGX_ERROR == load->watch ) || ( 0 == load->watch ) ) {
+                ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[ idx ] );
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[ idx ] );
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_THREADS)
+    if( NULL == ngx_thread_pool_add( cf, &load->thread_pool ) ) {
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+    return NGX_CONF_OK;
+}
+
+/* Syncs the zone once the file was replaced or written to */
+static void
+ngx_http_lklb_loader_watch_handler( ngx_event_t *ev ) {
+    ngx_http_lklb_loader_watch_t    *watch = ev->data;
+    ngx_http_lklb_loader_conf_t     *load = watch->load;
+    ngx_file_info_t                  fi;
+
+    if( ngx_exiting ) {
+        return;
+    }
+
+    /* Returns NGX_BUSY while the zone is being loaded, the file is looked at again next tick */
+    if( ( NGX_FILE_ERROR != ngx_file_info( load->path.data, &fi ) ) &&
+        ( ( ngx_file_mtime( &fi ) != watch->mtime ) || ( ngx_file_size( &fi ) != watch->size ) ||
+          ( ngx_file_uniq( &fi ) != watch->uniq ) ) ) {
+        ngx_http_lklb_loader_run( watch->cycle, load->zone, &load->path, &load->thread_pool, watch );
+    }
+
+    ngx_add_timer( ev, load->watch );
+}
+
+void
+ngx_http_lklb_loader_init_process( ngx_cycle_t *cycle, ngx_array_t *loads ) {
+    ngx_http_lklb_loader_conf_t     *load = loads->elts;
+    ngx_http_lklb_loader_watch_t    *watch;
+    ngx_uint_t                       idx;
+    ngx_int_t                        rc;
+
+    for( idx = 0; idx < loads->nelts; idx++ ) {
+        watch = NULL;
+
+        if( load[ idx ].watch ) {
+            watch = ngx_pcalloc( cycle->pool, sizeof( ngx_http_lklb_loader_watch_t ) );
+            if( NULL == watch ) {
+                return;
+            }
+
+            watch->load  = &load[ idx ];
+            watch->cycle = cycle;
+
+            watch->event.handler    = ngx_http_lklb_loader_watch_handler;
+            watch->event.data       = watch;
+            watch->event.log        = cycle->log;
+            watch->event.cancelable = 1;
+
+            ngx_add_timer( &watch->event, load[ idx ].watch );
+        }
+
+        rc = ngx_http_lklb_loader_run( cycle, load[ idx ].zone, &load[ idx ].path, &load[ idx ].thread_pool, watch );
+
+        if( NGX_OK == rc ) {
+            continue;
+        }
+
+        ngx_log_error( NGX_LOG_ERR, cycle->log, 0, "could not load shared lookup zone \"%V\" from \"%V\"%s",
+                       &load[ idx ].zone->shm.name, &load[ idx ].path,
+                       ( NGX_BUSY == rc ) ? ", a load is underway"
+                       : ( NGX_ABORT == rc ) ? ", the zone is read only" : "" );
+
+        /* The load that holds the zone seals it once done */
+        if( ( NGX_BUSY != rc ) && ( load[ idx ].zone->data ) ) {
+            ngx_http_lklb_loader_seal( load[ idx ].zone->data, &load[ idx ].zone->shm.name, cycle->log );
+        }
+    }
+}
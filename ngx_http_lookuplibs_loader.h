@@ -0,0 +1,56 @@
+#ifndef _NGX_HTTP_LOOKUPLIBS_LOADER_H_INCLUDED_
+#define _NGX_HTTP_LOOKUPLIBS_LOADER_H_INCLUDED_
+
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_shards.h"
+
+/* Inserts per batch, batches committed per event loop iteration */
+#define NGX_HTTP_LKLB_LOADER_BATCH      4096
+#define NGX_HTTP_LKLB_LOADER_BATCHES    8
+
+/* watch: interval the file is polled at, 0 not watched */
+typedef struct {
+    ngx_shm_zone_t              *zone;
+    ngx_str_t                    path;
+    ngx_str_t                    thread_pool;
+    ngx_msec_t                   watch;
+} ngx_http_lklb_loader_conf_t;
+
+/*
+ * Handler for the lookup_load directive
+ *      "lookup_load <zone> <path> [thread_pool=<name>] [watch=<time>]"
+ * With watch= the zone is kept in sync with the file: it is checked for
+ * a new mtime, size or inode every <time> and the entries that were
+ * added, removed or changed are applied, see ngx_http_lklb_loader_t.
+ * Entries of the zone not in the file are deleted then. Zones of the
+ * readonly option can not be watched.
+ */
+char *
+ngx_http_lklb_load( ngx_conf_t *cf, ngx_command_t *cmd, void *conf );
+
+/*
+ * Loads the prefixes listed in a file into a radix zone, one per line
+ *      <address>[/<bits>] [<value>]
+ * Blank lines and lines starting with # are skipped. IPv4 prefixes are
+ * inserted as uint32 keys, IPv6 ones as uint128 keys, both as the Lua
+ * APIs take them. Dual-stack zones get IPv4 prefixes as IPv4-mapped
+ * uint128 keys. Lines without value store entries without value.
+ * Returns NGX_BUSY while the zone is being loaded, NGX_ABORT while it is
+ * read-only and NGX_DECLINED if there is no thread pool of that name, the
+ * load goes on in the background otherwise and its outcome is logged.
+ * Zones of the readonly option turn read-only once loaded, or once the
+ * load failed.
+ */
+ngx_int_t
+ngx_http_lklb_loader_start(
+    ngx_cycle_t                *cycle,
+    ngx_shm_zone_t             *zone,
+    ngx_str_t                  *path,
+    ngx_str_t                  *thread_pool
+);
+
+/* The files of the lookup_load directives are loaded and watched by the first worker */
+void
+ngx_http_lklb_loader_init_process( ngx_cycle_t *cycle, ngx_array_t *loads );
+
+#endif /* _NGX_HTTP_LOOKUPLIBS_LOADER_H_INCLUDED_ */
@@ -1,60 +1,144 @@
 #include "ngx_http_lookuplibs_module.h"
 #include "ngx_http_lookuplibs_internal.h"
+#include "ngx_http_lookuplibs_transforms.h"
 #include "ngx_http_lookuplib_radix_tree.h"
 #include "ngx_http_lookuplibs_lua.h"
 
 static void *ngx_http_lklb_shmem_calloc( void *shpool, size_t size );
 static void  ngx_http_lklb_shmem_free( void *shpool, void *ptr );
-static void  ngx_http_lklb_tree_rlock( void *lock_ctx );
-static void  ngx_http_lklb_tree_wlock( void *lock_ctx );
-static void  ngx_http_lklb_tree_unlock( void *lock_ctx );
+static void  ngx_http_lklb_shm_rlock( void *lock_ctx );
+static void  ngx_http_lklb_shm_wlock( void *lock_ctx );
+static void  ngx_http_lklb_shm_unlock( void *lock_ctx );
 
 typedef ngx_int_t ( *lklb_ctx_init_pt )( ngx_http_lklb_ctx_t * );
 typedef ngx_int_t ( *lklb_ctx_get_pt )( ngx_http_lklb_ctx_t * );
 typedef ngx_int_t ( *lklb_ctx_set_pt )( ngx_http_lklb_ctx_t * );
 typedef ngx_int_t ( *lklb_ctx_copy_pt )( ngx_http_lklb_ctx_t *, ngx_http_lklb_ctx_t * );
+typedef ngx_int_t ( *lklb_ctx_migrate_pt )( ngx_http_lklb_ctx_t *, ngx_http_lklb_ctx_t * );
 
+/*
+ * copy takes over the zone of the previous cycle when its segment is
+ * reused, migrate copies its entries into a new segment, e.g. of another
+ * size. migrate is optional, the zone then starts empty.
+ */
 typedef struct {
     lklb_ctx_init_pt    init_handler;
     lklb_ctx_get_pt     get_handler;
     lklb_ctx_set_pt     set_handler;
     lklb_ctx_copy_pt    copy_handler;
+    lklb_ctx_migrate_pt migrate_handler;
 } ngx_http_lklb_ctx_handlers_t;
 
 static ngx_int_t ngx_http_lklb_init_radix_ctx( ngx_http_lklb_ctx_t *ctx );
 static ngx_int_t ngx_http_lklb_get_radix_ctx( ngx_http_lklb_ctx_t *ctx );
 static ngx_int_t ngx_http_lklb_set_radix_ctx( ngx_http_lklb_ctx_t *ctx );
 static ngx_int_t ngx_http_lklb_copy_radix_ctx( ngx_http_lklb_ctx_t *ctx, ngx_http_lklb_ctx_t *octx );
+static ngx_int_t ngx_http_lklb_migrate_radix_ctx( ngx_http_lklb_ctx_t *ctx, ngx_http_lklb_ctx_t *octx );
+
+static ngx_int_t ngx_http_lklb_init_ac_ctx( ngx_http_lklb_ctx_t *ctx );
+static ngx_int_t ngx_http_lklb_get_ac_ctx( ngx_http_lklb_ctx_t *ctx );
+static ngx_int_t ngx_http_lklb_set_ac_ctx( ngx_http_lklb_ctx_t *ctx );
+static ngx_int_t ngx_http_lklb_copy_ac_ctx( ngx_http_lklb_ctx_t *ctx, ngx_http_lklb_ctx_t *octx );
 
 ngx_http_lklb_ctx_handlers_t ctx_handlers[ NGX_HTTP_LKLB_TYPE_MAX ] = {
     /* NGX_HTTP_LKLB_TYPE_RADIX */
     { ngx_http_lklb_init_radix_ctx,
       ngx_http_lklb_get_radix_ctx,
       ngx_http_lklb_set_radix_ctx,
-      ngx_http_lklb_copy_radix_ctx }
+      ngx_http_lklb_copy_radix_ctx,
+      ngx_http_lklb_migrate_radix_ctx },
+
+    /* NGX_HTTP_LKLB_TYPE_AC */
+    { ngx_http_lklb_init_ac_ctx,
+      ngx_http_lklb_get_ac_ctx,
+      ngx_http_lklb_set_ac_ctx,
+      ngx_http_lklb_copy_ac_ctx,
+      NULL }
 };
 
 static ngx_int_t
 ngx_http_lklb_init_radix_ctx( ngx_http_lklb_ctx_t *ctx ) {
     ngx_http_lklb_radix_ctx_t   *radix_ctx;
+    ngx_http_lklb_radix_shard_t *shard;
+    ngx_uint_t                   idx;
 
-    radix_ctx = ngx_slab_calloc( ctx->shpool, sizeof( ngx_http_lklb_radix_ctx_t ) );
+    radix_ctx = ngx_slab_calloc( ctx->shpool, ngx_http_lklb_shards_size( ctx->shards ) );
     if( NULL == radix_ctx ) {
         return NGX_ERROR;
     }
 
-    radix_ctx->tree = ngx_http_lklb_radix_create( NULL, ctx->shpool, ctx->transforms,
+    radix_ctx->epochs = ngx_http_lklb_epochs_create( ctx->shpool );
+    if( NULL == radix_ctx->epochs ) {
+        return NGX_ERROR;
+    }
+
+    radix_ctx->values.shpool = ctx->shpool;
+    radix_ctx->values.epochs = radix_ctx->epochs;
+    radix_ctx->values.sample = ctx->stats;
+    radix_ctx->transforms    = ctx->transforms;
+    radix_ctx->dualstack     = ctx->dualstack;
+    radix_ctx->nshards       = ctx->shards;
+
+    while( ( ( ngx_uint_t )1 << radix_ctx->bits ) < radix_ctx->nshards ) {
+        radix_ctx->bits++;
+    }
+
+    for( idx = 0; idx < radix_ctx->nshards; idx++ ) {
+        shard = &radix_ctx->shards[ idx ];
+
+        shard->tree = ngx_http_lklb_radix_create( NULL, ctx->shpool, ctx->transforms,
                                                   ngx_http_lklb_shmem_calloc,
                                                   ngx_http_lklb_shmem_free );
-    if( NULL == radix_ctx->tree ) {
-        return NGX_ERROR;
+        if( NULL == shard->tree ) {
+            return NGX_ERROR;
+        }
+
+        if( ( ctx->dualstack ) && ( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_set_dualstack( shard->tree ) ) ) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_lklb_radix_set_lock_functions( shard->tree, ( void * )&shard->rwlock,
+                                                ngx_http_lklb_shm_rlock,
+                                                ngx_http_lklb_shm_wlock,
+                                                ngx_http_lklb_shm_unlock );
+
+        ngx_http_lklb_radix_set_value_functions( shard->tree, &radix_ctx->values,
+                                                 ngx_http_lklb_value_ref,
+                                                 ngx_http_lklb_value_unref );
+        ngx_http_lklb_radix_set_expire_function( shard->tree, ngx_http_lklb_value_expired );
+        ngx_http_lklb_radix_set_epoch_functions( shard->tree, radix_ctx->epochs,
+                                                 ngx_http_lklb_epochs_retire,
+                                                 ngx_http_lklb_epochs_quiesced );
+
+        if( NGX_HTTP_LKLB_EVICT_CLOCK == ctx->evict ) {
+            ngx_http_lklb_radix_set_clock_functions( shard->tree,
+                                                     ngx_http_lklb_value_touch,
+                                                     ngx_http_lklb_value_referenced );
+        } else if( ctx->stats ) {
+            ngx_http_lklb_radix_set_clock_functions( shard->tree, ngx_http_lklb_value_touch, NULL );
+        }
+    }
+
+    if( ctx->queue ) {
+        radix_ctx->queue = ngx_http_lklb_queue_create( ctx->shpool, ctx->queue );
+        if( NULL == radix_ctx->queue ) {
+            return NGX_ERROR;
+        }
     }
 
-    ngx_http_lklb_radix_set_lock_functions( radix_ctx->tree, radix_ctx,
-                                            ngx_http_lklb_tree_rlock,
-                                            ngx_http_lklb_tree_wlock,
-                                            ngx_http_lklb_tree_unlock );
+    if( ctx->journal.len ) {
+        radix_ctx->journal = ngx_http_lklb_journal_create( ctx->shpool, NGX_HTTP_LKLB_JOURNAL_SIZE );
+        if( NULL == radix_ctx->journal ) {
+            return NGX_ERROR;
+        }
+    }
 
+    if( ctx->replicate ) {
+        radix_ctx->outbox = ngx_http_lklb_journal_create( ctx->shpool, NGX_HTTP_LKLB_REPLICA_OUTBOX );
+        if( NULL == radix_ctx->outbox ) {
+            return NGX_ERROR;
+        }
+    }
 
     ngx_http_lklb_ctx_radix( ctx ) = radix_ctx;
     return NGX_OK;
@@ -83,9 +167,112 @@ ngx_http_lklb_copy_radix_ctx( ngx_http_lklb_ctx_t *ctx, ngx_http_lklb_ctx_t *oct
     return NGX_OK;
 }
 
+/*
+ * The old segment stays mapped until the new cycle is up and its workers
+ * may still update it, every shard is copied under its read lock.
+ */
+static ngx_int_t
+ngx_http_lklb_migrate_radix_ctx( ngx_http_lklb_ctx_t *ctx, ngx_http_lklb_ctx_t *octx ) {
+    ngx_http_lklb_radix_ctx_t    *radix_ctx, *oradix_ctx;
+    ngx_http_lklb_values_copy_t   copy;
+    ngx_uint_t                    idx;
+    ngx_int_t                     rc = NGX_OK;
+
+    radix_ctx  = ngx_http_lklb_ctx_radix( ctx );
+    oradix_ctx = ngx_http_lklb_ctx_radix( octx );
+
+    if( ( NULL == oradix_ctx ) || ( radix_ctx->nshards != oradix_ctx->nshards ) ||
+        ( radix_ctx->transforms != oradix_ctx->transforms ) || ( radix_ctx->dualstack != oradix_ctx->dualstack ) ) {
+        return NGX_ERROR;
+    }
+
+    if( NGX_OK != ngx_http_lklb_values_copy_init( &copy, &radix_ctx->values, ngx_cycle->log ) ) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * Workers of the previous cycle run on until the new ones took over,
+     * their writes past the copy would be lost. They get refused instead,
+     * and the copy walks the shards without locking them. The zone turns
+     * writable again if the new cycle fails, see ngx_http_lklb_octx_cleanup.
+     */
+    ctx->oreadonly = oradix_ctx->readonly;
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_shards_set_readonly( oradix_ctx, 1 ) ) {
+        ngx_http_lklb_values_copy_done( &copy );
+        return NGX_ERROR;
+    }
+
+    ctx->moved = 1;
+
+    for( idx = 0; idx < radix_ctx->nshards; idx++ ) {
+        if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_copy( radix_ctx->shards[ idx ].tree,
+                                                          oradix_ctx->shards[ idx ].tree,
+                                                          &copy, ngx_http_lklb_value_copy ) ) {
+            rc = NGX_ERROR;
+            break;
+        }
+    }
+
+    ngx_http_lklb_values_copy_done( &copy );
+
+    radix_ctx->family = oradix_ctx->family;
+
+    return rc;
+}
+
+static ngx_int_t
+ngx_http_lklb_init_ac_ctx( ngx_http_lklb_ctx_t *ctx ) {
+    ngx_http_lklb_ac_ctx_t  *ac_ctx;
+
+    ac_ctx = ngx_slab_calloc( ctx->shpool, sizeof( ngx_http_lklb_ac_ctx_t ) );
+    if( NULL == ac_ctx ) {
+        return NGX_ERROR;
+    }
+
+    ac_ctx->ac = ngx_http_lklb_ac_create( NULL, ctx->shpool, ctx->transforms,
+                                          ngx_http_lklb_shmem_calloc,
+                                          ngx_http_lklb_shmem_free );
+    if( NULL == ac_ctx->ac ) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_lklb_ac_set_lock_functions( ac_ctx->ac, ( void * )&ac_ctx->rwlock,
+                                         ngx_http_lklb_shm_rlock,
+                                         ngx_http_lklb_shm_wlock,
+                                         ngx_http_lklb_shm_unlock );
+
+    ngx_http_lklb_ctx_ac( ctx ) = ac_ctx;
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_lklb_get_ac_ctx( ngx_http_lklb_ctx_t *ctx ) {
+    ngx_http_lklb_ctx_ac( ctx ) = ctx->shpool->data;
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_lklb_set_ac_ctx( ngx_http_lklb_ctx_t *ctx ) {
+    ctx->shpool->data = ngx_http_lklb_ctx_ac( ctx );
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_lklb_copy_ac_ctx( ngx_http_lklb_ctx_t *ctx, ngx_http_lklb_ctx_t *octx ) {
+    if( NGX_HTTP_LKLB_TYPE_AC != octx->type ) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_lklb_ctx_ac( ctx ) = ngx_http_lklb_ctx_ac( octx );
+
+    return NGX_OK;
+}
+
 ngx_int_t
 ngx_http_lklb_shm_init( ngx_shm_zone_t *shm_zone, void *data ) {
     ngx_http_lklb_ctx_t         *octx, *ctx;
+    ngx_core_conf_t             *ccf;
 
     octx = data;
     ctx  = shm_zone->data;
@@ -123,6 +310,32 @@ ngx_http_lklb_shm_init( ngx_shm_zone_t *shm_zone, void *data ) {
         return NGX_ERROR;
     }
 
+    /* The master writes the snapshot for the workers to take over */
+    ccf = ( ngx_core_conf_t * )ngx_get_conf( ctx->cycle->conf_ctx, ngx_core_module );
+
+    if( ( ctx->octx ) && ( ( ctx_handlers[ ctx->type ] ).migrate_handler ) ) {
+        if( NGX_OK != ( ctx_handlers[ ctx->type ] ).migrate_handler( ctx, ctx->octx ) ) {
+            ngx_log_error( NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                           "could not move the entries of shared lookup lib \"%V\" to its new segment",
+                           &shm_zone->shm.name );
+            return NGX_ERROR;
+        }
+
+        /* The files may lag behind the entries taken over */
+        if( ( ctx->journal.len ) &&
+            ( NGX_OK != ngx_http_lklb_journal_reset( ngx_http_lklb_ctx_radix( ctx ), &ctx->journal, ccf->user,
+                                                     shm_zone->shm.log ) ) ) {
+            return NGX_ERROR;
+        }
+    } else if( ( ctx->journal.len ) &&
+               ( NGX_OK != ngx_http_lklb_journal_recover( ngx_http_lklb_ctx_radix( ctx ), &ctx->journal, ccf->user,
+                                                          shm_zone->shm.log ) ) ) {
+        ngx_log_error( NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                       "could not recover shared lookup lib \"%V\" from \"%V\"",
+                       &shm_zone->shm.name, &ctx->journal );
+        return NGX_ERROR;
+    }
+
     return NGX_OK;
 }
 
@@ -139,80 +352,1457 @@ ngx_http_lklb_shmem_free( void *shpool, void *ptr )
 }
 
 static void
-ngx_http_lklb_tree_rlock( void *lock_ctx )
+ngx_http_lklb_shm_rlock( void *lock_ctx )
 {
-    ngx_http_lklb_radix_ctx_t   *radix_ctx = lock_ctx;
+    ngx_rwlock_rlock( ( ngx_atomic_t * )lock_ctx );
+}
 
-    ngx_rwlock_rlock( &radix_ctx->rwlock );
+static void
+ngx_http_lklb_shm_wlock( void *lock_ctx )
+{
+    ngx_rwlock_wlock( ( ngx_atomic_t * )lock_ctx );
 }
 
 static void
-ngx_http_lklb_tree_wlock( void *lock_ctx )
+ngx_http_lklb_shm_unlock( void *lock_ctx )
 {
-    ngx_http_lklb_radix_ctx_t   *radix_ctx = lock_ctx;
+    ngx_rwlock_unlock( ( ngx_atomic_t * )lock_ctx );
+}
+
+/*
+ * Resolve the shared lookup zone named by the string argument at idx.
+ * Raises a Lua error if the zone is unknown, not of the expected type
+ * or not initialized yet.
+ */
+static ngx_http_lklb_ctx_t *
+ngx_http_lklb_lua_get_ctx( lua_State *L, int idx, ngx_http_lklb_type_e type ) {
+    ngx_http_lklb_main_conf_t   *lklbmcf;
+    ngx_http_lklb_shared_t      *shared_libs;
+    ngx_uint_t                   lidx;
+    ngx_str_t                    name;
+
+    name.data = ( u_char * )luaL_checklstring( L, idx, &name.len );
+
+    lklbmcf = ngx_http_cycle_get_module_main_conf( ngx_cycle, ngx_http_lookuplibs_module );
+    if( ( NULL == lklbmcf ) || ( NULL == lklbmcf->shared_libs ) ) {
+        luaL_error( L, "no shared lookup zones configured" );
+        return NULL;
+    }
+
+    shared_libs = lklbmcf->shared_libs->elts;
 
-    ngx_rwlock_wlock( &radix_ctx->rwlock );
+    for( lidx = 0; lidx < lklbmcf->shared_libs->nelts; lidx++ ) {
+        if( ( name.len != shared_libs[ lidx ].zone->shm.name.len ) ||
+            ( ngx_strncmp( name.data, shared_libs[ lidx ].zone->shm.name.data, name.len ) ) ) {
+            continue;
+        }
+
+        if( ( NULL == shared_libs[ lidx ].ctx->shpool ) ||
+            ( type != ngx_http_lklb_ctx_type( shared_libs[ lidx ].ctx ) ) ) {
+            luaL_error( L, "shared lookup zone \"%s\" is not usable for this operation", name.data );
+            return NULL;
+        }
+
+        return shared_libs[ lidx ].ctx;
+    }
+
+    luaL_error( L, "unknown shared lookup zone \"%s\"", name.data );
+    return NULL;
+}
+
+/*
+ * Values are passed as strings. true stores an entry without a value,
+ * finds report such entries as true. An optional ttl in seconds follows
+ * the value, the entry is gone for finds once it elapsed.
+ * Zones evicting entries keep free pages in reserve so that released
+ * values can wait for every worker to move past them.
+ */
+static ngx_int_t
+ngx_http_lklb_lua_get_value( lua_State *L, int idx, ngx_http_lklb_ctx_t *ctx,
+                             ngx_http_lklb_value_t **value ) {
+    ngx_http_lklb_radix_ctx_t   *radix_ctx = ngx_http_lklb_ctx_radix( ctx );
+    ngx_str_t                    data;
+    ngx_msec_t                   ttl = 0;
+    lua_Number                   seconds;
+
+    if( !lua_isnoneornil( L, idx + 1 ) ) {
+        seconds = luaL_checknumber( L, idx + 1 );
+        if( seconds <= 0 ) {
+            luaL_argerror( L, idx + 1, "ttl must be positive" );
+        }
+
+        ttl = ( seconds < 0.001 ) ? 1 : ( ngx_msec_t )( seconds * 1000 );
+    }
+
+    if( LUA_TBOOLEAN == lua_type( L, idx ) ) {
+        if( !lua_toboolean( L, idx ) ) {
+            luaL_argerror( L, idx, "value must be a string or true" );
+        }
+
+        ngx_str_null( &data );
+
+        /* Evicting and counting zones track entries on values, keep one for every entry */
+        if( ( 0 == ttl ) && ( NGX_HTTP_LKLB_EVICT_NONE == ctx->evict ) && ( 0 == ctx->stats ) ) {
+            *value = NULL;
+            return NGX_OK;
+        }
+    } else {
+        data.data = ( u_char * )luaL_checklstring( L, idx, &data.len );
+    }
+
+    if( ( NGX_HTTP_LKLB_EVICT_NONE != ctx->evict ) &&
+        ( ctx->shpool->pfree < NGX_HTTP_LKLB_EVICT_RESERVE ) ) {
+        ngx_http_lklb_shards_evict( radix_ctx, NGX_HTTP_LKLB_EVICT_BATCH );
+    }
+
+    *value = ngx_http_lklb_value_create( &radix_ctx->values, data.data, data.len, ttl );
+    if( NULL == *value ) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
 }
 
 static void
-ngx_http_lklb_tree_unlock( void *lock_ctx )
-{
-    ngx_http_lklb_radix_ctx_t   *radix_ctx = lock_ctx;
+ngx_http_lklb_lua_push_value( lua_State *L, void *ptr ) {
+    ngx_http_lklb_value_t   *value = ptr;
+
+    if( !ngx_http_lklb_value_has_data( value ) ) {
+        lua_pushboolean( L, 1 );
+        return;
+    }
 
-    ngx_rwlock_unlock( &radix_ctx->rwlock );
+    lua_pushlstring( L, ( const char * )value->data, value->len );
 }
 
 static int
-ngx_http_lklb_radix_uint32_insert_lua( lua_State *L ) {
+ngx_http_lklb_lua_insert_result( lua_State *L, ngx_http_lklb_radix_ctx_t *radix_ctx,
+                                 ngx_http_lklb_value_t *value, ngx_http_lklb_retval_e rc ) {
+    if( NGX_HTTP_LKLB_MATCH == rc ) {
+        lua_pushboolean( L, 1 );
+        return 1;
+    }
+
+    /* The tree did not take a reference, release the value */
+    ngx_http_lklb_value_unref( &radix_ctx->values, value );
+
+    if( NGX_HTTP_LKLB_DUP == rc ) {
+        lua_pushboolean( L, 0 );
+        lua_pushliteral( L, "exists" );
+        return 2;
+    }
+
+    lua_pushnil( L );
+
+    /* Zones made writable again refuse writes for a moment, see ngx_http_lklb_radix_set_readonly */
+    if( radix_ctx->readonly ) {
+        lua_pushliteral( L, "read only" );
+    } else if( ngx_http_lklb_shards_settling( radix_ctx ) ) {
+        lua_pushliteral( L, "busy" );
+    } else {
+        lua_pushliteral( L, "no memory" );
+    }
+
+    return 2;
+}
+
+static int
+ngx_http_lklb_lua_delete_result( lua_State *L, ngx_http_lklb_radix_ctx_t *radix_ctx,
+                                 void *value, ngx_http_lklb_retval_e rc ) {
+    if( NGX_HTTP_LKLB_MATCH != rc ) {
+        lua_pushnil( L );
+        return 1;
+    }
+
+    ngx_http_lklb_lua_push_value( L, value );
+
+    /* Delete handed the tree reference over to us */
+    ngx_http_lklb_value_unref( &radix_ctx->values, value );
     return 1;
 }
 
+static int
+ngx_http_lklb_lua_find_result( lua_State *L, void *value, ngx_http_lklb_retval_e rc ) {
+    if( NGX_HTTP_LKLB_ERR == rc ) {
+        lua_pushnil( L );
+        return 1;
+    }
+
+    ngx_http_lklb_lua_push_value( L, value );
+    lua_pushboolean( L, NGX_HTTP_LKLB_PARTIAL_MATCH == rc );
+    return 2;
+}
+
+/* Keys and masks are numbers in 0..0xffffffff, the cast is undefined outside of it */
+static uint32_t
+ngx_http_lklb_lua_check_uint32( lua_State *L, int idx ) {
+    lua_Number  number = luaL_checknumber( L, idx );
+
+    /* NaN fails both comparisons */
+    if( !( ( number >= 0 ) && ( number <= ( lua_Number )0xffffffff ) ) ) {
+        luaL_argerror( L, idx, "expected a number between 0 and 0xffffffff" );
+    }
+
+    return ( uint32_t )number;
+}
+
+/*
+ * IPv4 and IPv6 keys share their top bits, a zone that is not dual-stack
+ * takes the prefixes of one family only: that of the first prefix
+ * stored, uint32 keys count as IPv4 and uint128 ones as IPv6. Returns 0
+ * for prefixes of the other family.
+ */
+static ngx_uint_t
+ngx_http_lklb_lua_cidr_family( ngx_http_lklb_radix_ctx_t *radix_ctx, ngx_uint_t nwords ) {
+    ngx_atomic_uint_t   family = ( 1 == nwords ) ? AF_INET : AF_INET6;
+
+    return( ( radix_ctx->dualstack ) || ( 0 == radix_ctx->family ) || ( family == radix_ctx->family ) );
+}
+
+/*
+ * Latches the family once an insert stored a prefix, failed inserts leave
+ * it open. The first inserts of both families may race, the one latching
+ * second fails: its prefix or range is deleted again and 0 returned.
+ */
+static ngx_uint_t
+ngx_http_lklb_lua_family_latch(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_uint_t                  nwords,
+    uint32_t                   *key,
+    uint32_t                   *arg,
+    ngx_uint_t                  range
+) {
+    ngx_atomic_uint_t   family = ( 1 == nwords ) ? AF_INET : AF_INET6;
+    ngx_uint_t          count;
+    void               *value;
+
+    if( radix_ctx->dualstack ) {
+        return 1;
+    }
+
+    ngx_atomic_cmp_set( &radix_ctx->family, 0, family );
+
+    if( family == radix_ctx->family ) {
+        return 1;
+    }
+
+    if( range ) {
+        ngx_http_lklb_shards_delete_range( radix_ctx, key, arg, nwords, &count );
+        return 0;
+    }
+
+    if( NGX_HTTP_LKLB_MATCH == ( ( 1 == nwords )
+                                 ? ngx_http_lklb_shards_uint32_delete_with_mask( radix_ctx, key[ 0 ], arg[ 0 ], &value )
+                                 : ngx_http_lklb_shards_uint128_delete_with_mask( radix_ctx, key, arg, &value ) ) ) {
+        ngx_http_lklb_value_unref( &radix_ctx->values, value );
+    }
+
+    return 0;
+}
+
+static int
+ngx_http_lklb_radix_uint32_insert_common( lua_State *L, ngx_uint_t with_mask ) {
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_http_lklb_radix_ctx_t   *radix_ctx;
+    ngx_http_lklb_value_t       *value;
+    ngx_http_lklb_retval_e       rc;
+    uint32_t                     key, mask;
+
+    ctx       = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+    radix_ctx = ngx_http_lklb_ctx_radix( ctx );
+
+    key  = ngx_http_lklb_lua_check_uint32( L, 2 );
+    mask = ( with_mask ) ? ngx_http_lklb_lua_check_uint32( L, 3 ) : ( uint32_t )( -1 );
+
+    if( !ngx_http_lklb_lua_cidr_family( radix_ctx, 1 ) ) {
+        return luaL_argerror( L, 2, "address family differs from the zone's" );
+    }
+
+    if( NGX_OK != ngx_http_lklb_lua_get_value( L, 3 + with_mask, ctx, &value ) ) {
+        lua_pushnil( L );
+        lua_pushliteral( L, "no memory" );
+        return 2;
+    }
+
+    rc = ngx_http_lklb_shards_uint32_insert_with_mask( radix_ctx, key, mask, value );
+
+    if( ( NGX_HTTP_LKLB_MATCH == rc ) && ( !ngx_http_lklb_lua_family_latch( radix_ctx, 1, &key, &mask, 0 ) ) ) {
+        return luaL_argerror( L, 2, "address family differs from the zone's" );
+    }
+
+    return ngx_http_lklb_lua_insert_result( L, radix_ctx, value, rc );
+}
+
+static int
+ngx_http_lklb_radix_uint32_insert_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_uint32_insert_common( L, 0 );
+}
+
 static int
 ngx_http_lklb_radix_uint32_mask_insert_lua( lua_State *L ) {
-    return 1;
+    return ngx_http_lklb_radix_uint32_insert_common( L, 1 );
+}
+
+static int
+ngx_http_lklb_radix_uint32_delete_common( lua_State *L, ngx_uint_t with_mask ) {
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_http_lklb_radix_ctx_t   *radix_ctx;
+    ngx_http_lklb_retval_e       rc;
+    uint32_t                     key, mask;
+    void                        *value;
+
+    ctx       = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+    radix_ctx = ngx_http_lklb_ctx_radix( ctx );
+
+    key  = ngx_http_lklb_lua_check_uint32( L, 2 );
+    mask = ( with_mask ) ? ngx_http_lklb_lua_check_uint32( L, 3 ) : ( uint32_t )( -1 );
+
+    rc = ngx_http_lklb_shards_uint32_delete_with_mask( radix_ctx, key, mask, &value );
+
+    return ngx_http_lklb_lua_delete_result( L, radix_ctx, value, rc );
 }
 
 static int
 ngx_http_lklb_radix_uint32_delete_lua( lua_State *L ) {
-    return 1;
+    return ngx_http_lklb_radix_uint32_delete_common( L, 0 );
 }
 
 static int
 ngx_http_lklb_radix_uint32_mask_delete_lua( lua_State *L ) {
-    return 1;
+    return ngx_http_lklb_radix_uint32_delete_common( L, 1 );
+}
+
+static int
+ngx_http_lklb_radix_uint32_find_common( lua_State *L, ngx_uint_t with_mask ) {
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_http_lklb_retval_e       rc;
+    uint32_t                     key, mask;
+    uint8_t                      prefix;
+    void                        *value;
+
+    ctx = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+
+    key    = ngx_http_lklb_lua_check_uint32( L, 2 );
+    mask   = ( with_mask ) ? ngx_http_lklb_lua_check_uint32( L, 3 ) : ( uint32_t )( -1 );
+    prefix = lua_toboolean( L, 3 + with_mask );
+
+    rc = ngx_http_lklb_shards_uint32_find_with_mask( ngx_http_lklb_ctx_radix( ctx ),
+                                                     key, mask, &value, prefix );
+
+    return ngx_http_lklb_lua_find_result( L, value, rc );
 }
 
 static int
 ngx_http_lklb_radix_uint32_find_lua( lua_State *L ) {
-    return 1;
+    return ngx_http_lklb_radix_uint32_find_common( L, 0 );
 }
 
 static int
 ngx_http_lklb_radix_uint32_mask_find_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_uint32_find_common( L, 1 );
+}
+
+/*
+ * find_all_ipv4( zone, key [, mask] )
+ * Every entry covering key, shortest prefix first, as an array of
+ * { bits = , value = } tables. nil if there are none.
+ */
+static int
+ngx_http_lklb_radix_uint32_find_all_lua( lua_State *L ) {
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_http_lklb_radix_match_t  matches[ 33 ];
+    ngx_uint_t                   count, idx;
+    uint32_t                     key, mask;
+
+    ctx = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+
+    key  = ngx_http_lklb_lua_check_uint32( L, 2 );
+    mask = lua_isnoneornil( L, 3 ) ? ( uint32_t )( -1 ) : ngx_http_lklb_lua_check_uint32( L, 3 );
+
+    if( NGX_HTTP_LKLB_ERR == ngx_http_lklb_shards_uint32_find_all( ngx_http_lklb_ctx_radix( ctx ), key, mask,
+                                                                   &matches[ 0 ], 33, &count ) ) {
+        lua_pushnil( L );
+        return 1;
+    }
+
+    lua_createtable( L, count, 0 );
+
+    for( idx = 0; idx < count; idx++ ) {
+        lua_createtable( L, 0, 2 );
+
+        lua_pushinteger( L, ( lua_Integer )matches[ idx ].bits );
+        lua_setfield( L, -2, "bits" );
+
+        ngx_http_lklb_lua_push_value( L, matches[ idx ].value );
+        lua_setfield( L, -2, "value" );
+
+        lua_rawseti( L, -2, idx + 1 );
+    }
+
     return 1;
 }
 
-int
-ngx_http_lklb_create_lua_module( lua_State *L ) {
-    lua_createtable( L, 0, 1 );
+/*
+ * Zone IPv6 addresses go to: zone6 at idx if given, else zone itself if it
+ * is dual-stack. NULL otherwise, the keys of both families share their top
+ * bits and would match each other in a single family tree.
+ */
+static ngx_http_lklb_radix_ctx_t *
+ngx_http_lklb_lua_get_radix6( lua_State *L, int idx, ngx_http_lklb_radix_ctx_t *radix_ctx4 ) {
+    if( !lua_isnoneornil( L, idx ) ) {
+        return ngx_http_lklb_ctx_radix( ngx_http_lklb_lua_get_ctx( L, idx, NGX_HTTP_LKLB_TYPE_RADIX ) );
+    }
 
-    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_insert_lua );
-    lua_setfield( L, -2, "insert_ipv4" );
+    return( ( radix_ctx4->dualstack ) ? radix_ctx4 : NULL );
+}
 
-    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_mask_insert_lua );
-    lua_setfield( L, -2, "insert_ipv4_with_mask" );
+/*
+ * find_client_addr( zone, prefix [, zone6] )
+ * Looks up the client address of the current request (after realip) without
+ * formatting it. IPv4 goes to zone, IPv6 to zone6. Without zone6 IPv6 goes
+ * to zone if it is dual-stack and finds nothing otherwise.
+ */
+static int
+ngx_http_lklb_radix_client_addr_find_lua( lua_State *L ) {
+    ngx_http_request_t          *r;
+    ngx_http_lklb_radix_ctx_t   *radix_ctx4, *radix_ctx6;
+    ngx_http_lklb_retval_e       rc;
+    uint8_t                      prefix;
+    void                        *value;
 
-    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_delete_lua );
-    lua_setfield( L, -2, "delete_ipv4" );
+    r = ngx_http_lua_get_request( L );
+    if( NULL == r ) {
+        return luaL_error( L, "no request found" );
+    }
 
-    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_mask_delete_lua );
-    lua_setfield( L, -2, "delete_ipv4_with_mask" );
+    radix_ctx4 = ngx_http_lklb_ctx_radix( ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX ) );
+    prefix     = lua_toboolean( L, 2 );
+    radix_ctx6 = ngx_http_lklb_lua_get_radix6( L, 3, radix_ctx4 );
 
-    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_find_lua );
-    lua_setfield( L, -2, "find_ipv4" );
+    rc = ngx_http_lklb_shards_sockaddr_find( radix_ctx4, radix_ctx6, r->connection->sockaddr, &value, prefix );
 
-    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_mask_find_lua );
-    lua_setfield( L, -2, "find_ipv4_with_mask" );
+    return ngx_http_lklb_lua_find_result( L, value, rc );
+}
+
+/* Binary form of an IPv4 or IPv6 address in text, 4 or 16 bytes in network byte order */
+static ngx_int_t
+ngx_http_lklb_lua_parse_addr( ngx_str_t *text, u_char *addr, size_t *len ) {
+    in_addr_t   inaddr;
+
+    inaddr = ngx_inet_addr( text->data, text->len );
+    if( INADDR_NONE != inaddr ) {
+        ngx_memcpy( addr, &inaddr, 4 );
+        *len = 4;
+        return NGX_OK;
+    }
+
+#if (NGX_HAVE_INET6)
+    if( NGX_OK == ngx_inet6_addr( text->data, text->len, addr ) ) {
+        *len = 16;
+        return NGX_OK;
+    }
+#endif
+
+    return NGX_ERROR;
+}
+
+/*
+ * find_addr( zone, addr, prefix [, zone6] )
+ * Looks up an address given as text, e.g. "192.0.2.1" or "2001:db8::1",
+ * parsed without allocating. Zones as for find_client_addr, IPv4-mapped
+ * addresses go to zone.
+ */
+static int
+ngx_http_lklb_radix_text_addr_find_lua( lua_State *L ) {
+    ngx_http_lklb_radix_ctx_t   *radix_ctx4, *radix_ctx6;
+    ngx_http_lklb_retval_e       rc;
+    ngx_str_t                    text;
+    u_char                       addr[ 16 ];
+    size_t                       len;
+    uint8_t                      prefix;
+    void                        *value;
+
+    radix_ctx4 = ngx_http_lklb_ctx_radix( ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX ) );
+    text.data  = ( u_char * )luaL_checklstring( L, 2, &text.len );
+    prefix     = lua_toboolean( L, 3 );
+    radix_ctx6 = ngx_http_lklb_lua_get_radix6( L, 4, radix_ctx4 );
+
+    if( NGX_OK != ngx_http_lklb_lua_parse_addr( &text, &addr[ 0 ], &len ) ) {
+        return luaL_argerror( L, 2, "invalid address" );
+    }
+
+    rc = ngx_http_lklb_shards_addr_find( radix_ctx4, radix_ctx6, &addr[ 0 ], len, &value, prefix );
+
+    return ngx_http_lklb_lua_find_result( L, value, rc );
+}
+
+/*
+ * IPv6 keys are passed as 16 byte binary strings in network byte order,
+ * e.g. $binary_remote_addr. The words are handed to the tree so that they
+ * end up in host byte order after the configured transforms.
+ */
+static void
+ngx_http_lklb_lua_check_uint128( lua_State *L, int idx, ngx_http_lklb_ctx_t *ctx, uint32_t *key ) {
+    ngx_str_t   data;
+    ngx_uint_t  widx;
+
+    data.data = ( u_char * )luaL_checklstring( L, idx, &data.len );
+    if( 16 != data.len ) {
+        luaL_argerror( L, idx, "expected 16 byte binary address" );
+        return;
+    }
+
+    ngx_memcpy( key, data.data, 16 );
+
+    if( !( NGX_HTTP_LKLB_TRANSFORM_HTONL & ctx->transforms ) ) {
+        for( widx = 0; widx < 4; widx++ ) {
+            key[ widx ] = ntohl( key[ widx ] );
+        }
+    }
+}
+
+/*
+ * Prefixes given as text, "<address>[/<bits>]", are parsed on the stack
+ * into key and mask words in the order the tree APIs take them. Returns
+ * the number of words, 1 for IPv4 and 4 for IPv6. Prefixes with host
+ * bits set, e.g. "10.0.0.1/8", are rejected rather than truncated.
+ */
+static ngx_uint_t
+ngx_http_lklb_lua_check_cidr(
+    lua_State              *L,
+    int                     idx,
+    ngx_http_lklb_ctx_t    *ctx,
+    uint32_t               *key,
+    uint32_t               *mask
+) {
+    ngx_str_t   text;
+    ngx_cidr_t  cidr;
+    ngx_uint_t  nwords, widx;
+
+    text.data = ( u_char * )luaL_checklstring( L, idx, &text.len );
+
+    switch( ngx_ptocidr( &text, &cidr ) ) {
+        case NGX_OK:
+            break;
+
+        case NGX_DONE:
+            return luaL_argerror( L, idx, "host bits set" );
+
+        default:
+            return luaL_argerror( L, idx, "invalid prefix" );
+    }
+
+    switch( cidr.family ) {
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            nwords = 4;
+            ngx_memcpy( key, cidr.u.in6.addr.s6_addr, 16 );
+            ngx_memcpy( mask, cidr.u.in6.mask.s6_addr, 16 );
+            break;
+#endif
+
+        case AF_INET:
+            nwords    = 1;
+            key[ 0 ]  = cidr.u.in.addr;
+            mask[ 0 ] = cidr.u.in.mask;
+            break;
+
+        default:
+            return luaL_argerror( L, idx, "invalid prefix" );
+    }
+
+    if( !( NGX_HTTP_LKLB_TRANSFORM_HTONL & ctx->transforms ) ) {
+        for( widx = 0; widx < nwords; widx++ ) {
+            key[ widx ]  = ntohl( key[ widx ] );
+            mask[ widx ] = ntohl( mask[ widx ] );
+        }
+    }
+
+    return nwords;
+}
+
+/*
+ * insert_cidr( zone, cidr, value [, ttl] )
+ * Inserts a prefix given as text, e.g. "10.0.0.0/8" or "2001:db8::/32",
+ * returns as insert_ipv4. Prefixes with host bits set are rejected, so
+ * are IPv6 prefixes in a zone IPv4 ones went to and the other way round,
+ * unless the zone is dual-stack.
+ */
+static int
+ngx_http_lklb_radix_cidr_insert_lua( lua_State *L ) {
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_http_lklb_radix_ctx_t   *radix_ctx;
+    ngx_http_lklb_value_t       *value;
+    ngx_http_lklb_retval_e       rc;
+    uint32_t                     key[ 4 ], mask[ 4 ];
+    ngx_uint_t                   nwords;
+
+    ctx       = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+    radix_ctx = ngx_http_lklb_ctx_radix( ctx );
+
+    nwords = ngx_http_lklb_lua_check_cidr( L, 2, ctx, &key[ 0 ], &mask[ 0 ] );
+
+    if( !ngx_http_lklb_lua_cidr_family( radix_ctx, nwords ) ) {
+        return luaL_argerror( L, 2, "address family differs from the zone's" );
+    }
+
+    if( NGX_OK != ngx_http_lklb_lua_get_value( L, 3, ctx, &value ) ) {
+        lua_pushnil( L );
+        lua_pushliteral( L, "no memory" );
+        return 2;
+    }
+
+    rc = ( 1 == nwords )
+         ? ngx_http_lklb_shards_uint32_insert_with_mask( radix_ctx, key[ 0 ], mask[ 0 ], value )
+         : ngx_http_lklb_shards_uint128_insert_with_mask( radix_ctx, &key[ 0 ], &mask[ 0 ], value );
+
+    if( ( NGX_HTTP_LKLB_MATCH == rc ) &&
+        ( !ngx_http_lklb_lua_family_latch( radix_ctx, nwords, &key[ 0 ], &mask[ 0 ], 0 ) ) ) {
+        return luaL_argerror( L, 2, "address family differs from the zone's" );
+    }
+
+    return ngx_http_lklb_lua_insert_result( L, radix_ctx, value, rc );
+}
+
+/* delete_cidr( zone, cidr ), prefixes of the other family are not looked for */
+static int
+ngx_http_lklb_radix_cidr_delete_lua( lua_State *L ) {
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_http_lklb_radix_ctx_t   *radix_ctx;
+    ngx_http_lklb_retval_e       rc;
+    uint32_t                     key[ 4 ], mask[ 4 ];
+    ngx_uint_t                   nwords;
+    void                        *value;
+
+    ctx       = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+    radix_ctx = ngx_http_lklb_ctx_radix( ctx );
+
+    nwords = ngx_http_lklb_lua_check_cidr( L, 2, ctx, &key[ 0 ], &mask[ 0 ] );
+
+    if( !ngx_http_lklb_lua_cidr_family( radix_ctx, nwords ) ) {
+        lua_pushnil( L );
+        return 1;
+    }
+
+    rc = ( 1 == nwords )
+         ? ngx_http_lklb_shards_uint32_delete_with_mask( radix_ctx, key[ 0 ], mask[ 0 ], &value )
+         : ngx_http_lklb_shards_uint128_delete_with_mask( radix_ctx, &key[ 0 ], &mask[ 0 ], &value );
+
+    return ngx_http_lklb_lua_delete_result( L, radix_ctx, value, rc );
+}
+
+/* find_cidr( zone, cidr, prefix ), prefixes of the other family find nothing */
+static int
+ngx_http_lklb_radix_cidr_find_lua( lua_State *L ) {
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_http_lklb_radix_ctx_t   *radix_ctx;
+    ngx_http_lklb_retval_e       rc;
+    uint32_t                     key[ 4 ], mask[ 4 ];
+    ngx_uint_t                   nwords;
+    uint8_t                      prefix;
+    void                        *value;
+
+    ctx       = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+    radix_ctx = ngx_http_lklb_ctx_radix( ctx );
+
+    nwords = ngx_http_lklb_lua_check_cidr( L, 2, ctx, &key[ 0 ], &mask[ 0 ] );
+    prefix = lua_toboolean( L, 3 );
+
+    if( !ngx_http_lklb_lua_cidr_family( radix_ctx, nwords ) ) {
+        lua_pushnil( L );
+        return 1;
+    }
+
+    rc = ( 1 == nwords )
+         ? ngx_http_lklb_shards_uint32_find_with_mask( radix_ctx, key[ 0 ], mask[ 0 ], &value, prefix )
+         : ngx_http_lklb_shards_uint128_find_with_mask( radix_ctx, &key[ 0 ], &mask[ 0 ], &value, prefix );
+
+    return ngx_http_lklb_lua_find_result( L, value, rc );
+}
+
+static int
+ngx_http_lklb_radix_range_insert_common( lua_State *L, ngx_uint_t uint128 ) {
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_http_lklb_radix_ctx_t   *radix_ctx;
+    ngx_http_lklb_value_t       *value;
+    ngx_http_lklb_retval_e       rc;
+    ngx_uint_t                   count;
+    uint32_t                     start[ 4 ], end[ 4 ];
+
+    ctx       = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+    radix_ctx = ngx_http_lklb_ctx_radix( ctx );
+
+    if( uint128 ) {
+        ngx_http_lklb_lua_check_uint128( L, 2, ctx, &start[ 0 ] );
+        ngx_http_lklb_lua_check_uint128( L, 3, ctx, &end[ 0 ] );
+    } else {
+        start[ 0 ] = ngx_http_lklb_lua_check_uint32( L, 2 );
+        end[ 0 ]   = ngx_http_lklb_lua_check_uint32( L, 3 );
+    }
+
+    if( !ngx_http_lklb_lua_cidr_family( radix_ctx, ( uint128 ) ? 4 : 1 ) ) {
+        return luaL_argerror( L, 2, "address family differs from the zone's" );
+    }
+
+    if( NGX_OK != ngx_http_lklb_lua_get_value( L, 4, ctx, &value ) ) {
+        lua_pushnil( L );
+        lua_pushliteral( L, "no memory" );
+        return 2;
+    }
+
+    rc = ngx_http_lklb_shards_insert_range( radix_ctx, &start[ 0 ], &end[ 0 ], ( uint128 ) ? 4 : 1,
+                                            value, &count );
+
+    if( NGX_HTTP_LKLB_MATCH != rc ) {
+        return ngx_http_lklb_lua_insert_result( L, radix_ctx, value, rc );
+    }
+
+    if( !ngx_http_lklb_lua_family_latch( radix_ctx, ( uint128 ) ? 4 : 1, &start[ 0 ], &end[ 0 ], 1 ) ) {
+        return luaL_argerror( L, 2, "address family differs from the zone's" );
+    }
+
+    lua_pushinteger( L, ( lua_Integer )count );
+    return 1;
+}
+
+static int
+ngx_http_lklb_radix_range_delete_common( lua_State *L, ngx_uint_t uint128 ) {
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_http_lklb_radix_ctx_t   *radix_ctx;
+    ngx_uint_t                   count = 0;
+    uint32_t                     start[ 4 ], end[ 4 ];
+
+    ctx       = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+    radix_ctx = ngx_http_lklb_ctx_radix( ctx );
+
+    if( uint128 ) {
+        ngx_http_lklb_lua_check_uint128( L, 2, ctx, &start[ 0 ] );
+        ngx_http_lklb_lua_check_uint128( L, 3, ctx, &end[ 0 ] );
+    } else {
+        start[ 0 ] = ngx_http_lklb_lua_check_uint32( L, 2 );
+        end[ 0 ]   = ngx_http_lklb_lua_check_uint32( L, 3 );
+    }
+
+    ngx_http_lklb_shards_delete_range( radix_ctx, &start[ 0 ], &end[ 0 ], ( uint128 ) ? 4 : 1, &count );
+
+    lua_pushinteger( L, ( lua_Integer )count );
+    return 1;
+}
+
+static int
+ngx_http_lklb_radix_uint32_range_insert_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_range_insert_common( L, 0 );
+}
+
+static int
+ngx_http_lklb_radix_uint32_range_delete_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_range_delete_common( L, 0 );
+}
+
+static int
+ngx_http_lklb_radix_uint128_range_insert_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_range_insert_common( L, 1 );
+}
+
+static int
+ngx_http_lklb_radix_uint128_range_delete_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_range_delete_common( L, 1 );
+}
+
+/*
+ * Sets key, bits and value of the table on top of the stack from a
+ * cursor entry. keybits is 32 or 128 for numeric keys, given as the
+ * insert APIs take them, 0 for string keys.
+ */
+static void
+ngx_http_lklb_lua_push_entry( lua_State *L, ngx_http_lklb_ctx_t *ctx, ngx_http_lklb_radix_entry_t *entry,
+                              ngx_uint_t keybits ) {
+    ngx_http_lklb_value_t   *value = entry->value;
+    uint32_t                 word;
+    size_t                   len;
+
+    len = ( entry->bits + 7 ) / 8;
+
+    if( 0 == keybits ) {
+        /* Undo the reverse transform, tolower can not be */
+        if( NGX_HTTP_LKLB_TRANSFORM_REVERSE & ctx->transforms ) {
+            ngx_http_lklb_str_transform( NGX_HTTP_LKLB_TRANSFORM_REVERSE, &entry->key[ 0 ], len );
+        }
+
+        lua_pushlstring( L, ( const char * )&entry->key[ 0 ], len );
+    } else {
+        /* Bytes past the key are left over from earlier keys */
+        ngx_memzero( &entry->key[ len ], keybits / 8 - len );
+
+        if( 128 == keybits ) {
+            /* Host order words in big endian, i.e. the address in network byte order */
+            lua_pushlstring( L, ( const char * )&entry->key[ 0 ], 16 );
+        } else {
+            word = ( ( uint32_t )entry->key[ 0 ] << 24 ) | ( ( uint32_t )entry->key[ 1 ] << 16 ) |
+                   ( ( uint32_t )entry->key[ 2 ] << 8 ) | entry->key[ 3 ];
+            lua_pushnumber( L, ( lua_Number )ngx_http_lklb_uint32_htonl( ctx->transforms, word ) );
+        }
+    }
+
+    lua_setfield( L, -2, "key" );
+
+    lua_pushinteger( L, ( lua_Integer )entry->bits );
+    lua_setfield( L, -2, "bits" );
+
+    ngx_http_lklb_lua_push_value( L, value );
+    lua_setfield( L, -2, "value" );
+}
+
+/*
+ * entries, cursor = dump_ipv4( zone, cursor, limit [, key, mask] )
+ * entries, cursor = dump_ipv6( zone, cursor, limit [, addr, bits] )
+ * Lists up to limit entries in key order as { key =, bits =, value = }
+ * tables, key as passed to the insert APIs. cursor is nil for the first
+ * call and the string returned by the previous one after that, nil is
+ * returned once the walk is complete. The optional prefix restricts the
+ * walk to the entries under it, it is only read by the first call.
+ * dump_ipv4 walks ::ffff:0:0/96 of dual-stack zones.
+ */
+#define NGX_HTTP_LKLB_LUA_DUMP_MAX  256
+
+static int
+ngx_http_lklb_radix_dump_common( lua_State *L, ngx_uint_t uint128 ) {
+    ngx_http_lklb_ctx_t             *ctx;
+    ngx_http_lklb_radix_ctx_t       *radix_ctx;
+    ngx_http_lklb_shards_cursor_t    cursor;
+    ngx_http_lklb_radix_entry_t     *entries;
+    ngx_http_lklb_retval_e           rc;
+    ngx_uint_t                       limit, count, idx, lidx, bits, keybits, mapped;
+    uint32_t                         words[ 4 ], mask;
+    uint8_t                          prefix[ 16 ];
+    ngx_str_t                        data;
+
+    ctx       = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+    radix_ctx = ngx_http_lklb_ctx_radix( ctx );
+    limit     = ( ngx_uint_t )luaL_checkinteger( L, 3 );
+    keybits   = ( uint128 ) ? 128 : 32;
+    mapped    = ( ( !uint128 ) && ( radix_ctx->dualstack ) ) ? 96 : 0;
+
+    if( ( 0 == limit ) || ( limit > NGX_HTTP_LKLB_LUA_DUMP_MAX ) ) {
+        limit = NGX_HTTP_LKLB_LUA_DUMP_MAX;
+    }
+
+    if( !lua_isnoneornil( L, 2 ) ) {
+        data.data = ( u_char * )luaL_checklstring( L, 2, &data.len );
+
+        if( sizeof( cursor ) != data.len ) {
+            return luaL_argerror( L, 2, "invalid cursor" );
+        }
+
+        ngx_memcpy( &cursor, data.data, sizeof( cursor ) );
+
+        if( ( cursor.str ) || ( cursor.last >= radix_ctx->nshards ) ||
+            ( cursor.cursor.base > cursor.cursor.depth ) || ( cursor.cursor.depth > mapped + keybits ) ) {
+            return luaL_argerror( L, 2, "invalid cursor" );
+        }
+    } else {
+        bits = 0;
+        ngx_memzero( &words[ 0 ], sizeof( words ) );
+
+        /* Stored form of the prefix, big endian host order words */
+        if( uint128 ) {
+            if( !lua_isnoneornil( L, 4 ) ) {
+                ngx_http_lklb_lua_check_uint128( L, 4, ctx, &words[ 0 ] );
+                ngx_http_lklb_uint128_htonl( ctx->transforms, &words[ 0 ] );
+                bits = ( ngx_uint_t )luaL_checkinteger( L, 5 );
+
+                if( bits > 128 ) {
+                    return luaL_argerror( L, 5, "prefix length out of range" );
+                }
+            }
+        } else if( !lua_isnoneornil( L, 4 ) ) {
+            mask       = ngx_http_lklb_uint32_htonl( ctx->transforms, ngx_http_lklb_lua_check_uint32( L, 5 ) );
+            words[ 0 ] = ngx_http_lklb_uint32_htonl( ctx->transforms, ngx_http_lklb_lua_check_uint32( L, 4 ) );
+
+            /* Like the tree, only the leading ones of the mask count */
+            while( ( bits < 32 ) && ( mask & ( ( uint32_t )1 << ( 31 - bits ) ) ) ) {
+                bits++;
+            }
+        }
+
+        if( mapped ) {
+            words[ 3 ] = words[ 0 ];
+            words[ 2 ] = ( uint32_t )0xffff;
+            words[ 0 ] = 0;
+            bits      += mapped;
+        }
+
+        for( idx = 0; idx < 16; idx++ ) {
+            prefix[ idx ] = ( uint8_t )( words[ idx / 4 ] >> ( 24 - 8 * ( idx % 4 ) ) );
+        }
+
+        ngx_http_lklb_shards_cursor_init( radix_ctx, &cursor, &prefix[ 0 ], bits, 0 );
+    }
+
+    /* Userdata so that a Lua error does not leak the buffer */
+    entries = lua_newuserdata( L, limit * sizeof( ngx_http_lklb_radix_entry_t ) );
+
+    rc = ngx_http_lklb_shards_cursor_next( radix_ctx, &cursor, entries, limit, &count );
+    if( NGX_HTTP_LKLB_ERR == rc ) {
+        return luaL_error( L, "invalid cursor" );
+    }
+
+    lua_createtable( L, count, 0 );
+
+    for( idx = 0, lidx = 0; idx < count; idx++ ) {
+        if( mapped ) {
+            ngx_http_lklb_shards_unmap_entry( &entries[ idx ] );
+        }
+
+        if( entries[ idx ].bits > keybits ) {
+            continue;
+        }
+
+        lua_createtable( L, 0, 3 );
+
+        ngx_http_lklb_lua_push_entry( L, ctx, &entries[ idx ], keybits );
+
+        lua_rawseti( L, -2, ++lidx );
+    }
+
+    if( NGX_HTTP_LKLB_MATCH == rc ) {
+        lua_pushnil( L );
+    } else {
+        lua_pushlstring( L, ( const char * )&cursor, sizeof( cursor ) );
+    }
+
+    return 2;
+}
+
+static int
+ngx_http_lklb_radix_uint32_dump_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_dump_common( L, 0 );
+}
+
+static int
+ngx_http_lklb_radix_uint128_dump_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_dump_common( L, 1 );
+}
+
+/*
+ * top_hits( zone, limit [, key_type] )
+ * Up to limit entries of a zone with stats= enabled that were found, most
+ * hit first, as { key =, bits =, value =, hits = } tables. key_type is
+ * "ipv4" (default) or "ipv6" for keys as dump_ipv4 and dump_ipv6 return
+ * them, "string" for string keys. hits is an estimate scaled by the
+ * sampling rate. nil if no entry was hit. Walks the whole zone, callers
+ * reporting per request are better served by lookup_stats.
+ */
+static int
+ngx_http_lklb_radix_top_hits_lua( lua_State *L ) {
+    static const char *const         key_types[] = { "ipv4", "ipv6", "string", NULL };
+    static ngx_uint_t                key_bits[] = { 32, 128, 0 };
+    ngx_http_lklb_ctx_t             *ctx;
+    ngx_http_lklb_shards_hits_t     *top;
+    ngx_uint_t                       limit, count, idx, lidx, keybits;
+
+    ctx     = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+    limit   = ( ngx_uint_t )luaL_checkinteger( L, 2 );
+    keybits = key_bits[ luaL_checkoption( L, 3, "ipv4", key_types ) ];
+
+    if( ( 0 == limit ) || ( limit > NGX_HTTP_LKLB_LUA_DUMP_MAX ) ) {
+        limit = NGX_HTTP_LKLB_LUA_DUMP_MAX;
+    }
+
+    top = lua_newuserdata( L, limit * sizeof( ngx_http_lklb_shards_hits_t ) );
+
+    if( NGX_HTTP_LKLB_ERR == ngx_http_lklb_shards_top_hits( ngx_http_lklb_ctx_radix( ctx ), ( 0 == keybits ),
+                                                            top, limit, &count ) ) {
+        lua_pushnil( L );
+        return 1;
+    }
+
+    lua_createtable( L, count, 0 );
+
+    for( idx = 0, lidx = 0; idx < count; idx++ ) {
+        if( ( 32 == keybits ) && ( ngx_http_lklb_ctx_radix( ctx )->dualstack ) &&
+            ( !ngx_http_lklb_shards_unmap_entry( &top[ idx ].entry ) ) ) {
+            continue;
+        }
+
+        if( ( keybits ) && ( top[ idx ].entry.bits > keybits ) ) {
+            continue;
+        }
+
+        lua_createtable( L, 0, 4 );
+
+        ngx_http_lklb_lua_push_entry( L, ctx, &top[ idx ].entry, keybits );
+
+        lua_pushnumber( L, ( lua_Number )top[ idx ].hits );
+        lua_setfield( L, -2, "hits" );
+
+        lua_rawseti( L, -2, ++lidx );
+    }
+
+    return 1;
+}
+
+/*
+ * Queued updates, see the queue= zone option. They return the sequence
+ * number of the op once queued, the worker draining the zone applies it
+ * later. queue_status( zone ) returns the sequence number up to which ops
+ * have been applied and the number of inserts that failed for lack of
+ * memory.
+ */
+static ngx_http_lklb_radix_ctx_t *
+ngx_http_lklb_lua_get_queue( lua_State *L, ngx_http_lklb_ctx_t **ctx ) {
+    ngx_http_lklb_radix_ctx_t   *radix_ctx;
+
+    *ctx      = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+    radix_ctx = ngx_http_lklb_ctx_radix( *ctx );
+
+    if( NULL == radix_ctx->queue ) {
+        luaL_error( L, "shared lookup zone has no queue" );
+        return NULL;
+    }
+
+    return radix_ctx;
+}
+
+static int
+ngx_http_lklb_lua_queue_push( lua_State *L, ngx_http_lklb_radix_ctx_t *radix_ctx,
+                              ngx_http_lklb_queue_slot_t *op ) {
+    ngx_atomic_uint_t   seq;
+
+    seq = ngx_http_lklb_queue_push( radix_ctx->queue, op );
+    if( 0 == seq ) {
+        ngx_http_lklb_value_unref( &radix_ctx->values, op->value );
+
+        lua_pushnil( L );
+        lua_pushliteral( L, "queue full" );
+        return 2;
+    }
+
+    lua_pushnumber( L, ( lua_Number )seq );
+    return 1;
+}
+
+static int
+ngx_http_lklb_radix_uint32_queue_common( lua_State *L, ngx_http_lklb_queue_op_e qop, ngx_uint_t with_mask ) {
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_http_lklb_radix_ctx_t   *radix_ctx;
+    ngx_http_lklb_queue_slot_t   op;
+
+    radix_ctx = ngx_http_lklb_lua_get_queue( L, &ctx );
+
+    ngx_memzero( &op, sizeof( op ) );
+
+    op.op       = qop;
+    op.nwords   = 1;
+    op.key[ 0 ] = ngx_http_lklb_lua_check_uint32( L, 2 );
+    op.arg[ 0 ] = ( with_mask ) ? ngx_http_lklb_lua_check_uint32( L, 3 ) : ( uint32_t )( -1 );
+
+    if( ( NGX_HTTP_LKLB_QUEUE_INSERT == qop ) &&
+        ( NGX_OK != ngx_http_lklb_lua_get_value( L, 3 + with_mask, ctx, &op.value ) ) ) {
+        lua_pushnil( L );
+        lua_pushliteral( L, "no memory" );
+        return 2;
+    }
+
+    return ngx_http_lklb_lua_queue_push( L, radix_ctx, &op );
+}
+
+static int
+ngx_http_lklb_radix_uint32_queue_insert_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_uint32_queue_common( L, NGX_HTTP_LKLB_QUEUE_INSERT, 0 );
+}
+
+static int
+ngx_http_lklb_radix_uint32_mask_queue_insert_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_uint32_queue_common( L, NGX_HTTP_LKLB_QUEUE_INSERT, 1 );
+}
+
+static int
+ngx_http_lklb_radix_uint32_queue_delete_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_uint32_queue_common( L, NGX_HTTP_LKLB_QUEUE_DELETE, 0 );
+}
+
+static int
+ngx_http_lklb_radix_uint32_mask_queue_delete_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_uint32_queue_common( L, NGX_HTTP_LKLB_QUEUE_DELETE, 1 );
+}
+
+static int
+ngx_http_lklb_radix_range_queue_common( lua_State *L, ngx_http_lklb_queue_op_e qop, ngx_uint_t uint128 ) {
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_http_lklb_radix_ctx_t   *radix_ctx;
+    ngx_http_lklb_queue_slot_t   op;
+
+    radix_ctx = ngx_http_lklb_lua_get_queue( L, &ctx );
+
+    ngx_memzero( &op, sizeof( op ) );
+
+    op.op = qop;
+
+    if( uint128 ) {
+        op.nwords = 4;
+        ngx_http_lklb_lua_check_uint128( L, 2, ctx, &op.key[ 0 ] );
+        ngx_http_lklb_lua_check_uint128( L, 3, ctx, &op.arg[ 0 ] );
+    } else {
+        op.nwords   = 1;
+        op.key[ 0 ] = ngx_http_lklb_lua_check_uint32( L, 2 );
+        op.arg[ 0 ] = ngx_http_lklb_lua_check_uint32( L, 3 );
+    }
+
+    if( ( NGX_HTTP_LKLB_QUEUE_INSERT_RANGE == qop ) &&
+        ( NGX_OK != ngx_http_lklb_lua_get_value( L, 4, ctx, &op.value ) ) ) {
+        lua_pushnil( L );
+        lua_pushliteral( L, "no memory" );
+        return 2;
+    }
+
+    return ngx_http_lklb_lua_queue_push( L, radix_ctx, &op );
+}
+
+static int
+ngx_http_lklb_radix_uint32_range_queue_insert_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_range_queue_common( L, NGX_HTTP_LKLB_QUEUE_INSERT_RANGE, 0 );
+}
+
+static int
+ngx_http_lklb_radix_uint32_range_queue_delete_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_range_queue_common( L, NGX_HTTP_LKLB_QUEUE_DELETE_RANGE, 0 );
+}
+
+static int
+ngx_http_lklb_radix_uint128_range_queue_insert_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_range_queue_common( L, NGX_HTTP_LKLB_QUEUE_INSERT_RANGE, 1 );
+}
+
+static int
+ngx_http_lklb_radix_uint128_range_queue_delete_lua( lua_State *L ) {
+    return ngx_http_lklb_radix_range_queue_common( L, NGX_HTTP_LKLB_QUEUE_DELETE_RANGE, 1 );
+}
+
+static int
+ngx_http_lklb_radix_queue_status_lua( lua_State *L ) {
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_http_lklb_radix_ctx_t   *radix_ctx;
+
+    radix_ctx = ngx_http_lklb_lua_get_queue( L, &ctx );
+
+    lua_pushnumber( L, ( lua_Number )radix_ctx->queue->head );
+    lua_pushnumber( L, ( lua_Number )radix_ctx->queue->failed );
+    return 2;
+}
+
+static int
+ngx_http_lklb_radix_freeze_lua( lua_State *L ) {
+    ngx_http_lklb_ctx_t     *ctx;
+
+    ctx = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_shards_freeze( ngx_http_lklb_ctx_radix( ctx ) ) ) {
+        lua_pushnil( L );
+        lua_pushliteral( L, "no memory or zone changed" );
+        return 2;
+    }
+
+    lua_pushboolean( L, 1 );
+    return 1;
+}
+
+/*
+ * set_readonly( zone, readonly )
+ * Makes the zone read-only, or writable again, see
+ * ngx_http_lklb_shards_set_readonly. Finds of read-only zones skip the
+ * shard locks. Returns false if a shard could not be set, the zone is
+ * left as it was then.
+ */
+static int
+ngx_http_lklb_radix_set_readonly_lua( lua_State *L ) {
+    ngx_http_lklb_ctx_t     *ctx;
+    ngx_uint_t               readonly;
+
+    ctx      = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+    readonly = lua_toboolean( L, 2 );
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_shards_set_readonly( ngx_http_lklb_ctx_radix( ctx ), readonly ) ) {
+        lua_pushboolean( L, 0 );
+        return 1;
+    }
+
+    lua_pushboolean( L, 1 );
+    return 1;
+}
+
+/*
+ * load_file_async( zone, path [, thread_pool] ) loads a prefix file into
+ * the zone on a thread of the pool, "default" if not given, see
+ * ngx_http_lklb_loader_start. Returns once the load is started, its
+ * outcome is logged.
+ */
+static int
+ngx_http_lklb_radix_load_file_async_lua( lua_State *L ) {
+    ngx_http_lklb_main_conf_t   *lklbmcf;
+    ngx_http_lklb_shared_t      *shared_libs;
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_shm_zone_t              *zone = NULL;
+    ngx_str_t                    path, thread_pool;
+    ngx_uint_t                   idx;
+    ngx_int_t                    rc;
+
+    ctx = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_RADIX );
+
+    path.data = ( u_char * )luaL_checklstring( L, 2, &path.len );
+
+    if( lua_isnoneornil( L, 3 ) ) {
+        ngx_str_set( &thread_pool, "default" );
+    } else {
+        thread_pool.data = ( u_char * )luaL_checklstring( L, 3, &thread_pool.len );
+    }
+
+    lklbmcf     = ngx_http_cycle_get_module_main_conf( ngx_cycle, ngx_http_lookuplibs_module );
+    shared_libs = lklbmcf->shared_libs->elts;
+
+    for( idx = 0; idx < lklbmcf->shared_libs->nelts; idx++ ) {
+        if( ctx == shared_libs[ idx ].ctx ) {
+            zone = shared_libs[ idx ].zone;
+            break;
+        }
+    }
+
+    rc = ngx_http_lklb_loader_start( ( ngx_cycle_t * )ngx_cycle, zone, &path, &thread_pool );
+
+    if( NGX_OK == rc ) {
+        lua_pushboolean( L, 1 );
+        return 1;
+    }
+
+    lua_pushnil( L );
+
+    switch( rc ) {
+        case NGX_BUSY:
+            lua_pushliteral( L, "busy" );
+            break;
+
+        case NGX_DECLINED:
+            lua_pushliteral( L, "no thread pool" );
+            break;
+
+        case NGX_ABORT:
+            lua_pushliteral( L, "read only" );
+            break;
+
+        default:
+            lua_pushliteral( L, "no memory" );
+            break;
+    }
+
+    return 2;
+}
+
+static int
+ngx_http_lklb_ac_add_lua( lua_State *L ) {
+    ngx_http_lklb_ctx_t     *ctx;
+    ngx_str_t                pattern;
+    uint32_t                 id;
+
+    ctx = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_AC );
+
+    pattern.data = ( u_char * )luaL_checklstring( L, 2, &pattern.len );
+    id           = ( uint32_t )luaL_checkinteger( L, 3 );
+
+    switch( ngx_http_lklb_ac_add_pattern( ngx_http_lklb_ctx_ac( ctx )->ac, pattern.data, pattern.len, id ) ) {
+        case NGX_HTTP_LKLB_MATCH:
+            lua_pushboolean( L, 1 );
+            return 1;
+
+        case NGX_HTTP_LKLB_DUP:
+            lua_pushboolean( L, 0 );
+            lua_pushliteral( L, "exists" );
+            return 2;
+
+        default:
+            lua_pushnil( L );
+            lua_pushliteral( L, "no memory" );
+            return 2;
+    }
+}
+
+static int
+ngx_http_lklb_ac_delete_lua( lua_State *L ) {
+    ngx_http_lklb_ctx_t     *ctx;
+    ngx_str_t                pattern;
+    uint32_t                 id;
+
+    ctx = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_AC );
+
+    pattern.data = ( u_char * )luaL_checklstring( L, 2, &pattern.len );
+
+    if( NGX_HTTP_LKLB_MATCH != ngx_http_lklb_ac_delete_pattern( ngx_http_lklb_ctx_ac( ctx )->ac,
+                                                                pattern.data, pattern.len, &id ) ) {
+        lua_pushnil( L );
+        return 1;
+    }
+
+    lua_pushinteger( L, ( lua_Integer )id );
+    return 1;
+}
+
+static int
+ngx_http_lklb_ac_compile_lua( lua_State *L ) {
+    ngx_http_lklb_ctx_t     *ctx;
+
+    ctx = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_AC );
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_ac_compile( ngx_http_lklb_ctx_ac( ctx )->ac ) ) {
+        lua_pushnil( L );
+        lua_pushliteral( L, "no memory" );
+        return 2;
+    }
+
+    lua_pushboolean( L, 1 );
+    return 1;
+}
+
+#define NGX_HTTP_LKLB_LUA_AC_MAX_MATCHES    1024
+
+static int
+ngx_http_lklb_ac_match_lua( lua_State *L ) {
+    ngx_http_lklb_ctx_t     *ctx;
+    ngx_str_t                subject;
+    uint32_t                 ids[ NGX_HTTP_LKLB_LUA_AC_MAX_MATCHES ];
+    ngx_uint_t               nids, idx;
+
+    ctx = ngx_http_lklb_lua_get_ctx( L, 1, NGX_HTTP_LKLB_TYPE_AC );
+
+    subject.data = ( u_char * )luaL_checklstring( L, 2, &subject.len );
+    nids         = ( ngx_uint_t )luaL_optinteger( L, 3, NGX_HTTP_LKLB_LUA_AC_MAX_MATCHES );
+
+    if( ( 0 == nids ) || ( nids > NGX_HTTP_LKLB_LUA_AC_MAX_MATCHES ) ) {
+        nids = NGX_HTTP_LKLB_LUA_AC_MAX_MATCHES;
+    }
+
+    if( NGX_HTTP_LKLB_MATCH != ngx_http_lklb_ac_match( ngx_http_lklb_ctx_ac( ctx )->ac,
+                                                       subject.data, subject.len, &ids[ 0 ], &nids ) ) {
+        lua_pushnil( L );
+        return 1;
+    }
+
+    lua_createtable( L, nids, 0 );
+
+    for( idx = 0; idx < nids; idx++ ) {
+        lua_pushinteger( L, ( lua_Integer )ids[ idx ] );
+        lua_rawseti( L, -2, idx + 1 );
+    }
+
+    return 1;
+}
+
+int
+ngx_http_lklb_create_lua_module( lua_State *L ) {
+    lua_createtable( L, 0, 35 );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_insert_lua );
+    lua_setfield( L, -2, "insert_ipv4" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_mask_insert_lua );
+    lua_setfield( L, -2, "insert_ipv4_with_mask" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_delete_lua );
+    lua_setfield( L, -2, "delete_ipv4" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_mask_delete_lua );
+    lua_setfield( L, -2, "delete_ipv4_with_mask" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_find_lua );
+    lua_setfield( L, -2, "find_ipv4" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_mask_find_lua );
+    lua_setfield( L, -2, "find_ipv4_with_mask" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_find_all_lua );
+    lua_setfield( L, -2, "find_all_ipv4" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_client_addr_find_lua );
+    lua_setfield( L, -2, "find_client_addr" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_text_addr_find_lua );
+    lua_setfield( L, -2, "find_addr" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_cidr_insert_lua );
+    lua_setfield( L, -2, "insert_cidr" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_cidr_delete_lua );
+    lua_setfield( L, -2, "delete_cidr" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_cidr_find_lua );
+    lua_setfield( L, -2, "find_cidr" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_range_insert_lua );
+    lua_setfield( L, -2, "insert_ipv4_range" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_range_delete_lua );
+    lua_setfield( L, -2, "delete_ipv4_range" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint128_range_insert_lua );
+    lua_setfield( L, -2, "insert_ipv6_range" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint128_range_delete_lua );
+    lua_setfield( L, -2, "delete_ipv6_range" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_dump_lua );
+    lua_setfield( L, -2, "dump_ipv4" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint128_dump_lua );
+    lua_setfield( L, -2, "dump_ipv6" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_top_hits_lua );
+    lua_setfield( L, -2, "top_hits" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_queue_insert_lua );
+    lua_setfield( L, -2, "queue_insert_ipv4" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_mask_queue_insert_lua );
+    lua_setfield( L, -2, "queue_insert_ipv4_with_mask" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_queue_delete_lua );
+    lua_setfield( L, -2, "queue_delete_ipv4" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_mask_queue_delete_lua );
+    lua_setfield( L, -2, "queue_delete_ipv4_with_mask" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_range_queue_insert_lua );
+    lua_setfield( L, -2, "queue_insert_ipv4_range" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint32_range_queue_delete_lua );
+    lua_setfield( L, -2, "queue_delete_ipv4_range" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint128_range_queue_insert_lua );
+    lua_setfield( L, -2, "queue_insert_ipv6_range" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_uint128_range_queue_delete_lua );
+    lua_setfield( L, -2, "queue_delete_ipv6_range" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_queue_status_lua );
+    lua_setfield( L, -2, "queue_status" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_freeze_lua );
+    lua_setfield( L, -2, "freeze" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_set_readonly_lua );
+    lua_setfield( L, -2, "set_readonly" );
+
+    lua_pushcfunction( L, ngx_http_lklb_radix_load_file_async_lua );
+    lua_setfield( L, -2, "load_file_async" );
+
+    lua_pushcfunction( L, ngx_http_lklb_ac_add_lua );
+    lua_setfield( L, -2, "ac_add" );
+
+    lua_pushcfunction( L, ngx_http_lklb_ac_delete_lua );
+    lua_setfield( L, -2, "ac_delete" );
+
+    lua_pushcfunction( L, ngx_http_lklb_ac_compile_lua );
+    lua_setfield( L, -2, "ac_compile" );
+
+    lua_pushcfunction( L, ngx_http_lklb_ac_match_lua );
+    lua_setfield( L, -2, "ac_match" );
 
     return 1;
 }
@@ -4,7 +4,8 @@
 #include "ngx_http_lookuplibs_internal.h"
 
 static ngx_conf_enum_t ngx_http_lklb_types[ ] = {
-    { ngx_string( "radix" ), NGX_HTTP_LKLB_TYPE_RADIX }
+    { ngx_string( "radix" ), NGX_HTTP_LKLB_TYPE_RADIX },
+    { ngx_string( "aho_corasick" ), NGX_HTTP_LKLB_TYPE_AC }
     /* Add newer types here */
 };
 
@@ -24,6 +25,24 @@ ngx_http_lklb_post_config_init( ngx_conf_t *cf );
 static void *
 ngx_http_lklb_create_main_conf(ngx_conf_t *cf );
 
+static void *
+ngx_http_lklb_create_loc_conf( ngx_conf_t *cf );
+
+static void
+ngx_http_lklb_octx_cleanup( void *data );
+
+static ngx_int_t
+ngx_http_lklb_init_module( ngx_cycle_t *cycle );
+
+static ngx_int_t
+ngx_http_lklb_init_process( ngx_cycle_t *cycle );
+
+static void
+ngx_http_lklb_exit_process( ngx_cycle_t *cycle );
+
+static char *
+ngx_http_lklb_merge_loc_conf( ngx_conf_t *cf, void *parent, void *child );
+
 static ngx_command_t  ngx_http_lookuplibs_commands[ ] = {
     { ngx_string( "lua_shared_lookup" ),
       NGX_HTTP_MAIN_CONF | NGX_CONF_2MORE,
@@ -32,6 +51,48 @@ static ngx_command_t  ngx_http_lookuplibs_commands[ ] = {
       0,
       NULL },
 
+    { ngx_string( "lookup_deny" ),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_HTTP_LMT_CONF | NGX_CONF_1MORE,
+      ngx_http_lklb_access_rule,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string( "lookup_allow" ),
+      NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_HTTP_LMT_CONF | NGX_CONF_1MORE,
+      ngx_http_lklb_access_rule,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string( "lookup_map" ),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_2MORE,
+      ngx_http_lklb_lookup_map,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string( "lookup_replication" ),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_2MORE,
+      ngx_http_lklb_replication,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string( "lookup_load" ),
+      NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE234,
+      ngx_http_lklb_load,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string( "lookup_stats" ),
+      NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+      ngx_http_lklb_stats,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     ngx_null_command
 };
 
@@ -45,8 +106,8 @@ static ngx_http_module_t  ngx_http_lookuplibs_module_ctx = {
     NULL,                                   /* create server configuration */
     NULL,                                   /* merge server configuration */
 
-    NULL,                                   /* create location configuration */
-    NULL                                    /* merge location configuration */
+    ngx_http_lklb_create_loc_conf,          /* create location configuration */
+    ngx_http_lklb_merge_loc_conf            /* merge location configuration */
 };
 
 ngx_module_t  ngx_http_lookuplibs_module = {
@@ -55,11 +116,11 @@ ngx_module_t  ngx_http_lookuplibs_module = {
     ngx_http_lookuplibs_commands,          /* module directives */
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
-    NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_lklb_init_module,             /* init module */
+    ngx_http_lklb_init_process,            /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_lklb_exit_process,            /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -69,6 +130,42 @@ ngx_module_t  ngx_http_lookuplibs_module = {
 #define NGX_HTTP_LKLB_TYPE_IDX          3
 #define NGX_HTTP_LKLB_TRANSFORMS_IDX    4
 
+/* Zone of the same name in the previous cycle, NULL if there is none */
+static ngx_http_lklb_ctx_t *
+ngx_http_lklb_old_ctx( ngx_conf_t *cf, ngx_str_t *name ) {
+    ngx_cycle_t         *old_cycle = cf->cycle->old_cycle;
+    ngx_list_part_t     *part;
+    ngx_shm_zone_t      *shm_zone;
+    ngx_uint_t           idx;
+
+    if( ( NULL == old_cycle ) || ( ngx_is_init_cycle( old_cycle ) ) ) {
+        return NULL;
+    }
+
+    part     = &old_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for( idx = 0; /* void */ ; idx++ ) {
+        if( idx >= part->nelts ) {
+            if( NULL == part->next ) {
+                break;
+            }
+
+            part     = part->next;
+            shm_zone = part->elts;
+            idx      = 0;
+        }
+
+        if( ( &ngx_http_lookuplibs_module == shm_zone[ idx ].tag ) &&
+            ( name->len == shm_zone[ idx ].shm.name.len ) &&
+            ( 0 == ngx_strncmp( name->data, shm_zone[ idx ].shm.name.data, name->len ) ) ) {
+            return shm_zone[ idx ].data;
+        }
+    }
+
+    return NULL;
+}
+
 /*
  * Handler for lua_shared_lookup directive. This directive will take 2 or
  * more arguments. The simplest to way to setup is
@@ -81,14 +178,49 @@ ngx_module_t  ngx_http_lookuplibs_module = {
  * Supported transformations are "htonl" - e.g. ip addresses, tolower or reverse
  * Strings can be reversed before being inserted to support domain suffix match lookup
  * use case.
+ *      "lua_shared_lookup <shared segment name> <size> radix [<list of transforms>] evict=clock"
+ * Bounded cache, least recently found entries are evicted when the segment is full.
+ *      "lua_shared_lookup <shared segment name> <size> radix [<list of transforms>] shards=<n>"
+ * Splits the keyspace into n (power of 2, up to 64) trees with their own locks so that
+ * writers to different parts of it do not block each other.
+ *      "lua_shared_lookup <shared segment name> <size> radix [<list of transforms>] queue=<n>"
+ * Adds a queue of n (power of 2) slots for the queue_* Lua updates which the first
+ * worker applies in the background, keeping other workers off the write lock.
+ *      "lua_shared_lookup <shared segment name> <size> radix [<list of transforms>] stats=<n>"
+ * Counts one in n finds of every entry, see the lookup_stats directive and top_hits Lua API.
+ *      "lua_shared_lookup <shared segment name> <size> radix [<list of transforms>] journal=<path>"
+ * Journals the updates to <path>, synced by the first worker every second, and rebuilds
+ * the zone from it on startup. Evicted entries are not journaled and come back then.
+ * Compactions run in the "default" thread pool. The files belong to the worker user,
+ * which needs write access to their directory.
+ *      "lua_shared_lookup <shared segment name> <size> radix [<list of transforms>] replicate"
+ * Sends the updates to the peers of the lookup_replication directive and applies theirs,
+ * zones are matched by name.
+ *      "lua_shared_lookup <shared segment name> <size> radix [<list of transforms>] dualstack"
+ * Keeps IPv4 keys under ::ffff:0:0/96 as IPv4-mapped IPv6 keys so that a single zone holds
+ * both families, IPv4 finds start at that prefix. Not combined with shards=.
+ *      "lua_shared_lookup <shared segment name> <size> radix [<list of transforms>] readonly"
+ * Makes the zone read-only once the first worker has loaded its lookup_load files, at once
+ * if it has none: writes fail, queued ones wait and finds take no lock. Its files can not
+ * be watched. Zones kept across reloads stay read-only, see the set_readonly Lua API.
+ *      "lua_shared_lookup <shared segment name> <size> aho_corasick [tolower]"
+ * Multi pattern substring matcher, patterns are compiled into an Aho-Corasick automaton.
+ * Zones keep their entries across reloads as long as type and transforms do not change,
+ * radix zones changing size or other options get them copied into the new segment.
+ * Workers of the previous cycle have their writes to such zones refused from then on.
  */
 static char *
 ngx_http_lklb_lua_shared_lookuplib( ngx_conf_t *cf, ngx_command_t *cmd, void *conf ) {
     ngx_http_lklb_main_conf_t   *lklbmcf = conf;
     ngx_http_lklb_shared_t      *shared_lib;
-    ngx_http_lklb_ctx_t         *lklb_ctx;
+    ngx_http_lklb_ctx_t         *lklb_ctx, *octx;
     ngx_str_t                   *value, type;
     ngx_uint_t                   idx, itype, tflag;
+    ngx_http_lklb_evict_e        evict;
+    ngx_int_t                    shards, queue, stats;
+    ngx_str_t                    journal;
+    ngx_uint_t                   replicate, dualstack, readonly;
+    ngx_pool_cleanup_t          *cln;
     ssize_t                      size;
 
     if( NULL == lklbmcf->shared_libs ) {
@@ -113,7 +245,17 @@ ngx_http_lklb_lua_shared_lookuplib( ngx_conf_t *cf, ngx_command_t *cmd, void *co
         return NGX_CONF_ERROR;
     }
 
-    tflag = 0;
+    tflag  = 0;
+    evict  = NGX_HTTP_LKLB_EVICT_NONE;
+    shards = 1;
+    queue  = 0;
+    stats  = 0;
+
+    replicate = 0;
+    dualstack = 0;
+    readonly  = 0;
+
+    ngx_str_null( &journal );
 
     /* cf->args->nelts > NGX_HTTP_LKLB_TYPE_IDX means backing implementation is explicitly configured */
     if( cf->args->nelts > NGX_HTTP_LKLB_TYPE_IDX ) {
@@ -145,7 +287,113 @@ ngx_http_lklb_lua_shared_lookuplib( ngx_conf_t *cf, ngx_command_t *cmd, void *co
             ngx_uint_t  tidx;
             ngx_str_t   transform;
 
-            for( idx = NGX_HTTP_LKLB_TRANSFORMS_IDX; idx <= cf->args->nelts; idx++ ) {
+            for( idx = NGX_HTTP_LKLB_TRANSFORMS_IDX; idx < cf->args->nelts; idx++ ) {
+                if( ( value[ idx ].len > 6 ) && ( 0 == ngx_strncmp( value[ idx ].data, "evict=", 6 ) ) ) {
+                    if( ( NGX_HTTP_LKLB_TYPE_RADIX != itype ) ||
+                        ( value[ idx ].len != sizeof( "evict=clock" ) - 1 ) ||
+                        ( 0 != ngx_strncmp( value[ idx ].data, "evict=clock", value[ idx ].len ) ) ) {
+                        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0,
+                                            "invalid shared lookup lib option \"%V\"", &value[ idx ] );
+                        return NGX_CONF_ERROR;
+                    }
+
+                    evict = NGX_HTTP_LKLB_EVICT_CLOCK;
+                    continue;
+                }
+
+                if( ( value[ idx ].len > 7 ) && ( 0 == ngx_strncmp( value[ idx ].data, "shards=", 7 ) ) ) {
+                    shards = ngx_atoi( value[ idx ].data + 7, value[ idx ].len - 7 );
+
+                    if( ( NGX_HTTP_LKLB_TYPE_RADIX != itype ) || ( NGX_ERROR == shards ) ||
+                        ( shards < 1 ) || ( shards > NGX_HTTP_LKLB_SHARDS_MAX ) || ( shards & ( shards - 1 ) ) ) {
+                        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0,
+                                            "invalid shared lookup lib option \"%V\"", &value[ idx ] );
+                        return NGX_CONF_ERROR;
+                    }
+
+                    continue;
+                }
+
+                if( ( value[ idx ].len > 6 ) && ( 0 == ngx_strncmp( value[ idx ].data, "queue=", 6 ) ) ) {
+                    queue = ngx_atoi( value[ idx ].data + 6, value[ idx ].len - 6 );
+
+                    if( ( NGX_HTTP_LKLB_TYPE_RADIX != itype ) || ( NGX_ERROR == queue ) ||
+                        ( queue < 1 ) || ( queue > NGX_HTTP_LKLB_QUEUE_MAX ) || ( queue & ( queue - 1 ) ) ) {
+                        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0,
+                                            "invalid shared lookup lib option \"%V\"", &value[ idx ] );
+                        return NGX_CONF_ERROR;
+                    }
+
+                    continue;
+                }
+
+                if( ( value[ idx ].len > 6 ) && ( 0 == ngx_strncmp( value[ idx ].data, "stats=", 6 ) ) ) {
+                    stats = ngx_atoi( value[ idx ].data + 6, value[ idx ].len - 6 );
+
+                    if( ( NGX_HTTP_LKLB_TYPE_RADIX != itype ) || ( NGX_ERROR == stats ) || ( stats < 1 ) ) {
+                        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0,
+                                            "invalid shared lookup lib option \"%V\"", &value[ idx ] );
+                        return NGX_CONF_ERROR;
+                    }
+
+                    continue;
+                }
+
+                if( ( value[ idx ].len > 8 ) && ( 0 == ngx_strncmp( value[ idx ].data, "journal=", 8 ) ) ) {
+                    journal.data = value[ idx ].data + 8;
+                    journal.len  = value[ idx ].len - 8;
+
+                    if( ( NGX_HTTP_LKLB_TYPE_RADIX != itype ) ||
+                        ( NGX_OK != ngx_conf_full_name( cf->cycle, &journal, 0 ) ) ||
+                        ( journal.len + sizeof( ".snapshot.tmp" ) > NGX_MAX_PATH ) ) {
+                        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0,
+                                            "invalid shared lookup lib option \"%V\"", &value[ idx ] );
+                        return NGX_CONF_ERROR;
+                    }
+
+                    if( NGX_OK != ngx_http_lklb_journal_init_conf( cf ) ) {
+                        return NGX_CONF_ERROR;
+                    }
+
+                    continue;
+                }
+
+                if( ( value[ idx ].len == sizeof( "replicate" ) - 1 ) &&
+                    ( 0 == ngx_strncmp( value[ idx ].data, "replicate", value[ idx ].len ) ) ) {
+                    if( NGX_HTTP_LKLB_TYPE_RADIX != itype ) {
+                        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0,
+                                            "invalid shared lookup lib option \"%V\"", &value[ idx ] );
+                        return NGX_CONF_ERROR;
+                    }
+
+                    replicate = 1;
+                    continue;
+                }
+
+                if( ( value[ idx ].len == sizeof( "dualstack" ) - 1 ) &&
+                    ( 0 == ngx_strncmp( value[ idx ].data, "dualstack", value[ idx ].len ) ) ) {
+                    if( NGX_HTTP_LKLB_TYPE_RADIX != itype ) {
+                        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0,
+                                            "invalid shared lookup lib option \"%V\"", &value[ idx ] );
+                        return NGX_CONF_ERROR;
+                    }
+
+                    dualstack = 1;
+                    continue;
+                }
+
+                if( ( value[ idx ].len == sizeof( "readonly" ) - 1 ) &&
+                    ( 0 == ngx_strncmp( value[ idx ].data, "readonly", value[ idx ].len ) ) ) {
+                    if( NGX_HTTP_LKLB_TYPE_RADIX != itype ) {
+                        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0,
+                                            "invalid shared lookup lib option \"%V\"", &value[ idx ] );
+                        return NGX_CONF_ERROR;
+                    }
+
+                    readonly = 1;
+                    continue;
+                }
+
                 for( tidx = 0; tidx < sizeof( ngx_http_lklb_transforms ) / sizeof( ngx_conf_enum_t ); tidx++ ) {
                     transform = ( ngx_http_lklb_transforms[ tidx ] ).name;
 
@@ -160,13 +408,20 @@ ngx_http_lklb_lua_shared_lookuplib( ngx_conf_t *cf, ngx_command_t *cmd, void *co
         itype = NGX_HTTP_LKLB_TYPE_RADIX;
     }
 
+    /* IPv4 keys would all land in the shard of ::/8 */
+    if( ( dualstack ) && ( shards > 1 ) ) {
+        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "dualstack shared lookup lib \"%V\" can not be sharded",
+                            &value[ NGX_HTTP_LKLB_NAME_IDX ] );
+        return NGX_CONF_ERROR;
+    }
+
 
     shared_lib = ngx_array_push( lklbmcf->shared_libs );
     if( NULL == shared_lib ) {
         return NGX_CONF_ERROR;
     }
 
-    shared_lib->zone = ngx_shared_memory_add( cf, &value[ 2 ], size, &ngx_http_lookuplibs_module );
+    shared_lib->zone = ngx_shared_memory_add( cf, &value[ NGX_HTTP_LKLB_NAME_IDX ], size, &ngx_http_lookuplibs_module );
     if( NULL == shared_lib->zone ) {
         return NGX_CONF_ERROR;
     }
@@ -178,15 +433,357 @@ ngx_http_lklb_lua_shared_lookuplib( ngx_conf_t *cf, ngx_command_t *cmd, void *co
 
     lklb_ctx->type       = itype;
     lklb_ctx->transforms = tflag;
+    lklb_ctx->evict      = evict;
+    lklb_ctx->shards     = ( ngx_uint_t )shards;
+    lklb_ctx->queue      = ( ngx_uint_t )queue;
+    lklb_ctx->stats      = ( ngx_uint_t )stats;
+    lklb_ctx->journal    = journal;
+    lklb_ctx->replicate  = replicate;
+    lklb_ctx->dualstack  = dualstack;
+    lklb_ctx->readonly   = readonly;
     lklb_ctx->lklbmcf    = lklbmcf;
+    lklb_ctx->cycle      = cf->cycle;
+
+    shared_lib->ctx = lklb_ctx;
 
     shared_lib->zone->init    = ngx_http_lklb_shm_init;
     shared_lib->zone->data    = lklb_ctx;
     shared_lib->zone->noreuse = 1;
 
+    octx = ngx_http_lklb_old_ctx( cf, &value[ NGX_HTTP_LKLB_NAME_IDX ] );
+
+    /*
+     * On reload an unchanged zone keeps its segment. A radix zone whose
+     * keys are laid out the same moves its entries to the new segment
+     * otherwise, e.g. when resized. Other zones start over empty.
+     */
+    if( ( octx ) && ( octx->type == lklb_ctx->type ) && ( octx->transforms == lklb_ctx->transforms ) &&
+        ( octx->dualstack == lklb_ctx->dualstack ) ) {
+        if( ( octx->evict == lklb_ctx->evict ) && ( octx->shards == lklb_ctx->shards ) &&
+            ( octx->queue == lklb_ctx->queue ) && ( octx->stats == lklb_ctx->stats ) &&
+            ( octx->replicate == lklb_ctx->replicate ) && ( octx->journal.len == journal.len ) &&
+            ( ( 0 == journal.len ) || ( 0 == ngx_strncmp( octx->journal.data, journal.data, journal.len ) ) ) ) {
+            shared_lib->zone->noreuse = 0;
+        }
+
+        if( ( NGX_HTTP_LKLB_TYPE_RADIX == itype ) && ( octx->shards == lklb_ctx->shards ) ) {
+            lklb_ctx->octx = octx;
+
+            cln = ngx_pool_cleanup_add( cf->pool, 0 );
+            if( NULL == cln ) {
+                return NGX_CONF_ERROR;
+            }
+
+            cln->handler = ngx_http_lklb_octx_cleanup;
+            cln->data    = lklb_ctx;
+        }
+    }
+
     return NGX_CONF_OK;
 }
 
+/*
+ * The cycle ends, moved is only still set if it failed to start, the
+ * previous one then goes on with its zones.
+ */
+static void
+ngx_http_lklb_octx_cleanup( void *data ) {
+    ngx_http_lklb_ctx_t     *ctx = data;
+
+    if( ( ctx->moved ) &&
+        ( NGX_HTTP_LKLB_OK != ngx_http_lklb_shards_set_readonly( ngx_http_lklb_ctx_radix( ctx->octx ),
+                                                                 ctx->oreadonly ) ) ) {
+        ngx_log_error( NGX_LOG_ALERT, ngx_cycle->log, 0,
+                       "could not restore the state of a shared lookup zone of the previous cycle" );
+    }
+}
+
+/* The cycle started, the zones of the previous one are no longer needed */
+static ngx_int_t
+ngx_http_lklb_init_module( ngx_cycle_t *cycle ) {
+    ngx_http_lklb_main_conf_t   *lklbmcf;
+    ngx_http_lklb_shared_t      *shared_libs;
+    ngx_uint_t                   idx;
+
+    lklbmcf = ngx_http_cycle_get_module_main_conf( cycle, ngx_http_lookuplibs_module );
+    if( ( NULL == lklbmcf ) || ( NULL == lklbmcf->shared_libs ) ) {
+        return NGX_OK;
+    }
+
+    shared_libs = lklbmcf->shared_libs->elts;
+
+    for( idx = 0; idx < lklbmcf->shared_libs->nelts; idx++ ) {
+        shared_libs[ idx ].ctx->octx  = NULL;
+        shared_libs[ idx ].ctx->moved = 0;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_event_t  ngx_http_lklb_epochs_event;
+
+/* Reports the calling worker as between finds to every radix zone, or gone */
+static void
+ngx_http_lklb_epochs_update( ngx_http_lklb_main_conf_t *lklbmcf, ngx_uint_t leave ) {
+    ngx_http_lklb_shared_t      *shared_libs;
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_uint_t                   idx;
+
+    shared_libs = lklbmcf->shared_libs->elts;
+
+    for( idx = 0; idx < lklbmcf->shared_libs->nelts; idx++ ) {
+        ctx = shared_libs[ idx ].ctx;
+
+        if( ( NULL == ctx->shpool ) || ( !ngx_http_lklb_ctx_is_radix( ctx ) ) ) {
+            continue;
+        }
+
+        if( leave ) {
+            ngx_http_lklb_epochs_leave( ngx_http_lklb_ctx_radix( ctx )->epochs );
+        } else {
+            ngx_http_lklb_epochs_quiesce( ngx_http_lklb_ctx_radix( ctx )->epochs );
+        }
+    }
+}
+
+/* Keeps going while the worker shuts down, it still serves finds */
+static void
+ngx_http_lklb_epochs_handler( ngx_event_t *ev ) {
+    ngx_http_lklb_epochs_update( ev->data, 0 );
+
+    ngx_add_timer( ev, NGX_HTTP_LKLB_EPOCHS_INTERVAL );
+}
+
+#define NGX_HTTP_LKLB_SWEEP_INTERVAL    1000
+#define NGX_HTTP_LKLB_SWEEP_NODES       4096
+
+static ngx_event_t  ngx_http_lklb_sweep_event;
+
+/*
+ * Reclaims expired entries of all radix zones, a bounded number of nodes
+ * per zone and tick so that the write lock is held only briefly.
+ */
+static void
+ngx_http_lklb_sweep_handler( ngx_event_t *ev ) {
+    ngx_http_lklb_main_conf_t   *lklbmcf = ev->data;
+    ngx_http_lklb_shared_t      *shared_libs;
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_uint_t                   idx, count;
+
+    shared_libs = lklbmcf->shared_libs->elts;
+
+    for( idx = 0; idx < lklbmcf->shared_libs->nelts; idx++ ) {
+        ctx = shared_libs[ idx ].ctx;
+
+        if( ( NULL == ctx->shpool ) || ( !ngx_http_lklb_ctx_is_radix( ctx ) ) ) {
+            continue;
+        }
+
+        ngx_http_lklb_shards_sweep( ngx_http_lklb_ctx_radix( ctx ), NGX_HTTP_LKLB_SWEEP_NODES, &count );
+
+        if( count ) {
+            ngx_log_debug2( NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                            "shared lookup zone \"%V\" reclaimed %ui expired entries",
+                            &shared_libs[ idx ].zone->shm.name, count );
+        }
+    }
+
+    if( !ngx_exiting ) {
+        ngx_add_timer( ev, NGX_HTTP_LKLB_SWEEP_INTERVAL );
+    }
+}
+
+#define NGX_HTTP_LKLB_DRAIN_INTERVAL    10
+
+static ngx_event_t  ngx_http_lklb_drain_event;
+
+/* Applies the queued updates of all radix zones */
+static void
+ngx_http_lklb_drain_handler( ngx_event_t *ev ) {
+    ngx_http_lklb_main_conf_t   *lklbmcf = ev->data;
+    ngx_http_lklb_shared_t      *shared_libs;
+    ngx_http_lklb_radix_ctx_t   *radix_ctx;
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_uint_t                   idx;
+
+    shared_libs = lklbmcf->shared_libs->elts;
+
+    for( idx = 0; idx < lklbmcf->shared_libs->nelts; idx++ ) {
+        ctx = shared_libs[ idx ].ctx;
+
+        if( ( NULL == ctx->shpool ) || ( !ngx_http_lklb_ctx_is_radix( ctx ) ) ) {
+            continue;
+        }
+
+        radix_ctx = ngx_http_lklb_ctx_radix( ctx );
+
+        /* Updates queued for read-only zones wait until they are writable */
+        if( ( radix_ctx->queue ) && ( !radix_ctx->readonly ) ) {
+            ngx_http_lklb_queue_drain( radix_ctx, radix_ctx->queue->size );
+        }
+    }
+
+    if( !ngx_exiting ) {
+        ngx_add_timer( ev, NGX_HTTP_LKLB_DRAIN_INTERVAL );
+    }
+}
+
+static ngx_event_t  ngx_http_lklb_journal_event;
+
+/* Writes out the journals of all radix zones */
+static void
+ngx_http_lklb_journal_flush_all( ngx_http_lklb_main_conf_t *lklbmcf, ngx_uint_t exiting, ngx_log_t *log ) {
+    ngx_http_lklb_shared_t      *shared_libs;
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_uint_t                   idx;
+
+    shared_libs = lklbmcf->shared_libs->elts;
+
+    for( idx = 0; idx < lklbmcf->shared_libs->nelts; idx++ ) {
+        ctx = shared_libs[ idx ].ctx;
+
+        if( ( NULL == ctx->shpool ) || ( 0 == ctx->journal.len ) ) {
+            continue;
+        }
+
+        ngx_http_lklb_journal_flush( ngx_http_lklb_ctx_radix( ctx ), &ctx->journal, exiting, log );
+    }
+}
+
+static void
+ngx_http_lklb_journal_handler( ngx_event_t *ev ) {
+    ngx_http_lklb_journal_flush_all( ev->data, 0, ev->log );
+
+    if( !ngx_exiting ) {
+        ngx_add_timer( ev, NGX_HTTP_LKLB_JOURNAL_INTERVAL );
+    }
+}
+
+/* Whether a lookup_load directive loads the zone */
+static ngx_uint_t
+ngx_http_lklb_is_loaded( ngx_http_lklb_main_conf_t *lklbmcf, ngx_shm_zone_t *zone ) {
+    ngx_http_lklb_loader_conf_t *load;
+    ngx_uint_t                   idx;
+
+    if( NULL == lklbmcf->loads ) {
+        return 0;
+    }
+
+    load = lklbmcf->loads->elts;
+
+    for( idx = 0; idx < lklbmcf->loads->nelts; idx++ ) {
+        if( zone == load[ idx ].zone ) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Every worker reports its event loop passes to the zones, see
+ * ngx_http_lklb_epochs_t. The sweeper, the queue drain, the journal
+ * flush, replication and the loads of lookup_load run in the first
+ * worker only. readonly zones without lookup_load turn read-only there,
+ * the others once loaded.
+ */
+static ngx_int_t
+ngx_http_lklb_init_process( ngx_cycle_t *cycle ) {
+    ngx_http_lklb_main_conf_t   *lklbmcf;
+    ngx_http_lklb_shared_t      *shared_libs;
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_uint_t                   idx;
+
+    if( ( NGX_PROCESS_WORKER != ngx_process ) && ( NGX_PROCESS_SINGLE != ngx_process ) ) {
+        return NGX_OK;
+    }
+
+    lklbmcf = ngx_http_cycle_get_module_main_conf( cycle, ngx_http_lookuplibs_module );
+    if( ( NULL == lklbmcf ) || ( NULL == lklbmcf->shared_libs ) ) {
+        return NGX_OK;
+    }
+
+    ngx_http_lklb_epochs_update( lklbmcf, 0 );
+
+    ngx_http_lklb_epochs_event.handler    = ngx_http_lklb_epochs_handler;
+    ngx_http_lklb_epochs_event.data       = lklbmcf;
+    ngx_http_lklb_epochs_event.log        = cycle->log;
+    ngx_http_lklb_epochs_event.cancelable = 1;
+
+    ngx_add_timer( &ngx_http_lklb_epochs_event, NGX_HTTP_LKLB_EPOCHS_INTERVAL );
+
+    if( 0 != ngx_worker ) {
+        return NGX_OK;
+    }
+
+    ngx_http_lklb_sweep_event.handler    = ngx_http_lklb_sweep_handler;
+    ngx_http_lklb_sweep_event.data       = lklbmcf;
+    ngx_http_lklb_sweep_event.log        = cycle->log;
+    ngx_http_lklb_sweep_event.cancelable = 1;
+
+    ngx_add_timer( &ngx_http_lklb_sweep_event, NGX_HTTP_LKLB_SWEEP_INTERVAL );
+
+    shared_libs = lklbmcf->shared_libs->elts;
+
+    for( idx = 0; idx < lklbmcf->shared_libs->nelts; idx++ ) {
+        if( shared_libs[ idx ].ctx->queue ) {
+            ngx_http_lklb_drain_event.handler    = ngx_http_lklb_drain_handler;
+            ngx_http_lklb_drain_event.data       = lklbmcf;
+            ngx_http_lklb_drain_event.log        = cycle->log;
+            ngx_http_lklb_drain_event.cancelable = 1;
+
+            ngx_add_timer( &ngx_http_lklb_drain_event, NGX_HTTP_LKLB_DRAIN_INTERVAL );
+            break;
+        }
+    }
+
+    for( idx = 0; idx < lklbmcf->shared_libs->nelts; idx++ ) {
+        if( shared_libs[ idx ].ctx->journal.len ) {
+            ngx_http_lklb_journal_event.handler    = ngx_http_lklb_journal_handler;
+            ngx_http_lklb_journal_event.data       = lklbmcf;
+            ngx_http_lklb_journal_event.log        = cycle->log;
+            ngx_http_lklb_journal_event.cancelable = 1;
+
+            ngx_add_timer( &ngx_http_lklb_journal_event, NGX_HTTP_LKLB_JOURNAL_INTERVAL );
+            break;
+        }
+    }
+
+    for( idx = 0; idx < lklbmcf->shared_libs->nelts; idx++ ) {
+        ctx = shared_libs[ idx ].ctx;
+
+        if( ( ctx->readonly ) && ( ctx->shpool ) && ( !ngx_http_lklb_is_loaded( lklbmcf, shared_libs[ idx ].zone ) ) &&
+            ( NGX_HTTP_LKLB_OK != ngx_http_lklb_shards_set_readonly( ngx_http_lklb_ctx_radix( ctx ), 1 ) ) ) {
+            ngx_log_error( NGX_LOG_ALERT, cycle->log, 0, "could not make shared lookup zone \"%V\" read only",
+                           &shared_libs[ idx ].zone->shm.name );
+        }
+    }
+
+    if( lklbmcf->loads ) {
+        ngx_http_lklb_loader_init_process( cycle, lklbmcf->loads );
+    }
+
+    if( lklbmcf->replica ) {
+        return ngx_http_lklb_replica_init_process( cycle, lklbmcf->replica, lklbmcf->shared_libs );
+    }
+
+    return NGX_OK;
+}
+
+/* Records of the last tick are written out on the way down */
+static void
+ngx_http_lklb_exit_process( ngx_cycle_t *cycle ) {
+    ngx_http_lklb_replica_exit_process( cycle );
+
+    if( ngx_http_lklb_journal_event.handler ) {
+        ngx_http_lklb_journal_flush_all( ngx_http_lklb_journal_event.data, 1, cycle->log );
+    }
+
+    if( ngx_http_lklb_epochs_event.handler ) {
+        ngx_http_lklb_epochs_update( ngx_http_lklb_epochs_event.data, 1 );
+    }
+}
+
 static void *
 ngx_http_lklb_create_main_conf(ngx_conf_t *cf ) {
     ngx_http_lklb_main_conf_t   *lklbmcf;
@@ -199,9 +796,207 @@ ngx_http_lklb_create_main_conf(ngx_conf_t *cf ) {
     return lklbmcf;
 }
 
+static void *
+ngx_http_lklb_create_loc_conf( ngx_conf_t *cf ) {
+    ngx_http_lklb_loc_conf_t    *lklblcf;
+
+    lklblcf = ngx_pcalloc( cf->pool, sizeof( ngx_http_lklb_loc_conf_t ) );
+    if( NULL == lklblcf ) {
+        return NULL;
+    }
+
+    return lklblcf;
+}
+
+static char *
+ngx_http_lklb_merge_loc_conf( ngx_conf_t *cf, void *parent, void *child ) {
+    ngx_http_lklb_loc_conf_t    *prev = parent;
+    ngx_http_lklb_loc_conf_t    *conf = child;
+
+    if( NULL == conf->access_rules ) {
+        conf->access_rules = prev->access_rules;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * Zones are referenced by name and may be declared by lua_shared_lookup
+ * after the directive referencing them, the size is filled in then.
+ */
+char *
+ngx_http_lklb_lookup_init( ngx_conf_t *cf, ngx_http_lklb_lookup_t *lookup, ngx_str_t *zone_name ) {
+    if( 0 == zone_name->len ) {
+        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "invalid shared lookup lib name \"%V\"", zone_name );
+        return NGX_CONF_ERROR;
+    }
+
+    lookup->zone = ngx_shared_memory_add( cf, zone_name, 0, &ngx_http_lookuplibs_module );
+    if( NULL == lookup->zone ) {
+        return NGX_CONF_ERROR;
+    }
+
+    lookup->zone6    = NULL;
+    lookup->key      = NULL;
+    lookup->key_type = NGX_HTTP_LKLB_KEY_ADDR;
+    lookup->prefix   = 1;
+
+    return NGX_CONF_OK;
+}
+
+ngx_int_t
+ngx_http_lklb_lookup_key( ngx_conf_t *cf, ngx_http_lklb_lookup_t *lookup, ngx_str_t *value ) {
+    ngx_http_compile_complex_value_t    ccv;
+
+    lookup->key = ngx_palloc( cf->pool, sizeof( ngx_http_complex_value_t ) );
+    if( NULL == lookup->key ) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero( &ccv, sizeof( ngx_http_compile_complex_value_t ) );
+
+    ccv.cf            = cf;
+    ccv.value         = value;
+    ccv.complex_value = lookup->key;
+
+    if( NGX_OK != ngx_http_compile_complex_value( &ccv ) ) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Parses the lookup parameters shared by the directives
+ *      key=<complex value>         client address if not set
+ *      key_type=addr|string        addr - 4 or 16 byte binary address, e.g. $binary_remote_addr
+ *      prefix=on|off               report entries covering the key, on by default
+ *      zone6=<name>                zone IPv6 addresses are looked up in
+ * Without zone6 IPv6 addresses go to the zone if it is dual-stack and find
+ * nothing otherwise, IPv4 and IPv6 keys would match each other in it.
+ * Returns NGX_DECLINED for parameters that are not lookup parameters.
+ */
+ngx_int_t
+ngx_http_lklb_lookup_param( ngx_conf_t *cf, ngx_http_lklb_lookup_t *lookup, ngx_str_t *param ) {
+    ngx_str_t   value;
+
+    if( ( param->len > 6 ) && ( 0 == ngx_strncmp( param->data, "zone6=", 6 ) ) ) {
+        value.data = param->data + 6;
+        value.len  = param->len - 6;
+
+        lookup->zone6 = ngx_shared_memory_add( cf, &value, 0, &ngx_http_lookuplibs_module );
+
+        return( ( NULL == lookup->zone6 ) ? NGX_ERROR : NGX_OK );
+    }
+
+    if( ( param->len > 4 ) && ( 0 == ngx_strncmp( param->data, "key=", 4 ) ) ) {
+        value.data = param->data + 4;
+        value.len  = param->len - 4;
+
+        return ngx_http_lklb_lookup_key( cf, lookup, &value );
+    }
+
+    if( ( param->len == sizeof( "key_type=addr" ) - 1 ) &&
+        ( 0 == ngx_strncmp( param->data, "key_type=addr", param->len ) ) ) {
+        lookup->key_type = NGX_HTTP_LKLB_KEY_ADDR;
+        return NGX_OK;
+    }
+
+    if( ( param->len == sizeof( "key_type=string" ) - 1 ) &&
+        ( 0 == ngx_strncmp( param->data, "key_type=string", param->len ) ) ) {
+        lookup->key_type = NGX_HTTP_LKLB_KEY_STRING;
+        return NGX_OK;
+    }
+
+    if( ( param->len == sizeof( "prefix=on" ) - 1 ) &&
+        ( 0 == ngx_strncmp( param->data, "prefix=on", param->len ) ) ) {
+        lookup->prefix = 1;
+        return NGX_OK;
+    }
+
+    if( ( param->len == sizeof( "prefix=off" ) - 1 ) &&
+        ( 0 == ngx_strncmp( param->data, "prefix=off", param->len ) ) ) {
+        lookup->prefix = 0;
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+static ngx_http_lklb_radix_ctx_t *
+ngx_http_lklb_lookup_radix( ngx_http_request_t *r, ngx_shm_zone_t *zone ) {
+    ngx_http_lklb_ctx_t         *ctx = zone->data;
+
+    if( ( NULL == ctx ) || ( NULL == ctx->shpool ) || ( !ngx_http_lklb_ctx_is_radix( ctx ) ) ) {
+        ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
+                       "shared lookup zone \"%V\" is not usable for this operation", &zone->shm.name );
+        return NULL;
+    }
+
+    return ngx_http_lklb_ctx_radix( ctx );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_lookup_find( ngx_http_request_t *r, ngx_http_lklb_lookup_t *lookup, void **value ) {
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_http_lklb_radix_ctx_t   *radix_ctx, *radix_ctx6;
+    ngx_str_t                    key;
+    u_char                      *data;
+
+    ctx = lookup->zone->data;
+
+    radix_ctx = ngx_http_lklb_lookup_radix( r, lookup->zone );
+    if( NULL == radix_ctx ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    if( lookup->zone6 ) {
+        radix_ctx6 = ngx_http_lklb_lookup_radix( r, lookup->zone6 );
+        if( NULL == radix_ctx6 ) {
+            return NGX_HTTP_LKLB_ERR;
+        }
+    } else {
+        radix_ctx6 = ( radix_ctx->dualstack ) ? radix_ctx : NULL;
+    }
+
+    if( NULL == lookup->key ) {
+        return ngx_http_lklb_shards_sockaddr_find( radix_ctx, radix_ctx6, r->connection->sockaddr, value,
+                                                   lookup->prefix );
+    }
+
+    if( NGX_OK != ngx_http_complex_value( r, lookup->key, &key ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    if( NGX_HTTP_LKLB_KEY_ADDR == lookup->key_type ) {
+        return ngx_http_lklb_shards_addr_find( radix_ctx, radix_ctx6, key.data, key.len, value, lookup->prefix );
+    }
+
+    if( 0 == key.len ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    /* String transforms work in place, the key may point into request data */
+    if( ( NGX_HTTP_LKLB_TRANSFORM_TOLOWER | NGX_HTTP_LKLB_TRANSFORM_REVERSE ) & ctx->transforms ) {
+        data = ngx_pnalloc( r->pool, key.len );
+        if( NULL == data ) {
+            return NGX_HTTP_LKLB_ERR;
+        }
+
+        ngx_memcpy( data, key.data, key.len );
+        key.data = data;
+    }
+
+    return ngx_http_lklb_shards_str_find( radix_ctx, key.data, key.len, value, lookup->prefix );
+}
+
 static ngx_int_t
 ngx_http_lklb_post_config_init( ngx_conf_t *cf ) {
     ngx_http_lklb_main_conf_t   *lklbmcf;
+    ngx_http_lklb_shared_t      *shared_libs;
+    ngx_http_lklb_loader_conf_t *load;
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_uint_t                   idx;
 
     lklbmcf = ngx_http_conf_get_module_main_conf( cf, ngx_http_lookuplibs_module );
     if( NULL == lklbmcf ) {
@@ -212,5 +1007,36 @@ ngx_http_lklb_post_config_init( ngx_conf_t *cf ) {
         return NGX_ERROR;
     }
 
+    if( NGX_OK != ngx_http_lklb_access_init( cf ) ) {
+        return NGX_ERROR;
+    }
+
+    /* readonly zones turn read-only once loaded, a watched file could not be synced */
+    if( lklbmcf->loads ) {
+        load = lklbmcf->loads->elts;
+
+        for( idx = 0; idx < lklbmcf->loads->nelts; idx++ ) {
+            ctx = load[ idx ].zone->data;
+
+            if( ( load[ idx ].watch ) && ( ctx ) && ( ctx->readonly ) ) {
+                ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "shared lookup zone \"%V\" is read only "
+                                    "and can not be watched", &load[ idx ].zone->shm.name );
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    if( ( NULL == lklbmcf->replica ) && ( lklbmcf->shared_libs ) ) {
+        shared_libs = lklbmcf->shared_libs->elts;
+
+        for( idx = 0; idx < lklbmcf->shared_libs->nelts; idx++ ) {
+            if( shared_libs[ idx ].ctx->replicate ) {
+                ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "shared lookup zone \"%V\" is replicated "
+                                    "but \"lookup_replication\" is not set", &shared_libs[ idx ].zone->shm.name );
+                return NGX_ERROR;
+            }
+        }
+    }
+
     return NGX_OK;
 }
@@ -18,4 +18,26 @@ typedef enum {
 #define NGX_HTTP_LKLB_TRANSFORM_TOLOWER      2
 #define NGX_HTTP_LKLB_TRANSFORM_REVERSE      4
 
+/*
+ * Locks held across event loop passes, e.g. while a worker drains a queue,
+ * hold the pid of their owner. A lock whose owner died is taken over.
+ */
+static ngx_inline ngx_uint_t
+ngx_http_lklb_trylock_owner( ngx_atomic_t *lock ) {
+    ngx_atomic_uint_t   owner;
+
+    if( ngx_atomic_cmp_set( lock, 0, ngx_pid ) ) {
+        return 1;
+    }
+
+    owner = *lock;
+
+    if( ( 0 == owner ) || ( ( ngx_atomic_uint_t )ngx_pid == owner ) ||
+        ( -1 != kill( ( ngx_pid_t )owner, 0 ) ) || ( NGX_ESRCH != ngx_errno ) ) {
+        return 0;
+    }
+
+    return ngx_atomic_cmp_set( lock, owner, ngx_pid );
+}
+
 #endif /* _NGX_HTTP_LOOKUPLIBS_MODULE_H_INCLUDED_ */
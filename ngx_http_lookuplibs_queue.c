@@ -0,0 +1,347 @@
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_transforms.h"
+#include "ngx_http_lookuplibs_queue.h"
+
+ngx_http_lklb_queue_t *
+ngx_http_lklb_queue_create( ngx_slab_pool_t *shpool, ngx_uint_t size ) {
+    ngx_http_lklb_queue_t   *queue;
+    ngx_uint_t               idx;
+
+    queue = ngx_slab_calloc( shpool, offsetof( ngx_http_lklb_queue_t, slots )
+                                     + size * sizeof( ngx_http_lklb_queue_slot_t ) );
+    if( NULL == queue ) {
+        return NULL;
+    }
+
+    queue->size = size;
+
+    for( idx = 0; idx < size; idx++ ) {
+        queue->slots[ idx ].seq = idx;
+    }
+
+    return queue;
+}
+
+ngx_atomic_uint_t
+ngx_http_lklb_queue_push( ngx_http_lklb_queue_t *queue, ngx_http_lklb_queue_slot_t *op ) {
+    ngx_http_lklb_queue_slot_t  *slot;
+    ngx_atomic_uint_t            pos;
+    ngx_atomic_int_t             diff;
+
+    pos = queue->tail;
+
+    while( 1 ) {
+        slot = &queue->slots[ pos & ( queue->size - 1 ) ];
+        diff = ( ngx_atomic_int_t )( slot->seq - pos );
+
+        if( 0 == diff ) {
+            if( ngx_atomic_cmp_set( &queue->tail, pos, pos + 1 ) ) {
+                break;
+            }
+        } else if( diff < 0 ) {
+            /* Slot still holds an op from the previous lap */
+            return 0;
+        }
+
+        pos = queue->tail;
+    }
+
+    slot->op     = op->op;
+    slot->nwords = op->nwords;
+    slot->value  = op->value;
+    ngx_memcpy( &slot->key[ 0 ], &op->key[ 0 ], sizeof( slot->key ) );
+    ngx_memcpy( &slot->arg[ 0 ], &op->arg[ 0 ], sizeof( slot->arg ) );
+
+    ngx_memory_barrier();
+
+    /* The drain gave up waiting for the slot, the op is dropped */
+    if( !ngx_atomic_cmp_set( &slot->seq, pos, pos + 1 ) ) {
+        return 0;
+    }
+
+    return pos + 1;
+}
+
+static void
+ngx_http_lklb_queue_apply( ngx_http_lklb_radix_ctx_t *radix_ctx, ngx_http_lklb_queue_slot_t *slot ) {
+    ngx_http_lklb_retval_e   rc;
+    void                    *value;
+
+    switch( slot->op ) {
+        case NGX_HTTP_LKLB_QUEUE_INSERT:
+            rc = ngx_http_lklb_shards_uint32_insert_with_mask( radix_ctx, slot->key[ 0 ], slot->arg[ 0 ],
+                                                               slot->value );
+            break;
+
+        case NGX_HTTP_LKLB_QUEUE_INSERT_RANGE:
+            rc = ngx_http_lklb_shards_insert_range( radix_ctx, &slot->key[ 0 ], &slot->arg[ 0 ], slot->nwords,
+                                                    slot->value, NULL );
+            break;
+
+        case NGX_HTTP_LKLB_QUEUE_DELETE:
+            if( NGX_HTTP_LKLB_MATCH == ngx_http_lklb_shards_uint32_delete_with_mask( radix_ctx, slot->key[ 0 ],
+                                                                                     slot->arg[ 0 ], &value ) ) {
+                ngx_http_lklb_value_unref( &radix_ctx->values, value );
+            }
+
+            return;
+
+        default:
+            ngx_http_lklb_shards_delete_range( radix_ctx, &slot->key[ 0 ], &slot->arg[ 0 ], slot->nwords, NULL );
+            return;
+    }
+
+    if( NGX_HTTP_LKLB_MATCH == rc ) {
+        return;
+    }
+
+    /* The tree did not take a reference, release the queued one */
+    ngx_http_lklb_value_unref( &radix_ctx->values, slot->value );
+
+    if( NGX_HTTP_LKLB_ERR == rc ) {
+        ngx_atomic_fetch_add( &radix_ctx->queue->failed, 1 );
+    }
+}
+
+#define ngx_http_lklb_queue_is_range( __slot )                                          \
+    ( ( NGX_HTTP_LKLB_QUEUE_INSERT_RANGE == ( __slot )->op ) ||                         \
+      ( NGX_HTTP_LKLB_QUEUE_DELETE_RANGE == ( __slot )->op ) )
+
+/* Shards a uint32 op applies to */
+static void
+ngx_http_lklb_queue_span(
+    ngx_http_lklb_radix_ctx_t   *radix_ctx,
+    ngx_http_lklb_queue_slot_t  *slot,
+    ngx_uint_t                  *lo,
+    ngx_uint_t                  *hi
+) {
+    uint32_t    hkey, hmask;
+
+    hmask = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, slot->arg[ 0 ] );
+    hkey  = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, slot->key[ 0 ] ) & hmask;
+
+    *lo = ngx_http_lklb_shard_idx( radix_ctx, hkey );
+    *hi = ngx_http_lklb_shard_idx( radix_ctx, hkey | ~hmask );
+}
+
+/* Apply a uint32 op to a single shard, outside of a batch */
+static ngx_uint_t
+ngx_http_lklb_queue_apply_shard(
+    ngx_http_lklb_radix_ctx_t   *radix_ctx,
+    ngx_http_lklb_queue_slot_t  *slot,
+    ngx_uint_t                   idx
+) {
+    ngx_http_lklb_radix_t   *tree = radix_ctx->shards[ idx ].tree;
+    void                    *value;
+
+    if( NGX_HTTP_LKLB_QUEUE_INSERT == slot->op ) {
+        return( NGX_HTTP_LKLB_ERR == ngx_http_lklb_radix_uint32_insert_with_mask( tree, slot->key[ 0 ],
+                                                                                   slot->arg[ 0 ], slot->value ) );
+    }
+
+    if( NGX_HTTP_LKLB_MATCH == ngx_http_lklb_radix_uint32_delete_with_mask( tree, slot->key[ 0 ], slot->arg[ 0 ],
+                                                                            &value ) ) {
+        ngx_http_lklb_value_unref( &radix_ctx->values, value );
+    }
+
+    return 0;
+}
+
+/*
+ * Apply nslots uint32 ops starting at pos with one batch, i.e. one write
+ * lock, per shard. The ops of a shard whose batch failed are applied
+ * one by one instead so that only those not fitting are lost. The
+ * queued value references are held until every shard is done. The
+ * log locks are held throughout as by the shards write APIs.
+ */
+static void
+ngx_http_lklb_queue_apply_batch(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_atomic_uint_t           pos,
+    ngx_uint_t                  nslots
+) {
+    ngx_http_lklb_queue_t        *queue = radix_ctx->queue;
+    ngx_uint_t                    logged = ngx_http_lklb_shards_logged( radix_ctx );
+    ngx_http_lklb_queue_slot_t   *slot;
+    ngx_http_lklb_radix_batch_t  *batches[ NGX_HTTP_LKLB_SHARDS_MAX ];
+    ngx_http_lklb_retval_e        rc;
+    uint64_t                      failed = 0;
+    ngx_uint_t                    n, idx, lo, hi, lost;
+
+    ngx_memzero( batches, sizeof( batches ) );
+
+    if( logged ) {
+        ngx_http_lklb_shards_log_lock( radix_ctx );
+    }
+
+    for( n = 0; n < nslots; n++ ) {
+        slot = &queue->slots[ ( pos + n ) & ( queue->size - 1 ) ];
+
+        if( NGX_HTTP_LKLB_QUEUE_INSERT == slot->op ) {
+            ngx_http_lklb_value_ref( &radix_ctx->values, slot->value );
+        }
+
+        ngx_http_lklb_queue_span( radix_ctx, slot, &lo, &hi );
+
+        for( idx = lo; idx <= hi; idx++ ) {
+            if( failed & ( ( uint64_t )1 << idx ) ) {
+                continue;
+            }
+
+            if( ( NULL == batches[ idx ] ) &&
+                ( NULL == ( batches[ idx ] = ngx_http_lklb_radix_batch_begin( radix_ctx->shards[ idx ].tree,
+                                                                              ngx_cycle->log ) ) ) ) {
+                failed |= ( uint64_t )1 << idx;
+                continue;
+            }
+
+            if( NGX_HTTP_LKLB_QUEUE_INSERT == slot->op ) {
+                rc = ngx_http_lklb_radix_batch_uint32_insert( batches[ idx ], slot->key[ 0 ], slot->arg[ 0 ],
+                                                              slot->value );
+            } else {
+                rc = ngx_http_lklb_radix_batch_uint32_delete( batches[ idx ], slot->key[ 0 ], slot->arg[ 0 ] );
+            }
+
+            if( NGX_HTTP_LKLB_OK != rc ) {
+                ngx_http_lklb_radix_batch_abort( batches[ idx ] );
+                batches[ idx ] = NULL;
+                failed |= ( uint64_t )1 << idx;
+            }
+        }
+    }
+
+    for( idx = 0; idx < radix_ctx->nshards; idx++ ) {
+        if( ( batches[ idx ] ) && ( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_batch_commit( batches[ idx ], NULL ) ) ) {
+            failed |= ( uint64_t )1 << idx;
+        }
+    }
+
+    for( n = 0; n < nslots; n++ ) {
+        slot = &queue->slots[ ( pos + n ) & ( queue->size - 1 ) ];
+        lost = 0;
+
+        if( failed ) {
+            ngx_http_lklb_queue_span( radix_ctx, slot, &lo, &hi );
+
+            for( idx = lo; idx <= hi; idx++ ) {
+                if( failed & ( ( uint64_t )1 << idx ) ) {
+                    lost |= ngx_http_lklb_queue_apply_shard( radix_ctx, slot, idx );
+                }
+            }
+
+            if( lost ) {
+                ngx_atomic_fetch_add( &queue->failed, 1 );
+            }
+        }
+
+        /* Ops without effect replay without effect too */
+        if( ( logged ) && ( !lost ) ) {
+            ngx_http_lklb_shards_log( radix_ctx, slot->op, 1, &slot->key[ 0 ], &slot->arg[ 0 ],
+                                      ( NGX_HTTP_LKLB_QUEUE_INSERT == slot->op ) ? slot->value : NULL );
+        }
+
+        /* Released unless some shard stored it */
+        if( NGX_HTTP_LKLB_QUEUE_INSERT == slot->op ) {
+            ngx_http_lklb_value_unref( &radix_ctx->values, slot->value );
+        }
+    }
+
+    if( logged ) {
+        ngx_http_lklb_shards_log_unlock( radix_ctx );
+    }
+}
+
+/*
+ * Gives up on the claimed but unpublished slot at pos once it stalled the
+ * drain for NGX_HTTP_LKLB_QUEUE_STALL, its producer finds the slot moved
+ * on to the next lap when it publishes.
+ */
+static ngx_uint_t
+ngx_http_lklb_queue_skip( ngx_http_lklb_queue_t *queue, ngx_atomic_uint_t pos ) {
+    ngx_http_lklb_queue_slot_t  *slot = &queue->slots[ pos & ( queue->size - 1 ) ];
+
+    if( ( slot->seq != pos ) || ( ( ngx_atomic_int_t )( queue->tail - pos ) <= 0 ) ) {
+        return 0;
+    }
+
+    if( queue->stalled != pos + 1 ) {
+        queue->stalled = pos + 1;
+        queue->since   = ngx_current_msec;
+        return 0;
+    }
+
+    if( ( ngx_msec_int_t )( ngx_current_msec - queue->since ) < NGX_HTTP_LKLB_QUEUE_STALL ) {
+        return 0;
+    }
+
+    return ngx_atomic_cmp_set( &slot->seq, pos, pos + queue->size );
+}
+
+/*
+ * Runs of published uint32 ops are applied as batches of up to
+ * NGX_HTTP_LKLB_QUEUE_BATCH ops, range ops one at a time.
+ */
+ngx_uint_t
+ngx_http_lklb_queue_drain( ngx_http_lklb_radix_ctx_t *radix_ctx, ngx_uint_t max_ops ) {
+    ngx_http_lklb_queue_t       *queue = radix_ctx->queue;
+    ngx_http_lklb_queue_slot_t  *slot;
+    ngx_atomic_uint_t            pos;
+    ngx_uint_t                   count = 0, n, idx;
+
+    if( ( NULL == queue ) || ( !ngx_http_lklb_trylock_owner( &queue->draining ) ) ) {
+        return 0;
+    }
+
+    pos = queue->head;
+
+    while( count < max_ops ) {
+        /* Claimed but not yet published ops stop the drain, order is kept */
+        for( n = 0; ( count + n < max_ops ) && ( n < NGX_HTTP_LKLB_QUEUE_BATCH ); n++ ) {
+            slot = &queue->slots[ ( pos + n ) & ( queue->size - 1 ) ];
+
+            if( ( slot->seq != pos + n + 1 ) || ( ( n ) && ( ngx_http_lklb_queue_is_range( slot ) ) ) ) {
+                break;
+            }
+
+            if( ngx_http_lklb_queue_is_range( slot ) ) {
+                n++;
+                break;
+            }
+        }
+
+        if( 0 == n ) {
+            if( !ngx_http_lklb_queue_skip( queue, pos ) ) {
+                break;
+            }
+
+            ngx_atomic_fetch_add( &queue->failed, 1 );
+
+            queue->head = ++pos;
+            continue;
+        }
+
+        ngx_memory_barrier();
+
+        slot = &queue->slots[ pos & ( queue->size - 1 ) ];
+
+        if( ngx_http_lklb_queue_is_range( slot ) ) {
+            ngx_http_lklb_queue_apply( radix_ctx, slot );
+        } else {
+            ngx_http_lklb_queue_apply_batch( radix_ctx, pos, n );
+        }
+
+        ngx_memory_barrier();
+
+        for( idx = 0; idx < n; idx++ ) {
+            queue->slots[ ( pos + idx ) & ( queue->size - 1 ) ].seq = pos + idx + queue->size;
+        }
+
+        pos        += n;
+        queue->head = pos;
+        count      += n;
+    }
+
+    ngx_unlock( &queue->draining );
+
+    return count;
+}
@@ -0,0 +1,73 @@
+#ifndef _NGX_HTTP_LOOKUPLIBS_QUEUE_H_INCLUDED_
+#define _NGX_HTTP_LOOKUPLIBS_QUEUE_H_INCLUDED_
+
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_values.h"
+#include "ngx_http_lookuplibs_shards.h"
+
+#define NGX_HTTP_LKLB_QUEUE_MAX     ( 1 << 20 )
+#define NGX_HTTP_LKLB_QUEUE_BATCH   256
+#define NGX_HTTP_LKLB_QUEUE_STALL   1000
+
+typedef enum {
+    NGX_HTTP_LKLB_QUEUE_INSERT          = 0,
+    NGX_HTTP_LKLB_QUEUE_DELETE          = 1,
+    NGX_HTTP_LKLB_QUEUE_INSERT_RANGE    = 2,
+    NGX_HTTP_LKLB_QUEUE_DELETE_RANGE    = 3
+} ngx_http_lklb_queue_op_e;
+
+/*
+ * uint32 ops carry key and mask in the first word of key and arg, range
+ * ops start and end in nwords words. Keys are kept as given, the zone
+ * transforms apply when the op is drained.
+ */
+typedef struct {
+    ngx_atomic_t                 seq;
+    ngx_http_lklb_queue_op_e     op;
+    ngx_uint_t                   nwords;
+    uint32_t                     key[ 4 ];
+    uint32_t                     arg[ 4 ];
+    ngx_http_lklb_value_t       *value;
+} ngx_http_lklb_queue_slot_t;
+
+/*
+ * Bounded multi producer, single consumer ring of zone updates. Workers
+ * claim a slot by advancing tail and publish it through the slot
+ * sequence, they never touch the tree locks. The draining worker applies
+ * published slots in order and advances head, so every op numbered up to
+ * head has been applied. draining holds the pid of the draining process.
+ * A slot claimed but left unpublished for NGX_HTTP_LKLB_QUEUE_STALL
+ * milliseconds, e.g. by a worker that died, is skipped and counted as
+ * failed, stalled and since track the slot the drain waits for.
+ */
+struct ngx_http_lklb_queue_s {
+    ngx_atomic_t                 tail;
+    ngx_atomic_t                 head;
+    ngx_atomic_t                 failed;
+    ngx_atomic_t                 draining;
+    ngx_atomic_uint_t            stalled;
+    ngx_msec_t                   since;
+    ngx_uint_t                   size;
+    ngx_http_lklb_queue_slot_t   slots[ 1 ];
+};
+
+/* size must be a power of 2 */
+ngx_http_lklb_queue_t *
+ngx_http_lklb_queue_create( ngx_slab_pool_t *shpool, ngx_uint_t size );
+
+/*
+ * Queues an op, the queue takes over the value reference.
+ * Returns the sequence number of the op, 0 if the queue is full or the
+ * op was skipped before it got published.
+ */
+ngx_atomic_uint_t
+ngx_http_lklb_queue_push( ngx_http_lklb_queue_t *queue, ngx_http_lklb_queue_slot_t *op );
+
+/*
+ * Applies up to max_ops queued ops to the zone, returns the number
+ * applied. Only one process drains a queue at a time, others return 0.
+ */
+ngx_uint_t
+ngx_http_lklb_queue_drain( ngx_http_lklb_radix_ctx_t *radix_ctx, ngx_uint_t max_ops );
+
+#endif /* _NGX_HTTP_LOOKUPLIBS_QUEUE_H_INCLUDED_ */
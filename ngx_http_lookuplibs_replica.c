@@ -0,0 +1,1241 @@
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_internal.h"
+#include "ngx_http_lookuplibs_replica.h"
+
+/* Cursor chunk of snapshots, snapshot parts kept, datagrams read per tick */
+#define NGX_HTTP_LKLB_REPLICA_ENTRIES       64
+#define NGX_HTTP_LKLB_REPLICA_PARTS         4096
+#define NGX_HTTP_LKLB_REPLICA_READS         4096
+
+/* Parts a received snapshot may have, bounding the have bitmap to 2MB */
+#define NGX_HTTP_LKLB_REPLICA_MAX_PARTS     ( 1 << 24 )
+
+#define ngx_http_lklb_replica_name_len( __len )     ngx_align( ( __len ), 8 )
+
+/*
+ * What a peer has of our stream of a zone and what we have of its.
+ * next is the next datagram to send it, 0 once it needs a snapshot.
+ * A snapshot walks the zone with a cursor, records of a chunk of
+ * entries wait in records until sent. Parts sent are kept in a ring of
+ * NGX_HTTP_LKLB_REPLICA_PARTS for the peer to ask for those it missed.
+ * expect is the next datagram of the peer to apply, 0 until its
+ * snapshot completed. Parts of a snapshot hold distinct entries and
+ * apply in any order, those received are set in have. A datagram or
+ * part that did not apply is not taken and asked for again.
+ */
+typedef struct {
+    uint64_t                         next;
+    ngx_uint_t                       snapshot;
+    ngx_uint_t                       walked;
+    ngx_uint_t                       ended;
+    uint32_t                         snap;
+    uint64_t                         snap_last;
+    uint64_t                         snap_parts;
+    ngx_http_lklb_shards_cursor_t    cursor;
+    u_char                          *records;
+    size_t                           size;
+    size_t                           len;
+    size_t                           pos;
+    u_char                         **parts;
+    size_t                          *plen;
+
+    uint64_t                         node;
+    uint64_t                         expect;
+    uint32_t                         rsnap;
+    uint64_t                         rsnap_last;
+    ngx_uint_t                       rsnap_end;
+    uint64_t                         rsnap_parts;
+    uint64_t                         rsnap_count;
+    uint64_t                         rsnap_max;
+    u_char                          *have;
+    size_t                           hsize;
+    ngx_msec_t                       retry;
+} ngx_http_lklb_replica_peer_t;
+
+/* The stream of a zone, datagram seq is kept at history[ seq % HISTORY ] */
+typedef struct {
+    ngx_str_t                        name;
+    ngx_http_lklb_radix_ctx_t       *radix_ctx;
+    uint64_t                         seq;
+    u_char                          *history[ NGX_HTTP_LKLB_REPLICA_HISTORY ];
+    size_t                           hlen[ NGX_HTTP_LKLB_REPLICA_HISTORY ];
+    ngx_http_lklb_replica_peer_t    *peers;
+} ngx_http_lklb_replica_zone_t;
+
+/*
+ * Replication state of the first worker. Updates of replicated zones
+ * are logged to their outbox like to a journal. Every tick the outbox
+ * is cut into datagrams numbered per zone and sent to every peer, which
+ * applies them in order. A peer missing datagrams asks for them again,
+ * one that fell behind the history or started anew gets a snapshot of
+ * the zone first. Snapshots add entries, deletes a peer missed out on
+ * or that raced the snapshot are thus not undone, expiry takes care of
+ * those.
+ */
+struct ngx_http_lklb_replica_s {
+    uint64_t                         node;
+    ngx_uint_t                       npeers;
+    ngx_array_t                      zones;
+    ngx_msec_t                       heartbeat;
+    ngx_http_lklb_replica_send_pt    send;
+    void                            *data;
+    ngx_log_t                       *log;
+    u_char                          *buf;
+    u_char                          *rbuf;
+    ngx_http_lklb_radix_entry_t     *entries;
+
+    ngx_http_lklb_replica_conf_t    *conf;
+    ngx_socket_t                     fd;
+    ngx_uint_t                       warned;
+};
+
+ngx_http_lklb_replica_t *
+ngx_http_lklb_replica_create( ngx_pool_t *pool, ngx_uint_t npeers, ngx_log_t *log ) {
+    ngx_http_lklb_replica_t     *replica;
+
+    replica = ngx_pcalloc( pool, sizeof( ngx_http_lklb_replica_t ) );
+    if( NULL == replica ) {
+        return NULL;
+    }
+
+    if( NGX_OK != ngx_array_init( &replica->zones, pool, 2, sizeof( ngx_http_lklb_replica_zone_t ) ) ) {
+        return NULL;
+    }
+
+    replica->buf     = ngx_palloc( pool, NGX_HTTP_LKLB_REPLICA_DATAGRAM );
+    replica->rbuf    = ngx_palloc( pool, NGX_HTTP_LKLB_REPLICA_DATAGRAM );
+    replica->entries = ngx_palloc( pool, NGX_HTTP_LKLB_REPLICA_ENTRIES * sizeof( ngx_http_lklb_radix_entry_t ) );
+
+    if( ( NULL == replica->buf ) || ( NULL == replica->rbuf ) || ( NULL == replica->entries ) ) {
+        return NULL;
+    }
+
+    /* Tells this stream from those of earlier workers */
+    replica->node = ( ( uint64_t )ngx_random() << 32 ) ^ ( ( uint64_t )ngx_pid << 16 ) ^ ngx_random()
+                    ^ ngx_http_lklb_journal_now();
+    if( 0 == replica->node ) {
+        replica->node = 1;
+    }
+
+    replica->npeers    = npeers;
+    replica->heartbeat = ngx_current_msec;
+    replica->log       = log;
+    replica->fd        = ( ngx_socket_t )-1;
+
+    return replica;
+}
+
+ngx_int_t
+ngx_http_lklb_replica_add_zone(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_str_t                      *name,
+    ngx_http_lklb_radix_ctx_t      *radix_ctx
+) {
+    ngx_http_lklb_replica_zone_t    *zone;
+    ngx_uint_t                       idx;
+
+    zone = ngx_array_push( &replica->zones );
+    if( NULL == zone ) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero( zone, sizeof( ngx_http_lklb_replica_zone_t ) );
+
+    zone->name      = *name;
+    zone->radix_ctx = radix_ctx;
+
+    zone->peers = ngx_pcalloc( replica->zones.pool, replica->npeers * sizeof( ngx_http_lklb_replica_peer_t ) );
+    if( NULL == zone->peers ) {
+        return NGX_ERROR;
+    }
+
+    /* Peers take our stream from the start, after a snapshot */
+    for( idx = 0; idx < replica->npeers; idx++ ) {
+        zone->peers[ idx ].retry = ngx_current_msec;
+    }
+
+    return NGX_OK;
+}
+
+void
+ngx_http_lklb_replica_set_send(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_send_pt   send,
+    void                           *data
+) {
+    replica->send = send;
+    replica->data = data;
+}
+
+/* Starts a datagram in replica->buf, returns the offset of its records */
+static size_t
+ngx_http_lklb_replica_begin(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_zone_t   *zone,
+    ngx_uint_t                      type,
+    uint64_t                        seq,
+    uint64_t                        last,
+    uint32_t                        snap
+) {
+    ngx_http_lklb_replica_header_t  *header = ( ngx_http_lklb_replica_header_t * )replica->buf;
+    size_t                           len;
+
+    len = sizeof( ngx_http_lklb_replica_header_t ) + ngx_http_lklb_replica_name_len( zone->name.len );
+
+    ngx_memzero( replica->buf, len );
+
+    header->magic   = NGX_HTTP_LKLB_REPLICA_MAGIC;
+    header->version = NGX_HTTP_LKLB_REPLICA_VERSION;
+    header->type    = ( uint16_t )type;
+    header->node    = replica->node;
+    header->seq     = seq;
+    header->last    = last;
+    header->nlen    = ( uint32_t )zone->name.len;
+    header->snap    = snap;
+
+    ngx_memcpy( replica->buf + sizeof( ngx_http_lklb_replica_header_t ), zone->name.data, zone->name.len );
+
+    return len;
+}
+
+/*
+ * Moves the record at *pos of records into the datagram being built,
+ * unless it would overfill it. Returns 0 once the datagram is full.
+ */
+static ngx_uint_t
+ngx_http_lklb_replica_pack(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_zone_t   *zone,
+    u_char                         *records,
+    size_t                         *pos,
+    size_t                          start,
+    size_t                         *used
+) {
+    ngx_http_lklb_journal_record_t  *record = ( ngx_http_lklb_journal_record_t * )( records + *pos );
+
+    if( ( *used + record->len > NGX_HTTP_LKLB_REPLICA_PAYLOAD ) && ( *used > start ) ) {
+        return 0;
+    }
+
+    if( *used + record->len > NGX_HTTP_LKLB_REPLICA_DATAGRAM ) {
+        ngx_log_error( NGX_LOG_WARN, replica->log, 0, "shared lookup zone \"%V\": %uD byte record not replicated",
+                       &zone->name, record->len );
+    } else {
+        ngx_memcpy( replica->buf + *used, record, record->len );
+        *used += record->len;
+    }
+
+    *pos += record->len;
+
+    return 1;
+}
+
+/* Drops the snapshot sent to a peer along with the parts kept */
+static void
+ngx_http_lklb_replica_snapshot_stop( ngx_http_lklb_replica_peer_t *peer ) {
+    ngx_uint_t  slot;
+
+    if( peer->records ) {
+        ngx_free( peer->records );
+    }
+
+    if( peer->parts ) {
+        for( slot = 0; slot < NGX_HTTP_LKLB_REPLICA_PARTS; slot++ ) {
+            if( peer->parts[ slot ] ) {
+                ngx_free( peer->parts[ slot ] );
+            }
+        }
+
+        ngx_free( peer->parts );
+    }
+
+    peer->records  = NULL;
+    peer->size     = 0;
+    peer->parts    = NULL;
+    peer->plen     = NULL;
+    peer->snapshot = 0;
+    peer->ended    = 0;
+}
+
+/*
+ * Peers get a new snapshot once updates were lost, one underway may have
+ * walked past the entries of those already.
+ */
+static void
+ngx_http_lklb_replica_lost( ngx_http_lklb_replica_t *replica, ngx_http_lklb_replica_zone_t *zone ) {
+    ngx_uint_t  idx;
+
+    for( idx = 0; idx < replica->npeers; idx++ ) {
+        ngx_http_lklb_replica_snapshot_stop( &zone->peers[ idx ] );
+        zone->peers[ idx ].next = 0;
+    }
+}
+
+/* Cuts records into the next datagrams of the stream */
+static void
+ngx_http_lklb_replica_stream(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_zone_t   *zone,
+    u_char                         *records,
+    size_t                          len
+) {
+    size_t       pos = 0, start, used;
+    ngx_uint_t   slot;
+    u_char      *datagram;
+
+    while( pos < len ) {
+        start = ngx_http_lklb_replica_begin( replica, zone, NGX_HTTP_LKLB_REPLICA_UPDATE, zone->seq + 1, 0, 0 );
+        used  = start;
+
+        while( ( pos < len ) && ( ngx_http_lklb_replica_pack( replica, zone, records, &pos, start, &used ) ) ) {
+            /* void */
+        }
+
+        if( used == start ) {
+            continue;
+        }
+
+        datagram = ngx_alloc( used, replica->log );
+        if( NULL == datagram ) {
+            ngx_http_lklb_replica_lost( replica, zone );
+            return;
+        }
+
+        ngx_memcpy( datagram, replica->buf, used );
+
+        zone->seq++;
+        slot = zone->seq % NGX_HTTP_LKLB_REPLICA_HISTORY;
+
+        if( zone->history[ slot ] ) {
+            ngx_free( zone->history[ slot ] );
+        }
+
+        zone->history[ slot ] = datagram;
+        zone->hlen[ slot ]    = used;
+    }
+}
+
+/*
+ * Encodes the next chunk of entries of a snapshot into the records of
+ * the peer. Entries are read like find results, they are encoded at once.
+ */
+static ngx_int_t
+ngx_http_lklb_replica_walk(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_zone_t   *zone,
+    ngx_http_lklb_replica_peer_t   *peer
+) {
+    ngx_http_lklb_radix_ctx_t       *radix_ctx = zone->radix_ctx;
+    ngx_http_lklb_radix_entry_t     *entries = replica->entries;
+    ngx_http_lklb_retval_e           rc;
+    uint32_t                         key[ 4 ], arg[ 4 ];
+    ngx_uint_t                       idx, count, op, nwords;
+    size_t                           need = 0;
+
+    rc = ngx_http_lklb_shards_cursor_next( radix_ctx, &peer->cursor, entries, NGX_HTTP_LKLB_REPLICA_ENTRIES, &count );
+    if( NGX_HTTP_LKLB_ERR == rc ) {
+        return NGX_ERROR;
+    }
+
+    peer->walked = ( NGX_HTTP_LKLB_MATCH == rc );
+
+    for( idx = 0; idx < count; idx++ ) {
+        need += ngx_http_lklb_journal_record_len( ngx_http_lklb_journal_vlen( entries[ idx ].value ) );
+    }
+
+    if( need > peer->size ) {
+        if( peer->records ) {
+            ngx_free( peer->records );
+        }
+
+        peer->size    = ngx_max( need, NGX_HTTP_LKLB_REPLICA_DATAGRAM );
+        peer->records = ngx_alloc( peer->size, replica->log );
+
+        if( NULL == peer->records ) {
+            peer->size = 0;
+            return NGX_ERROR;
+        }
+    }
+
+    peer->len = 0;
+    peer->pos = 0;
+
+    for( idx = 0; idx < count; idx++ ) {
+        if( ngx_http_lklb_value_expired( &radix_ctx->values, entries[ idx ].value ) ) {
+            continue;
+        }
+
+        ngx_http_lklb_journal_entry_op( radix_ctx, &entries[ idx ], &op, &nwords, &key[ 0 ], &arg[ 0 ] );
+
+        peer->len += ngx_http_lklb_journal_encode( peer->records + peer->len, op, nwords, &key[ 0 ], &arg[ 0 ],
+                                                   entries[ idx ].value );
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_lklb_replica_snapshot_start(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_zone_t   *zone,
+    ngx_http_lklb_replica_peer_t   *peer
+) {
+    size_t  size = NGX_HTTP_LKLB_REPLICA_PARTS * ( sizeof( u_char * ) + sizeof( size_t ) );
+
+    ngx_http_lklb_replica_snapshot_stop( peer );
+
+    peer->parts = ngx_calloc( size, replica->log );
+    if( NULL == peer->parts ) {
+        return NGX_ERROR;
+    }
+
+    peer->plen       = ( size_t * )&peer->parts[ NGX_HTTP_LKLB_REPLICA_PARTS ];
+    peer->snapshot   = 1;
+    peer->walked     = 0;
+    peer->snap++;
+    peer->snap_last  = zone->seq;
+    peer->snap_parts = 0;
+    peer->len        = 0;
+    peer->pos        = 0;
+
+    ngx_http_lklb_shards_cursor_init( zone->radix_ctx, &peer->cursor, NULL, 0, 0 );
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_lklb_replica_send_end(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_zone_t   *zone,
+    ngx_uint_t                      idx
+) {
+    ngx_http_lklb_replica_peer_t    *peer = &zone->peers[ idx ];
+    size_t                           len;
+
+    len = ngx_http_lklb_replica_begin( replica, zone, NGX_HTTP_LKLB_REPLICA_SNAPSHOT_END, peer->snap_parts,
+                                       peer->snap_last, peer->snap );
+
+    return replica->send( replica, idx, replica->buf, len );
+}
+
+/*
+ * Sends snapshot parts to peer idx within budget, the end marker once
+ * the walk is done. The peer then takes the stream past the datagram
+ * the snapshot started at, the snapshot may hold some of those already.
+ * Returns NGX_OK once the snapshot is sent.
+ */
+static ngx_int_t
+ngx_http_lklb_replica_send_snapshot(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_zone_t   *zone,
+    ngx_uint_t                      idx,
+    ngx_uint_t                     *budget
+) {
+    ngx_http_lklb_replica_peer_t    *peer = &zone->peers[ idx ];
+    size_t                           start, used, pos;
+    ngx_uint_t                       slot;
+    u_char                          *part;
+
+    while( *budget ) {
+        if( ( peer->pos == peer->len ) && ( !peer->walked ) ) {
+            if( NGX_OK != ngx_http_lklb_replica_walk( replica, zone, peer ) ) {
+                ngx_http_lklb_replica_snapshot_stop( peer );
+                peer->next = 0;
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+
+        if( peer->pos == peer->len ) {
+            if( NGX_AGAIN == ngx_http_lklb_replica_send_end( replica, zone, idx ) ) {
+                return NGX_AGAIN;
+            }
+
+            peer->snapshot = 0;
+            peer->ended    = 1;
+            peer->next     = peer->snap_last + 1;
+            ( *budget )--;
+
+            return NGX_OK;
+        }
+
+        /* Parts end with the chunk so that they can be built again as they were */
+        pos   = peer->pos;
+        start = ngx_http_lklb_replica_begin( replica, zone, NGX_HTTP_LKLB_REPLICA_SNAPSHOT, peer->snap_parts + 1,
+                                             peer->snap_last, peer->snap );
+        used  = start;
+
+        while( ( peer->pos < peer->len ) &&
+               ( ngx_http_lklb_replica_pack( replica, zone, peer->records, &peer->pos, start, &used ) ) ) {
+            /* void */
+        }
+
+        if( used == start ) {
+            continue;
+        }
+
+        if( NGX_AGAIN == replica->send( replica, idx, replica->buf, used ) ) {
+            peer->pos = pos;
+            return NGX_AGAIN;
+        }
+
+        part = ngx_alloc( used, replica->log );
+        if( NULL == part ) {
+            ngx_http_lklb_replica_snapshot_stop( peer );
+            peer->next = 0;
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy( part, replica->buf, used );
+
+        peer->snap_parts++;
+        slot = peer->snap_parts % NGX_HTTP_LKLB_REPLICA_PARTS;
+
+        if( peer->parts[ slot ] ) {
+            ngx_free( peer->parts[ slot ] );
+        }
+
+        peer->parts[ slot ] = part;
+        peer->plen[ slot ]  = used;
+
+        ( *budget )--;
+    }
+
+    return NGX_AGAIN;
+}
+
+/* Sends peer idx what it is missing of the stream */
+static void
+ngx_http_lklb_replica_send_peer(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_zone_t   *zone,
+    ngx_uint_t                      idx,
+    ngx_uint_t                      heartbeat
+) {
+    ngx_http_lklb_replica_peer_t    *peer = &zone->peers[ idx ];
+    ngx_uint_t                       budget = NGX_HTTP_LKLB_REPLICA_BURST, slot;
+    uint64_t                         oldest;
+    size_t                           len;
+
+    oldest = ( zone->seq > NGX_HTTP_LKLB_REPLICA_HISTORY ) ? zone->seq - NGX_HTTP_LKLB_REPLICA_HISTORY + 1 : 1;
+
+    if( ( !peer->snapshot ) && ( peer->next < oldest ) &&
+        ( NGX_OK != ngx_http_lklb_replica_snapshot_start( replica, zone, peer ) ) ) {
+        return;
+    }
+
+    if( ( peer->snapshot ) &&
+        ( NGX_OK != ngx_http_lklb_replica_send_snapshot( replica, zone, idx, &budget ) ) ) {
+        return;
+    }
+
+    while( ( budget ) && ( peer->next <= zone->seq ) ) {
+        slot = peer->next % NGX_HTTP_LKLB_REPLICA_HISTORY;
+
+        /* Errors lose the datagram like the network would */
+        if( NGX_AGAIN == replica->send( replica, idx, zone->history[ slot ], zone->hlen[ slot ] ) ) {
+            return;
+        }
+
+        peer->next++;
+        budget--;
+    }
+
+    if( heartbeat ) {
+        len = ngx_http_lklb_replica_begin( replica, zone, NGX_HTTP_LKLB_REPLICA_HEARTBEAT_MSG, zone->seq, 0, 0 );
+        replica->send( replica, idx, replica->buf, len );
+    }
+}
+
+void
+ngx_http_lklb_replica_tick( ngx_http_lklb_replica_t *replica ) {
+    ngx_http_lklb_replica_zone_t    *zones = replica->zones.elts, *zone;
+    ngx_http_lklb_journal_t         *outbox;
+    ngx_uint_t                       idx, pidx, lost, heartbeat = 0;
+    uint64_t                         gen;
+    u_char                          *buf;
+    size_t                           len;
+
+    if( ( ngx_msec_int_t )( ngx_current_msec - replica->heartbeat ) >= NGX_HTTP_LKLB_REPLICA_HEARTBEAT ) {
+        replica->heartbeat = ngx_current_msec;
+        heartbeat          = 1;
+    }
+
+    for( idx = 0; idx < replica->zones.nelts; idx++ ) {
+        zone   = &zones[ idx ];
+        outbox = zone->radix_ctx->outbox;
+        lost   = outbox->lost;
+
+        if( NGX_OK != ngx_http_lklb_journal_take( outbox, lost, &buf, &len, &gen, replica->log ) ) {
+            lost = 1;
+        }
+
+        if( lost ) {
+            ngx_log_error( NGX_LOG_WARN, replica->log, 0,
+                           "shared lookup zone \"%V\": replication outbox overflowed, resyncing peers", &zone->name );
+            ngx_http_lklb_replica_lost( replica, zone );
+        }
+
+        if( len ) {
+            ngx_http_lklb_replica_stream( replica, zone, buf, len );
+            ngx_free( buf );
+        }
+
+        for( pidx = 0; pidx < replica->npeers; pidx++ ) {
+            ngx_http_lklb_replica_send_peer( replica, zone, pidx, heartbeat );
+        }
+    }
+}
+
+/* Sends a NACK of len bytes built in replica->buf, further ones wait RETRY ms */
+static void
+ngx_http_lklb_replica_request(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_zone_t   *zone,
+    ngx_uint_t                      idx,
+    size_t                          len
+) {
+    ngx_http_lklb_replica_peer_t    *peer = &zone->peers[ idx ];
+
+    if( NGX_AGAIN != replica->send( replica, idx, replica->buf, len ) ) {
+        peer->retry = ngx_current_msec + NGX_HTTP_LKLB_REPLICA_RETRY;
+    }
+}
+
+#define ngx_http_lklb_replica_may_request( __peer )                                     \
+    ( ( ngx_msec_int_t )( ngx_current_msec - ( __peer )->retry ) >= 0 )
+
+/* Asks peer idx for its stream from seq on, 0 for a new snapshot */
+static void
+ngx_http_lklb_replica_request_stream(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_zone_t   *zone,
+    ngx_uint_t                      idx,
+    uint64_t                        seq
+) {
+    size_t  len;
+
+    if( ngx_http_lklb_replica_may_request( &zone->peers[ idx ] ) ) {
+        len = ngx_http_lklb_replica_begin( replica, zone, NGX_HTTP_LKLB_REPLICA_NACK, seq, 0, 0 );
+        ngx_http_lklb_replica_request( replica, zone, idx, len );
+    }
+}
+
+#define ngx_http_lklb_replica_has_part( __peer, __part )                                \
+    ( ( __part ) < 8 * ( __peer )->hsize                                                \
+      && ( ( __peer )->have[ ( __part ) >> 3 ] & ( 1 << ( ( __part ) & 7 ) ) ) )
+
+/*
+ * Asks peer idx for the parts of its snapshot we are missing, lowest
+ * first as those leave its ring first, and for the end marker with none.
+ */
+static void
+ngx_http_lklb_replica_request_parts(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_zone_t   *zone,
+    ngx_uint_t                      idx
+) {
+    ngx_http_lklb_replica_peer_t    *peer = &zone->peers[ idx ];
+    uint64_t                         part, last;
+    size_t                           len;
+
+    if( !ngx_http_lklb_replica_may_request( peer ) ) {
+        return;
+    }
+
+    len  = ngx_http_lklb_replica_begin( replica, zone, NGX_HTTP_LKLB_REPLICA_NACK, 0, peer->rsnap_last,
+                                        peer->rsnap );
+    last = ( peer->rsnap_parts ) ? peer->rsnap_parts : peer->rsnap_max;
+
+    for( part = 1; ( part <= last ) && ( len + sizeof( uint64_t ) <= NGX_HTTP_LKLB_REPLICA_PAYLOAD ); part++ ) {
+        if( !ngx_http_lklb_replica_has_part( peer, part ) ) {
+            ngx_memcpy( replica->buf + len, &part, sizeof( uint64_t ) );
+            len += sizeof( uint64_t );
+        }
+    }
+
+    ngx_http_lklb_replica_request( replica, zone, idx, len );
+}
+
+/*
+ * Applies the records of a datagram without sending them on. Returns
+ * NGX_DECLINED if the zone is read-only, NGX_ERROR if records did not
+ * fit. Records are applied again with the datagram then, which leaves
+ * the zone as if they applied once.
+ */
+static ngx_int_t
+ngx_http_lklb_replica_apply(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_zone_t   *zone,
+    u_char                         *p,
+    u_char                         *end
+) {
+    ngx_http_lklb_journal_record_t  *record;
+    uint64_t                         now = ngx_http_lklb_journal_now();
+    ngx_uint_t                       failed = 0;
+
+    /* Taken once the zone is writable again */
+    if( zone->radix_ctx->readonly ) {
+        return NGX_DECLINED;
+    }
+
+    ngx_http_lklb_shards_remote = 1;
+
+    while( ( size_t )( end - p ) >= sizeof( ngx_http_lklb_journal_record_t ) ) {
+        record = ( ngx_http_lklb_journal_record_t * )p;
+
+        if( !ngx_http_lklb_journal_record_valid( record, ( size_t )( end - p ) ) ) {
+            ngx_log_error( NGX_LOG_WARN, replica->log, 0, "shared lookup zone \"%V\": damaged replication datagram",
+                           &zone->name );
+            break;
+        }
+
+        failed += ngx_http_lklb_journal_apply( zone->radix_ctx, record, now );
+        p += record->len;
+    }
+
+    ngx_http_lklb_shards_remote = 0;
+
+    if( failed ) {
+        ngx_log_error( NGX_LOG_ERR, replica->log, 0, "shared lookup zone \"%V\": %ui replicated updates did not fit",
+                       &zone->name, failed );
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/* Forgets the parts received, the snapshot id is kept to tell late parts */
+static void
+ngx_http_lklb_replica_rsnap_reset( ngx_http_lklb_replica_peer_t *peer ) {
+    if( peer->have ) {
+        ngx_free( peer->have );
+    }
+
+    peer->have        = NULL;
+    peer->hsize       = 0;
+    peer->rsnap_end   = 0;
+    peer->rsnap_parts = 0;
+    peer->rsnap_count = 0;
+    peer->rsnap_max   = 0;
+}
+
+/*
+ * Takes in part of the snapshot being received. Returns NGX_DECLINED if
+ * it had it or the part can not be, NGX_ERROR if out of memory.
+ */
+static ngx_int_t
+ngx_http_lklb_replica_rsnap_part(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_peer_t   *peer,
+    uint64_t                        part
+) {
+    u_char  *have;
+    size_t   size;
+
+    /* part comes off the wire, the bitmap grows to it */
+    if( ( 0 == part ) || ( part > NGX_HTTP_LKLB_REPLICA_MAX_PARTS ) ||
+        ( ( peer->rsnap_end ) && ( part > peer->rsnap_parts ) ) ) {
+        return NGX_DECLINED;
+    }
+
+    if( part >= 8 * peer->hsize ) {
+        size = ngx_min( ngx_max( 2 * peer->hsize, part / 8 + 64 ), NGX_HTTP_LKLB_REPLICA_MAX_PARTS / 8 + 1 );
+
+        have = ngx_calloc( size, replica->log );
+        if( NULL == have ) {
+            return NGX_ERROR;
+        }
+
+        if( peer->have ) {
+            ngx_memcpy( have, peer->have, peer->hsize );
+            ngx_free( peer->have );
+        }
+
+        peer->have  = have;
+        peer->hsize = size;
+    }
+
+    if( ngx_http_lklb_replica_has_part( peer, part ) ) {
+        return NGX_DECLINED;
+    }
+
+    peer->have[ part >> 3 ] |= ( u_char )( 1 << ( part & 7 ) );
+    peer->rsnap_count++;
+    peer->rsnap_max = ngx_max( peer->rsnap_max, part );
+
+    return NGX_OK;
+}
+
+/* Forgets a part that did not apply, it is asked for again */
+static void
+ngx_http_lklb_replica_rsnap_drop( ngx_http_lklb_replica_peer_t *peer, uint64_t part ) {
+    peer->have[ part >> 3 ] &= ( u_char )~( 1 << ( part & 7 ) );
+    peer->rsnap_count--;
+}
+
+/*
+ * Once every part is in the stream of the peer is taken on after the
+ * snapshot, asking for it at once tells the peer to drop the parts kept.
+ */
+static void
+ngx_http_lklb_replica_rsnap_check(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_zone_t   *zone,
+    ngx_uint_t                      idx
+) {
+    ngx_http_lklb_replica_peer_t    *peer = &zone->peers[ idx ];
+    size_t                           len;
+
+    if( ( peer->rsnap_end ) && ( peer->rsnap_count == peer->rsnap_parts ) ) {
+        peer->expect = peer->rsnap_last + 1;
+        ngx_http_lklb_replica_rsnap_reset( peer );
+
+        len = ngx_http_lklb_replica_begin( replica, zone, NGX_HTTP_LKLB_REPLICA_NACK, peer->expect, 0, 0 );
+        ngx_http_lklb_replica_request( replica, zone, idx, len );
+        return;
+    }
+
+    if( ( peer->rsnap_end ) || ( peer->rsnap_count < peer->rsnap_max ) ) {
+        ngx_http_lklb_replica_request_parts( replica, zone, idx );
+    }
+}
+
+/*
+ * A peer asks for our stream from seq on, a snapshot with seq 0. Asking
+ * for parts of the snapshot it got gets those sent again, the end marker
+ * too once sent. Parts that left the ring take a new snapshot.
+ */
+static void
+ngx_http_lklb_replica_nack(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_zone_t   *zone,
+    ngx_uint_t                      idx,
+    ngx_http_lklb_replica_header_t *header,
+    u_char                         *p,
+    u_char                         *end
+) {
+    ngx_http_lklb_replica_peer_t    *peer = &zone->peers[ idx ];
+    uint64_t                         part;
+    ngx_uint_t                       slot;
+
+    if( header->seq ) {
+        /* Past the snapshot being sent the stream follows anyway */
+        if( ( !peer->snapshot ) && ( header->seq <= zone->seq + 1 ) ) {
+            ngx_http_lklb_replica_snapshot_stop( peer );
+            peer->next = header->seq;
+        }
+
+        return;
+    }
+
+    if( ( 0 == header->snap ) || ( header->snap != peer->snap ) || ( NULL == peer->parts ) ) {
+        ngx_http_lklb_replica_snapshot_stop( peer );
+        peer->next = 0;
+        return;
+    }
+
+    for( /* void */; ( size_t )( end - p ) >= sizeof( uint64_t ); p += sizeof( uint64_t ) ) {
+        ngx_memcpy( &part, p, sizeof( uint64_t ) );
+
+        if( ( 0 == part ) || ( part > peer->snap_parts ) ||
+            ( part + NGX_HTTP_LKLB_REPLICA_PARTS <= peer->snap_parts ) ) {
+            ngx_http_lklb_replica_snapshot_stop( peer );
+            peer->next = 0;
+            return;
+        }
+
+        slot = part % NGX_HTTP_LKLB_REPLICA_PARTS;
+        replica->send( replica, idx, peer->parts[ slot ], peer->plen[ slot ] );
+    }
+
+    if( peer->ended ) {
+        ngx_http_lklb_replica_send_end( replica, zone, idx );
+    }
+}
+
+void
+ngx_http_lklb_replica_receive(
+    ngx_http_lklb_replica_t    *replica,
+    ngx_uint_t                  idx,
+    u_char                     *buf,
+    size_t                      len
+) {
+    ngx_http_lklb_replica_header_t  *header = ( ngx_http_lklb_replica_header_t * )buf;
+    ngx_http_lklb_replica_zone_t    *zones = replica->zones.elts, *zone = NULL;
+    ngx_http_lklb_replica_peer_t    *peer;
+    ngx_uint_t                       zidx;
+    ngx_int_t                        rc;
+    u_char                          *p, *end = buf + len;
+
+    if( ( len < sizeof( ngx_http_lklb_replica_header_t ) ) ||
+        ( NGX_HTTP_LKLB_REPLICA_MAGIC != header->magic ) || ( NGX_HTTP_LKLB_REPLICA_VERSION != header->version ) ||
+        ( ngx_http_lklb_replica_name_len( header->nlen ) > len - sizeof( ngx_http_lklb_replica_header_t ) ) ) {
+        ngx_log_error( NGX_LOG_WARN, replica->log, 0, "invalid lookup replication datagram" );
+        return;
+    }
+
+    p = buf + sizeof( ngx_http_lklb_replica_header_t );
+
+    for( zidx = 0; zidx < replica->zones.nelts; zidx++ ) {
+        if( ( zones[ zidx ].name.len == header->nlen ) &&
+            ( 0 == ngx_strncmp( zones[ zidx ].name.data, p, header->nlen ) ) ) {
+            zone = &zones[ zidx ];
+            break;
+        }
+    }
+
+    if( NULL == zone ) {
+        ngx_log_debug0( NGX_LOG_DEBUG_HTTP, replica->log, 0, "lookup replication datagram for unknown zone" );
+        return;
+    }
+
+    p   += ngx_http_lklb_replica_name_len( header->nlen );
+    peer = &zone->peers[ idx ];
+
+    if( NGX_HTTP_LKLB_REPLICA_NACK == header->type ) {
+        ngx_http_lklb_replica_nack( replica, zone, idx, header, p, end );
+        return;
+    }
+
+    /* A new stream, e.g. of a restarted peer, is taken from a snapshot */
+    if( header->node != peer->node ) {
+        ngx_http_lklb_replica_rsnap_reset( peer );
+        peer->rsnap  = 0;
+        peer->node   = header->node;
+        peer->expect = 0;
+        peer->retry  = ngx_current_msec;
+    }
+
+    switch( header->type ) {
+        case NGX_HTTP_LKLB_REPLICA_UPDATE:
+        case NGX_HTTP_LKLB_REPLICA_HEARTBEAT_MSG:
+            /* Sent past the end of a snapshot only, so we missed the end */
+            if( 0 == peer->expect ) {
+                if( peer->rsnap ) {
+                    ngx_http_lklb_replica_request_parts( replica, zone, idx );
+                } else {
+                    ngx_http_lklb_replica_request_stream( replica, zone, idx, 0 );
+                }
+            } else if( ( NGX_HTTP_LKLB_REPLICA_UPDATE == header->type ) && ( header->seq == peer->expect ) ) {
+                if( NGX_OK == ngx_http_lklb_replica_apply( replica, zone, p, end ) ) {
+                    peer->expect++;
+                }
+            } else if( header->seq >= peer->expect ) {
+                ngx_http_lklb_replica_request_stream( replica, zone, idx, peer->expect );
+            }
+
+            break;
+
+        case NGX_HTTP_LKLB_REPLICA_SNAPSHOT:
+        case NGX_HTTP_LKLB_REPLICA_SNAPSHOT_END:
+            /* Parts of an earlier snapshot or sent again after it completed */
+            if( ( peer->rsnap ) &&
+                ( ( header->snap < peer->rsnap ) || ( ( header->snap == peer->rsnap ) && ( peer->expect ) ) ) ) {
+                break;
+            }
+
+            if( header->snap != peer->rsnap ) {
+                ngx_http_lklb_replica_rsnap_reset( peer );
+                peer->rsnap      = header->snap;
+                peer->rsnap_last = header->last;
+                peer->expect     = 0;
+            }
+
+            if( NGX_HTTP_LKLB_REPLICA_SNAPSHOT_END == header->type ) {
+                if( ( header->seq > NGX_HTTP_LKLB_REPLICA_MAX_PARTS ) || ( header->seq < peer->rsnap_max ) ) {
+                    break;
+                }
+
+                peer->rsnap_end   = 1;
+                peer->rsnap_parts = header->seq;
+            } else {
+                rc = ngx_http_lklb_replica_rsnap_part( replica, peer, header->seq );
+
+                if( NGX_ERROR == rc ) {
+                    ngx_http_lklb_replica_rsnap_reset( peer );
+                    peer->rsnap = 0;
+                    ngx_http_lklb_replica_request_stream( replica, zone, idx, 0 );
+                    break;
+                }
+
+                if( ( NGX_OK == rc ) && ( NGX_OK != ngx_http_lklb_replica_apply( replica, zone, p, end ) ) ) {
+                    ngx_http_lklb_replica_rsnap_drop( peer, header->seq );
+                }
+            }
+
+            ngx_http_lklb_replica_rsnap_check( replica, zone, idx );
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*
+ * Handler for the lookup_replication directive. Zones with the replicate
+ * option are replicated to every peer, which must list this instance as
+ * a peer in turn, datagrams are told apart by source address and port.
+ */
+char *
+ngx_http_lklb_replication( ngx_conf_t *cf, ngx_command_t *cmd, void *conf ) {
+    ngx_http_lklb_main_conf_t       *lklbmcf = conf;
+    ngx_http_lklb_replica_conf_t    *rconf;
+    ngx_str_t                       *value;
+    ngx_addr_t                      *peer;
+    ngx_url_t                        u;
+    ngx_uint_t                       idx;
+
+    if( lklbmcf->replica ) {
+        return "is duplicate";
+    }
+
+    rconf = ngx_pcalloc( cf->pool, sizeof( ngx_http_lklb_replica_conf_t ) );
+    if( NULL == rconf ) {
+        return NGX_CONF_ERROR;
+    }
+
+    rconf->peers = ngx_array_create( cf->pool, cf->args->nelts - 2, sizeof( ngx_addr_t ) );
+    if( NULL == rconf->peers ) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    for( idx = 1; idx < cf->args->nelts; idx++ ) {
+        ngx_memzero( &u, sizeof( ngx_url_t ) );
+
+        u.url    = value[ idx ];
+        u.listen = ( 1 == idx );
+
+        if( ( NGX_OK != ngx_parse_url( cf->pool, &u ) ) || ( u.no_port ) || ( 0 == u.naddrs ) ) {
+            ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "invalid lookup replication address \"%V\"%s%s",
+                                &value[ idx ], ( u.err ) ? ": " : "", ( u.err ) ? u.err : "" );
+            return NGX_CONF_ERROR;
+        }
+
+        if( 1 == idx ) {
+            rconf->listen = u.addrs[ 0 ];
+            continue;
+        }
+
+        peer = ngx_array_push( rconf->peers );
+        if( NULL == peer ) {
+            return NGX_CONF_ERROR;
+        }
+
+        *peer = u.addrs[ 0 ];
+    }
+
+    lklbmcf->replica = rconf;
+
+    return NGX_CONF_OK;
+}
+
+static ngx_event_t  ngx_http_lklb_replica_event;
+
+static ngx_int_t
+ngx_http_lklb_replica_sendto(
+    ngx_http_lklb_replica_t    *replica,
+    ngx_uint_t                  idx,
+    u_char                     *buf,
+    size_t                      len
+) {
+    ngx_addr_t  *peers = replica->conf->peers->elts;
+    ngx_err_t    err;
+
+    if( ( ngx_socket_t )-1 == replica->fd ) {
+        return NGX_AGAIN;
+    }
+
+    if( -1 == sendto( replica->fd, buf, len, 0, peers[ idx ].sockaddr, peers[ idx ].socklen ) ) {
+        err = ngx_socket_errno;
+
+        if( NGX_EAGAIN == err ) {
+            return NGX_AGAIN;
+        }
+
+        ngx_log_debug1( NGX_LOG_DEBUG_HTTP, replica->log, err, "lookup replication sendto() %V failed",
+                        &peers[ idx ].name );
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Binds the replication socket. While the workers of the previous cycle
+ * still hold the address this fails and is retried every tick.
+ */
+static ngx_int_t
+ngx_http_lklb_replica_bind( ngx_http_lklb_replica_t *replica ) {
+    ngx_addr_t      *listen = &replica->conf->listen;
+    ngx_socket_t     fd;
+    int              on = 1, rcvbuf = NGX_HTTP_LKLB_REPLICA_RCVBUF;
+
+    fd = ngx_socket( listen->sockaddr->sa_family, SOCK_DGRAM, 0 );
+    if( ( ngx_socket_t )-1 == fd ) {
+        ngx_log_error( NGX_LOG_ALERT, replica->log, ngx_socket_errno, ngx_socket_n " failed" );
+        return NGX_ERROR;
+    }
+
+    if( -1 == ngx_nonblocking( fd ) ) {
+        ngx_log_error( NGX_LOG_ALERT, replica->log, ngx_socket_errno, ngx_nonblocking_n " failed" );
+        goto lfailed;
+    }
+
+    /* Best effort, bursts get retransmitted anyway */
+    ( void )setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, ( const void * )&on, sizeof( int ) );
+    ( void )setsockopt( fd, SOL_SOCKET, SO_RCVBUF, ( const void * )&rcvbuf, sizeof( int ) );
+
+    if( -1 == bind( fd, listen->sockaddr, listen->socklen ) ) {
+        if( !replica->warned ) {
+            ngx_log_error( NGX_LOG_ERR, replica->log, ngx_socket_errno,
+                           "lookup replication bind() to %V failed, retrying", &listen->name );
+            replica->warned = 1;
+        }
+
+        goto lfailed;
+    }
+
+    replica->fd = fd;
+
+    return NGX_OK;
+
+lfailed:
+    if( -1 == ngx_close_socket( fd ) ) {
+        ngx_log_error( NGX_LOG_ALERT, replica->log, ngx_socket_errno, ngx_close_socket_n " failed" );
+    }
+
+    return NGX_ERROR;
+}
+
+static void
+ngx_http_lklb_replica_close( ngx_http_lklb_replica_t *replica ) {
+    if( ( ngx_socket_t )-1 == replica->fd ) {
+        return;
+    }
+
+    if( -1 == ngx_close_socket( replica->fd ) ) {
+        ngx_log_error( NGX_LOG_ALERT, replica->log, ngx_socket_errno, ngx_close_socket_n " failed" );
+    }
+
+    replica->fd = ( ngx_socket_t )-1;
+}
+
+/* Reads what the peers sent since the last tick */
+static void
+ngx_http_lklb_replica_read( ngx_http_lklb_replica_t *replica ) {
+    ngx_addr_t      *peers = replica->conf->peers->elts;
+    ngx_sockaddr_t   sa;
+    socklen_t        socklen;
+    ssize_t          n;
+    ngx_uint_t       count, idx;
+    ngx_err_t        err;
+
+    for( count = 0; count < NGX_HTTP_LKLB_REPLICA_READS; count++ ) {
+        socklen = sizeof( ngx_sockaddr_t );
+
+        n = recvfrom( replica->fd, replica->rbuf, NGX_HTTP_LKLB_REPLICA_DATAGRAM, 0, &sa.sockaddr, &socklen );
+        if( -1 == n ) {
+            err = ngx_socket_errno;
+
+            if( ( NGX_EAGAIN != err ) && ( NGX_EINTR != err ) ) {
+                ngx_log_error( NGX_LOG_ERR, replica->log, err, "lookup replication recvfrom() failed" );
+            }
+
+            return;
+        }
+
+        for( idx = 0; idx < replica->npeers; idx++ ) {
+            if( NGX_OK == ngx_cmp_sockaddr( &sa.sockaddr, socklen, peers[ idx ].sockaddr, peers[ idx ].socklen, 1 ) ) {
+                break;
+            }
+        }
+
+        if( idx == replica->npeers ) {
+            ngx_log_debug0( NGX_LOG_DEBUG_HTTP, replica->log, 0, "lookup replication datagram from unknown peer" );
+            continue;
+        }
+
+        ngx_http_lklb_replica_receive( replica, idx, replica->rbuf, ( size_t )n );
+    }
+}
+
+static void
+ngx_http_lklb_replica_handler( ngx_event_t *ev ) {
+    ngx_http_lklb_replica_t     *replica = ev->data;
+
+    /* The next cycle takes over the address */
+    if( ngx_exiting ) {
+        ngx_http_lklb_replica_close( replica );
+        return;
+    }
+
+    if( ( ( ngx_socket_t )-1 != replica->fd ) || ( NGX_OK == ngx_http_lklb_replica_bind( replica ) ) ) {
+        ngx_http_lklb_replica_read( replica );
+    }
+
+    /* Outboxes are streamed even while unbound so that they do not overflow */
+    ngx_http_lklb_replica_tick( replica );
+
+    ngx_add_timer( ev, NGX_HTTP_LKLB_REPLICA_INTERVAL );
+}
+
+ngx_int_t
+ngx_http_lklb_replica_init_process(
+    ngx_cycle_t                    *cycle,
+    ngx_http_lklb_replica_conf_t   *conf,
+    ngx_array_t                    *shared_libs
+) {
+    ngx_http_lklb_replica_t     *replica;
+    ngx_http_lklb_shared_t      *shared = shared_libs->elts;
+    ngx_http_lklb_ctx_t         *ctx;
+    ngx_uint_t                   idx;
+
+    replica = ngx_http_lklb_replica_create( cycle->pool, conf->peers->nelts, cycle->log );
+    if( NULL == replica ) {
+        return NGX_ERROR;
+    }
+
+    for( idx = 0; idx < shared_libs->nelts; idx++ ) {
+        ctx = shared[ idx ].ctx;
+
+        if( ( NULL == ctx->shpool ) || ( !ctx->replicate ) ) {
+            continue;
+        }
+
+        if( NGX_OK != ngx_http_lklb_replica_add_zone( replica, &shared[ idx ].zone->shm.name,
+                                                      ngx_http_lklb_ctx_radix( ctx ) ) ) {
+            return NGX_ERROR;
+        }
+    }
+
+    if( 0 == replica->zones.nelts ) {
+        return NGX_OK;
+    }
+
+    replica->conf = conf;
+    ngx_http_lklb_replica_set_send( replica, ngx_http_lklb_replica_sendto, NULL );
+
+    ngx_http_lklb_replica_bind( replica );
+
+    ngx_http_lklb_replica_event.handler    = ngx_http_lklb_replica_handler;
+    ngx_http_lklb_replica_event.data       = replica;
+    ngx_http_lklb_replica_event.log        = cycle->log;
+    ngx_http_lklb_replica_event.cancelable = 1;
+
+    ngx_add_timer( &ngx_http_lklb_replica_event, NGX_HTTP_LKLB_REPLICA_INTERVAL );
+
+    return NGX_OK;
+}
+
+void
+ngx_http_lklb_replica_exit_process( ngx_cycle_t *cycle ) {
+    if( NULL == ngx_http_lklb_replica_event.data ) {
+        return;
+    }
+
+    ngx_http_lklb_replica_close( ngx_http_lklb_replica_event.data );
+}
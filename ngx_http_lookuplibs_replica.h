@@ -0,0 +1,124 @@
+#ifndef _NGX_HTTP_LOOKUPLIBS_REPLICA_H_INCLUDED_
+#define _NGX_HTTP_LOOKUPLIBS_REPLICA_H_INCLUDED_
+
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_shards.h"
+
+/* Timer tick, heartbeat period, least time between retransmit requests */
+#define NGX_HTTP_LKLB_REPLICA_INTERVAL      50
+#define NGX_HTTP_LKLB_REPLICA_HEARTBEAT     1000
+#define NGX_HTTP_LKLB_REPLICA_RETRY         200
+
+/* Shared outbox of a zone, datagrams kept for retransmits and sent per peer and tick */
+#define NGX_HTTP_LKLB_REPLICA_OUTBOX        ( 1 << 20 )
+#define NGX_HTTP_LKLB_REPLICA_HISTORY       1024
+#define NGX_HTTP_LKLB_REPLICA_BURST         256
+
+/* Records are packed up to PAYLOAD bytes, a larger one goes alone up to DATAGRAM */
+#define NGX_HTTP_LKLB_REPLICA_PAYLOAD       1400
+#define NGX_HTTP_LKLB_REPLICA_DATAGRAM      65000
+#define NGX_HTTP_LKLB_REPLICA_RCVBUF        ( 4 << 20 )
+
+#define NGX_HTTP_LKLB_REPLICA_MAGIC         0x6c6b7270
+#define NGX_HTTP_LKLB_REPLICA_VERSION       1
+
+typedef enum {
+    NGX_HTTP_LKLB_REPLICA_UPDATE            = 0,
+    NGX_HTTP_LKLB_REPLICA_HEARTBEAT_MSG     = 1,
+    NGX_HTTP_LKLB_REPLICA_NACK              = 2,
+    NGX_HTTP_LKLB_REPLICA_SNAPSHOT          = 3,
+    NGX_HTTP_LKLB_REPLICA_SNAPSHOT_END      = 4
+} ngx_http_lklb_replica_type_e;
+
+/*
+ * Datagram header, followed by the zone name padded to 8 bytes and, for
+ * updates and snapshot parts, journal records. Fields are in host order,
+ * peers must share the byte order. node identifies the stream of the
+ * sender, a new one starts with every first worker. snap numbers the
+ * snapshots sent to a peer.
+ *  UPDATE          seq: number of the datagram in the stream of the zone
+ *  HEARTBEAT       seq: last datagram sent
+ *  NACK            seq: first datagram missing. With seq 0 snap and last
+ *                  as in the snapshot, followed by the parts missing,
+ *                  snap 0 asks for a new snapshot
+ *  SNAPSHOT        seq: part number from 1, last: stream datagram it covers
+ *  SNAPSHOT_END    seq: number of parts, last: as above
+ */
+typedef struct {
+    uint32_t                     magic;
+    uint16_t                     version;
+    uint16_t                     type;
+    uint64_t                     node;
+    uint64_t                     seq;
+    uint64_t                     last;
+    uint32_t                     nlen;
+    uint32_t                     snap;
+} ngx_http_lklb_replica_header_t;
+
+typedef struct {
+    ngx_addr_t                   listen;
+    ngx_array_t                 *peers;
+} ngx_http_lklb_replica_conf_t;
+
+typedef struct ngx_http_lklb_replica_s ngx_http_lklb_replica_t;
+
+/* Sends a datagram to peer idx, NGX_AGAIN if it would block */
+typedef ngx_int_t (*ngx_http_lklb_replica_send_pt)(
+    ngx_http_lklb_replica_t    *replica,
+    ngx_uint_t                  idx,
+    u_char                     *buf,
+    size_t                      len
+);
+
+/*
+ * Handler for the lookup_replication directive
+ *      "lookup_replication <listen address:port> <peer address:port> ..."
+ */
+char *
+ngx_http_lklb_replication( ngx_conf_t *cf, ngx_command_t *cmd, void *conf );
+
+ngx_http_lklb_replica_t *
+ngx_http_lklb_replica_create( ngx_pool_t *pool, ngx_uint_t npeers, ngx_log_t *log );
+
+ngx_int_t
+ngx_http_lklb_replica_add_zone(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_str_t                      *name,
+    ngx_http_lklb_radix_ctx_t      *radix_ctx
+);
+
+void
+ngx_http_lklb_replica_set_send(
+    ngx_http_lklb_replica_t        *replica,
+    ngx_http_lklb_replica_send_pt   send,
+    void                           *data
+);
+
+/*
+ * Moves the outboxes into the streams and sends to every peer what it
+ * is missing, paced to NGX_HTTP_LKLB_REPLICA_BURST datagrams per tick.
+ */
+void
+ngx_http_lklb_replica_tick( ngx_http_lklb_replica_t *replica );
+
+/* Handles a datagram received from peer idx */
+void
+ngx_http_lklb_replica_receive(
+    ngx_http_lklb_replica_t    *replica,
+    ngx_uint_t                  idx,
+    u_char                     *buf,
+    size_t                      len
+);
+
+/* Replication runs in the first worker, on a socket of its own */
+ngx_int_t
+ngx_http_lklb_replica_init_process(
+    ngx_cycle_t                    *cycle,
+    ngx_http_lklb_replica_conf_t   *conf,
+    ngx_array_t                    *shared_libs
+);
+
+void
+ngx_http_lklb_replica_exit_process( ngx_cycle_t *cycle );
+
+#endif /* _NGX_HTTP_LOOKUPLIBS_REPLICA_H_INCLUDED_ */
@@ -0,0 +1,1219 @@
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_transforms.h"
+#include "ngx_http_lookuplibs_shards.h"
+#include "ngx_http_lookuplibs_queue.h"
+#include "ngx_http_lookuplibs_journal.h"
+
+#define NGX_HTTP_LKLB_SHARDS_INSERT     0
+#define NGX_HTTP_LKLB_SHARDS_DELETE     1
+#define NGX_HTTP_LKLB_SHARDS_UNDO       2
+
+/* Mask of the key bits selecting a shard */
+static uint32_t
+ngx_http_lklb_shards_mask( ngx_http_lklb_radix_ctx_t *radix_ctx ) {
+    return ( uint32_t )( -1 ) << ( 32 - radix_ctx->bits );
+}
+
+static ngx_int_t
+ngx_http_lklb_shards_cmp( uint32_t *a, uint32_t *b, ngx_uint_t nwords ) {
+    ngx_uint_t  idx;
+
+    for( idx = 0; idx < nwords; idx++ ) {
+        if( a[ idx ] != b[ idx ] ) {
+            return( ( a[ idx ] < b[ idx ] ) ? -1 : 1 );
+        }
+    }
+
+    return 0;
+}
+
+/* Transforms are their own inverse, keys convert both ways alike */
+static void
+ngx_http_lklb_shards_transform( ngx_http_lklb_radix_ctx_t *radix_ctx, uint32_t *key, ngx_uint_t nwords ) {
+    ngx_uint_t  idx;
+
+    for( idx = 0; idx < nwords; idx++ ) {
+        key[ idx ] = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, key[ idx ] );
+    }
+}
+
+/* First word of a stored bit string, bits past len are cleared */
+static uint32_t
+ngx_http_lklb_shards_word( uint8_t *key, ngx_uint_t bits ) {
+    uint32_t    word = 0;
+    ngx_uint_t  idx;
+
+    for( idx = 0; ( idx < 4 ) && ( 8 * idx < bits ); idx++ ) {
+        word |= ( uint32_t )key[ idx ] << ( 24 - 8 * idx );
+    }
+
+    if( bits < 32 ) {
+        word &= ( bits ) ? ( uint32_t )( -1 ) << ( 32 - bits ) : 0;
+    }
+
+    return word;
+}
+
+/*
+ * Prefixes shorter than the shard bits cover several shards and are
+ * stored in each of them, under the very key and mask. If a shard can
+ * not store it, it is taken back from the shards that stored it, shards
+ * that held it before keep it.
+ */
+static ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint32_insert_apply(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                    key,
+    uint32_t                    mask,
+    void                       *value
+) {
+    uint32_t                 hkey, hmask;
+    ngx_uint_t               lo, hi, idx, stored = 0;
+    u_char                   match[ NGX_HTTP_LKLB_SHARDS_MAX ];
+    ngx_http_lklb_retval_e   rc;
+    void                    *result;
+
+    hmask = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, mask );
+    hkey  = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, key ) & hmask;
+
+    lo = ngx_http_lklb_shard_idx( radix_ctx, hkey );
+    hi = ngx_http_lklb_shard_idx( radix_ctx, hkey | ~hmask );
+
+    for( idx = lo; idx <= hi; idx++ ) {
+        rc = ngx_http_lklb_radix_uint32_insert_with_mask( radix_ctx->shards[ idx ].tree, key, mask, value );
+
+        if( NGX_HTTP_LKLB_ERR == rc ) {
+            while( idx-- > lo ) {
+                if( ( match[ idx ] ) &&
+                    ( NGX_HTTP_LKLB_MATCH == ngx_http_lklb_radix_uint32_delete_with_mask(
+                                                 radix_ctx->shards[ idx ].tree, key, mask, &result ) ) ) {
+                    ngx_http_lklb_value_unref( &radix_ctx->values, result );
+                }
+            }
+
+            return NGX_HTTP_LKLB_ERR;
+        }
+
+        match[ idx ] = ( NGX_HTTP_LKLB_MATCH == rc );
+        stored      += match[ idx ];
+    }
+
+    return( ( stored ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_DUP );
+}
+
+static ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint32_delete_apply(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                    key,
+    uint32_t                    mask,
+    void                      **value
+) {
+    uint32_t                 hkey, hmask;
+    ngx_uint_t               lo, hi, idx, found = 0;
+    void                    *result;
+
+    hmask = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, mask );
+    hkey  = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, key ) & hmask;
+
+    lo = ngx_http_lklb_shard_idx( radix_ctx, hkey );
+    hi = ngx_http_lklb_shard_idx( radix_ctx, hkey | ~hmask );
+
+    for( idx = lo; idx <= hi; idx++ ) {
+        if( NGX_HTTP_LKLB_MATCH != ngx_http_lklb_radix_uint32_delete_with_mask( radix_ctx->shards[ idx ].tree,
+                                                                                key, mask, &result ) ) {
+            continue;
+        }
+
+        /* The first value is handed over, the other references are dropped */
+        if( found++ ) {
+            ngx_http_lklb_value_unref( &radix_ctx->values, result );
+        } else if( value ) {
+            *value = result;
+        }
+    }
+
+    return( ( found ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_ERR );
+}
+
+static ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint128_insert_apply(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                   *key,
+    uint32_t                   *mask,
+    void                       *value
+) {
+    uint32_t                 hkey, hmask;
+    ngx_uint_t               lo, hi, idx, stored = 0;
+    u_char                   match[ NGX_HTTP_LKLB_SHARDS_MAX ];
+    ngx_http_lklb_retval_e   rc;
+    void                    *result;
+
+    hmask = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, mask[ 0 ] );
+    hkey  = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, key[ 0 ] ) & hmask;
+
+    lo = ngx_http_lklb_shard_idx( radix_ctx, hkey );
+    hi = ngx_http_lklb_shard_idx( radix_ctx, hkey | ~hmask );
+
+    for( idx = lo; idx <= hi; idx++ ) {
+        rc = ngx_http_lklb_radix_uint128_insert_with_mask( radix_ctx->shards[ idx ].tree, key, mask, value );
+
+        if( NGX_HTTP_LKLB_ERR == rc ) {
+            while( idx-- > lo ) {
+                if( ( match[ idx ] ) &&
+                    ( NGX_HTTP_LKLB_MATCH == ngx_http_lklb_radix_uint128_delete_with_mask(
+                                                 radix_ctx->shards[ idx ].tree, key, mask, &result ) ) ) {
+                    ngx_http_lklb_value_unref( &radix_ctx->values, result );
+                }
+            }
+
+            return NGX_HTTP_LKLB_ERR;
+        }
+
+        match[ idx ] = ( NGX_HTTP_LKLB_MATCH == rc );
+        stored      += match[ idx ];
+    }
+
+    return( ( stored ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_DUP );
+}
+
+static ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint128_delete_apply(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                   *key,
+    uint32_t                   *mask,
+    void                      **value
+) {
+    uint32_t                 hkey, hmask;
+    ngx_uint_t               lo, hi, idx, found = 0;
+    void                    *result;
+
+    hmask = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, mask[ 0 ] );
+    hkey  = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, key[ 0 ] ) & hmask;
+
+    lo = ngx_http_lklb_shard_idx( radix_ctx, hkey );
+    hi = ngx_http_lklb_shard_idx( radix_ctx, hkey | ~hmask );
+
+    for( idx = lo; idx <= hi; idx++ ) {
+        if( NGX_HTTP_LKLB_MATCH != ngx_http_lklb_radix_uint128_delete_with_mask( radix_ctx->shards[ idx ].tree,
+                                                                                 key, mask, &result ) ) {
+            continue;
+        }
+
+        if( found++ ) {
+            ngx_http_lklb_value_unref( &radix_ctx->values, result );
+        } else if( value ) {
+            *value = result;
+        }
+    }
+
+    return( ( found ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_ERR );
+}
+
+ngx_uint_t  ngx_http_lklb_shards_remote;
+
+void
+ngx_http_lklb_shards_log_lock( ngx_http_lklb_radix_ctx_t *radix_ctx ) {
+    if( radix_ctx->journal ) {
+        ngx_http_lklb_journal_lock( radix_ctx->journal );
+    }
+
+    if( radix_ctx->outbox ) {
+        ngx_http_lklb_journal_lock( radix_ctx->outbox );
+    }
+}
+
+void
+ngx_http_lklb_shards_log_unlock( ngx_http_lklb_radix_ctx_t *radix_ctx ) {
+    if( radix_ctx->outbox ) {
+        ngx_http_lklb_journal_unlock( radix_ctx->outbox );
+    }
+
+    if( radix_ctx->journal ) {
+        ngx_http_lklb_journal_unlock( radix_ctx->journal );
+    }
+}
+
+void
+ngx_http_lklb_shards_log(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_uint_t                  op,
+    ngx_uint_t                  nwords,
+    uint32_t                   *key,
+    uint32_t                   *arg,
+    ngx_http_lklb_value_t      *value
+) {
+    if( radix_ctx->journal ) {
+        ngx_http_lklb_journal_append( radix_ctx->journal, op, nwords, key, arg, value );
+    }
+
+    /* Updates from peers are not sent back out */
+    if( ( radix_ctx->outbox ) && ( !ngx_http_lklb_shards_remote ) ) {
+        ngx_http_lklb_journal_append( radix_ctx->outbox, op, nwords, key, arg, value );
+    }
+}
+
+/*
+ * The write APIs log to the journal and the replication outbox of the
+ * zone, if any, under their locks held across the op so that records
+ * are in the order ops apply.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint32_insert_with_mask(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                    key,
+    uint32_t                    mask,
+    void                       *value
+) {
+    ngx_http_lklb_retval_e       rc;
+
+    if( !ngx_http_lklb_shards_logged( radix_ctx ) ) {
+        return ngx_http_lklb_shards_uint32_insert_apply( radix_ctx, key, mask, value );
+    }
+
+    ngx_http_lklb_shards_log_lock( radix_ctx );
+
+    rc = ngx_http_lklb_shards_uint32_insert_apply( radix_ctx, key, mask, value );
+
+    if( NGX_HTTP_LKLB_MATCH == rc ) {
+        ngx_http_lklb_shards_log( radix_ctx, NGX_HTTP_LKLB_QUEUE_INSERT, 1, &key, &mask, value );
+    }
+
+    ngx_http_lklb_shards_log_unlock( radix_ctx );
+
+    return rc;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint32_delete_with_mask(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                    key,
+    uint32_t                    mask,
+    void                      **value
+) {
+    ngx_http_lklb_retval_e       rc;
+
+    if( !ngx_http_lklb_shards_logged( radix_ctx ) ) {
+        return ngx_http_lklb_shards_uint32_delete_apply( radix_ctx, key, mask, value );
+    }
+
+    ngx_http_lklb_shards_log_lock( radix_ctx );
+
+    rc = ngx_http_lklb_shards_uint32_delete_apply( radix_ctx, key, mask, value );
+
+    if( NGX_HTTP_LKLB_MATCH == rc ) {
+        ngx_http_lklb_shards_log( radix_ctx, NGX_HTTP_LKLB_QUEUE_DELETE, 1, &key, &mask, NULL );
+    }
+
+    ngx_http_lklb_shards_log_unlock( radix_ctx );
+
+    return rc;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint128_insert_with_mask(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                   *key,
+    uint32_t                   *mask,
+    void                       *value
+) {
+    ngx_http_lklb_retval_e       rc;
+
+    if( !ngx_http_lklb_shards_logged( radix_ctx ) ) {
+        return ngx_http_lklb_shards_uint128_insert_apply( radix_ctx, key, mask, value );
+    }
+
+    ngx_http_lklb_shards_log_lock( radix_ctx );
+
+    rc = ngx_http_lklb_shards_uint128_insert_apply( radix_ctx, key, mask, value );
+
+    if( NGX_HTTP_LKLB_MATCH == rc ) {
+        ngx_http_lklb_shards_log( radix_ctx, NGX_HTTP_LKLB_QUEUE_INSERT, 4, key, mask, value );
+    }
+
+    ngx_http_lklb_shards_log_unlock( radix_ctx );
+
+    return rc;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint128_delete_with_mask(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                   *key,
+    uint32_t                   *mask,
+    void                      **value
+) {
+    ngx_http_lklb_retval_e       rc;
+
+    if( !ngx_http_lklb_shards_logged( radix_ctx ) ) {
+        return ngx_http_lklb_shards_uint128_delete_apply( radix_ctx, key, mask, value );
+    }
+
+    ngx_http_lklb_shards_log_lock( radix_ctx );
+
+    rc = ngx_http_lklb_shards_uint128_delete_apply( radix_ctx, key, mask, value );
+
+    if( NGX_HTTP_LKLB_MATCH == rc ) {
+        ngx_http_lklb_shards_log( radix_ctx, NGX_HTTP_LKLB_QUEUE_DELETE, 4, key, mask, NULL );
+    }
+
+    ngx_http_lklb_shards_log_unlock( radix_ctx );
+
+    return rc;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint32_find_with_mask(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                    key,
+    uint32_t                    mask,
+    void                      **value,
+    uint8_t                     prefix
+) {
+    uint32_t    hkey;
+
+    hkey = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, key )
+         & ngx_http_lklb_uint32_htonl( radix_ctx->transforms, mask );
+
+    return ngx_http_lklb_radix_uint32_find_with_mask( ngx_http_lklb_shard_tree( radix_ctx, hkey ),
+                                                      key, mask, value, prefix );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint128_find_with_mask(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                   *key,
+    uint32_t                   *mask,
+    void                      **value,
+    uint8_t                     prefix
+) {
+    uint32_t    hkey;
+
+    hkey = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, key[ 0 ] )
+         & ngx_http_lklb_uint32_htonl( radix_ctx->transforms, mask[ 0 ] );
+
+    return ngx_http_lklb_radix_uint128_find_with_mask( ngx_http_lklb_shard_tree( radix_ctx, hkey ),
+                                                       key, mask, value, prefix );
+}
+
+/* Every covering prefix lives in the shard of the key, see above */
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint32_find_all(
+    ngx_http_lklb_radix_ctx_t    *radix_ctx,
+    uint32_t                      key,
+    uint32_t                      mask,
+    ngx_http_lklb_radix_match_t  *matches,
+    ngx_uint_t                    nmatches,
+    ngx_uint_t                   *count
+) {
+    uint32_t    hkey;
+
+    hkey = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, key )
+         & ngx_http_lklb_uint32_htonl( radix_ctx->transforms, mask );
+
+    return ngx_http_lklb_radix_uint32_find_all( ngx_http_lklb_shard_tree( radix_ctx, hkey ),
+                                                key, mask, matches, nmatches, count );
+}
+
+/*
+ * Part of host order [start, end] stored in shard idx, converted back to
+ * the order the tree APIs expect. Ranges are cut at shard boundaries
+ * except for the blocks of the range covering whole shards which, like
+ * short prefixes, are stored intact in every shard they cover. Each shard
+ * thus holds the same blocks the range puts into an unsharded tree.
+ */
+static void
+ngx_http_lklb_shards_bounds(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_uint_t                  idx,
+    uint32_t                   *start,
+    uint32_t                   *end,
+    ngx_uint_t                  nwords,
+    uint32_t                   *bstart,
+    uint32_t                   *bend
+) {
+    uint32_t    first[ 4 ], last[ 4 ], blk;
+    ngx_uint_t  widx, hostbits;
+
+    ngx_memcpy( bstart, start, nwords * sizeof( uint32_t ) );
+    ngx_memcpy( bend, end, nwords * sizeof( uint32_t ) );
+
+    if( radix_ctx->bits ) {
+        first[ 0 ] = ( uint32_t )idx << ( 32 - radix_ctx->bits );
+        last[ 0 ]  = first[ 0 ] | ~ngx_http_lklb_shards_mask( radix_ctx );
+
+        for( widx = 1; widx < nwords; widx++ ) {
+            first[ widx ] = 0;
+            last[ widx ]  = ( uint32_t )( -1 );
+        }
+
+        if( ngx_http_lklb_shards_cmp( start, &first[ 0 ], nwords ) < 0 ) {
+            ngx_memcpy( bstart, &first[ 0 ], nwords * sizeof( uint32_t ) );
+        }
+
+        if( ngx_http_lklb_shards_cmp( end, &last[ 0 ], nwords ) > 0 ) {
+            ngx_memcpy( bend, &last[ 0 ], nwords * sizeof( uint32_t ) );
+        }
+
+        /* Shard covered entirely, widen to the largest block within the range */
+        if( ( ngx_http_lklb_shards_cmp( start, &first[ 0 ], nwords ) <= 0 ) &&
+            ( ngx_http_lklb_shards_cmp( end, &last[ 0 ], nwords ) >= 0 ) ) {
+            for( hostbits = 33 - radix_ctx->bits; hostbits <= 32; hostbits++ ) {
+                blk = ( 32 == hostbits ) ? ( uint32_t )( -1 ) : ( ( uint32_t )1 << hostbits ) - 1;
+
+                first[ 0 ] &= ~blk;
+                last[ 0 ]  |= blk;
+
+                if( ( ngx_http_lklb_shards_cmp( start, &first[ 0 ], nwords ) > 0 ) ||
+                    ( ngx_http_lklb_shards_cmp( end, &last[ 0 ], nwords ) < 0 ) ) {
+                    break;
+                }
+
+                ngx_memcpy( bstart, &first[ 0 ], nwords * sizeof( uint32_t ) );
+                ngx_memcpy( bend, &last[ 0 ], nwords * sizeof( uint32_t ) );
+            }
+        }
+    }
+
+    ngx_http_lklb_shards_transform( radix_ctx, bstart, nwords );
+    ngx_http_lklb_shards_transform( radix_ctx, bend, nwords );
+}
+
+static ngx_http_lklb_retval_e
+ngx_http_lklb_shards_range_op(
+    ngx_http_lklb_radix_t             *tree,
+    uint32_t                          *start,
+    uint32_t                          *end,
+    ngx_uint_t                         nwords,
+    ngx_uint_t                         op,
+    void                              *value,
+    ngx_uint_t                        *count,
+    ngx_http_lklb_radix_range_undo_t  *undo
+) {
+    switch( op ) {
+        case NGX_HTTP_LKLB_SHARDS_INSERT:
+            return( ( 1 == nwords )
+                    ? ngx_http_lklb_radix_uint32_insert_range( tree, start[ 0 ], end[ 0 ], value, count, undo )
+                    : ngx_http_lklb_radix_uint128_insert_range( tree, start, end, value, count, undo ) );
+
+        case NGX_HTTP_LKLB_SHARDS_DELETE:
+            return( ( 1 == nwords )
+                    ? ngx_http_lklb_radix_uint32_delete_range( tree, start[ 0 ], end[ 0 ], count )
+                    : ngx_http_lklb_radix_uint128_delete_range( tree, start, end, count ) );
+
+        default:
+            return( ( 1 == nwords )
+                    ? ngx_http_lklb_radix_uint32_undo_range( tree, start[ 0 ], end[ 0 ], undo )
+                    : ngx_http_lklb_radix_uint128_undo_range( tree, start, end, undo ) );
+    }
+}
+
+/*
+ * Range APIs apply the range to every shard it touches, see above. If a
+ * shard fails, the blocks the shards before it stored are released.
+ */
+static ngx_http_lklb_retval_e
+ngx_http_lklb_shards_insert_range_apply(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                   *start,
+    uint32_t                   *end,
+    ngx_uint_t                  nwords,
+    void                       *value,
+    ngx_uint_t                 *count
+) {
+    uint32_t                          hstart[ 4 ], hend[ 4 ], bstart[ 4 ], bend[ 4 ];
+    ngx_uint_t                        lo, hi, idx, stored, total = 0;
+    ngx_http_lklb_radix_range_undo_t  undo[ NGX_HTTP_LKLB_SHARDS_MAX ];
+    ngx_http_lklb_retval_e            rc = NGX_HTTP_LKLB_OK;
+
+    ngx_memcpy( &hstart[ 0 ], start, nwords * sizeof( uint32_t ) );
+    ngx_memcpy( &hend[ 0 ], end, nwords * sizeof( uint32_t ) );
+
+    ngx_http_lklb_shards_transform( radix_ctx, &hstart[ 0 ], nwords );
+    ngx_http_lklb_shards_transform( radix_ctx, &hend[ 0 ], nwords );
+
+    lo = ngx_http_lklb_shard_idx( radix_ctx, hstart[ 0 ] );
+    hi = ngx_http_lklb_shard_idx( radix_ctx, hend[ 0 ] );
+
+    if( lo > hi ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    for( idx = lo; idx <= hi; idx++ ) {
+        ngx_http_lklb_shards_bounds( radix_ctx, idx, &hstart[ 0 ], &hend[ 0 ], nwords, &bstart[ 0 ], &bend[ 0 ] );
+
+        stored = 0;
+        rc = ngx_http_lklb_shards_range_op( radix_ctx->shards[ idx ].tree, &bstart[ 0 ], &bend[ 0 ], nwords,
+                                            NGX_HTTP_LKLB_SHARDS_INSERT, value, &stored, &undo[ idx - lo ] );
+
+        if( NGX_HTTP_LKLB_ERR == rc ) {
+            while( idx-- > lo ) {
+                ngx_http_lklb_shards_bounds( radix_ctx, idx, &hstart[ 0 ], &hend[ 0 ], nwords,
+                                           &bstart[ 0 ], &bend[ 0 ] );
+                ngx_http_lklb_shards_range_op( radix_ctx->shards[ idx ].tree, &bstart[ 0 ], &bend[ 0 ], nwords,
+                                               NGX_HTTP_LKLB_SHARDS_UNDO, NULL, NULL, &undo[ idx - lo ] );
+            }
+
+            total = 0;
+            break;
+        }
+
+        total += stored;
+    }
+
+    if( count ) {
+        *count = total;
+    }
+
+    if( NGX_HTTP_LKLB_ERR == rc ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    return( ( total ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_DUP );
+}
+
+static ngx_http_lklb_retval_e
+ngx_http_lklb_shards_delete_range_apply(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                   *start,
+    uint32_t                   *end,
+    ngx_uint_t                  nwords,
+    ngx_uint_t                 *count
+) {
+    uint32_t                 hstart[ 4 ], hend[ 4 ], bstart[ 4 ], bend[ 4 ];
+    ngx_uint_t               lo, hi, idx, released, total = 0;
+
+    ngx_memcpy( &hstart[ 0 ], start, nwords * sizeof( uint32_t ) );
+    ngx_memcpy( &hend[ 0 ], end, nwords * sizeof( uint32_t ) );
+
+    ngx_http_lklb_shards_transform( radix_ctx, &hstart[ 0 ], nwords );
+    ngx_http_lklb_shards_transform( radix_ctx, &hend[ 0 ], nwords );
+
+    lo = ngx_http_lklb_shard_idx( radix_ctx, hstart[ 0 ] );
+    hi = ngx_http_lklb_shard_idx( radix_ctx, hend[ 0 ] );
+
+    for( idx = lo; idx <= hi; idx++ ) {
+        ngx_http_lklb_shards_bounds( radix_ctx, idx, &hstart[ 0 ], &hend[ 0 ], nwords, &bstart[ 0 ], &bend[ 0 ] );
+
+        released = 0;
+        ngx_http_lklb_shards_range_op( radix_ctx->shards[ idx ].tree, &bstart[ 0 ], &bend[ 0 ], nwords,
+                                       NGX_HTTP_LKLB_SHARDS_DELETE, NULL, &released, NULL );
+
+        total += released;
+    }
+
+    if( count ) {
+        *count = total;
+    }
+
+    return( ( total ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_ERR );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_insert_range(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                   *start,
+    uint32_t                   *end,
+    ngx_uint_t                  nwords,
+    void                       *value,
+    ngx_uint_t                 *count
+) {
+    ngx_http_lklb_retval_e       rc;
+
+    if( !ngx_http_lklb_shards_logged( radix_ctx ) ) {
+        return ngx_http_lklb_shards_insert_range_apply( radix_ctx, start, end, nwords, value, count );
+    }
+
+    ngx_http_lklb_shards_log_lock( radix_ctx );
+
+    rc = ngx_http_lklb_shards_insert_range_apply( radix_ctx, start, end, nwords, value, count );
+
+    if( NGX_HTTP_LKLB_MATCH == rc ) {
+        ngx_http_lklb_shards_log( radix_ctx, NGX_HTTP_LKLB_QUEUE_INSERT_RANGE, nwords, start, end, value );
+    }
+
+    ngx_http_lklb_shards_log_unlock( radix_ctx );
+
+    return rc;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_delete_range(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                   *start,
+    uint32_t                   *end,
+    ngx_uint_t                  nwords,
+    ngx_uint_t                 *count
+) {
+    ngx_http_lklb_retval_e       rc;
+
+    if( !ngx_http_lklb_shards_logged( radix_ctx ) ) {
+        return ngx_http_lklb_shards_delete_range_apply( radix_ctx, start, end, nwords, count );
+    }
+
+    ngx_http_lklb_shards_log_lock( radix_ctx );
+
+    rc = ngx_http_lklb_shards_delete_range_apply( radix_ctx, start, end, nwords, count );
+
+    if( NGX_HTTP_LKLB_MATCH == rc ) {
+        ngx_http_lklb_shards_log( radix_ctx, NGX_HTTP_LKLB_QUEUE_DELETE_RANGE, nwords, start, end, NULL );
+    }
+
+    ngx_http_lklb_shards_log_unlock( radix_ctx );
+
+    return rc;
+}
+
+/* Shards an op of a bulk load goes to, as by the insert APIs */
+static void
+ngx_http_lklb_shards_op_span(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_http_lklb_shards_op_t  *op,
+    ngx_uint_t                 *lo,
+    ngx_uint_t                 *hi
+) {
+    uint32_t    hkey, hmask;
+
+    hmask = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, op->mask[ 0 ] );
+    hkey  = ngx_http_lklb_uint32_htonl( radix_ctx->transforms, op->key[ 0 ] ) & hmask;
+
+    *lo = ngx_http_lklb_shard_idx( radix_ctx, hkey );
+    *hi = ngx_http_lklb_shard_idx( radix_ctx, hkey | ~hmask );
+}
+
+void
+ngx_http_lklb_shards_batch_record(
+    ngx_http_lklb_shards_batch_t   *batch,
+    ngx_http_lklb_radix_ctx_t      *radix_ctx,
+    ngx_http_lklb_shards_op_t      *ops,
+    ngx_uint_t                      nops,
+    ngx_log_t                      *log
+) {
+    ngx_http_lklb_shards_op_t   *op;
+    ngx_http_lklb_retval_e       rc;
+    ngx_uint_t                   n, idx, lo, hi, delete;
+
+    ngx_memzero( batch, sizeof( ngx_http_lklb_shards_batch_t ) );
+
+    batch->radix_ctx = radix_ctx;
+
+    for( n = 0; n < nops; n++ ) {
+        op = &ops[ n ];
+
+        ngx_http_lklb_value_ref( &radix_ctx->values, op->value );
+
+        ngx_http_lklb_shards_op_span( radix_ctx, op, &lo, &hi );
+
+        delete = ( NGX_HTTP_LKLB_QUEUE_DELETE == op->op );
+
+        for( idx = lo; idx <= hi; idx++ ) {
+            if( batch->failed & ( ( uint64_t )1 << idx ) ) {
+                continue;
+            }
+
+            if( ( NULL == batch->batches[ idx ] ) &&
+                ( NULL == ( batch->batches[ idx ] = ngx_http_lklb_radix_batch_begin( radix_ctx->shards[ idx ].tree,
+                                                                                     log ) ) ) ) {
+                batch->failed |= ( uint64_t )1 << idx;
+                continue;
+            }
+
+            if( 1 == op->nwords ) {
+                rc = ( delete )
+                     ? ngx_http_lklb_radix_batch_uint32_delete( batch->batches[ idx ], op->key[ 0 ], op->mask[ 0 ] )
+                     : ngx_http_lklb_radix_batch_uint32_insert( batch->batches[ idx ], op->key[ 0 ], op->mask[ 0 ],
+                                                                op->value );
+            } else {
+                rc = ( delete )
+                     ? ngx_http_lklb_radix_batch_uint128_delete( batch->batches[ idx ], &op->key[ 0 ], &op->mask[ 0 ] )
+                     : ngx_http_lklb_radix_batch_uint128_insert( batch->batches[ idx ], &op->key[ 0 ], &op->mask[ 0 ],
+                                                                 op->value );
+            }
+
+            if( NGX_HTTP_LKLB_OK != rc ) {
+                ngx_http_lklb_radix_batch_abort( batch->batches[ idx ] );
+                batch->batches[ idx ] = NULL;
+                batch->failed |= ( uint64_t )1 << idx;
+            }
+        }
+    }
+}
+
+/* Apply an op to a single shard, outside of a batch. Returns 1 if it did not fit */
+static ngx_uint_t
+ngx_http_lklb_shards_op_apply( ngx_http_lklb_radix_ctx_t *radix_ctx, ngx_http_lklb_shards_op_t *op, ngx_uint_t idx ) {
+    ngx_http_lklb_radix_t   *tree = radix_ctx->shards[ idx ].tree;
+    ngx_http_lklb_retval_e   rc;
+    void                    *result;
+
+    if( NGX_HTTP_LKLB_QUEUE_DELETE == op->op ) {
+        if( 1 == op->nwords ) {
+            rc = ngx_http_lklb_radix_uint32_delete_with_mask( tree, op->key[ 0 ], op->mask[ 0 ], &result );
+        } else {
+            rc = ngx_http_lklb_radix_uint128_delete_with_mask( tree, &op->key[ 0 ], &op->mask[ 0 ], &result );
+        }
+
+        if( NGX_HTTP_LKLB_MATCH == rc ) {
+            ngx_http_lklb_value_unref( &radix_ctx->values, result );
+        }
+
+        return 0;
+    }
+
+    if( 1 == op->nwords ) {
+        rc = ngx_http_lklb_radix_uint32_insert_with_mask( tree, op->key[ 0 ], op->mask[ 0 ], op->value );
+    } else {
+        rc = ngx_http_lklb_radix_uint128_insert_with_mask( tree, &op->key[ 0 ], &op->mask[ 0 ], op->value );
+    }
+
+    return( NGX_HTTP_LKLB_ERR == rc );
+}
+
+/*
+ * As ngx_http_lklb_queue_apply_batch, the ops of a shard whose batch
+ * failed are applied one by one. uint128 inserts are logged as the
+ * range they span, deletes as key and mask since a range delete would
+ * take the longer prefixes within along.
+ */
+ngx_uint_t
+ngx_http_lklb_shards_batch_commit(
+    ngx_http_lklb_shards_batch_t   *batch,
+    ngx_http_lklb_shards_op_t      *ops,
+    ngx_uint_t                      nops
+) {
+    ngx_http_lklb_radix_ctx_t   *radix_ctx = batch->radix_ctx;
+    ngx_uint_t                   logged = ngx_http_lklb_shards_logged( radix_ctx );
+    ngx_http_lklb_shards_op_t   *op;
+    uint32_t                     end[ 4 ];
+    ngx_uint_t                   n, idx, lo, hi, lost, nlost = 0;
+
+    if( logged ) {
+        ngx_http_lklb_shards_log_lock( radix_ctx );
+    }
+
+    for( idx = 0; idx < radix_ctx->nshards; idx++ ) {
+        if( ( batch->batches[ idx ] ) &&
+            ( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_batch_commit( batch->batches[ idx ], NULL ) ) ) {
+            batch->failed |= ( uint64_t )1 << idx;
+        }
+
+        batch->batches[ idx ] = NULL;
+    }
+
+    for( n = 0; n < nops; n++ ) {
+        op   = &ops[ n ];
+        lost = 0;
+
+        if( batch->failed ) {
+            ngx_http_lklb_shards_op_span( radix_ctx, op, &lo, &hi );
+
+            for( idx = lo; idx <= hi; idx++ ) {
+                if( batch->failed & ( ( uint64_t )1 << idx ) ) {
+                    lost |= ngx_http_lklb_shards_op_apply( radix_ctx, op, idx );
+                }
+            }
+        }
+
+        if( ( logged ) && ( !lost ) ) {
+            if( NGX_HTTP_LKLB_QUEUE_DELETE == op->op ) {
+                ngx_http_lklb_shards_log( radix_ctx, NGX_HTTP_LKLB_QUEUE_DELETE, op->nwords, &op->key[ 0 ],
+                                          &op->mask[ 0 ], NULL );
+            } else if( 1 == op->nwords ) {
+                ngx_http_lklb_shards_log( radix_ctx, NGX_HTTP_LKLB_QUEUE_INSERT, 1, &op->key[ 0 ], &op->mask[ 0 ],
+                                          op->value );
+            } else {
+                for( idx = 0; idx < 4; idx++ ) {
+                    end[ idx ] = op->key[ idx ] | ~op->mask[ idx ];
+                }
+
+                ngx_http_lklb_shards_log( radix_ctx, NGX_HTTP_LKLB_QUEUE_INSERT_RANGE, 4, &op->key[ 0 ], &end[ 0 ],
+                                          op->value );
+            }
+        }
+
+        nlost += lost;
+
+        /* Released unless some shard stored it */
+        ngx_http_lklb_value_unref( &radix_ctx->values, op->value );
+    }
+
+    if( logged ) {
+        ngx_http_lklb_shards_log_unlock( radix_ctx );
+    }
+
+    return nlost;
+}
+
+void
+ngx_http_lklb_shards_batch_abort(
+    ngx_http_lklb_shards_batch_t   *batch,
+    ngx_http_lklb_shards_op_t      *ops,
+    ngx_uint_t                      nops
+) {
+    ngx_uint_t  n, idx;
+
+    for( idx = 0; idx < NGX_HTTP_LKLB_SHARDS_MAX; idx++ ) {
+        if( batch->batches[ idx ] ) {
+            ngx_http_lklb_radix_batch_abort( batch->batches[ idx ] );
+            batch->batches[ idx ] = NULL;
+        }
+    }
+
+    for( n = 0; n < nops; n++ ) {
+        ngx_http_lklb_value_unref( &batch->radix_ctx->values, ops[ n ].value );
+    }
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_addr_find(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx4,
+    ngx_http_lklb_radix_ctx_t  *radix_ctx6,
+    u_char                     *addr,
+    size_t                      len,
+    void                      **value,
+    uint8_t                     prefix
+) {
+    static u_char            v4mapped[ 12 ] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    ngx_http_lklb_radix_t   *tree4 = NULL, *tree6 = NULL;
+    u_char                  *addr4 = NULL;
+
+    if( NULL == addr ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    if( 4 == len ) {
+        addr4 = addr;
+    } else if( ( 16 == len ) && ( 0 == ngx_memcmp( addr, v4mapped, sizeof( v4mapped ) ) ) ) {
+        addr4 = addr + sizeof( v4mapped );
+    }
+
+    if( ( addr4 ) && ( radix_ctx4 ) ) {
+        tree4 = ngx_http_lklb_shard_tree( radix_ctx4, ( uint32_t )addr4[ 0 ] << 24 );
+    }
+
+    if( ( 16 == len ) && ( radix_ctx6 ) ) {
+        tree6 = ngx_http_lklb_shard_tree( radix_ctx6, ( uint32_t )addr[ 0 ] << 24 );
+    }
+
+    return ngx_http_lklb_radix_addr_find( tree4, tree6, addr, len, value, prefix );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_sockaddr_find(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx4,
+    ngx_http_lklb_radix_ctx_t  *radix_ctx6,
+    struct sockaddr            *sockaddr,
+    void                      **value,
+    uint8_t                     prefix
+) {
+    if( NULL == sockaddr ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    switch( sockaddr->sa_family ) {
+        case AF_INET:
+            return ngx_http_lklb_shards_addr_find( radix_ctx4, radix_ctx6,
+                                                   ( u_char * )&( ( struct sockaddr_in * )sockaddr )->sin_addr,
+                                                   4, value, prefix );
+
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            return ngx_http_lklb_shards_addr_find( radix_ctx4, radix_ctx6,
+                                                   ( ( struct sockaddr_in6 * )sockaddr )->sin6_addr.s6_addr,
+                                                   16, value, prefix );
+#endif
+
+        default:
+            return NGX_HTTP_LKLB_ERR;
+    }
+}
+
+ngx_uint_t
+ngx_http_lklb_shards_unmap_entry( ngx_http_lklb_radix_entry_t *entry ) {
+    static u_char    v4mapped[ 12 ] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+    if( ( entry->bits < 8 * sizeof( v4mapped ) ) ||
+        ( 0 != ngx_memcmp( &entry->key[ 0 ], v4mapped, sizeof( v4mapped ) ) ) ) {
+        return 0;
+    }
+
+    ngx_memmove( &entry->key[ 0 ], &entry->key[ sizeof( v4mapped ) ], 4 );
+    entry->bits -= 8 * sizeof( v4mapped );
+
+    return 1;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_str_find(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint8_t                    *key,
+    size_t                      key_len,
+    void                      **value,
+    uint8_t                     prefix
+) {
+    uint8_t     first;
+
+    if( ( NULL == key ) || ( 0 == key_len ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    /* First byte the key will have once the tree applied the transforms */
+    first = ( NGX_HTTP_LKLB_TRANSFORM_REVERSE & radix_ctx->transforms ) ? key[ key_len - 1 ] : key[ 0 ];
+
+    if( NGX_HTTP_LKLB_TRANSFORM_TOLOWER & radix_ctx->transforms ) {
+        first = ngx_tolower( first );
+    }
+
+    return ngx_http_lklb_radix_str_find( radix_ctx->shards[ first & ( radix_ctx->nshards - 1 ) ].tree,
+                                         key, key_len, value, prefix );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_sweep(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_uint_t                  max_nodes,
+    ngx_uint_t                 *count
+) {
+    ngx_uint_t               idx, reclaimed, total = 0, done = 0;
+
+    max_nodes /= radix_ctx->nshards;
+    if( 0 == max_nodes ) {
+        max_nodes = 1;
+    }
+
+    for( idx = 0; idx < radix_ctx->nshards; idx++ ) {
+        reclaimed = 0;
+
+        if( NGX_HTTP_LKLB_MATCH == ngx_http_lklb_radix_sweep( radix_ctx->shards[ idx ].tree,
+                                                              max_nodes, &reclaimed ) ) {
+            done++;
+        }
+
+        total += reclaimed;
+    }
+
+    if( count ) {
+        *count = total;
+    }
+
+    return( ( done == radix_ctx->nshards ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_OK );
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_freeze( ngx_http_lklb_radix_ctx_t *radix_ctx ) {
+    ngx_http_lklb_retval_e   rc = NGX_HTTP_LKLB_OK;
+    ngx_uint_t               idx;
+
+    /* A shard that fails stays on its tree, the others are still frozen */
+    for( idx = 0; idx < radix_ctx->nshards; idx++ ) {
+        if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_freeze( radix_ctx->shards[ idx ].tree ) ) {
+            rc = NGX_HTTP_LKLB_ERR;
+        }
+    }
+
+    return rc;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_set_readonly( ngx_http_lklb_radix_ctx_t *radix_ctx, ngx_uint_t readonly ) {
+    ngx_uint_t  idx;
+
+    for( idx = 0; idx < radix_ctx->nshards; idx++ ) {
+        if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_set_readonly( radix_ctx->shards[ idx ].tree, readonly ) ) {
+            break;
+        }
+    }
+
+    if( idx < radix_ctx->nshards ) {
+        while( idx-- ) {
+            ngx_http_lklb_radix_set_readonly( radix_ctx->shards[ idx ].tree, radix_ctx->readonly );
+        }
+
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    radix_ctx->readonly = ( readonly ) ? 1 : 0;
+
+    return NGX_HTTP_LKLB_OK;
+}
+
+ngx_uint_t
+ngx_http_lklb_shards_settling( ngx_http_lklb_radix_ctx_t *radix_ctx ) {
+    ngx_uint_t  idx;
+
+    for( idx = 0; idx < radix_ctx->nshards; idx++ ) {
+        if( ngx_http_lklb_radix_settling( radix_ctx->shards[ idx ].tree ) ) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+ngx_uint_t
+ngx_http_lklb_shards_evict( ngx_http_lklb_radix_ctx_t *radix_ctx, ngx_uint_t max_entries ) {
+    ngx_uint_t  turns, idx, count = 0;
+
+    for( turns = 0; ( turns < radix_ctx->nshards ) && ( count < max_entries ); turns++ ) {
+        /* Racing updates of the hand only skew the order */
+        idx = radix_ctx->hand++ % radix_ctx->nshards;
+
+        count += ngx_http_lklb_radix_evict( radix_ctx->shards[ idx ].tree, max_entries - count );
+    }
+
+    return count;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_cursor_init(
+    ngx_http_lklb_radix_ctx_t      *radix_ctx,
+    ngx_http_lklb_shards_cursor_t  *cursor,
+    uint8_t                        *prefix,
+    ngx_uint_t                      bits,
+    ngx_uint_t                      str
+) {
+    uint32_t    word;
+
+    if( NGX_HTTP_LKLB_OK != ngx_http_lklb_radix_cursor_init( &cursor->cursor, prefix, bits ) ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    cursor->str   = str;
+    cursor->shard = 0;
+    cursor->last  = radix_ctx->nshards - 1;
+
+    if( str ) {
+        if( bits >= 8 ) {
+            cursor->shard = cursor->last = prefix[ 0 ] & ( radix_ctx->nshards - 1 );
+        }
+
+        return NGX_HTTP_LKLB_OK;
+    }
+
+    word = ngx_http_lklb_shards_word( prefix, bits );
+
+    cursor->shard = ngx_http_lklb_shard_idx( radix_ctx, word );
+
+    if( bits < 32 ) {
+        word |= ( bits ) ? ~( ( uint32_t )( -1 ) << ( 32 - bits ) ) : ( uint32_t )( -1 );
+    }
+
+    cursor->last = ngx_http_lklb_shard_idx( radix_ctx, word );
+
+    return NGX_HTTP_LKLB_OK;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_cursor_next(
+    ngx_http_lklb_radix_ctx_t      *radix_ctx,
+    ngx_http_lklb_shards_cursor_t  *cursor,
+    ngx_http_lklb_radix_entry_t    *entries,
+    ngx_uint_t                      nentries,
+    ngx_uint_t                     *count
+) {
+    ngx_http_lklb_radix_entry_t   *entry;
+    ngx_http_lklb_retval_e         rc;
+    ngx_uint_t                     idx, filled, kept;
+
+    *count = 0;
+
+    while( cursor->shard <= cursor->last ) {
+        entry = entries + *count;
+
+        rc = ngx_http_lklb_radix_cursor_next( radix_ctx->shards[ cursor->shard ].tree, &cursor->cursor,
+                                              entry, nentries - *count, &filled );
+        if( NGX_HTTP_LKLB_ERR == rc ) {
+            return NGX_HTTP_LKLB_ERR;
+        }
+
+        /* Prefixes shorter than the shard bits are reported by the first shard they cover */
+        for( idx = 0, kept = 0; idx < filled; idx++ ) {
+            if( ( !cursor->str ) && ( entry[ idx ].bits < radix_ctx->bits ) &&
+                ( cursor->shard != ngx_http_lklb_shard_idx( radix_ctx,
+                                       ngx_http_lklb_shards_word( &entry[ idx ].key[ 0 ], entry[ idx ].bits ) ) ) ) {
+                if( cursor->cursor.ref ) {
+                    ngx_http_lklb_value_unref( &radix_ctx->values, entry[ idx ].value );
+                }
+
+                continue;
+            }
+
+            if( kept != idx ) {
+                entry[ kept ] = entry[ idx ];
+            }
+
+            kept++;
+        }
+
+        *count += kept;
+
+        if( NGX_HTTP_LKLB_OK == rc ) {
+            return NGX_HTTP_LKLB_OK;
+        }
+
+        cursor->shard++;
+        ngx_http_lklb_radix_cursor_rewind( &cursor->cursor );
+
+        if( *count == nentries ) {
+            break;
+        }
+    }
+
+    return( ( cursor->shard <= cursor->last ) ? NGX_HTTP_LKLB_OK : NGX_HTTP_LKLB_MATCH );
+}
+
+#define NGX_HTTP_LKLB_SHARDS_TOP_CHUNK  16
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_top_hits(
+    ngx_http_lklb_radix_ctx_t      *radix_ctx,
+    ngx_uint_t                      str,
+    ngx_http_lklb_shards_hits_t    *top,
+    ngx_uint_t                      ntop,
+    ngx_uint_t                     *count
+) {
+    ngx_http_lklb_shards_cursor_t   cursor;
+    ngx_http_lklb_radix_entry_t     entries[ NGX_HTTP_LKLB_SHARDS_TOP_CHUNK ];
+    ngx_http_lklb_value_t          *value;
+    ngx_http_lklb_retval_e          rc;
+    ngx_atomic_uint_t               hits;
+    ngx_uint_t                      filled, idx, pos;
+
+    *count = 0;
+
+    if( 0 == ntop ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    ngx_http_lklb_shards_cursor_init( radix_ctx, &cursor, NULL, 0, str );
+
+    do {
+        rc = ngx_http_lklb_shards_cursor_next( radix_ctx, &cursor, &entries[ 0 ],
+                                               NGX_HTTP_LKLB_SHARDS_TOP_CHUNK, &filled );
+        if( NGX_HTTP_LKLB_ERR == rc ) {
+            return NGX_HTTP_LKLB_ERR;
+        }
+
+        /* Values outlive the chunk lock until the event loop is back, see ngx_http_lklb_epochs_t */
+        for( idx = 0; idx < filled; idx++ ) {
+            value = entries[ idx ].value;
+            hits  = ( value ) ? value->hits : 0;
+
+            if( ( 0 == hits ) || ( ( *count == ntop ) && ( hits <= top[ ntop - 1 ].hits ) ) ) {
+                continue;
+            }
+
+            /* Insertion into the list kept in descending order */
+            pos = ( *count < ntop ) ? ( *count )++ : ntop - 1;
+
+            while( ( pos ) && ( top[ pos - 1 ].hits < hits ) ) {
+                top[ pos ] = top[ pos - 1 ];
+                pos--;
+            }
+
+            top[ pos ].entry = entries[ idx ];
+            top[ pos ].hits  = hits;
+        }
+    } while( NGX_HTTP_LKLB_OK == rc );
+
+    return( ( *count ) ? NGX_HTTP_LKLB_MATCH : NGX_HTTP_LKLB_ERR );
+}
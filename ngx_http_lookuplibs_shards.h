@@ -0,0 +1,351 @@
+#ifndef _NGX_HTTP_LOOKUPLIBS_SHARDS_H_INCLUDED_
+#define _NGX_HTTP_LOOKUPLIBS_SHARDS_H_INCLUDED_
+
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplib_radix_tree.h"
+#include "ngx_http_lookuplibs_values.h"
+
+#define NGX_HTTP_LKLB_SHARDS_MAX    64
+
+typedef struct ngx_http_lklb_queue_s ngx_http_lklb_queue_t;
+typedef struct ngx_http_lklb_journal_s ngx_http_lklb_journal_t;
+
+typedef struct {
+    ngx_atomic_t             rwlock;
+    ngx_http_lklb_radix_t   *tree;
+} ngx_http_lklb_radix_shard_t;
+
+/*
+ * A radix zone is split into nshards trees, each with its own lock and
+ * free list. Numeric keys go to the shard selected by the top bits of
+ * their first word after transforms, prefixes shorter than that are
+ * stored in every shard they cover. Every prefix covering a key thus
+ * lives in the shard of the key and finds visit a single shard. String
+ * keys go by their first byte after transforms so that prefixes of a key
+ * share its shard. loading is set to the pid of a process loading a
+ * file into the zone, see ngx_http_lklb_loader_start. dualstack zones
+ * have a single dual-stack tree, see ngx_http_lklb_radix_set_dualstack.
+ * readonly is set while the zone is read-only, see
+ * ngx_http_lklb_shards_set_readonly. family is the address family of the
+ * first prefix a Lua insert stored, AF_INET or AF_INET6. epochs tracks
+ * when memory finds may still use can be freed, for values and every
+ * shard.
+ */
+typedef struct {
+    ngx_http_lklb_values_t           values;
+    ngx_uint_t                       transforms;
+    ngx_uint_t                       dualstack;
+    ngx_uint_t                       readonly;
+    ngx_uint_t                       nshards;
+    ngx_uint_t                       bits;
+    ngx_uint_t                       hand;
+    ngx_atomic_t                     loading;
+    ngx_atomic_t                     family;
+    ngx_http_lklb_epochs_t          *epochs;
+    ngx_http_lklb_queue_t           *queue;
+    ngx_http_lklb_journal_t         *journal;
+    ngx_http_lklb_journal_t         *outbox;
+    ngx_http_lklb_radix_shard_t      shards[ 1 ];
+} ngx_http_lklb_radix_ctx_t;
+
+#define ngx_http_lklb_shards_size( __nshards )                                          \
+    ( offsetof( ngx_http_lklb_radix_ctx_t, shards )                                     \
+      + ( __nshards ) * sizeof( ngx_http_lklb_radix_shard_t ) )
+
+/* Shard of a host order key, i.e. after transforms */
+#define ngx_http_lklb_shard_idx( __radix_ctx, __key )                                   \
+    ( ( 0 == ( __radix_ctx )->bits ) ? 0 : ( ( __key ) >> ( 32 - ( __radix_ctx )->bits ) ) )
+
+#define ngx_http_lklb_shard_tree( __radix_ctx, __key )                                  \
+    ( ( __radix_ctx )->shards[ ngx_http_lklb_shard_idx( __radix_ctx, __key ) ].tree )
+
+/* Set while applying updates received from peers, those are not sent on */
+extern ngx_uint_t  ngx_http_lklb_shards_remote;
+
+#define ngx_http_lklb_shards_logged( __radix_ctx )                                      \
+    ( ( NULL != ( __radix_ctx )->journal ) || ( NULL != ( __radix_ctx )->outbox ) )
+
+/*
+ * Locks the journal and the replication outbox of the zone, if any, for
+ * writers logging their ops in apply order.
+ */
+void
+ngx_http_lklb_shards_log_lock( ngx_http_lklb_radix_ctx_t *radix_ctx );
+
+void
+ngx_http_lklb_shards_log_unlock( ngx_http_lklb_radix_ctx_t *radix_ctx );
+
+/* Logs an applied op as ngx_http_lklb_journal_append(), the locks are held */
+void
+ngx_http_lklb_shards_log(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_uint_t                  op,
+    ngx_uint_t                  nwords,
+    uint32_t                   *key,
+    uint32_t                   *arg,
+    ngx_http_lklb_value_t      *value
+);
+
+/*
+ * Same semantics as the tree APIs of the same name. Counts and results
+ * take entries stored in several shards into account once per shard.
+ * Updates are journaled on zones with a journal, see
+ * ngx_http_lklb_journal_s, and sent to the peers of replicated zones.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint32_insert_with_mask(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                    key,
+    uint32_t                    mask,
+    void                       *value
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint32_delete_with_mask(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                    key,
+    uint32_t                    mask,
+    void                      **value
+);
+
+/* key and mask: 4 words in the order of the range APIs */
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint128_insert_with_mask(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                   *key,
+    uint32_t                   *mask,
+    void                       *value
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint128_delete_with_mask(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                   *key,
+    uint32_t                   *mask,
+    void                      **value
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint32_find_with_mask(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                    key,
+    uint32_t                    mask,
+    void                      **value,
+    uint8_t                     prefix
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint128_find_with_mask(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                   *key,
+    uint32_t                   *mask,
+    void                      **value,
+    uint8_t                     prefix
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_uint32_find_all(
+    ngx_http_lklb_radix_ctx_t    *radix_ctx,
+    uint32_t                      key,
+    uint32_t                      mask,
+    ngx_http_lklb_radix_match_t  *matches,
+    ngx_uint_t                    nmatches,
+    ngx_uint_t                   *count
+);
+
+/* nwords: 1 for uint32, 4 for uint128 keys */
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_insert_range(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                   *start,
+    uint32_t                   *end,
+    ngx_uint_t                  nwords,
+    void                       *value,
+    ngx_uint_t                 *count
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_delete_range(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint32_t                   *start,
+    uint32_t                   *end,
+    ngx_uint_t                  nwords,
+    ngx_uint_t                 *count
+);
+
+/*
+ * Op of a bulk load, NGX_HTTP_LKLB_QUEUE_INSERT or NGX_HTTP_LKLB_QUEUE_DELETE.
+ * nwords 1: key and mask as given to the uint32 APIs. nwords 4: a uint128
+ * prefix, words in the order of the range APIs. Deletes carry no value.
+ */
+typedef struct {
+    ngx_uint_t                       op;
+    ngx_uint_t                       nwords;
+    uint32_t                         key[ 4 ];
+    uint32_t                         mask[ 4 ];
+    ngx_http_lklb_value_t           *value;
+} ngx_http_lklb_shards_op_t;
+
+/*
+ * Ops are recorded into one tree batch per shard without taking any
+ * lock, e.g. on a thread, and committed with a single write lock per
+ * shard, see ngx_http_lklb_radix_batch_begin.
+ * failed:  shards whose batch could not be had, their ops are applied
+ *          one by one on commit
+ */
+typedef struct {
+    ngx_http_lklb_radix_ctx_t       *radix_ctx;
+    uint64_t                         failed;
+    ngx_http_lklb_radix_batch_t     *batches[ NGX_HTTP_LKLB_SHARDS_MAX ];
+} ngx_http_lklb_shards_batch_t;
+
+/* Every insert holds a reference on its value until commit or abort */
+void
+ngx_http_lklb_shards_batch_record(
+    ngx_http_lklb_shards_batch_t   *batch,
+    ngx_http_lklb_radix_ctx_t      *radix_ctx,
+    ngx_http_lklb_shards_op_t      *ops,
+    ngx_uint_t                      nops,
+    ngx_log_t                      *log
+);
+
+/*
+ * Commits the ops recorded and logs them as the insert and delete APIs
+ * do. Returns the number of inserts that did not fit the zone.
+ */
+ngx_uint_t
+ngx_http_lklb_shards_batch_commit(
+    ngx_http_lklb_shards_batch_t   *batch,
+    ngx_http_lklb_shards_op_t      *ops,
+    ngx_uint_t                      nops
+);
+
+void
+ngx_http_lklb_shards_batch_abort(
+    ngx_http_lklb_shards_batch_t   *batch,
+    ngx_http_lklb_shards_op_t      *ops,
+    ngx_uint_t                      nops
+);
+
+/* radix_ctx4 and radix_ctx6 may be NULL, addresses of that family fail then */
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_addr_find(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx4,
+    ngx_http_lklb_radix_ctx_t  *radix_ctx6,
+    u_char                     *addr,
+    size_t                      len,
+    void                      **value,
+    uint8_t                     prefix
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_sockaddr_find(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx4,
+    ngx_http_lklb_radix_ctx_t  *radix_ctx6,
+    struct sockaddr            *sockaddr,
+    void                      **value,
+    uint8_t                     prefix
+);
+
+/*
+ * Turns an IPv4-mapped entry of a dual-stack zone into the entry the
+ * uint32 APIs see. Returns 0 for other entries, those are left as is.
+ */
+ngx_uint_t
+ngx_http_lklb_shards_unmap_entry( ngx_http_lklb_radix_entry_t *entry );
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_str_find(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    uint8_t                    *key,
+    size_t                      key_len,
+    void                      **value,
+    uint8_t                     prefix
+);
+
+/*
+ * Walks the shards in turn, see ngx_http_lklb_radix_cursor_next. Numeric
+ * keys come out in key order across shards and prefixes stored in
+ * several shards once. String keys are in order within each shard.
+ * str:     the zone holds string keys
+ */
+typedef struct {
+    ngx_uint_t                       shard;
+    ngx_uint_t                       last;
+    ngx_uint_t                       str;
+    ngx_http_lklb_radix_cursor_t     cursor;
+} ngx_http_lklb_shards_cursor_t;
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_cursor_init(
+    ngx_http_lklb_radix_ctx_t      *radix_ctx,
+    ngx_http_lklb_shards_cursor_t  *cursor,
+    uint8_t                        *prefix,
+    ngx_uint_t                      bits,
+    ngx_uint_t                      str
+);
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_cursor_next(
+    ngx_http_lklb_radix_ctx_t      *radix_ctx,
+    ngx_http_lklb_shards_cursor_t  *cursor,
+    ngx_http_lklb_radix_entry_t    *entries,
+    ngx_uint_t                      nentries,
+    ngx_uint_t                     *count
+);
+
+/*
+ * Entries of a zone with stats enabled ordered by hits, see the stats=
+ * zone option. Entries sharing a value, e.g. the blocks of a range,
+ * share its count. Walks the whole zone, meant for reporting only.
+ */
+typedef struct {
+    ngx_http_lklb_radix_entry_t      entry;
+    ngx_atomic_uint_t                hits;
+} ngx_http_lklb_shards_hits_t;
+
+/*
+ * Fills top with up to ntop entries that were hit, most hit first.
+ * str:     the zone holds string keys
+ * Returns NGX_HTTP_LKLB_ERR if no entry was hit.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_top_hits(
+    ngx_http_lklb_radix_ctx_t      *radix_ctx,
+    ngx_uint_t                      str,
+    ngx_http_lklb_shards_hits_t    *top,
+    ngx_uint_t                      ntop,
+    ngx_uint_t                     *count
+);
+
+/* Sweeps every shard, max_nodes is split between them */
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_sweep(
+    ngx_http_lklb_radix_ctx_t  *radix_ctx,
+    ngx_uint_t                  max_nodes,
+    ngx_uint_t                 *count
+);
+
+/* Freezes every shard, see ngx_http_lklb_radix_freeze */
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_freeze( ngx_http_lklb_radix_ctx_t *radix_ctx );
+
+/*
+ * Makes every shard read-only or writable again, see
+ * ngx_http_lklb_radix_set_readonly. Writes to a read-only zone fail,
+ * queued ones wait in the queue and loads are refused until it is
+ * writable again. If a shard fails, those before it are set back and
+ * NGX_HTTP_LKLB_ERR is returned.
+ */
+ngx_http_lklb_retval_e
+ngx_http_lklb_shards_set_readonly( ngx_http_lklb_radix_ctx_t *radix_ctx, ngx_uint_t readonly );
+
+/* Whether a shard of a zone made writable again still refuses writes */
+ngx_uint_t
+ngx_http_lklb_shards_settling( ngx_http_lklb_radix_ctx_t *radix_ctx );
+
+/* Evicts from the shards in turn, returns the number evicted */
+ngx_uint_t
+ngx_http_lklb_shards_evict( ngx_http_lklb_radix_ctx_t *radix_ctx, ngx_uint_t max_entries );
+
+#endif /* _NGX_HTTP_LOOKUPLIBS_SHARDS_H_INCLUDED_ */
@@ -0,0 +1,270 @@
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_internal.h"
+#include "ngx_http_lookuplibs_transforms.h"
+
+#define NGX_HTTP_LKLB_STATS_TOP         10
+#define NGX_HTTP_LKLB_STATS_TOP_MAX     1024
+#define NGX_HTTP_LKLB_STATS_INTERVAL    1000
+
+/*
+ * Collecting the top entries walks the whole zone. Each worker keeps the
+ * last result in cache for NGX_HTTP_LKLB_STATS_INTERVAL, requests
+ * meanwhile are served from it.
+ */
+struct ngx_http_lklb_stats_s {
+    ngx_shm_zone_t                  *zone;
+    ngx_http_lklb_key_type_e         key_type;
+    ngx_uint_t                       uint128;
+    ngx_uint_t                       top;
+
+    ngx_http_lklb_shards_hits_t     *cache;
+    ngx_uint_t                       count;
+    ngx_msec_t                       updated;
+};
+
+/* Longest line: an IPv6 key, "/", the prefix length, a space, hits and CRLF */
+#define NGX_HTTP_LKLB_STATS_LINE_LEN                                                    \
+    ( NGX_INET6_ADDRSTRLEN + sizeof( "/128 " ) - 1 + NGX_ATOMIC_T_LEN + sizeof( CRLF ) - 1 )
+
+static u_char *
+ngx_http_lklb_stats_key( u_char *p, ngx_http_lklb_stats_t *stats, ngx_http_lklb_ctx_t *ctx,
+                         ngx_http_lklb_radix_entry_t *entry ) {
+    size_t      len;
+
+    len = ( entry->bits + 7 ) / 8;
+
+    if( NGX_HTTP_LKLB_KEY_STRING == stats->key_type ) {
+        if( NGX_HTTP_LKLB_TRANSFORM_REVERSE & ctx->transforms ) {
+            ngx_http_lklb_str_transform( NGX_HTTP_LKLB_TRANSFORM_REVERSE, &entry->key[ 0 ], len );
+        }
+
+        return ngx_cpymem( p, &entry->key[ 0 ], len );
+    }
+
+    /* Bytes past the key are left over from earlier keys */
+    ngx_memzero( &entry->key[ len ], ( ( stats->uint128 ) ? 16 : 4 ) - len );
+
+#if (NGX_HAVE_INET6)
+    if( stats->uint128 ) {
+        return p + ngx_inet6_ntop( &entry->key[ 0 ], p, NGX_INET6_ADDRSTRLEN );
+    }
+#endif
+
+    return ngx_sprintf( p, "%ud.%ud.%ud.%ud", entry->key[ 0 ], entry->key[ 1 ], entry->key[ 2 ], entry->key[ 3 ] );
+}
+
+static ngx_int_t
+ngx_http_lklb_stats_collect( ngx_http_lklb_stats_t *stats, ngx_http_lklb_ctx_t *ctx, ngx_log_t *log ) {
+    ngx_uint_t  idx;
+
+    if( ( stats->cache ) &&
+        ( ( ngx_msec_int_t )( ngx_current_msec - stats->updated ) < NGX_HTTP_LKLB_STATS_INTERVAL ) ) {
+        return NGX_OK;
+    }
+
+    if( NULL == stats->cache ) {
+        stats->cache = ngx_alloc( stats->top * sizeof( ngx_http_lklb_shards_hits_t ), log );
+        if( NULL == stats->cache ) {
+            return NGX_ERROR;
+        }
+    }
+
+    if( NGX_HTTP_LKLB_ERR == ngx_http_lklb_shards_top_hits( ngx_http_lklb_ctx_radix( ctx ),
+                                                            ( NGX_HTTP_LKLB_KEY_STRING == stats->key_type ),
+                                                            stats->cache, stats->top, &stats->count ) ) {
+        stats->count = 0;
+    }
+
+    /* Values are only valid until the worker returns to its event loop */
+    for( idx = 0; idx < stats->count; idx++ ) {
+        stats->cache[ idx ].entry.value = NULL;
+    }
+
+    stats->updated = ngx_current_msec;
+
+    return NGX_OK;
+}
+
+/*
+ * Lists the most hit entries of the zone, one "<key>/<bits> <hits>" line
+ * each, most hit first.
+ */
+static ngx_int_t
+ngx_http_lklb_stats_handler( ngx_http_request_t *r ) {
+    ngx_http_lklb_loc_conf_t        *lklblcf;
+    ngx_http_lklb_stats_t           *stats;
+    ngx_http_lklb_ctx_t             *ctx;
+    ngx_http_lklb_radix_entry_t      entry;
+    ngx_uint_t                       idx, keybits;
+    ngx_chain_t                      out;
+    ngx_buf_t                       *b;
+    ngx_int_t                        rc;
+    size_t                           size;
+
+    if( !( r->method & ( NGX_HTTP_GET | NGX_HTTP_HEAD ) ) ) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body( r );
+    if( NGX_OK != rc ) {
+        return rc;
+    }
+
+    lklblcf = ngx_http_get_module_loc_conf( r, ngx_http_lookuplibs_module );
+    stats   = lklblcf->stats;
+    ctx     = stats->zone->data;
+
+    if( ( NULL == ctx ) || ( NULL == ctx->shpool ) || ( !ngx_http_lklb_ctx_is_radix( ctx ) ) ) {
+        ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
+                       "shared lookup zone \"%V\" is not usable for this operation", &stats->zone->shm.name );
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if( NGX_OK != ngx_http_lklb_stats_collect( stats, ctx, r->connection->log ) ) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    keybits = ( NGX_HTTP_LKLB_KEY_STRING == stats->key_type ) ? NGX_HTTP_LKLB_RADIX_KEY_MAX * 8
+                                                              : ( ( stats->uint128 ) ? 128 : 32 );
+
+    size = 0;
+
+    for( idx = 0; idx < stats->count; idx++ ) {
+        size += NGX_HTTP_LKLB_STATS_LINE_LEN;
+
+        if( NGX_HTTP_LKLB_KEY_STRING == stats->key_type ) {
+            size += ( stats->cache[ idx ].entry.bits + 7 ) / 8;
+        }
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    ngx_str_set( &r->headers_out.content_type, "text/plain" );
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    b = ngx_create_temp_buf( r->pool, ( size ) ? size : 1 );
+    if( NULL == b ) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    for( idx = 0; idx < stats->count; idx++ ) {
+        /* Printing rewrites the key, the cached entry serves later requests */
+        entry = stats->cache[ idx ].entry;
+
+        /* Entries of the other address family */
+        if( ( 32 == keybits ) && ( ngx_http_lklb_ctx_radix( ctx )->dualstack ) &&
+            ( !ngx_http_lklb_shards_unmap_entry( &entry ) ) ) {
+            continue;
+        }
+
+        if( entry.bits > keybits ) {
+            continue;
+        }
+
+        b->last = ngx_http_lklb_stats_key( b->last, stats, ctx, &entry );
+        b->last = ngx_sprintf( b->last, "/%ui %uA" CRLF, entry.bits, stats->cache[ idx ].hits );
+    }
+
+    b->last_buf      = ( r == r->main ) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header( r );
+    if( ( NGX_ERROR == rc ) || ( rc > NGX_OK ) || ( r->header_only ) ) {
+        return rc;
+    }
+
+    out.buf  = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter( r, &out );
+}
+
+/*
+ * Handler for lookup_stats directive
+ *      "lookup_stats <shared segment name> [key_type=addr|ipv6|string] [top=<n>]"
+ * Makes the location report the n, 10 by default, most hit entries of a
+ * zone with stats=<n> enabled, as of at most a second ago. key_type selects how keys are printed,
+ * addr for IPv4 addresses, ipv6 for IPv6 addresses.
+ */
+char *
+ngx_http_lklb_stats( ngx_conf_t *cf, ngx_command_t *cmd, void *conf ) {
+    ngx_http_lklb_loc_conf_t    *lklblcf = conf;
+    ngx_http_core_loc_conf_t    *clcf;
+    ngx_http_lklb_stats_t       *stats;
+    ngx_str_t                   *value;
+    ngx_uint_t                   idx;
+    ngx_int_t                    top;
+
+    if( lklblcf->stats ) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if( 0 == value[ 1 ].len ) {
+        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "invalid shared lookup lib name \"%V\"", &value[ 1 ] );
+        return NGX_CONF_ERROR;
+    }
+
+    stats = ngx_pcalloc( cf->pool, sizeof( ngx_http_lklb_stats_t ) );
+    if( NULL == stats ) {
+        return NGX_CONF_ERROR;
+    }
+
+    stats->zone = ngx_shared_memory_add( cf, &value[ 1 ], 0, &ngx_http_lookuplibs_module );
+    if( NULL == stats->zone ) {
+        return NGX_CONF_ERROR;
+    }
+
+    stats->key_type = NGX_HTTP_LKLB_KEY_ADDR;
+    stats->top      = NGX_HTTP_LKLB_STATS_TOP;
+
+    for( idx = 2; idx < cf->args->nelts; idx++ ) {
+        if( ( value[ idx ].len == sizeof( "key_type=addr" ) - 1 ) &&
+            ( 0 == ngx_strncmp( value[ idx ].data, "key_type=addr", value[ idx ].len ) ) ) {
+            stats->key_type = NGX_HTTP_LKLB_KEY_ADDR;
+            stats->uint128  = 0;
+            continue;
+        }
+
+        if( ( value[ idx ].len == sizeof( "key_type=ipv6" ) - 1 ) &&
+            ( 0 == ngx_strncmp( value[ idx ].data, "key_type=ipv6", value[ idx ].len ) ) ) {
+#if (NGX_HAVE_INET6)
+            stats->key_type = NGX_HTTP_LKLB_KEY_ADDR;
+            stats->uint128  = 1;
+            continue;
+#else
+            ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "IPv6 is not supported in \"%V\"", &value[ idx ] );
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        if( ( value[ idx ].len == sizeof( "key_type=string" ) - 1 ) &&
+            ( 0 == ngx_strncmp( value[ idx ].data, "key_type=string", value[ idx ].len ) ) ) {
+            stats->key_type = NGX_HTTP_LKLB_KEY_STRING;
+            continue;
+        }
+
+        if( ( value[ idx ].len > 4 ) && ( 0 == ngx_strncmp( value[ idx ].data, "top=", 4 ) ) ) {
+            top = ngx_atoi( value[ idx ].data + 4, value[ idx ].len - 4 );
+            if( ( NGX_ERROR == top ) || ( top < 1 ) || ( top > NGX_HTTP_LKLB_STATS_TOP_MAX ) ) {
+                ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[ idx ] );
+                return NGX_CONF_ERROR;
+            }
+
+            stats->top = ( ngx_uint_t )top;
+            continue;
+        }
+
+        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[ idx ] );
+        return NGX_CONF_ERROR;
+    }
+
+    lklblcf->stats = stats;
+
+    clcf = ngx_http_conf_get_module_loc_conf( cf, ngx_http_core_module );
+    clcf->handler = ngx_http_lklb_stats_handler;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,12 @@
+#ifndef _NGX_HTTP_LOOKUPLIBS_STATS_H_INCLUDED_
+#define _NGX_HTTP_LOOKUPLIBS_STATS_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+typedef struct ngx_http_lklb_stats_s ngx_http_lklb_stats_t;
+
+char *ngx_http_lklb_stats( ngx_conf_t *cf, ngx_command_t *cmd, void *conf );
+
+#endif /* _NGX_HTTP_LOOKUPLIBS_STATS_H_INCLUDED_ */
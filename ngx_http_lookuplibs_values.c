@@ -0,0 +1,241 @@
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_values.h"
+
+/* Finds seen by this worker, drives the sampling of every zone */
+static ngx_uint_t  ngx_http_lklb_value_touches;
+
+static void
+ngx_http_lklb_value_reclaim( ngx_http_lklb_values_t *values ) {
+    ngx_http_lklb_value_t   *value;
+
+    if( NULL == values->head ) {
+        return;
+    }
+
+    ngx_spinlock( &values->lock, ngx_pid, 1024 );
+
+    while( ( values->head ) && ( ngx_http_lklb_epochs_quiesced( values->epochs, values->head->retired ) ) ) {
+        value        = values->head;
+        values->head = value->next;
+
+        if( NULL == values->head ) {
+            values->tail = NULL;
+        }
+
+        ngx_slab_free( values->shpool, value );
+    }
+
+    ngx_unlock( &values->lock );
+}
+
+ngx_http_lklb_value_t *
+ngx_http_lklb_value_create( ngx_http_lklb_values_t *values, u_char *data, size_t len, ngx_msec_t ttl ) {
+    ngx_http_lklb_value_t   *value;
+
+    ngx_http_lklb_value_reclaim( values );
+
+    value = ngx_slab_alloc( values->shpool, offsetof( ngx_http_lklb_value_t, data ) + len );
+    if( NULL == value ) {
+        return NULL;
+    }
+
+    value->refs       = 0;
+    value->next       = NULL;
+    value->retired    = 0;
+    value->expires    = ( ttl ) ? ngx_current_msec + ttl : 0;
+    value->nodata     = ( NULL == data );
+    value->len        = ( data ) ? len : 0;
+    value->hits       = 0;
+
+    /* New entries survive the first pass of the clock hand */
+    value->referenced = 1;
+
+    if( value->len ) {
+        ngx_memcpy( value->data, data, len );
+    }
+
+    return value;
+}
+
+void
+ngx_http_lklb_value_ref( void *ctx, void *ptr ) {
+    ngx_http_lklb_value_t   *value = ptr;
+
+    if( value ) {
+        ngx_atomic_fetch_add( &value->refs, 1 );
+    }
+}
+
+void
+ngx_http_lklb_value_unref( void *ctx, void *ptr ) {
+    ngx_http_lklb_values_t  *values = ctx;
+    ngx_http_lklb_value_t   *value = ptr;
+
+    if( ( NULL == value ) ||
+        ( ( value->refs ) && ( 1 != ngx_atomic_fetch_add( &value->refs, -1 ) ) ) ) {
+        return;
+    }
+
+    value->next    = NULL;
+    value->retired = ngx_http_lklb_epochs_retire( values->epochs );
+
+    ngx_spinlock( &values->lock, ngx_pid, 1024 );
+
+    if( values->tail ) {
+        values->tail->next = value;
+    } else {
+        values->head = value;
+    }
+
+    values->tail = value;
+
+    ngx_unlock( &values->lock );
+}
+
+ngx_uint_t
+ngx_http_lklb_value_expired( void *ctx, void *ptr ) {
+    ngx_http_lklb_value_t   *value = ptr;
+
+    return( ( value ) && ( value->expires ) &&
+            ( ( ngx_msec_int_t )( ngx_current_msec - value->expires ) >= 0 ) );
+}
+
+/*
+ * The sampling decision is taken per worker so that only sampled finds
+ * touch the shared counter, which then advances by the sampling rate.
+ */
+void
+ngx_http_lklb_value_touch( void *ctx, void *ptr ) {
+    ngx_http_lklb_values_t  *values = ctx;
+    ngx_http_lklb_value_t   *value = ptr;
+
+    if( NULL == value ) {
+        return;
+    }
+
+    if( !value->referenced ) {
+        value->referenced = 1;
+    }
+
+    if( ( values->sample ) && ( 0 == ++ngx_http_lklb_value_touches % values->sample ) ) {
+        ngx_atomic_fetch_add( &value->hits, values->sample );
+    }
+}
+
+ngx_uint_t
+ngx_http_lklb_value_referenced( void *ctx, void *ptr ) {
+    ngx_http_lklb_value_t   *value = ptr;
+
+    if( ( NULL == value ) || ( !value->referenced ) ) {
+        return 0;
+    }
+
+    value->referenced = 0;
+    return 1;
+}
+
+#define NGX_HTTP_LKLB_VALUES_COPY_SIZE  1024
+
+/* Open addressing over pairs of slots, a value and its copy */
+#define ngx_http_lklb_values_copy_hash( __value, __size )                               \
+    ( ( ( ( uintptr_t )( __value ) >> 4 ) * 2654435761u ) & ( ( __size ) - 1 ) )
+
+ngx_int_t
+ngx_http_lklb_values_copy_init( ngx_http_lklb_values_copy_t *copy, ngx_http_lklb_values_t *values, ngx_log_t *log ) {
+    copy->values = values;
+    copy->size   = NGX_HTTP_LKLB_VALUES_COPY_SIZE;
+    copy->count  = 0;
+    copy->log    = log;
+
+    copy->slots = ngx_calloc( 2 * copy->size * sizeof( ngx_http_lklb_value_t * ), log );
+    if( NULL == copy->slots ) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_http_lklb_value_t **
+ngx_http_lklb_values_copy_slot( ngx_http_lklb_value_t **slots, ngx_uint_t size, ngx_http_lklb_value_t *value ) {
+    ngx_uint_t  idx;
+
+    for( idx = ngx_http_lklb_values_copy_hash( value, size ); ; idx = ( idx + 1 ) & ( size - 1 ) ) {
+        if( ( NULL == slots[ 2 * idx ] ) || ( value == slots[ 2 * idx ] ) ) {
+            return &slots[ 2 * idx ];
+        }
+    }
+}
+
+/* Double the table once half full so that probes stay short */
+static ngx_int_t
+ngx_http_lklb_values_copy_grow( ngx_http_lklb_values_copy_t *copy ) {
+    ngx_http_lklb_value_t  **slots, **slot;
+    ngx_uint_t               idx;
+
+    slots = ngx_calloc( 4 * copy->size * sizeof( ngx_http_lklb_value_t * ), copy->log );
+    if( NULL == slots ) {
+        return NGX_ERROR;
+    }
+
+    for( idx = 0; idx < copy->size; idx++ ) {
+        if( copy->slots[ 2 * idx ] ) {
+            slot      = ngx_http_lklb_values_copy_slot( slots, 2 * copy->size, copy->slots[ 2 * idx ] );
+            slot[ 0 ] = copy->slots[ 2 * idx ];
+            slot[ 1 ] = copy->slots[ 2 * idx + 1 ];
+        }
+    }
+
+    ngx_free( copy->slots );
+
+    copy->slots = slots;
+    copy->size *= 2;
+
+    return NGX_OK;
+}
+
+ngx_http_lklb_retval_e
+ngx_http_lklb_value_copy( void *ctx, void *ptr, void **result ) {
+    ngx_http_lklb_values_copy_t  *copy = ctx;
+    ngx_http_lklb_value_t        *value = ptr, *new_value, **slot;
+
+    if( NULL == value ) {
+        *result = NULL;
+        return NGX_HTTP_LKLB_OK;
+    }
+
+    slot = ngx_http_lklb_values_copy_slot( copy->slots, copy->size, value );
+
+    if( slot[ 0 ] ) {
+        *result = slot[ 1 ];
+        return NGX_HTTP_LKLB_OK;
+    }
+
+    new_value = ngx_http_lklb_value_create( copy->values, ( value->nodata ) ? NULL : value->data, value->len, 0 );
+    if( NULL == new_value ) {
+        return NGX_HTTP_LKLB_ERR;
+    }
+
+    new_value->expires    = value->expires;
+    new_value->referenced = value->referenced;
+    new_value->hits       = value->hits;
+
+    slot[ 0 ] = value;
+    slot[ 1 ] = new_value;
+
+    if( ( 2 * ++copy->count >= copy->size ) && ( NGX_OK != ngx_http_lklb_values_copy_grow( copy ) ) ) {
+        /* Copied already, a lost mapping only loses the sharing */
+        copy->count--;
+        slot[ 0 ] = NULL;
+    }
+
+    *result = new_value;
+    return NGX_HTTP_LKLB_OK;
+}
+
+void
+ngx_http_lklb_values_copy_done( ngx_http_lklb_values_copy_t *copy ) {
+    if( copy->slots ) {
+        ngx_free( copy->slots );
+        copy->slots = NULL;
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef _NGX_HTTP_LOOKUPLIBS_VALUES_H_INCLUDED_
+#define _NGX_HTTP_LOOKUPLIBS_VALUES_H_INCLUDED_
+
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_epochs.h"
+
+typedef struct ngx_http_lklb_value_s ngx_http_lklb_value_t;
+
+/*
+ * Values stored in a zone. A value may be shared by several entries, e.g.
+ * all the blocks of a range insert, and is reference counted by the tree.
+ * Released values are not freed right away since lookups read the value
+ * after dropping the tree lock. They are parked on a retire list with the
+ * epoch they were retired at and freed once every worker moved past it,
+ * see ngx_http_lklb_epochs_t.
+ * Values carrying an expiry time are ignored by lookups once it passed.
+ * hits counts the finds returning the value on zones with stats enabled.
+ */
+struct ngx_http_lklb_value_s {
+    ngx_atomic_t                 refs;
+    ngx_http_lklb_value_t       *next;
+    ngx_uint_t                   retired;
+    ngx_msec_t                   expires;
+    ngx_uint_t                   nodata;
+    ngx_uint_t                   referenced;
+    ngx_atomic_t                 hits;
+    size_t                       len;
+    u_char                       data[ 1 ];
+};
+
+#define ngx_http_lklb_value_has_data( __value )    ( ( NULL != ( __value ) ) && ( !( __value )->nodata ) )
+
+/* sample: count one in sample finds, 0 disables hit counting */
+typedef struct {
+    ngx_slab_pool_t             *shpool;
+    ngx_http_lklb_epochs_t      *epochs;
+    ngx_uint_t                   sample;
+    ngx_atomic_t                 lock;
+    ngx_http_lklb_value_t       *head;
+    ngx_http_lklb_value_t       *tail;
+} ngx_http_lklb_values_t;
+
+/*
+ * data:    NULL creates a value without data, e.g. to attach an expiry
+ *          time to an entry without value
+ * ttl:     lifetime in milliseconds, 0 never expires
+ */
+ngx_http_lklb_value_t *
+ngx_http_lklb_value_create( ngx_http_lklb_values_t *values, u_char *data, size_t len, ngx_msec_t ttl );
+
+/* Tree value functions, see ngx_http_lklb_radix_set_value_functions */
+void
+ngx_http_lklb_value_ref( void *values, void *value );
+
+void
+ngx_http_lklb_value_unref( void *values, void *value );
+
+ngx_uint_t
+ngx_http_lklb_value_expired( void *values, void *value );
+
+/*
+ * CLOCK reference bit and sampled hit counting, see
+ * ngx_http_lklb_radix_set_clock_functions
+ */
+void
+ngx_http_lklb_value_touch( void *values, void *value );
+
+ngx_uint_t
+ngx_http_lklb_value_referenced( void *values, void *value );
+
+/*
+ * Copies values into another zone, e.g. when a zone is migrated on
+ * reload. A value shared by several entries is copied once and the
+ * copies share it again. slots maps values to their copy.
+ */
+typedef struct {
+    ngx_http_lklb_values_t      *values;
+    ngx_uint_t                   size;
+    ngx_uint_t                   count;
+    ngx_http_lklb_value_t      **slots;
+    ngx_log_t                   *log;
+} ngx_http_lklb_values_copy_t;
+
+ngx_int_t
+ngx_http_lklb_values_copy_init( ngx_http_lklb_values_copy_t *copy, ngx_http_lklb_values_t *values, ngx_log_t *log );
+
+/* Tree copy function, see ngx_http_lklb_radix_copy */
+ngx_http_lklb_retval_e
+ngx_http_lklb_value_copy( void *copy, void *value, void **result );
+
+void
+ngx_http_lklb_values_copy_done( ngx_http_lklb_values_copy_t *copy );
+
+#endif /* _NGX_HTTP_LOOKUPLIBS_VALUES_H_INCLUDED_ */
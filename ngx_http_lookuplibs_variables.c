@@ -0,0 +1,163 @@
+#include "ngx_http_lookuplibs_module.h"
+#include "ngx_http_lookuplibs_internal.h"
+
+typedef enum {
+    NGX_HTTP_LKLB_MAP_VALUE     = 0,
+    NGX_HTTP_LKLB_MAP_MATCH     = 1
+} ngx_http_lklb_map_result_e;
+
+typedef struct {
+    ngx_http_lklb_lookup_t       lookup;
+    ngx_http_lklb_map_result_e   result;
+    ngx_str_t                    default_value;
+} ngx_http_lklb_map_t;
+
+static ngx_str_t  ngx_http_lklb_map_results[ ] = {
+    ngx_string( "match" ),                  /* NGX_HTTP_LKLB_MATCH */
+    ngx_string( "partial_match" )           /* NGX_HTTP_LKLB_PARTIAL_MATCH */
+};
+
+static ngx_str_t  ngx_http_lklb_map_no_data = ngx_string( "1" );
+
+/*
+ * The variable is evaluated on first use and cached for the request by the
+ * variables framework. Values are copied since the zone may release them
+ * while the request is still using the variable.
+ */
+static ngx_int_t
+ngx_http_lklb_map_variable( ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data ) {
+    ngx_http_lklb_map_t         *map = ( ngx_http_lklb_map_t * )data;
+    ngx_http_lklb_value_t       *value;
+    ngx_http_lklb_retval_e       rc;
+    ngx_str_t                   *result;
+    u_char                      *p;
+
+    v->valid        = 1;
+    v->no_cacheable = 0;
+    v->not_found    = 0;
+
+    rc = ngx_http_lklb_lookup_find( r, &map->lookup, ( void ** )&value );
+
+    if( NGX_HTTP_LKLB_ERR == rc ) {
+        v->len  = map->default_value.len;
+        v->data = map->default_value.data;
+        return NGX_OK;
+    }
+
+    if( NGX_HTTP_LKLB_MAP_MATCH == map->result ) {
+        result = &ngx_http_lklb_map_results[ ( NGX_HTTP_LKLB_PARTIAL_MATCH == rc ) ? 1 : 0 ];
+
+        v->len  = result->len;
+        v->data = result->data;
+        return NGX_OK;
+    }
+
+    if( !ngx_http_lklb_value_has_data( value ) ) {
+        v->len  = ngx_http_lklb_map_no_data.len;
+        v->data = ngx_http_lklb_map_no_data.data;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc( r->pool, value->len );
+    if( NULL == p ) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy( p, value->data, value->len );
+
+    v->len  = value->len;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+/*
+ * Handler for lookup_map directive
+ *      "lookup_map $<variable> <shared segment name> <key> [key_type=addr|string] [prefix=on|off] [zone6=<name>]
+ *                  [result=value|match] [default=<string>]"
+ * Defines a variable holding the value the key is stored with, "1" for
+ * entries without value. With result=match the variable is "match" or
+ * "partial_match" instead. Keys not found yield default, empty if not set.
+ */
+char *
+ngx_http_lklb_lookup_map( ngx_conf_t *cf, ngx_command_t *cmd, void *conf ) {
+    ngx_http_lklb_map_t         *map;
+    ngx_http_variable_t         *var;
+    ngx_str_t                   *value, name;
+    ngx_uint_t                   idx;
+    ngx_int_t                    rc;
+
+    value = cf->args->elts;
+
+    if( cf->args->nelts < 4 ) {
+        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "lookup key is missing for \"%V\"", &value[ 1 ] );
+        return NGX_CONF_ERROR;
+    }
+
+    name = value[ 1 ];
+
+    if( ( name.len < 2 ) || ( '$' != name.data[ 0 ] ) ) {
+        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "invalid variable name \"%V\"", &name );
+        return NGX_CONF_ERROR;
+    }
+
+    name.len--;
+    name.data++;
+
+    map = ngx_pcalloc( cf->pool, sizeof( ngx_http_lklb_map_t ) );
+    if( NULL == map ) {
+        return NGX_CONF_ERROR;
+    }
+
+    if( NGX_CONF_OK != ngx_http_lklb_lookup_init( cf, &map->lookup, &value[ 2 ] ) ) {
+        return NGX_CONF_ERROR;
+    }
+
+    if( NGX_OK != ngx_http_lklb_lookup_key( cf, &map->lookup, &value[ 3 ] ) ) {
+        return NGX_CONF_ERROR;
+    }
+
+    map->result = NGX_HTTP_LKLB_MAP_VALUE;
+
+    for( idx = 4; idx < cf->args->nelts; idx++ ) {
+        rc = ngx_http_lklb_lookup_param( cf, &map->lookup, &value[ idx ] );
+        if( NGX_ERROR == rc ) {
+            return NGX_CONF_ERROR;
+        }
+
+        if( NGX_OK == rc ) {
+            continue;
+        }
+
+        if( ( value[ idx ].len == sizeof( "result=value" ) - 1 ) &&
+            ( 0 == ngx_strncmp( value[ idx ].data, "result=value", value[ idx ].len ) ) ) {
+            map->result = NGX_HTTP_LKLB_MAP_VALUE;
+            continue;
+        }
+
+        if( ( value[ idx ].len == sizeof( "result=match" ) - 1 ) &&
+            ( 0 == ngx_strncmp( value[ idx ].data, "result=match", value[ idx ].len ) ) ) {
+            map->result = NGX_HTTP_LKLB_MAP_MATCH;
+            continue;
+        }
+
+        if( ( value[ idx ].len >= 8 ) && ( 0 == ngx_strncmp( value[ idx ].data, "default=", 8 ) ) ) {
+            map->default_value.data = value[ idx ].data + 8;
+            map->default_value.len  = value[ idx ].len - 8;
+            continue;
+        }
+
+        ngx_conf_log_error( NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[ idx ] );
+        return NGX_CONF_ERROR;
+    }
+
+    var = ngx_http_add_variable( cf, &name, NGX_HTTP_VAR_CHANGEABLE );
+    if( NULL == var ) {
+        return NGX_CONF_ERROR;
+    }
+
+    var->get_handler = ngx_http_lklb_map_variable;
+    var->data        = ( uintptr_t )map;
+
+    return NGX_CONF_OK;
+}
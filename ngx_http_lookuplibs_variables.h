@@ -0,0 +1,10 @@
+#ifndef _NGX_HTTP_LOOKUPLIBS_VARIABLES_H_INCLUDED_
+#define _NGX_HTTP_LOOKUPLIBS_VARIABLES_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+char *ngx_http_lklb_lookup_map( ngx_conf_t *cf, ngx_command_t *cmd, void *conf );
+
+#endif /* _NGX_HTTP_LOOKUPLIBS_VARIABLES_H_INCLUDED_ */
@@ -0,0 +1,142 @@
+#!/bin/sh
+#
+# Replication between two instances on 127.0.0.1: updates made on one
+# must show up on the other, in both directions, deletes included.
+#
+#   NGINX=/path/to/nginx t/replication.sh
+#
+# nginx must be built with this module and lua-nginx-module, curl is
+# used to drive the instances.
+
+NGINX=${NGINX:-nginx}
+PORT=${PORT:-18400}
+
+HTTP_A=$PORT
+HTTP_B=$(( PORT + 1 ))
+REPL_A=$(( PORT + 2 ))
+REPL_B=$(( PORT + 3 ))
+
+DIR=$(mktemp -d) || exit 1
+chmod 755 "$DIR"
+
+stop() {
+    for name in a b; do
+        if [ -f "$DIR/$name/logs/nginx.pid" ]; then
+            "$NGINX" -p "$DIR/$name/" -c conf/nginx.conf -s stop 2>/dev/null
+        fi
+    done
+
+    sleep 1
+    rm -rf "$DIR"
+}
+
+trap stop EXIT
+
+fail() {
+    echo "FAIL: $*"
+    for name in a b; do
+        echo "--- error log of $name"
+        cat "$DIR/$name/logs/error.log"
+    done
+    exit 1
+}
+
+# config name http_port listen_port peer_port
+config() {
+    mkdir -p "$DIR/$1/conf" "$DIR/$1/logs"
+
+    cat > "$DIR/$1/conf/nginx.conf" <<EOF
+worker_processes 2;
+error_log logs/error.log info;
+pid logs/nginx.pid;
+
+events {
+    worker_connections 64;
+}
+
+http {
+    access_log off;
+
+    lua_shared_lookup repl 4m radix replicate;
+    lookup_replication 127.0.0.1:$3 127.0.0.1:$4;
+
+    server {
+        listen 127.0.0.1:$2;
+
+        location = /insert {
+            content_by_lua_block {
+                local lookuplibs = require "ngx.lookuplibs"
+                local ok, err = lookuplibs.insert_cidr( "repl", ngx.var.arg_cidr, ngx.var.arg_value )
+                ngx.say( ok and "ok" or err )
+            }
+        }
+
+        location = /delete {
+            content_by_lua_block {
+                local lookuplibs = require "ngx.lookuplibs"
+                ngx.say( lookuplibs.delete_cidr( "repl", ngx.var.arg_cidr ) and "ok" or "none" )
+            }
+        }
+
+        location = /find {
+            content_by_lua_block {
+                local lookuplibs = require "ngx.lookuplibs"
+                ngx.say( lookuplibs.find_cidr( "repl", ngx.var.arg_cidr, true ) or "none" )
+            }
+        }
+    }
+}
+EOF
+}
+
+# get http_port uri
+get() {
+    curl -s "http://127.0.0.1:$1$2"
+}
+
+# expect http_port uri body, polls for up to 5 seconds
+expect() {
+    tries=50
+
+    while [ $tries -gt 0 ]; do
+        [ "$(get "$1" "$2")" = "$3" ] && return 0
+        tries=$(( tries - 1 ))
+        sleep 0.1
+    done
+
+    fail "$2 on port $1 did not return \"$3\", got \"$(get "$1" "$2")\""
+}
+
+config a $HTTP_A $REPL_A $REPL_B
+config b $HTTP_B $REPL_B $REPL_A
+
+for name in a b; do
+    "$NGINX" -p "$DIR/$name/" -c conf/nginx.conf || fail "could not start instance $name"
+done
+
+expect $HTTP_A "/find?cidr=10.0.0.0/8" none
+expect $HTTP_B "/find?cidr=10.0.0.0/8" none
+
+# a to b
+[ "$(get $HTTP_A "/insert?cidr=10.0.0.0/8&value=from-a")" = ok ] || fail "insert on a"
+expect $HTTP_B "/find?cidr=10.1.2.3/32" from-a
+
+# b to a
+[ "$(get $HTTP_B "/insert?cidr=192.168.0.0/16&value=from-b")" = ok ] || fail "insert on b"
+expect $HTTP_A "/find?cidr=192.168.1.1/32" from-b
+
+# deletes
+[ "$(get $HTTP_A "/delete?cidr=10.0.0.0/8")" = ok ] || fail "delete on a"
+expect $HTTP_B "/find?cidr=10.1.2.3/32" none
+
+# a burst, the last one must arrive
+i=0
+while [ $i -lt 200 ]; do
+    get $HTTP_A "/insert?cidr=172.16.$i.0/24&value=v$i" > /dev/null
+    i=$(( i + 1 ))
+done
+
+expect $HTTP_B "/find?cidr=172.16.199.1/32" v199
+expect $HTTP_B "/find?cidr=172.16.0.1/32" v0
+
+echo "ok"